@@ -0,0 +1,498 @@
+// Benchmarks the capture, decode and conversion hot paths without a
+// camera, on frames replayed from memory or from a recording, and
+// prints the results as JSON to diff across releases:
+//
+//   ./bench [-n frames] [-s WIDTHxHEIGHT] [-c max_cameras] [-r recording]
+//
+// Latencies are per frame, allocations are counted by wrapping malloc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <jpeglib.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2.h"
+#include "camera_v4l2_convert.h"
+#include "camera_v4l2_decode.h"
+#include "camera_v4l2_replay.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// glibc's own entry points, the wrappers below only count calls.
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long bench_allocs;
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	__atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr != NULL ? 0 : ENOMEM;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+struct bench_config {
+	int frames;
+	int width;
+	int height;
+	int max_cameras;
+	const char *recording;
+};
+
+// Measures one benchmark: per frame latency and allocations.
+struct bench_run {
+	const char *name;
+	camera_v4l2_histogram_t latency;
+	unsigned long allocs;
+	uint64_t start_ns;
+	uint64_t total_ns;
+	uint64_t frames;
+	uint64_t bytes;
+};
+
+// The JSON goes here, stdout carries the library's log.
+static FILE *bench_out;
+static int bench_first_result = 1;
+
+static uint64_t bench_now() {
+	return camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+}
+
+static void bench_begin(struct bench_run *run, const char *name) {
+	memset(run, 0, sizeof(*run));
+	run->name = name;
+	run->allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+	run->start_ns = bench_now();
+}
+
+static void bench_end(struct bench_run *run, const char *extra) {
+	run->total_ns = bench_now() - run->start_ns;
+	unsigned long allocs =
+		__atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - run->allocs;
+	double seconds = run->total_ns / 1e9;
+
+	fprintf(bench_out, "%s\n    {\"name\": \"%s\", \"frames\": %llu, "
+	       "\"fps\": %.1f, \"mb_per_s\": %.1f, "
+	       "\"mean_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+	       "\"max_ns\": %llu, \"allocs_per_frame\": %.3f%s%s}",
+	       bench_first_result ? "" : ",", run->name,
+	       (unsigned long long) run->frames,
+	       seconds > 0 ? run->frames / seconds : 0.0,
+	       seconds > 0 ? run->bytes / seconds / 1e6 : 0.0,
+	       (unsigned long long) (run->latency.count ?
+				     run->latency.sum_ns / run->latency.count : 0),
+	       (unsigned long long) camera_v4l2_histogram_percentile(&run->latency, 0.5),
+	       (unsigned long long) camera_v4l2_histogram_percentile(&run->latency, 0.99),
+	       (unsigned long long) run->latency.max_ns,
+	       run->frames ? (double) allocs / run->frames : 0.0,
+	       extra != NULL ? ", " : "", extra != NULL ? extra : "");
+	bench_first_result = 0;
+}
+
+static void bench_frame(struct bench_run *run, uint64_t start, size_t bytes) {
+	camera_v4l2_histogram_record(&run->latency, bench_now() - start);
+	run->frames++;
+	run->bytes += bytes;
+}
+
+// A gradient with some noise, so the entropy coded data is about as
+// large as a camera's.
+static uint8_t *bench_pattern(int width, int height) {
+	uint8_t *rgb = (uint8_t *) malloc((size_t) width * height * 3);
+	uint32_t noise = 12345;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			noise = noise * 1103515245u + 12345u;
+			uint8_t *p = rgb + ((size_t) y * width + x) * 3;
+			p[0] = (uint8_t) (x * 255 / width + (noise >> 28));
+			p[1] = (uint8_t) (y * 255 / height + (noise >> 29));
+			p[2] = (uint8_t) ((x + y) & 0xff);
+		}
+	}
+	return rgb;
+}
+
+// 4:2:2 like UVC cameras send.
+static uint8_t *bench_encode_jpeg(int width, int height, size_t *length) {
+	uint8_t *rgb = bench_pattern(width, height);
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	unsigned char *out = NULL;
+	unsigned long out_length = 0;
+	jpeg_mem_dest(&cinfo, &out, &out_length);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 85, TRUE);
+	cinfo.comp_info[0].h_samp_factor = 2;
+	cinfo.comp_info[0].v_samp_factor = 1;
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row = rgb + (size_t) cinfo.next_scanline * width * 3;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(rgb);
+
+	*length = out_length;
+	return out;
+}
+
+static uint8_t *bench_yuyv(int width, int height) {
+	uint8_t *yuyv = (uint8_t *) malloc((size_t) width * height * 2);
+	uint32_t noise = 777;
+	for (size_t i = 0; i < (size_t) width * height * 2; i++) {
+		noise = noise * 1103515245u + 12345u;
+		yuyv[i] = (uint8_t) (noise >> 24);
+	}
+	return yuyv;
+}
+
+// Replays one in-memory frame forever, 30 fps worth of timestamps.
+struct bench_source {
+	const uint8_t *data;
+	size_t length;
+	uint32_t sequence;
+};
+
+static int bench_source_next(void *user, const void **data, size_t *length,
+			     uint64_t *timestamp_ns, uint32_t *sequence) {
+	struct bench_source *source = (struct bench_source *) user;
+	*data = source->data;
+	*length = source->length;
+	*sequence = source->sequence;
+	*timestamp_ns = (uint64_t) source->sequence * 33333333ull;
+	source->sequence++;
+	return 1;
+}
+
+// Replays the recording when given one, the synthetic frame otherwise.
+static camera_v4l2_replay_t *bench_replay(const struct bench_config *config,
+					  struct bench_source *source) {
+	camera_v4l2_replay_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.width = config->width;
+	param.height = config->height;
+	param.pacing = CAMERA_V4L2_REPLAY_FAST;
+	param.loop = 1;
+	if (config->recording != NULL) {
+		return camera_v4l2_replay_open(config->recording, &param);
+	}
+
+	camera_v4l2_replay_source_t replay_source;
+	memset(&replay_source, 0, sizeof(replay_source));
+	replay_source.next = bench_source_next;
+	replay_source.user = source;
+	return camera_v4l2_replay_create(&param, &replay_source);
+}
+
+static int bench_open(camera_v4l2_camera_t *camera,
+		      camera_v4l2_replay_t *replay,
+		      const struct bench_config *config) {
+	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.frame_width = config->width;
+	param.frame_height = config->height;
+	param.fmt = MJPEG;
+	param.backend = camera_v4l2_replay_backend(replay);
+	return camera_v4l2_open(camera, 0, &param);
+}
+
+static void bench_read_path(const struct bench_config *config,
+			    struct bench_source *source) {
+	camera_v4l2_replay_t *replay = bench_replay(config, source);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	if (replay == NULL || !bench_open(camera, replay, config)) {
+		fprintf(stderr, "Cannot open the replay camera\n");
+		exit(1);
+	}
+
+	struct bench_run run;
+	bench_begin(&run, "acquire_release");
+	for (int i = 0; i < config->frames; i++) {
+		uint64_t start = bench_now();
+		camera_v4l2_frame_t frame;
+		if (!camera_v4l2_acquire(camera, &frame)) break;
+		size_t length = frame.length;
+		camera_v4l2_release(camera, &frame);
+		bench_frame(&run, start, length);
+	}
+	bench_end(&run, NULL);
+
+	bench_begin(&run, "read");
+	for (int i = 0; i < config->frames; i++) {
+		uint64_t start = bench_now();
+		camera_v4l2_buffer_t frame;
+		if (!camera_v4l2_read(camera, &frame)) break;
+		bench_frame(&run, start, frame.length);
+	}
+	bench_end(&run, NULL);
+
+	camera_v4l2_close(camera);
+	camera_v4l2_destroy(camera);
+	camera_v4l2_replay_destroy(replay);
+}
+
+static void bench_decode(const struct bench_config *config,
+			 const uint8_t *jpeg, size_t length) {
+	static const struct {
+		const char *name;
+		camera_v4l2_decode_format_t format;
+		int scale;
+	} cases[] = {
+		{ "decode_bgr", CAMERA_V4L2_DECODE_BGR, 1 },
+		{ "decode_bgr_half", CAMERA_V4L2_DECODE_BGR, 2 },
+		{ "decode_bgr_quarter", CAMERA_V4L2_DECODE_BGR, 4 },
+		{ "decode_gray", CAMERA_V4L2_DECODE_GRAY, 1 },
+		{ "decode_i420", CAMERA_V4L2_DECODE_I420, 1 },
+	};
+
+	camera_v4l2_decoder_t *decoder = camera_v4l2_decoder_create();
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		camera_v4l2_image_t image;
+		memset(&image, 0, sizeof(image));
+		image.format = cases[c].format;
+		image.scale = cases[c].scale;
+		// Warm up, so the decoder owned buffers exist.
+		camera_v4l2_decode(decoder, jpeg, length, &image);
+
+		struct bench_run run;
+		bench_begin(&run, cases[c].name);
+		for (int i = 0; i < config->frames; i++) {
+			uint64_t start = bench_now();
+			if (!camera_v4l2_decode(decoder, jpeg, length, &image)) break;
+			bench_frame(&run, start, length);
+		}
+		bench_end(&run, NULL);
+	}
+	camera_v4l2_decoder_destroy(decoder);
+}
+
+static void bench_convert(const struct bench_config *config) {
+	int width = config->width & ~1;
+	int height = config->height;
+	uint8_t *yuyv = bench_yuyv(width, height);
+	size_t size = (size_t) width * height * 3;
+	uint8_t *expected = (uint8_t *) malloc(size);
+	uint8_t *bgr = (uint8_t *) malloc(size);
+
+	camera_v4l2_isa_t best = camera_v4l2_convert_isa();
+	camera_v4l2_convert_set_isa(CAMERA_V4L2_ISA_SCALAR);
+	camera_v4l2_yuyv_convert(yuyv, width * 2, expected, width * 3,
+				 width, height, CAMERA_V4L2_LAYOUT_BGR,
+				 CAMERA_V4L2_BT601, CAMERA_V4L2_RANGE_LIMITED);
+
+	for (int isa = CAMERA_V4L2_ISA_SCALAR; isa <= CAMERA_V4L2_ISA_AVX512; isa++) {
+		if (!camera_v4l2_convert_isa_supported((camera_v4l2_isa_t) isa)) continue;
+		camera_v4l2_convert_set_isa((camera_v4l2_isa_t) isa);
+
+		char name[64];
+		snprintf(name, sizeof(name), "convert_yuyv_bgr_%s",
+			 camera_v4l2_isa_name((camera_v4l2_isa_t) isa));
+		struct bench_run run;
+		bench_begin(&run, name);
+		for (int i = 0; i < config->frames; i++) {
+			uint64_t start = bench_now();
+			camera_v4l2_yuyv_convert(yuyv, width * 2, bgr, width * 3,
+						 width, height, CAMERA_V4L2_LAYOUT_BGR,
+						 CAMERA_V4L2_BT601,
+						 CAMERA_V4L2_RANGE_LIMITED);
+			bench_frame(&run, start, (size_t) width * height * 2);
+		}
+		bench_end(&run, memcmp(bgr, expected, size) == 0 ?
+			  "\"matches_scalar\": true" : "\"matches_scalar\": false");
+	}
+	camera_v4l2_convert_set_isa(best);
+
+	free(yuyv);
+	free(expected);
+	free(bgr);
+}
+
+struct bench_dispatch {
+	struct bench_run *run;
+	uint64_t last_ns;
+};
+
+// The latency of a frame is the time since the previous dispatch, what
+// each frame costs the reactor with every camera ready at once.
+static int bench_dispatch(camera_v4l2_camera_t *camera,
+			  camera_v4l2_frame_t *frame, void *user) {
+	(void) camera;
+	struct bench_dispatch *dispatch = (struct bench_dispatch *) user;
+	uint64_t now = bench_now();
+	bench_frame(dispatch->run, dispatch->last_ns, frame->length);
+	dispatch->last_ns = now;
+	return 0;
+}
+
+static void bench_cameras(const struct bench_config *config,
+			  const uint8_t *jpeg, size_t length) {
+	for (int count = 1; count <= config->max_cameras; count *= 2) {
+		struct bench_source *sources = (struct bench_source *) calloc(
+			count, sizeof(struct bench_source));
+		camera_v4l2_replay_t **replays = (camera_v4l2_replay_t **) calloc(
+			count, sizeof(camera_v4l2_replay_t *));
+		camera_v4l2_camera_t **cameras = (camera_v4l2_camera_t **) calloc(
+			count, sizeof(camera_v4l2_camera_t *));
+		camera_v4l2_reactor_t *reactor = camera_v4l2_reactor_create();
+
+		struct bench_run run;
+		struct bench_dispatch dispatch;
+		dispatch.run = &run;
+		for (int i = 0; i < count; i++) {
+			sources[i].data = jpeg;
+			sources[i].length = length;
+			replays[i] = bench_replay(config, &sources[i]);
+			cameras[i] = camera_v4l2_create();
+			if (replays[i] == NULL ||
+			    !bench_open(cameras[i], replays[i], config) ||
+			    !camera_v4l2_reactor_add(reactor, cameras[i],
+						     bench_dispatch, &dispatch)) {
+				fprintf(stderr, "Cannot open replay camera %d\n", i);
+				exit(1);
+			}
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "reactor_%d_cameras", count);
+		bench_begin(&run, name);
+		dispatch.last_ns = bench_now();
+		while (run.frames < (uint64_t) config->frames) {
+			if (camera_v4l2_reactor_run_once(reactor, 1000) <= 0) break;
+		}
+		bench_end(&run, NULL);
+
+		camera_v4l2_reactor_destroy(reactor);
+		for (int i = 0; i < count; i++) {
+			camera_v4l2_close(cameras[i]);
+			camera_v4l2_destroy(cameras[i]);
+			camera_v4l2_replay_destroy(replays[i]);
+		}
+		free(cameras);
+		free(replays);
+		free(sources);
+	}
+}
+
+// The first frame of the recording, to decode.
+static uint8_t *bench_first_frame(const struct bench_config *config,
+				  size_t *length) {
+	struct bench_source unused;
+	memset(&unused, 0, sizeof(unused));
+	camera_v4l2_replay_t *replay = bench_replay(config, &unused);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	uint8_t *copy = NULL;
+	camera_v4l2_frame_t frame;
+	if (replay != NULL && bench_open(camera, replay, config) &&
+	    camera_v4l2_acquire(camera, &frame)) {
+		copy = (uint8_t *) malloc(frame.length);
+		memcpy(copy, frame.start, frame.length);
+		*length = frame.length;
+		camera_v4l2_release(camera, &frame);
+	}
+	camera_v4l2_close(camera);
+	camera_v4l2_destroy(camera);
+	camera_v4l2_replay_destroy(replay);
+	return copy;
+}
+
+int main(int argc, char **argv) {
+	struct bench_config config;
+	config.frames = 2000;
+	config.width = 1280;
+	config.height = 720;
+	config.max_cameras = 32;
+	config.recording = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (strcmp(argv[i], "-n") == 0 && value != NULL) {
+			config.frames = atoi(value);
+		} else if (strcmp(argv[i], "-s") == 0 && value != NULL &&
+			   sscanf(value, "%dx%d", &config.width, &config.height) == 2) {
+		} else if (strcmp(argv[i], "-c") == 0 && value != NULL) {
+			config.max_cameras = atoi(value);
+		} else if (strcmp(argv[i], "-r") == 0 && value != NULL) {
+			config.recording = value;
+		} else {
+			fprintf(stderr, "Usage: %s [-n frames] [-s WIDTHxHEIGHT] "
+				"[-c max_cameras] [-r recording]\n", argv[0]);
+			return 1;
+		}
+		i++;
+	}
+	if (config.frames <= 0 || config.width <= 0 || config.height <= 0) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	// The library logs every open and close to stdout, move that to
+	// stderr and keep the real stdout for the JSON.
+	fflush(stdout);
+	bench_out = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	size_t length = 0;
+	uint8_t *jpeg = NULL;
+	if (config.recording != NULL) {
+		jpeg = bench_first_frame(&config, &length);
+		if (jpeg == NULL) {
+			fprintf(stderr, "Cannot read %s\n", config.recording);
+			return 1;
+		}
+	} else {
+		jpeg = bench_encode_jpeg(config.width, config.height, &length);
+	}
+	struct bench_source source;
+	memset(&source, 0, sizeof(source));
+	source.data = jpeg;
+	source.length = length;
+
+	fprintf(bench_out, "{\n  \"width\": %d, \"height\": %d, \"frame_bytes\": %zu, "
+	       "\"recording\": %s, \"convert_isa\": \"%s\",\n  \"results\": [",
+	       config.width, config.height, length,
+	       config.recording != NULL ? "true" : "false",
+	       camera_v4l2_isa_name(camera_v4l2_convert_isa()));
+
+	bench_read_path(&config, &source);
+	bench_decode(&config, jpeg, length);
+	bench_convert(&config);
+	bench_cameras(&config, jpeg, length);
+
+	fprintf(bench_out, "\n  ]\n}\n");
+	fclose(bench_out);
+	free(jpeg);
+	return 0;
+}
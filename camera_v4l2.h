@@ -1,6 +1,9 @@
 #ifndef CAMERA_V4L2_H_
 #define CAMERA_V4L2_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cpluscplus
 extern "C" {
 #endif
@@ -11,16 +14,144 @@ struct camera_v4l2_buffer {
 };
 typedef struct camera_v4l2_buffer camera_v4l2_buffer_t;
 
+enum camera_v4l2_timestamp_source {
+	CAMERA_V4L2_TSTAMP_SRC_EOF = 0,  // Last pixel of the frame received
+	CAMERA_V4L2_TSTAMP_SRC_SOE,  // Start of exposure
+};
+typedef enum camera_v4l2_timestamp_source camera_v4l2_timestamp_source_t;
+
+struct camera_v4l2_frame_meta {
+	uint32_t sequence;
+	uint64_t timestamp_ns;  // CLOCK_MONOTONIC when timestamp_monotonic
+	// 0 when the driver's timestamp cannot be put on CLOCK_MONOTONIC:
+	// copied from an output buffer, left at 0, or of an unknown clock
+	// that is not clearly the wall clock. timestamp_ns is then passed
+	// through as the driver set it and must not be compared with
+	// CLOCK_MONOTONIC.
+	int timestamp_monotonic;
+	uint32_t flags;  // Raw V4L2_BUF_FLAG_* bits
+	camera_v4l2_timestamp_source_t timestamp_source;
+	// Frames the driver dropped (sequence gap) since the previously
+	// dequeued buffer.
+	unsigned int dropped;
+	// Failed MJPEG validation, only set in CAMERA_V4L2_VALIDATE_FLAG mode.
+	int corrupt;
+};
+typedef struct camera_v4l2_frame_meta camera_v4l2_frame_meta_t;
+
+// A capture buffer borrowed from the driver by camera_v4l2_acquire.
+// start stays valid (and is not overwritten by the driver) until the
+// frame is handed back with camera_v4l2_release.
+struct camera_v4l2_frame {
+	int index;
+	void *start;
+	size_t length;  // bytesused
+	unsigned int skipped;  // Older ready frames dropped in latest_only mode
+	camera_v4l2_frame_meta_t meta;
+	// dmabuf of the buffer when export_dmabuf is set, otherwise -1. Owned
+	// by the camera; dup it to keep it. Its content only stays stable
+	// until the frame is released.
+	int dmabuf_fd;
+};
+typedef struct camera_v4l2_frame camera_v4l2_frame_t;
+
 enum camera_v4l2_frame_format {
 	MJPEG = 0,
 	YUYV,
 };
 typedef enum camera_v4l2_frame_format camera_v4l2_frame_format_t;
 
+// Checking MJPEG frames with camera_v4l2_mjpeg_valid as they are
+// dequeued. Buffers the driver marked with V4L2_BUF_FLAG_ERROR count as
+// corrupt too.
+enum camera_v4l2_validate {
+	CAMERA_V4L2_VALIDATE_NONE = 0,
+	CAMERA_V4L2_VALIDATE_FLAG,  // Hand them out with meta.corrupt set
+	CAMERA_V4L2_VALIDATE_DROP,  // Queue them straight back, never hand out
+};
+typedef enum camera_v4l2_validate camera_v4l2_validate_t;
+
+enum camera_v4l2_memory {
+	CAMERA_V4L2_MEMORY_MMAP = 0,  // Driver allocated, mapped into us
+	CAMERA_V4L2_MEMORY_USERPTR,  // Driver DMAs into our own buffers
+};
+typedef enum camera_v4l2_memory camera_v4l2_memory_t;
+
+// Buffer pool used in USERPTR mode. size is at least the driver's
+// sizeimage; free gets the same size that was passed to alloc.
+struct camera_v4l2_allocator {
+	void *(*alloc)(size_t size, void *user);
+	void (*free)(void *ptr, size_t size, void *user);
+	void *user;
+};
+typedef struct camera_v4l2_allocator camera_v4l2_allocator_t;
+
+// Device operations, the kernel's unless replaced to run the capture
+// path without hardware (see camera_v4l2_replay.h). open returns an fd
+// that polls readable when a buffer can be dequeued; mmap maps a buffer
+// shared and read/write at the offset VIDIOC_QUERYBUF reported.
+struct camera_v4l2_backend {
+	int (*open)(const char *path, int flags, void *user);
+	int (*close)(int fd, void *user);
+	int (*ioctl)(int fd, unsigned long request, void *arg, void *user);
+	void *(*mmap)(size_t length, int fd, uint32_t offset, void *user);
+	int (*munmap)(void *start, size_t length, void *user);
+	void *user;
+};
+typedef struct camera_v4l2_backend camera_v4l2_backend_t;
+
+struct camera_v4l2_frame_mode {
+	uint32_t pixelformat;  // V4L2_PIX_FMT_*
+	uint32_t width;
+	uint32_t height;
+	// Seconds per frame, 0/0 when the size lists no intervals. Stepwise
+	// ranges are reported as two modes, their minimum and maximum.
+	uint32_t interval_numerator;
+	uint32_t interval_denominator;
+};
+typedef struct camera_v4l2_frame_mode camera_v4l2_frame_mode_t;
+
+struct camera_v4l2_caps {
+	char driver[16];
+	char card[32];
+	char bus_info[32];
+	uint32_t version;
+	uint32_t capabilities;  // V4L2_CAP_*
+	size_t mode_count;
+	camera_v4l2_frame_mode_t *modes;
+};
+typedef struct camera_v4l2_caps camera_v4l2_caps_t;
+
 struct camera_v4l2_param {
 	int frame_width;
 	int frame_height;
 	camera_v4l2_frame_format_t fmt;
+	// Drain every ready buffer on each read and only return the newest
+	// one, trading throughput for latency.
+	int latest_only;
+	// Capture buffers to request, 0 selects the default of 12. The driver
+	// may grant a different number, see camera_v4l2_buffer_count.
+	int buffer_count;
+	// Export every capture buffer as a dmabuf fd (VIDIOC_EXPBUF) so it
+	// can be passed to other processes or devices without copying.
+	int export_dmabuf;
+	// USERPTR falls back to MMAP if the driver does not support it.
+	camera_v4l2_memory_t memory;
+	// USERPTR pool, a NULL alloc selects the built-in page aligned
+	// allocator, backed by 2 MB huge pages when hugepages is set.
+	camera_v4l2_allocator_t allocator;
+	int hugepages;
+	// Enumerate the device modes during open, see camera_v4l2_query_caps.
+	int query_caps;
+	// Requested seconds per frame (1/30 for 30 fps), 0/0 keeps the
+	// driver default. The nearest interval the device offers for the
+	// negotiated format and size is used, see camera_v4l2_frame_interval.
+	int frame_interval_numerator;
+	int frame_interval_denominator;
+	// MJPEG only, see camera_v4l2_corrupt_frames.
+	camera_v4l2_validate_t validate;
+	// NULL selects the kernel. Copied, the pointer need not outlive open.
+	const camera_v4l2_backend_t *backend;
 };
 typedef struct camera_v4l2_param camera_v4l2_param_t;
 
@@ -34,8 +165,313 @@ int camera_v4l2_open(camera_v4l2_camera_t *camera,
 		     int index, camera_v4l2_param_t *param);
 int camera_v4l2_isopened(camera_v4l2_camera_t *camera);
 void camera_v4l2_close(camera_v4l2_camera_t *camera);
+// Reads and acquires block until a buffer is ready. The _timeout
+// variants give up after timeout_ms (< 0 waits forever, 0 never waits)
+// and return 0 with errno EAGAIN when no frame arrived in time.
 int camera_v4l2_read(camera_v4l2_camera_t *camera,
 		     camera_v4l2_buffer_t *frame);
+int camera_v4l2_read_timeout(camera_v4l2_camera_t *camera,
+			     camera_v4l2_buffer_t *frame, int timeout_ms);
+int camera_v4l2_try_read(camera_v4l2_camera_t *camera,
+			 camera_v4l2_buffer_t *frame);
+int camera_v4l2_read_meta(camera_v4l2_camera_t *camera,
+			  camera_v4l2_buffer_t *frame,
+			  camera_v4l2_frame_meta_t *meta);
+int camera_v4l2_acquire(camera_v4l2_camera_t *camera,
+			camera_v4l2_frame_t *frame);
+int camera_v4l2_acquire_timeout(camera_v4l2_camera_t *camera,
+				camera_v4l2_frame_t *frame, int timeout_ms);
+int camera_v4l2_release(camera_v4l2_camera_t *camera,
+			camera_v4l2_frame_t *frame);
+int camera_v4l2_outstanding(camera_v4l2_camera_t *camera);
+int camera_v4l2_buffer_count(camera_v4l2_camera_t *camera);
+// Frames that may be acquired at once, a couple of buffers always stay
+// queued in the driver. Acquire fails with EBUSY beyond it.
+int camera_v4l2_acquire_limit(camera_v4l2_camera_t *camera);
+
+// Releases the frames other threads are done with (see the frame ring
+// and the fanout), returns how many. wake_fd is -1, or an eventfd the
+// caller is about to wait on because the camera is at its acquire
+// limit: write to it once more frames come back.
+typedef int (*camera_v4l2_reclaim_callback_t)(void *user, int wake_fd);
+// Run by acquire and by the reactor before acquiring, on the thread
+// that acquires. Replaces the previous one, NULL removes it.
+void camera_v4l2_set_reclaim(camera_v4l2_camera_t *camera,
+			     camera_v4l2_reclaim_callback_t callback,
+			     void *user);
+// dmabuf fd of buffer index, -1 when not exported. Valid until close.
+int camera_v4l2_dmabuf_fd(camera_v4l2_camera_t *camera, int index);
+// The frame interval the driver granted. Returns 0 if the driver does
+// not report one.
+int camera_v4l2_frame_interval(camera_v4l2_camera_t *camera,
+			       uint32_t *numerator, uint32_t *denominator);
+// The memory mode in use, which may differ from the requested one.
+camera_v4l2_memory_t camera_v4l2_memory(camera_v4l2_camera_t *camera);
+// Formats x frame sizes x frame intervals of the opened device. They
+// are enumerated once per device (keyed by bus_info and card) and then
+// served from a process wide cache, and from disk across restarts when
+// a cache directory is set. Valid until close, NULL on failure.
+const camera_v4l2_caps_t *camera_v4l2_query_caps(camera_v4l2_camera_t *camera);
+// NULL (the default) keeps the cache in memory only.
+void camera_v4l2_set_caps_cache_dir(const char *dir);
+void camera_v4l2_clear_caps_cache();
+// Corrupt frames seen since open, flagged or dropped.
+unsigned long camera_v4l2_corrupt_frames(camera_v4l2_camera_t *camera);
+// Cheap structural check of an MJPEG frame, a few microseconds: SOI,
+// the marker segments up to the scan, the frame size against
+// width x height (0 skips that), enough entropy coded data for that
+// size, and EOI at the end (UVC pads with zeros behind it). The
+// compressed data itself is not decoded.
+int camera_v4l2_mjpeg_valid(const void *data, size_t length,
+			    int width, int height);
+// The device fd, -1 when closed. It becomes readable (POLLIN) when a
+// frame can be acquired, for use in the caller's own event loop.
+int camera_v4l2_fd(camera_v4l2_camera_t *camera);
+
+// Log-linear latency histogram: 8 buckets per power of two, so a value
+// is known to within 12.5%, from 1 ns up to over an hour.
+#define CAMERA_V4L2_HISTOGRAM_BUCKETS (320)
+struct camera_v4l2_histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[CAMERA_V4L2_HISTOGRAM_BUCKETS];
+};
+typedef struct camera_v4l2_histogram camera_v4l2_histogram_t;
+
+// Counted since open. Updated by the thread using the camera with
+// relaxed atomics, never locked, so they can be read from any thread
+// and stay on in production.
+struct camera_v4l2_stats {
+	uint64_t frames;  // Handed out by acquire and read
+	uint64_t bytes;
+	uint64_t dropped;  // By the driver, from sequence gaps
+	uint64_t corrupt;  // See camera_v4l2_param_t validate
+	uint64_t retries;  // Dequeues that found no frame ready (EAGAIN)
+	uint64_t ioctl_errors;
+	// Kernel timestamp to dequeue, frames with a monotonic timestamp only
+	camera_v4l2_histogram_t latency;
+	camera_v4l2_histogram_t hold;  // Acquire to release
+	camera_v4l2_histogram_t ioctl;  // Every ioctl on the device
+};
+typedef struct camera_v4l2_stats camera_v4l2_stats_t;
+
+// A consistent enough snapshot, each value is read atomically.
+void camera_v4l2_camera_stats(camera_v4l2_camera_t *camera,
+			      camera_v4l2_stats_t *stats);
+// The value below which the given fraction (0.99 for p99) of the
+// recorded ones fall, 0 when empty.
+uint64_t camera_v4l2_histogram_percentile(
+	const camera_v4l2_histogram_t *histogram, double fraction);
+
+// Called by the reactor with an acquired frame. Return 0 to have the
+// reactor release it afterwards, non-zero to keep it and release it
+// later with camera_v4l2_release.
+typedef int (*camera_v4l2_frame_callback_t)(camera_v4l2_camera_t *camera,
+					     camera_v4l2_frame_t *frame,
+					     void *user);
+
+// Services many cameras from one thread with epoll. Not thread safe,
+// use one reactor per thread.
+struct camera_v4l2_reactor;
+typedef struct camera_v4l2_reactor camera_v4l2_reactor_t;
+
+camera_v4l2_reactor_t *camera_v4l2_reactor_create();
+void camera_v4l2_reactor_destroy(camera_v4l2_reactor_t *reactor);
+// The camera must be open. It is dropped from the reactor automatically
+// when it disconnects, add it again after reopening.
+int camera_v4l2_reactor_add(camera_v4l2_reactor_t *reactor,
+			    camera_v4l2_camera_t *camera,
+			    camera_v4l2_frame_callback_t callback,
+			    void *user);
+int camera_v4l2_reactor_remove(camera_v4l2_reactor_t *reactor,
+			       camera_v4l2_camera_t *camera);
+// Wait up to timeout_ms (< 0 forever) and dispatch every ready frame.
+// A camera at its acquire limit is not polled until its reclaim
+// callback or a release makes room. Returns the number of frames
+// dispatched, -1 on error.
+int camera_v4l2_reactor_run_once(camera_v4l2_reactor_t *reactor,
+				 int timeout_ms);
+
+// Bounded lock-free ring of fixed size elements (frame handles, buffer
+// indices, ...) that overwrites its oldest element when full, so the
+// pushing side never blocks. Storage is allocated once at create.
+enum camera_v4l2_ring_mode {
+	CAMERA_V4L2_RING_SPSC = 0,  // One pushing and one popping thread
+	CAMERA_V4L2_RING_MPMC,  // Any number of each
+};
+typedef enum camera_v4l2_ring_mode camera_v4l2_ring_mode_t;
+
+struct camera_v4l2_ring;
+typedef struct camera_v4l2_ring camera_v4l2_ring_t;
+
+// capacity is rounded up to a power of two.
+camera_v4l2_ring_t *camera_v4l2_ring_create(size_t capacity,
+					    size_t element_size,
+					    camera_v4l2_ring_mode_t mode);
+void camera_v4l2_ring_destroy(camera_v4l2_ring_t *ring);
+// When full, the oldest element is taken out first and copied to
+// evicted with *evicted_count set to 1, so its owner can reclaim it.
+// With evicted NULL a full ring refuses instead. A full ring also
+// refuses while another thread is taking its oldest element out, rather
+// than wait for it. Returns 0 with errno EAGAIN when the element was
+// not pushed.
+int camera_v4l2_ring_push(camera_v4l2_ring_t *ring, const void *element,
+			  void *evicted, int *evicted_count);
+// The oldest element, 0 with errno EAGAIN when empty.
+int camera_v4l2_ring_pop(camera_v4l2_ring_t *ring, void *element);
+// Approximate while other threads push or pop.
+size_t camera_v4l2_ring_count(camera_v4l2_ring_t *ring);
+
+// Passes acquired frames from the capturing thread to consumer threads
+// over a ring. Cameras are not thread safe, so consumers never release
+// frames themselves: they give them back and the capturing thread
+// releases them before its next acquire, as it does with frames the
+// ring overwrote. One capturing thread per ring.
+struct camera_v4l2_frame_ring;
+typedef struct camera_v4l2_frame_ring camera_v4l2_frame_ring_t;
+
+camera_v4l2_frame_ring_t *camera_v4l2_frame_ring_create(
+	size_t capacity, camera_v4l2_ring_mode_t mode);
+// Releases every frame still in the ring or given back. Call it from
+// the capturing thread once consumers are done, before closing cameras.
+void camera_v4l2_frame_ring_destroy(camera_v4l2_frame_ring_t *ring);
+// Capturing thread only. Takes over frame; never blocks. Returns 0 with
+// errno EAGAIN, the frame already released, in the rare case the push
+// is refused.
+int camera_v4l2_frame_ring_push(camera_v4l2_frame_ring_t *ring,
+				camera_v4l2_camera_t *camera,
+				camera_v4l2_frame_t *frame);
+// Capturing thread only. Releases given back frames without pushing.
+int camera_v4l2_frame_ring_reclaim(camera_v4l2_frame_ring_t *ring);
+// Makes the ring the camera's reclaim callback, so frames given back
+// are released even while the camera cannot acquire. The camera must be
+// open. The ring then holds at most one frame less than the camera can
+// hand out, so a full ring never keeps it from acquiring the next one.
+int camera_v4l2_frame_ring_attach(camera_v4l2_frame_ring_t *ring,
+				  camera_v4l2_camera_t *camera);
+// Consumers. take returns the oldest frame; take_latest the newest,
+// giving every older one straight back and counting them in skipped.
+// Both return 0 with errno EAGAIN when the ring is empty.
+int camera_v4l2_frame_ring_take(camera_v4l2_frame_ring_t *ring,
+				camera_v4l2_camera_t **camera,
+				camera_v4l2_frame_t *frame);
+int camera_v4l2_frame_ring_take_latest(camera_v4l2_frame_ring_t *ring,
+				       camera_v4l2_camera_t **camera,
+				       camera_v4l2_frame_t *frame,
+				       unsigned int *skipped);
+int camera_v4l2_frame_ring_give_back(camera_v4l2_frame_ring_t *ring,
+				     camera_v4l2_camera_t *camera,
+				     camera_v4l2_frame_t *frame);
+
+// Shares every acquired frame between several consumers (recorder,
+// detector, preview, ...) without copying it. Each shared frame is
+// reference counted and its buffer is queued back to the driver only
+// once the last reference is dropped. References can be taken and
+// dropped from any thread; like with the frame ring, the capturing
+// thread requeues the dropped buffers on its next acquire. The fanout
+// is the camera's reclaim callback while it exists.
+enum camera_v4l2_fanout_policy {
+	// When every buffer is still referenced:
+	CAMERA_V4L2_FANOUT_FAIL = 0,  // acquire fails with EBUSY right away
+	// Wait for a reference to drop. Frames captured meanwhile stay
+	// queued, so the next one handed out may be stale.
+	CAMERA_V4L2_FANOUT_WAIT,
+	// Wait too, but queue frames captured meanwhile straight back to
+	// the driver, so the next one handed out is fresh. They show up in
+	// its meta.dropped.
+	CAMERA_V4L2_FANOUT_SKIP,
+};
+typedef enum camera_v4l2_fanout_policy camera_v4l2_fanout_policy_t;
+
+struct camera_v4l2_fanout;
+typedef struct camera_v4l2_fanout camera_v4l2_fanout_t;
+struct camera_v4l2_shared_frame;
+typedef struct camera_v4l2_shared_frame camera_v4l2_shared_frame_t;
+
+// The camera must be open. Destroy the fanout before closing it.
+camera_v4l2_fanout_t *camera_v4l2_fanout_create(
+	camera_v4l2_camera_t *camera, camera_v4l2_fanout_policy_t policy);
+// Every reference must have been dropped by then, the remaining frames
+// are released regardless.
+void camera_v4l2_fanout_destroy(camera_v4l2_fanout_t *fanout);
+// Capturing thread only. Waits like camera_v4l2_acquire_timeout; the
+// frame comes with one reference, owned by the caller.
+int camera_v4l2_fanout_acquire(camera_v4l2_fanout_t *fanout,
+			       camera_v4l2_shared_frame_t **shared,
+			       int timeout_ms);
+// Capturing thread only. Requeues the buffers whose last reference was
+// dropped, returns how many.
+int camera_v4l2_fanout_reclaim(camera_v4l2_fanout_t *fanout);
+// Any thread. The frame stays valid while the caller holds a reference.
+const camera_v4l2_frame_t *camera_v4l2_shared_frame_get(
+	const camera_v4l2_shared_frame_t *shared);
+void camera_v4l2_shared_frame_ref(camera_v4l2_shared_frame_t *shared);
+void camera_v4l2_shared_frame_unref(camera_v4l2_shared_frame_t *shared);
+
+// Frame callback pushing every frame into the camera_v4l2_frame_ring_t
+// passed as user, for use with a reactor or a capture thread. Attach the
+// ring to the camera first.
+int camera_v4l2_frame_ring_callback(camera_v4l2_camera_t *camera,
+				    camera_v4l2_frame_t *frame, void *user);
+
+// Runs a reactor on a thread of its own, so frames are dequeued as soon
+// as they are ready however busy the rest of the process is.
+struct camera_v4l2_thread_param {
+	// Bit n pins the thread to CPU n, 0 leaves it unpinned.
+	uint64_t cpu_mask;
+	// SCHED_FIFO priority (1 to 99), 0 keeps the default policy. Needs
+	// CAP_SYS_NICE or RLIMIT_RTPRIO, without them the thread runs with
+	// the default policy and a warning.
+	int priority;
+	// mlock the capture buffers while running, so the thread never
+	// faults on a buffer that was paged out.
+	int lock_memory;
+};
+typedef struct camera_v4l2_thread_param camera_v4l2_thread_param_t;
+
+struct camera_v4l2_thread_stats {
+	uint64_t frames;
+	// Kernel timestamp to dequeue, how late frames were picked up. Like
+	// jitter, only over frames with a monotonic timestamp.
+	uint64_t latency_mean_ns;
+	uint64_t latency_max_ns;
+	// How far the time between two dequeues of a camera strayed from
+	// the time between their timestamps. Bursts of back to back frames
+	// after the thread was descheduled show up here.
+	uint64_t jitter_mean_ns;
+	uint64_t jitter_max_ns;
+	uint64_t preemptions;  // Involuntary context switches
+	// What the thread actually got from param.
+	int pinned;
+	int realtime;
+	size_t locked_bytes;
+};
+typedef struct camera_v4l2_thread_stats camera_v4l2_thread_stats_t;
+
+struct camera_v4l2_capture_thread;
+typedef struct camera_v4l2_capture_thread camera_v4l2_capture_thread_t;
+
+camera_v4l2_capture_thread_t *camera_v4l2_capture_thread_create(
+	const camera_v4l2_thread_param_t *param);
+// Stops the thread first.
+void camera_v4l2_capture_thread_destroy(camera_v4l2_capture_thread_t *thread);
+// Only while stopped. The callback runs on the capture thread, as with
+// camera_v4l2_reactor_add; see camera_v4l2_frame_ring_callback to hand
+// the frames to other threads instead. The camera's reclaim callback
+// runs on every wakeup, and a camera at its acquire limit is not polled
+// until it frees a frame.
+int camera_v4l2_capture_thread_add(camera_v4l2_capture_thread_t *thread,
+				   camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_callback_t callback,
+				   void *user);
+int camera_v4l2_capture_thread_remove(camera_v4l2_capture_thread_t *thread,
+				      camera_v4l2_camera_t *camera);
+int camera_v4l2_capture_thread_start(camera_v4l2_capture_thread_t *thread);
+void camera_v4l2_capture_thread_stop(camera_v4l2_capture_thread_t *thread);
+// Any thread. Totals since create.
+void camera_v4l2_capture_thread_stats(camera_v4l2_capture_thread_t *thread,
+				      camera_v4l2_thread_stats_t *stats);
 
 #ifdef __cpluscplus
 }
@@ -44,6 +480,8 @@ int camera_v4l2_read(camera_v4l2_camera_t *camera,
 #endif  // CAMERA_V4L2_H_
 
 #ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_IMPLEMENTATION_
+#define CAMERA_V4L2_IMPLEMENTATION_
 
 #ifdef __cpluscplus
 extern "C" {
@@ -57,13 +495,34 @@ extern "C" {
 #include <errno.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
 
 #define	CAMERA_V4L2_BUFFER_COUNT (12)
+// Buffers that always stay queued in the driver, acquire refuses to
+// hand out more than (count - CAMERA_V4L2_MIN_QUEUED) at once.
+#define CAMERA_V4L2_MIN_QUEUED (2)
+#define CAMERA_V4L2_REACTOR_MAX_EVENTS (32)
+#define CAMERA_V4L2_HUGE_PAGE_SIZE (2u << 20)
+#define CAMERA_V4L2_CACHE_LINE (64)
+// Only declared with _GNU_SOURCE.
+#ifdef RUSAGE_THREAD
+#define CAMERA_V4L2_RUSAGE_THREAD RUSAGE_THREAD
+#else
+#define CAMERA_V4L2_RUSAGE_THREAD (1)
+#endif
 #define CAMERA_V4L2_ASSERT(cond, msg) \
 do { \
 	if (!(cond)) { \
@@ -87,145 +546,666 @@ do { \
 	fprintf(stderr, "\x1B[32mWARN: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
 } while(0)
 
+struct camera_v4l2_slot {
+	void *start;
+	size_t length;
+	int held;
+	int dmabuf_fd;
+	uint64_t acquired_ns;
+};
+
 struct camera_v4l2_camera {
 	int streaming;
 	int fd;
-	camera_v4l2_buffer_t *buf;
+	struct camera_v4l2_slot *slots;
+	int buffer_count;
+	int outstanding;
+	int latest_only;
+	int export_dmabuf;
+	enum v4l2_memory memory;
+	camera_v4l2_allocator_t allocator;
+	int hugepages;
+	camera_v4l2_caps_t caps;  // Identity always, modes once caps_valid
+	int caps_valid;
+	uint32_t interval_numerator;
+	uint32_t interval_denominator;
+	int sequence_valid;
+	uint32_t last_sequence;
+	uint32_t pixelformat;  // Negotiated by VIDIOC_S_FMT, 0 without param
+	uint32_t width;
+	uint32_t height;
+	camera_v4l2_validate_t validate;
+	camera_v4l2_stats_t stats;
+	camera_v4l2_backend_t backend;
+	// The reactor polling the camera, if any.
+	struct camera_v4l2_reactor_entry *reactor_entry;
+	camera_v4l2_reclaim_callback_t reclaim;
+	void *reclaim_user;
+};
+
+static int camera_v4l2_kernel_open(const char *path, int flags, void *user) {
+	(void) user;
+	return open(path, flags);
+}
+
+static int camera_v4l2_kernel_close(int fd, void *user) {
+	(void) user;
+	return close(fd);
+}
+
+static int camera_v4l2_kernel_ioctl(int fd, unsigned long request,
+				    void *arg, void *user) {
+	(void) user;
+	return ioctl(fd, request, arg);
+}
+
+static void *camera_v4l2_kernel_mmap(size_t length, int fd,
+				     uint32_t offset, void *user) {
+	(void) user;
+	return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+static int camera_v4l2_kernel_munmap(void *start, size_t length, void *user) {
+	(void) user;
+	return munmap(start, length);
+}
+
+static const camera_v4l2_backend_t camera_v4l2_kernel_backend = {
+	camera_v4l2_kernel_open,
+	camera_v4l2_kernel_close,
+	camera_v4l2_kernel_ioctl,
+	camera_v4l2_kernel_mmap,
+	camera_v4l2_kernel_munmap,
+	NULL,
 };
 
+static uint64_t camera_v4l2_clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Stats have a single writer, the thread using the camera, so plain
+// read-modify-write through atomic stores is enough for readers.
+static void camera_v4l2_count(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static int camera_v4l2_histogram_bucket(uint64_t value) {
+	if (value < 8) return (int) value;
+	int msb = 63 - __builtin_clzll(value);
+	int bucket = (msb - 2) * 8 + (int) ((value >> (msb - 3)) & 7);
+	return bucket < CAMERA_V4L2_HISTOGRAM_BUCKETS ?
+		bucket : CAMERA_V4L2_HISTOGRAM_BUCKETS - 1;
+}
+
+static void camera_v4l2_histogram_record(camera_v4l2_histogram_t *histogram,
+					 uint64_t value) {
+	camera_v4l2_count(&histogram->count, 1);
+	camera_v4l2_count(&histogram->sum_ns, value);
+	if (value > histogram->max_ns) {
+		__atomic_store_n(&histogram->max_ns, value, __ATOMIC_RELAXED);
+	}
+	camera_v4l2_count(
+		&histogram->buckets[camera_v4l2_histogram_bucket(value)], 1);
+}
+
+// Times every ioctl on the device and counts its failures. EAGAIN is a
+// retry, not an error.
+static int camera_v4l2_timed_ioctl(camera_v4l2_camera_t *camera,
+				   unsigned long request, void *arg) {
+	uint64_t start = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	int ret = camera->backend.ioctl(camera->fd, request, arg,
+					camera->backend.user);
+	int err = errno;
+	camera_v4l2_histogram_record(
+		&camera->stats.ioctl,
+		camera_v4l2_clock_ns(CLOCK_MONOTONIC) - start);
+	if (ret < 0) {
+		if (err == EAGAIN) {
+			camera_v4l2_count(&camera->stats.retries, 1);
+		} else if (err != EINTR) {
+			camera_v4l2_count(&camera->stats.ioctl_errors, 1);
+		}
+	}
+	errno = err;
+	return ret;
+}
+
+// Returns 0 with errno EAGAIN, and without logging, when a non-blocking
+// request has nothing to do yet. Waiting is up to the caller.
 static int camera_v4l2_io_control(camera_v4l2_camera_t *camera, int request,
 				   void *output) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
 
 	if (camera->fd == -1) return 0;
 
-ioctl_retry:
-	int ret = ioctl(camera->fd, request, output);
+	int ret;
+	do {
+		ret = camera_v4l2_timed_ioctl(camera, request, output);
+	} while (ret < 0 && errno == EINTR);
 	if (ret >= 0) return 1;
-	if (errno != EINPROGRESS && errno != EAGAIN && errno != EBUSY) {
-		if (errno == EBADF || errno == ENOENT ||
-		    errno == ENODEV || errno == EPIPE) {
-			camera->streaming = 0;  // If camera disconnected, the streaming should be 0.
-			camera_v4l2_close(camera);
+	if (errno == EAGAIN) return 0;
+
+	int err = errno;
+	if (err == EBADF || err == ENOENT ||
+	    err == ENODEV || err == EPIPE) {
+		camera->streaming = 0;  // If camera disconnected, the streaming should be 0.
+		camera_v4l2_close(camera);
+	}
+	CAMERA_V4L2_LOG_ERROR("ioctl failed: %s", strerror(err));
+	errno = err;
+	return 0;
+}
+
+// Milliseconds left until deadline (CLOCK_MONOTONIC ns), rounded up.
+static int camera_v4l2_remaining_ms(uint64_t deadline) {
+	uint64_t now = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	if (now >= deadline) return 0;
+	return (int) ((deadline - now + 999999) / 1000000);
+}
+
+// Block until the device is readable. timeout_ms < 0 waits forever.
+// Returns 0 with errno EAGAIN on timeout, otherwise 1 with the poll
+// events in revents.
+static int camera_v4l2_wait_ready(camera_v4l2_camera_t *camera,
+				  int timeout_ms, short *revents) {
+	struct pollfd pfd;
+	pfd.fd = camera->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	uint64_t deadline = 0;
+	if (timeout_ms > 0) {
+		deadline = camera_v4l2_clock_ns(CLOCK_MONOTONIC) +
+			(uint64_t) timeout_ms * 1000000ull;
+	}
+
+	int ret;
+	while ((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+		if (timeout_ms > 0) {
+			timeout_ms = camera_v4l2_remaining_ms(deadline);
 		}
-		CAMERA_V4L2_LOG_ERROR("ioctl failed: %s", strerror(errno));
+	}
+	if (ret < 0) {
+		CAMERA_V4L2_LOG_ERROR("poll failed: %s", strerror(errno));
+		return 0;
+	}
+	if (ret == 0) {
+		errno = EAGAIN;
 		return 0;
-	} else {
-		fd_set fdset;
-		FD_ZERO(&fdset);
-		FD_SET(camera->fd, &fdset);
-		struct timeval tv;
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000 * 50;
-		int select_ret = select(camera->fd + 1, &fdset, NULL, NULL,
-					&tv);
-		if (select_ret > 0) {
-			goto ioctl_retry;
-		} else {
-			CAMERA_V4L2_LOG_ERROR("select failed: %s", strerror(errno));
-			return 0;
-		}
 	}
 
+	*revents = pfd.revents;
 	return 1;
 }
 
-static void camera_v4l2_query_frame_interval(
-	camera_v4l2_camera_t *camera,
-	uint32_t pixelfmt,
-	int width,
-	int height) {
-	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+// ioctl for enumerations, which end with EINVAL and must not be logged.
+static int camera_v4l2_enum_control(camera_v4l2_camera_t *camera,
+				    int request, void *output) {
+	int ret;
+	do {
+		ret = camera->backend.ioctl(camera->fd, request, output,
+					    camera->backend.user);
+	} while (ret < 0 && errno == EINTR);
+	return ret >= 0;
+}
+
+static int camera_v4l2_caps_add_mode(camera_v4l2_caps_t *caps,
+				     size_t *capacity,
+				     uint32_t pixelformat,
+				     uint32_t width, uint32_t height,
+				     uint32_t numerator,
+				     uint32_t denominator) {
+	if (caps->mode_count == *capacity) {
+		size_t grow = *capacity ? *capacity * 2 : 32;
+		camera_v4l2_frame_mode_t *modes =
+			(camera_v4l2_frame_mode_t *) realloc(
+				caps->modes, grow * sizeof(*caps->modes));
+		if (modes == NULL) return 0;
+		caps->modes = modes;
+		*capacity = grow;
+	}
+
+	camera_v4l2_frame_mode_t *mode = &caps->modes[caps->mode_count++];
+	mode->pixelformat = pixelformat;
+	mode->width = width;
+	mode->height = height;
+	mode->interval_numerator = numerator;
+	mode->interval_denominator = denominator;
+
+	return 1;
+}
 
+static int camera_v4l2_enum_frame_intervals(camera_v4l2_camera_t *camera,
+					    camera_v4l2_caps_t *caps,
+					    size_t *capacity,
+					    uint32_t pixelfmt,
+					    uint32_t width,
+					    uint32_t height) {
 	struct v4l2_frmivalenum frmival;
-	frmival.index = 0;
+	memset(&frmival, 0, sizeof(frmival));
 	frmival.pixel_format = pixelfmt;
 	frmival.width = width;
 	frmival.height = height;
 
-	while (camera_v4l2_io_control(camera, VIDIOC_ENUM_FRAMEINTERVALS,
-				      &frmival)) {
-		CAMERA_V4L2_LOG_INFO(
-		       "%d/%d ",
-		       frmival.discrete.numerator,
-		       frmival.discrete.denominator
-		);
+	int found = 0;
+	while (camera_v4l2_enum_control(camera, VIDIOC_ENUM_FRAMEINTERVALS,
+					&frmival)) {
+		if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+			if (!camera_v4l2_caps_add_mode(
+				    caps, capacity, pixelfmt, width, height,
+				    frmival.discrete.numerator,
+				    frmival.discrete.denominator)) {
+				return 0;
+			}
+			found = 1;
+		} else {
+			// Stepwise ranges are reported by their bounds.
+			if (!camera_v4l2_caps_add_mode(
+				    caps, capacity, pixelfmt, width, height,
+				    frmival.stepwise.min.numerator,
+				    frmival.stepwise.min.denominator) ||
+			    !camera_v4l2_caps_add_mode(
+				    caps, capacity, pixelfmt, width, height,
+				    frmival.stepwise.max.numerator,
+				    frmival.stepwise.max.denominator)) {
+				return 0;
+			}
+			return 1;
+		}
 
 		frmival.index++;
 	}
-	CAMERA_V4L2_LOG_INFO("\n");
-}
 
-static void camera_v4l2_query_frame_size(camera_v4l2_camera_t *camera,
-					 uint32_t pixelfmt) {
-	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	if (!found) {
+		return camera_v4l2_caps_add_mode(caps, capacity, pixelfmt,
+						 width, height, 0, 0);
+	}
 
+	return 1;
+}
+
+static int camera_v4l2_enum_frame_sizes(camera_v4l2_camera_t *camera,
+					camera_v4l2_caps_t *caps,
+					size_t *capacity,
+					uint32_t pixelfmt) {
 	struct v4l2_frmsizeenum frmsize;
+	memset(&frmsize, 0, sizeof(frmsize));
 	frmsize.pixel_format = pixelfmt;
-	frmsize.index = 0;
-
-	while (camera_v4l2_io_control(camera, VIDIOC_ENUM_FRAMESIZES,
-				      &frmsize)) {
-		CAMERA_V4L2_LOG_INFO(
-		       "width: %d, height: %d, fps: ",
-		       frmsize.discrete.width,
-		       frmsize.discrete.height
-		);
 
-		camera_v4l2_query_frame_interval(camera, pixelfmt, frmsize.discrete.width, frmsize.discrete.height);
+	while (camera_v4l2_enum_control(camera, VIDIOC_ENUM_FRAMESIZES,
+					&frmsize)) {
+		if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			if (!camera_v4l2_enum_frame_intervals(
+				    camera, caps, capacity, pixelfmt,
+				    frmsize.discrete.width,
+				    frmsize.discrete.height)) {
+				return 0;
+			}
+		} else {
+			if (!camera_v4l2_enum_frame_intervals(
+				    camera, caps, capacity, pixelfmt,
+				    frmsize.stepwise.min_width,
+				    frmsize.stepwise.min_height) ||
+			    !camera_v4l2_enum_frame_intervals(
+				    camera, caps, capacity, pixelfmt,
+				    frmsize.stepwise.max_width,
+				    frmsize.stepwise.max_height)) {
+				return 0;
+			}
+			return 1;
+		}
 
 		frmsize.index++;
 	}
-	CAMERA_V4L2_LOG_INFO("\n");
-}
 
-static void camera_v4l2_query_fmt_desc(camera_v4l2_camera_t *camera) {
-	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return 1;
+}
 
+static int camera_v4l2_enum_caps(camera_v4l2_camera_t *camera,
+				 camera_v4l2_caps_t *caps) {
+	size_t capacity = 0;
 	struct v4l2_fmtdesc fmtdesc;
-	fmtdesc.index = 0;
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
 	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	while (camera_v4l2_io_control(camera, VIDIOC_ENUM_FMT, &fmtdesc)) {
-		CAMERA_V4L2_LOG_INFO(
-		       "Format: %c %c %c %c\n"
-		       "Format description: %s\n",
-        	       fmtdesc.pixelformat & 0xFF,
-		       (fmtdesc.pixelformat >> 8) & 0xFF,
-		       (fmtdesc.pixelformat >> 16) & 0xFF,
-		       (fmtdesc.pixelformat >> 24) & 0xFF,
-		       fmtdesc.description
-		);
-
-		camera_v4l2_query_frame_size(camera, fmtdesc.pixelformat);
+	while (camera_v4l2_enum_control(camera, VIDIOC_ENUM_FMT, &fmtdesc)) {
+		if (!camera_v4l2_enum_frame_sizes(camera, caps, &capacity,
+						  fmtdesc.pixelformat)) {
+			CAMERA_V4L2_LOG_ERROR("Out of memory");
+			return 0;
+		}
 
 		fmtdesc.index++;
 	}
 
+	return 1;
+}
+
+static void camera_v4l2_caps_free(camera_v4l2_caps_t *caps) {
+	free(caps->modes);
+	caps->modes = NULL;
+	caps->mode_count = 0;
+}
+
+static int camera_v4l2_caps_copy(camera_v4l2_caps_t *dst,
+				 const camera_v4l2_caps_t *src) {
+	*dst = *src;
+	dst->modes = NULL;
+	if (src->mode_count == 0) return 1;
+
+	dst->modes = (camera_v4l2_frame_mode_t *) malloc(
+		src->mode_count * sizeof(*src->modes));
+	if (dst->modes == NULL) {
+		dst->mode_count = 0;
+		return 0;
+	}
+	memcpy(dst->modes, src->modes, src->mode_count * sizeof(*src->modes));
+
+	return 1;
+}
+
+// Process wide cache of enumerated devices, keyed by bus_info and card.
+struct camera_v4l2_caps_entry {
+	camera_v4l2_caps_t caps;
+	struct camera_v4l2_caps_entry *next;
+};
+
+static pthread_mutex_t camera_v4l2_caps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct camera_v4l2_caps_entry *camera_v4l2_caps_cache = NULL;
+static char *camera_v4l2_caps_dir = NULL;
+
+static int camera_v4l2_caps_match(const camera_v4l2_caps_t *a,
+				  const camera_v4l2_caps_t *b) {
+	return strcmp(a->bus_info, b->bus_info) == 0 &&
+		strcmp(a->card, b->card) == 0 &&
+		strcmp(a->driver, b->driver) == 0 &&
+		a->version == b->version;
+}
+
+// <dir>/<card>@<bus_info>.caps, with anything but [A-Za-z0-9.-] as '_'.
+static void camera_v4l2_caps_path(const char *dir,
+				  const camera_v4l2_caps_t *caps,
+				  char *path, size_t size) {
+	char name[sizeof(caps->card) + sizeof(caps->bus_info) + 1];
+	snprintf(name, sizeof(name), "%s@%s", caps->card, caps->bus_info);
+	for (char *c = name; *c != '\0'; c++) {
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+		      (*c >= '0' && *c <= '9') || *c == '.' || *c == '-' ||
+		      *c == '@')) {
+			*c = '_';
+		}
+	}
+	snprintf(path, size, "%s/%s.caps", dir, name);
+}
+
+static void camera_v4l2_copy_string(char *dst, size_t size,
+				    const char *src) {
+	size_t length = strnlen(src, size - 1);
+	memcpy(dst, src, length);
+	dst[length] = '\0';
+}
+
+static int camera_v4l2_caps_load(const char *dir, camera_v4l2_caps_t *caps) {
+	char path[512];
+	camera_v4l2_caps_path(dir, caps, path, sizeof(path));
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return 0;
+
+	camera_v4l2_caps_t loaded;
+	memset(&loaded, 0, sizeof(loaded));
+	size_t capacity = 0;
+	char line[128];
+	int ok = 1;
+	while (ok && fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		camera_v4l2_frame_mode_t m;
+		if (strncmp(line, "driver=", 7) == 0) {
+			camera_v4l2_copy_string(loaded.driver,
+						sizeof(loaded.driver), line + 7);
+		} else if (strncmp(line, "card=", 5) == 0) {
+			camera_v4l2_copy_string(loaded.card,
+						sizeof(loaded.card), line + 5);
+		} else if (strncmp(line, "bus_info=", 9) == 0) {
+			camera_v4l2_copy_string(loaded.bus_info,
+						sizeof(loaded.bus_info), line + 9);
+		} else if (strncmp(line, "mode=", 5) == 0) {
+			ok = sscanf(line, "mode=%u %u %u %u %u", &m.pixelformat,
+				    &m.width, &m.height, &m.interval_numerator,
+				    &m.interval_denominator) == 5 &&
+				camera_v4l2_caps_add_mode(
+					&loaded, &capacity, m.pixelformat,
+					m.width, m.height, m.interval_numerator,
+					m.interval_denominator);
+		} else {
+			ok = sscanf(line, "version=%u", &loaded.version) == 1 ||
+				sscanf(line, "capabilities=%u",
+				       &loaded.capabilities) == 1;
+		}
+	}
+	fclose(file);
+
+	// A driver update or another device with a clashing name.
+	if (!ok || !camera_v4l2_caps_match(caps, &loaded)) {
+		camera_v4l2_caps_free(&loaded);
+		return 0;
+	}
+
+	caps->capabilities = loaded.capabilities;
+	caps->mode_count = loaded.mode_count;
+	caps->modes = loaded.modes;
+
+	return 1;
+}
+
+static void camera_v4l2_caps_store(const char *dir,
+				   const camera_v4l2_caps_t *caps) {
+	char path[512];
+	camera_v4l2_caps_path(dir, caps, path, sizeof(path));
+
+	// Written aside and renamed so a reader never sees half a file, each
+	// writer aside of its own as lookups of the same device may race.
+	char tmp[520];
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	// Readable by other processes, as fopen would have left it.
+	if (fd >= 0) fchmod(fd, 0644);
+	FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (file == NULL) {
+		CAMERA_V4L2_LOG_WARN("Cannot write %s: %s", tmp, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		return;
+	}
+
+	fprintf(file, "driver=%s\ncard=%s\nbus_info=%s\nversion=%u\n"
+		"capabilities=%u\n", caps->driver, caps->card, caps->bus_info,
+		caps->version, caps->capabilities);
+	for (size_t i = 0; i < caps->mode_count; i++) {
+		const camera_v4l2_frame_mode_t *m = &caps->modes[i];
+		fprintf(file, "mode=%u %u %u %u %u\n", m->pixelformat,
+			m->width, m->height, m->interval_numerator,
+			m->interval_denominator);
+	}
+
+	if (fclose(file) != 0 || rename(tmp, path) != 0) {
+		CAMERA_V4L2_LOG_WARN("Cannot write %s: %s", path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+static struct camera_v4l2_caps_entry *camera_v4l2_caps_find(
+	const camera_v4l2_caps_t *caps) {
+	struct camera_v4l2_caps_entry *entry = camera_v4l2_caps_cache;
+	while (entry != NULL && !camera_v4l2_caps_match(&entry->caps, caps)) {
+		entry = entry->next;
+	}
+	return entry;
+}
+
+// Fills caps->modes from the memory cache, the disk cache or the device,
+// in that order. The identity fields must already be set. The lock is
+// not held while enumerating, which takes a while on some devices.
+static int camera_v4l2_caps_lookup(camera_v4l2_camera_t *camera,
+				   camera_v4l2_caps_t *caps) {
+	pthread_mutex_lock(&camera_v4l2_caps_lock);
+	struct camera_v4l2_caps_entry *entry = camera_v4l2_caps_find(caps);
+	if (entry != NULL) {
+		int ok = camera_v4l2_caps_copy(caps, &entry->caps);
+		pthread_mutex_unlock(&camera_v4l2_caps_lock);
+		return ok;
+	}
+	char *dir = camera_v4l2_caps_dir != NULL ?
+		strdup(camera_v4l2_caps_dir) : NULL;
+	pthread_mutex_unlock(&camera_v4l2_caps_lock);
+
+	int loaded = dir != NULL && camera_v4l2_caps_load(dir, caps);
+	if (!loaded) {
+		if (!camera_v4l2_enum_caps(camera, caps)) {
+			camera_v4l2_caps_free(caps);
+			free(dir);
+			return 0;
+		}
+		if (dir != NULL) {
+			camera_v4l2_caps_store(dir, caps);
+		}
+	}
+	free(dir);
+
+	// Another camera on the same device may have got there first.
+	pthread_mutex_lock(&camera_v4l2_caps_lock);
+	if (camera_v4l2_caps_find(caps) == NULL) {
+		entry = (struct camera_v4l2_caps_entry *) calloc(1, sizeof(*entry));
+		if (entry != NULL && camera_v4l2_caps_copy(&entry->caps, caps)) {
+			entry->next = camera_v4l2_caps_cache;
+			camera_v4l2_caps_cache = entry;
+		} else {
+			free(entry);
+		}
+	}
+	pthread_mutex_unlock(&camera_v4l2_caps_lock);
+	return 1;
 }
 
 static int camera_v4l2_query_info(camera_v4l2_camera_t *camera) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
 
 	struct v4l2_capability capability;
+	memset(&capability, 0, sizeof(capability));
 
 	if (camera_v4l2_io_control(camera, VIDIOC_QUERYCAP, &capability) == 0) {
 		CAMERA_V4L2_LOG_ERROR("Query capability failed\n");
 		return 0;
 	}
 
-	CAMERA_V4L2_LOG_INFO(
-	       "Driver name: %s\n"
-	       "Device name: %s\n"
-	       "Bus info: %s\n"
-	       "Version: %d\n\n",
-	       capability.driver,
-	       capability.card,
-	       capability.bus_info,
-	       capability.version
-	);
+	camera_v4l2_caps_free(&camera->caps);
+	camera->caps_valid = 0;
+	memset(&camera->caps, 0, sizeof(camera->caps));
+	camera_v4l2_copy_string(camera->caps.driver, sizeof(camera->caps.driver),
+				(const char *) capability.driver);
+	camera_v4l2_copy_string(camera->caps.card, sizeof(camera->caps.card),
+				(const char *) capability.card);
+	camera_v4l2_copy_string(camera->caps.bus_info,
+				sizeof(camera->caps.bus_info),
+				(const char *) capability.bus_info);
+	camera->caps.version = capability.version;
+	camera->caps.capabilities = capability.capabilities;
+
+	CAMERA_V4L2_LOG_INFO("Device: %s (%s), bus: %s",
+			     camera->caps.card, camera->caps.driver,
+			     camera->caps.bus_info);
+
+	return 1;
+}
+
+// Picks the discrete interval closest to numerator/denominator. Sizes
+// with stepwise intervals keep the request, the driver clamps it.
+static void camera_v4l2_nearest_interval(camera_v4l2_camera_t *camera,
+					 uint32_t pixelfmt,
+					 uint32_t width,
+					 uint32_t height,
+					 uint32_t *numerator,
+					 uint32_t *denominator) {
+	double wanted = (double) *numerator / *denominator;
+	double best = -1.0;
+
+	struct v4l2_frmivalenum frmival;
+	memset(&frmival, 0, sizeof(frmival));
+	frmival.pixel_format = pixelfmt;
+	frmival.width = width;
+	frmival.height = height;
+
+	while (camera_v4l2_enum_control(camera, VIDIOC_ENUM_FRAMEINTERVALS,
+					&frmival)) {
+		if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE) return;
+		if (frmival.discrete.denominator != 0) {
+			double interval = (double) frmival.discrete.numerator /
+				frmival.discrete.denominator;
+			double diff = interval > wanted ?
+				interval - wanted : wanted - interval;
+			if (best < 0.0 || diff < best) {
+				best = diff;
+				*numerator = frmival.discrete.numerator;
+				*denominator = frmival.discrete.denominator;
+			}
+		}
+		frmival.index++;
+	}
+}
+
+static int camera_v4l2_get_frame_interval(camera_v4l2_camera_t *camera) {
+	struct v4l2_streamparm parm;
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	camera->interval_numerator = 0;
+	camera->interval_denominator = 0;
+	if (!camera_v4l2_enum_control(camera, VIDIOC_G_PARM, &parm) ||
+	    !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+		return 0;
+	}
+
+	camera->interval_numerator = parm.parm.capture.timeperframe.numerator;
+	camera->interval_denominator =
+		parm.parm.capture.timeperframe.denominator;
+
+	return 1;
+}
+
+static int camera_v4l2_set_frame_interval(camera_v4l2_camera_t *camera,
+					  uint32_t pixelfmt,
+					  uint32_t width,
+					  uint32_t height,
+					  uint32_t numerator,
+					  uint32_t denominator) {
+	if (!camera_v4l2_get_frame_interval(camera)) {
+		CAMERA_V4L2_LOG_WARN("Device has no frame rate control");
+		return 1;
+	}
+
+	camera_v4l2_nearest_interval(camera, pixelfmt, width, height,
+				     &numerator, &denominator);
+
+	struct v4l2_streamparm parm;
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = numerator;
+	parm.parm.capture.timeperframe.denominator = denominator;
+	if (!camera_v4l2_io_control(camera, VIDIOC_S_PARM, &parm)) {
+		CAMERA_V4L2_LOG_ERROR("Set frame interval failed");
+		return 0;
+	}
 
-	camera_v4l2_query_fmt_desc(camera);
+	camera->interval_numerator = parm.parm.capture.timeperframe.numerator;
+	camera->interval_denominator =
+		parm.parm.capture.timeperframe.denominator;
+	CAMERA_V4L2_LOG_INFO("Frame interval: %u/%u",
+			     camera->interval_numerator,
+			     camera->interval_denominator);
 
 	return 1;
 }
@@ -236,7 +1216,8 @@ static int camera_v4l2_set_param(
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
 
 	struct v4l2_format fmt;
-    	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	fmt.fmt.pix.width = param->frame_width;
 	fmt.fmt.pix.height = param->frame_height;
 	switch (param->fmt) {
@@ -250,28 +1231,169 @@ static int camera_v4l2_set_param(
 		}
 	}
 
-	return camera_v4l2_io_control(camera, VIDIOC_S_FMT, &fmt);
+	if (!camera_v4l2_io_control(camera, VIDIOC_S_FMT, &fmt)) {
+		return 0;
+	}
+	camera->pixelformat = fmt.fmt.pix.pixelformat;
+	camera->width = fmt.fmt.pix.width;
+	camera->height = fmt.fmt.pix.height;
+
+	if (param->frame_interval_numerator > 0 &&
+	    param->frame_interval_denominator > 0) {
+		// The driver adjusts the format, negotiate against what we got.
+		return camera_v4l2_set_frame_interval(
+			camera, fmt.fmt.pix.pixelformat,
+			fmt.fmt.pix.width, fmt.fmt.pix.height,
+			param->frame_interval_numerator,
+			param->frame_interval_denominator);
+	}
+
+	return 1;
+}
+
+static int camera_v4l2_export_buffer(camera_v4l2_camera_t *camera,
+				     int index) {
+	struct v4l2_exportbuffer expbuf;
+	memset(&expbuf, 0, sizeof(expbuf));
+	expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	expbuf.index = index;
+	expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+	if (!camera_v4l2_io_control(camera, VIDIOC_EXPBUF, &expbuf)) {
+		return 0;
+	}
+	camera->slots[index].dmabuf_fd = expbuf.fd;
+
+	return 1;
+}
+
+static size_t camera_v4l2_user_buffer_size(camera_v4l2_camera_t *camera,
+					   size_t size) {
+	if (camera->hugepages) {
+		return (size + CAMERA_V4L2_HUGE_PAGE_SIZE - 1) &
+			~((size_t) CAMERA_V4L2_HUGE_PAGE_SIZE - 1);
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+// Page aligned, which also covers the 64 byte alignment SIMD code wants.
+static void *camera_v4l2_default_alloc(size_t size, void *user) {
+	camera_v4l2_camera_t *camera = (camera_v4l2_camera_t *) user;
+	size = camera_v4l2_user_buffer_size(camera, size);
+
+	if (camera->hugepages) {
+		void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				 -1, 0);
+		if (ptr == MAP_FAILED) {
+			// No reserved huge pages, ask for transparent ones.
+			ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) return NULL;
+			madvise(ptr, size, MADV_HUGEPAGE);
+		}
+		return ptr;
+	}
+
+	void *ptr = NULL;
+	if (posix_memalign(&ptr, sysconf(_SC_PAGESIZE), size) != 0) {
+		return NULL;
+	}
+	return ptr;
+}
+
+static void camera_v4l2_default_free(void *ptr, size_t size, void *user) {
+	camera_v4l2_camera_t *camera = (camera_v4l2_camera_t *) user;
+
+	if (camera->hugepages) {
+		munmap(ptr, camera_v4l2_user_buffer_size(camera, size));
+	} else {
+		free(ptr);
+	}
+}
+
+static int camera_v4l2_alloc_user_buffers(camera_v4l2_camera_t *camera) {
+	struct v4l2_format fmt;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (!camera_v4l2_io_control(camera, VIDIOC_G_FMT, &fmt)) {
+		CAMERA_V4L2_LOG_ERROR("Failed to get format");
+		return 0;
+	}
+
+	if (camera->export_dmabuf) {
+		CAMERA_V4L2_LOG_WARN("dmabuf export needs MMAP buffers, skipped");
+	}
+
+	for (int i = 0; i < camera->buffer_count; i++) {
+		size_t size = fmt.fmt.pix.sizeimage;
+		void *start = camera->allocator.alloc(size, camera->allocator.user);
+		if (start == NULL) {
+			CAMERA_V4L2_LOG_ERROR("Allocate buffer failed");
+			return 0;
+		}
+		camera->slots[i].start = start;
+		camera->slots[i].length = size;
+	}
+
+	return 1;
 }
 
-static int camera_v4l2_request_buffers(camera_v4l2_camera_t *camera) {
+static int camera_v4l2_request_buffers(camera_v4l2_camera_t *camera,
+				       int count) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
 
 	struct v4l2_requestbuffers reqbufs;
+	memset(&reqbufs, 0, sizeof(reqbufs));
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	reqbufs.memory = V4L2_MEMORY_MMAP;
-	reqbufs.count = CAMERA_V4L2_BUFFER_COUNT;
-
-	if (!camera_v4l2_io_control(camera, VIDIOC_REQBUFS, &reqbufs)) {
+	reqbufs.memory = camera->memory;
+	reqbufs.count = count;
+
+	int granted;
+	if (camera->memory == V4L2_MEMORY_USERPTR) {
+		// A probe, drivers without USERPTR reject it: not logged as an
+		// error, a real failure shows up requesting MMAP buffers.
+		granted = camera_v4l2_enum_control(camera, VIDIOC_REQBUFS, &reqbufs);
+	} else {
+		granted = camera_v4l2_io_control(camera, VIDIOC_REQBUFS, &reqbufs);
+	}
+	if (!granted && camera->memory == V4L2_MEMORY_USERPTR) {
+		CAMERA_V4L2_LOG_WARN("USERPTR not supported, falling back to MMAP");
+		camera->memory = V4L2_MEMORY_MMAP;
+		reqbufs.memory = camera->memory;
+		reqbufs.count = count;
+		granted = camera_v4l2_io_control(camera, VIDIOC_REQBUFS, &reqbufs);
+	}
+	if (!granted) {
 		CAMERA_V4L2_LOG_ERROR("Request buffer failed");
 		return 0;
 	}
+	if (reqbufs.count == 0) {
+		CAMERA_V4L2_LOG_ERROR("Driver granted no buffers");
+		return 0;
+	}
+	if ((int) reqbufs.count != count) {
+		CAMERA_V4L2_LOG_WARN("Requested %d buffers, driver granted %u",
+				     count, reqbufs.count);
+	}
 
-	camera->buf = (camera_v4l2_buffer_t *) calloc(
+	camera->slots = (struct camera_v4l2_slot *) calloc(
 		reqbufs.count,
-		sizeof(*camera->buf));
+		sizeof(*camera->slots));
+	camera->buffer_count = reqbufs.count;
+	camera->outstanding = 0;
+	for (size_t i = 0; i < reqbufs.count; i++) {
+		camera->slots[i].dmabuf_fd = -1;
+	}
+
+	if (camera->memory == V4L2_MEMORY_USERPTR) {
+		return camera_v4l2_alloc_user_buffers(camera);
+	}
 
 	for (size_t i = 0; i < reqbufs.count; i++) {
 		struct v4l2_buffer tmp;
+		memset(&tmp, 0, sizeof(tmp));
 		tmp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		tmp.memory = V4L2_MEMORY_MMAP;
 		tmp.index = i;
@@ -280,54 +1402,201 @@ static int camera_v4l2_request_buffers(camera_v4l2_camera_t *camera) {
 			CAMERA_V4L2_LOG_ERROR("Failed to query buffer");
 			return 0;
 		}
-		camera->buf[i].length = tmp.length;
-		camera->buf[i].start = mmap(
-			NULL,
+		camera->slots[i].length = tmp.length;
+		camera->slots[i].start = camera->backend.mmap(
 			tmp.length,
-			PROT_READ | PROT_WRITE,
-			MAP_SHARED,
 			camera->fd,
-			tmp.m.offset);
-		if (camera->buf[i].start == MAP_FAILED) {
+			tmp.m.offset,
+			camera->backend.user);
+		if (camera->slots[i].start == MAP_FAILED) {
+			camera->slots[i].start = NULL;
 			CAMERA_V4L2_LOG_ERROR("Map buffer failed");
 			return 0;
 		}
-	}
-
-	return 1;
-}
 
-static int camera_v4l2_stream_on(camera_v4l2_camera_t *camera) {
-	for (int i = 0; i < CAMERA_V4L2_BUFFER_COUNT; ++i) {
-		struct v4l2_buffer buf;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
-		if (!camera_v4l2_io_control(camera, VIDIOC_QBUF, &buf)) {
-			CAMERA_V4L2_LOG_ERROR("Failed to queue buffer");
+		if (camera->export_dmabuf &&
+		    !camera_v4l2_export_buffer(camera, i)) {
+			CAMERA_V4L2_LOG_ERROR("Export buffer failed");
 			return 0;
 		}
 	}
 
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (!camera_v4l2_io_control(camera, VIDIOC_STREAMON, &type)) {
-		CAMERA_V4L2_LOG_ERROR("Failed to start capture");
-		return 0;
-	}
-
 	return 1;
 }
 
-static int camera_v4l2_stream_off(camera_v4l2_camera_t *camera) {
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (!camera_v4l2_io_control(camera, VIDIOC_STREAMOFF, &type)) {
-		CAMERA_V4L2_LOG_ERROR("Failed to close capture");
-		return 0;
+static int camera_v4l2_queue_buffer(camera_v4l2_camera_t *camera,
+				    int index) {
+	struct v4l2_buffer buf;
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = camera->memory;
+	buf.index = index;
+	if (camera->memory == V4L2_MEMORY_USERPTR) {
+		buf.m.userptr = (unsigned long) camera->slots[index].start;
+		buf.length = camera->slots[index].length;
 	}
-	return 1;
+
+	return camera_v4l2_io_control(camera, VIDIOC_QBUF, &buf);
 }
 
-camera_v4l2_camera_t *camera_v4l2_create() {
+// Dequeue without waiting, returns 0 (errno EAGAIN) if nothing is ready.
+static int camera_v4l2_dequeue_ready(camera_v4l2_camera_t *camera,
+				     struct v4l2_buffer *buf) {
+	memset(buf, 0, sizeof(*buf));
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = camera->memory;
+
+	return camera_v4l2_timed_ioctl(camera, VIDIOC_DQBUF, buf) >= 0;
+}
+
+static void camera_v4l2_fill_meta(camera_v4l2_camera_t *camera,
+				  const struct v4l2_buffer *buf,
+				  camera_v4l2_frame_meta_t *meta) {
+	meta->sequence = buf->sequence;
+	meta->flags = buf->flags;
+	meta->timestamp_source =
+		(buf->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) ==
+		V4L2_BUF_FLAG_TSTAMP_SRC_SOE ?
+		CAMERA_V4L2_TSTAMP_SRC_SOE : CAMERA_V4L2_TSTAMP_SRC_EOF;
+
+	uint64_t ts = (uint64_t) buf->timestamp.tv_sec * 1000000000ull +
+		(uint64_t) buf->timestamp.tv_usec * 1000ull;
+	uint32_t clock = buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+	meta->timestamp_monotonic = 0;
+	if (ts != 0 && clock == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		meta->timestamp_monotonic = 1;
+	} else if (ts != 0 && clock == V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN) {
+		// Old drivers stamp with gettimeofday, move it onto the
+		// monotonic clock so it can be compared with our own clocks.
+		// Only when it is much closer to the wall clock than to the
+		// monotonic one: with a wall clock still near boot time (no
+		// RTC yet) there is no telling them apart.
+		uint64_t realtime = camera_v4l2_clock_ns(CLOCK_REALTIME);
+		uint64_t monotonic = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+		uint64_t to_realtime = ts > realtime ? ts - realtime : realtime - ts;
+		uint64_t to_monotonic = ts > monotonic ? ts - monotonic : monotonic - ts;
+		if (to_realtime < to_monotonic / 4) {
+			ts = ts - realtime + monotonic;
+			meta->timestamp_monotonic = 1;
+		}
+	}
+	meta->timestamp_ns = ts;
+
+	meta->dropped = 0;
+	uint32_t gap = buf->sequence - camera->last_sequence;
+	// A backwards jump means the driver restarted counting, not a drop.
+	if (camera->sequence_valid && gap > 1 && gap < 0x80000000u) {
+		meta->dropped = gap - 1;
+	}
+	camera->last_sequence = buf->sequence;
+	camera->sequence_valid = 1;
+}
+
+int camera_v4l2_mjpeg_valid(const void *data, size_t length,
+			    int width, int height) {
+	const uint8_t *p = (const uint8_t *) data;
+	if (p == NULL || length < 4 || p[0] != 0xFF || p[1] != 0xD8) return 0;
+
+	size_t end = length;
+	while (end > 4 && p[end - 1] == 0) end--;
+	if (p[end - 2] != 0xFF || p[end - 1] != 0xD9) return 0;
+	end -= 2;
+
+	size_t pos = 2;
+	size_t blocks = 0;
+	int frame_width = 0;
+	int frame_height = 0;
+	for (;;) {
+		// Marker, optionally preceded by fill bytes, and its length.
+		if (pos + 4 > end || p[pos] != 0xFF) return 0;
+		while (p[pos + 1] == 0xFF) {
+			if (++pos + 4 > end) return 0;
+		}
+		uint8_t marker = p[pos + 1];
+		if (marker == 0x00 || (marker >= 0xD0 && marker <= 0xD9)) return 0;
+		size_t segment = ((size_t) p[pos + 2] << 8) | p[pos + 3];
+		if (segment < 2 || pos + 2 + segment > end) return 0;
+		const uint8_t *payload = p + pos + 4;
+		pos += 2 + segment;
+
+		if (marker == 0xDA) break;  // SOS, entropy coded data follows
+		if (marker < 0xC0 || marker > 0xCF ||
+		    marker == 0xC4 || marker == 0xC8 || marker == 0xCC) continue;
+
+		// SOFn: precision, height, width, components
+		if (segment < 8) return 0;
+		frame_height = (payload[1] << 8) | payload[2];
+		frame_width = (payload[3] << 8) | payload[4];
+		int components = payload[5];
+		if (frame_width == 0 || frame_height == 0 || components == 0 ||
+		    segment < 8 + 3 * (size_t) components) return 0;
+		int h_max = 1;
+		int v_max = 1;
+		int per_mcu = 0;
+		for (int i = 0; i < components; i++) {
+			int h = payload[7 + 3 * i] >> 4;
+			int v = payload[7 + 3 * i] & 0x0F;
+			if (h == 0 || v == 0) return 0;
+			if (h > h_max) h_max = h;
+			if (v > v_max) v_max = v;
+			per_mcu += h * v;
+		}
+		size_t mcus = (size_t) ((frame_width + 8 * h_max - 1) / (8 * h_max)) *
+			((frame_height + 8 * v_max - 1) / (8 * v_max));
+		blocks = mcus * per_mcu;
+	}
+	if (blocks == 0) return 0;  // Scan without a frame header
+
+	if (width > 0 && height > 0 &&
+	    (frame_width != width || frame_height != height)) return 0;
+
+	// Every block codes at least a DC difference and an end of block,
+	// one bit each at the very least.
+	return (end - pos) * 8 >= blocks * 2;
+}
+
+// Runs validation on a dequeued buffer, returns 1 if it is corrupt.
+static int camera_v4l2_frame_corrupt(camera_v4l2_camera_t *camera,
+				     const struct v4l2_buffer *buf) {
+	if (camera->validate == CAMERA_V4L2_VALIDATE_NONE ||
+	    camera->pixelformat != V4L2_PIX_FMT_MJPEG) return 0;
+
+	if (!(buf->flags & V4L2_BUF_FLAG_ERROR) &&
+	    camera_v4l2_mjpeg_valid(camera->slots[buf->index].start,
+				    buf->bytesused, camera->width,
+				    camera->height)) return 0;
+
+	camera_v4l2_count(&camera->stats.corrupt, 1);
+	return 1;
+}
+
+static int camera_v4l2_stream_on(camera_v4l2_camera_t *camera) {
+	for (int i = 0; i < camera->buffer_count; ++i) {
+		if (!camera_v4l2_queue_buffer(camera, i)) {
+			CAMERA_V4L2_LOG_ERROR("Failed to queue buffer");
+			return 0;
+		}
+	}
+
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (!camera_v4l2_io_control(camera, VIDIOC_STREAMON, &type)) {
+		CAMERA_V4L2_LOG_ERROR("Failed to start capture");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int camera_v4l2_stream_off(camera_v4l2_camera_t *camera) {
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (!camera_v4l2_io_control(camera, VIDIOC_STREAMOFF, &type)) {
+		CAMERA_V4L2_LOG_ERROR("Failed to close capture");
+		return 0;
+	}
+	return 1;
+}
+
+camera_v4l2_camera_t *camera_v4l2_create() {
 	camera_v4l2_camera_t *camera = NULL;
 	camera = (camera_v4l2_camera_t *) calloc(1, sizeof(*camera));
 
@@ -341,8 +1610,6 @@ void camera_v4l2_destroy(camera_v4l2_camera_t *camera) {
 
 	camera_v4l2_close(camera);
 
-	free(camera->buf);
-
 	free(camera);
 }
 
@@ -350,9 +1617,19 @@ int camera_v4l2_open(camera_v4l2_camera_t *camera,
 		     int index, camera_v4l2_param_t *param) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is NULL!!!");
 
+	int count = CAMERA_V4L2_BUFFER_COUNT;
+	if (param != NULL && param->buffer_count > 0) {
+		count = param->buffer_count;
+	}
+
 	char path[32] = { 0 };
 	sprintf(path, "/dev/video%d", index);
-	camera->fd = open(path, O_RDWR | O_NONBLOCK);
+	camera->backend = camera_v4l2_kernel_backend;
+	if (param != NULL && param->backend != NULL) {
+		camera->backend = *param->backend;
+	}
+	camera->fd = camera->backend.open(path, O_RDWR | O_NONBLOCK,
+					  camera->backend.user);
 	if (camera->fd < 0) {
 		camera->fd = -1;
 		CAMERA_V4L2_LOG_ERROR("Cannot open: %s, err: %s",
@@ -366,15 +1643,47 @@ int camera_v4l2_open(camera_v4l2_camera_t *camera,
 		CAMERA_V4L2_LOG_ERROR("Cannot query info!");
 		goto failed;
 	}
+	if (param != NULL && param->query_caps &&
+	    camera_v4l2_query_caps(camera) == NULL) {
+		CAMERA_V4L2_LOG_WARN("Cannot enumerate device modes");
+	}
 
+	camera->latest_only = 0;
+	camera->export_dmabuf = 0;
+	camera->memory = V4L2_MEMORY_MMAP;
+	camera->hugepages = 0;
+	camera->allocator.alloc = camera_v4l2_default_alloc;
+	camera->allocator.free = camera_v4l2_default_free;
+	camera->allocator.user = camera;
+	camera->sequence_valid = 0;
+	camera->pixelformat = 0;
+	camera->validate = CAMERA_V4L2_VALIDATE_NONE;
+	memset(&camera->stats, 0, sizeof(camera->stats));
 	if (param != NULL) {
+		camera->latest_only = param->latest_only;
+		camera->validate = param->validate;
+		camera->export_dmabuf = param->export_dmabuf;
+		camera->hugepages = param->hugepages;
+		if (param->memory == CAMERA_V4L2_MEMORY_USERPTR) {
+			camera->memory = V4L2_MEMORY_USERPTR;
+		}
+		if (param->allocator.alloc != NULL) {
+			CAMERA_V4L2_ASSERT(param->allocator.free != NULL,
+					   "Allocator without free!!!");
+			camera->allocator = param->allocator;
+		}
 		if (!camera_v4l2_set_param(camera, param)) {
 			CAMERA_V4L2_LOG_ERROR("Cannot set param!");
 			goto failed;
 		}
 	}
 
-	if (!camera_v4l2_request_buffers(camera)) {
+	if (param == NULL || param->frame_interval_numerator <= 0 ||
+	    param->frame_interval_denominator <= 0) {
+		camera_v4l2_get_frame_interval(camera);
+	}
+
+	if (!camera_v4l2_request_buffers(camera, count)) {
 		CAMERA_V4L2_LOG_ERROR("Cannot request buffer!");
 		goto failed;
 	}
@@ -393,6 +1702,26 @@ failed:
 	return 0;
 }
 
+static void camera_v4l2_free_slot(camera_v4l2_camera_t *camera,
+				  struct camera_v4l2_slot *slot) {
+	if (slot->length != 0 && slot->start != NULL) {
+		if (camera->memory == V4L2_MEMORY_USERPTR) {
+			camera->allocator.free(slot->start, slot->length,
+					       camera->allocator.user);
+		} else {
+			camera->backend.munmap(slot->start, slot->length,
+					       camera->backend.user);
+		}
+
+		slot->start = NULL;
+		slot->length = 0;
+	}
+	if (slot->dmabuf_fd != -1) {
+		close(slot->dmabuf_fd);
+		slot->dmabuf_fd = -1;
+	}
+}
+
 void camera_v4l2_close(camera_v4l2_camera_t *camera) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null");
 
@@ -404,64 +1733,1728 @@ void camera_v4l2_close(camera_v4l2_camera_t *camera) {
 				CAMERA_V4L2_LOG_ERROR("Stream close failed!");
 			}
 		}
-		if (camera->buf != NULL) {
-			for (int i = 0; i < CAMERA_V4L2_BUFFER_COUNT; i++) {
-				if (camera->buf[i].length != 0 &&
-				    camera->buf[i].start != NULL) {
-					munmap(camera->buf[i].start,
-					       camera->buf[i].length);
+		if (camera->outstanding != 0) {
+			CAMERA_V4L2_LOG_WARN("Closing with %d frame(s) still acquired",
+					     camera->outstanding);
+		}
 
-					camera->buf[i].start = NULL;
-					camera->buf[i].length = 0;
-				}
+		// Closing the device first makes the driver drop its
+		// references to USERPTR memory before we free it.
+		camera->backend.close(camera->fd, camera->backend.user);
+		camera->fd = -1;
+		camera->streaming = 0;
+
+		if (camera->slots != NULL) {
+			for (int i = 0; i < camera->buffer_count; i++) {
+				camera_v4l2_free_slot(camera, &camera->slots[i]);
 			}
 
-			free(camera->buf);
+			free(camera->slots);
 
-			camera->buf = NULL;
+			camera->slots = NULL;
 		}
+		camera->buffer_count = 0;
+		camera->outstanding = 0;
 
-		close(camera->fd);
-		camera->fd = -1;
-		camera->streaming = 0;
+		camera_v4l2_caps_free(&camera->caps);
+		camera->caps_valid = 0;
 
 		CAMERA_V4L2_LOG_INFO("Camera closed");
 	}
 }
 
-int camera_v4l2_read(camera_v4l2_camera_t *camera,
-		     camera_v4l2_buffer_t *frame) {
+int camera_v4l2_acquire_limit(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+
+	int reserve = CAMERA_V4L2_MIN_QUEUED;
+	if (reserve > camera->buffer_count - 1) {
+		reserve = camera->buffer_count - 1;
+	}
+	return camera->buffer_count - reserve;
+}
+
+void camera_v4l2_set_reclaim(camera_v4l2_camera_t *camera,
+			     camera_v4l2_reclaim_callback_t callback,
+			     void *user) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	camera->reclaim = callback;
+	camera->reclaim_user = callback != NULL ? user : NULL;
+}
+
+// Whether the camera can acquire another frame, once its reclaim
+// callback had a chance to make room.
+static int camera_v4l2_reclaim(camera_v4l2_camera_t *camera, int wake_fd) {
+	if (camera->reclaim != NULL &&
+	    (wake_fd >= 0 || camera->outstanding > 0)) {
+		camera->reclaim(camera->reclaim_user, wake_fd);
+	}
+	return camera->outstanding < camera_v4l2_acquire_limit(camera);
+}
+
+int camera_v4l2_acquire_timeout(camera_v4l2_camera_t *camera,
+				camera_v4l2_frame_t *frame, int timeout_ms) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	frame->index = -1;
+	frame->start = NULL;
+	frame->length = 0;
+	frame->skipped = 0;
+	memset(&frame->meta, 0, sizeof(frame->meta));
+	frame->dmabuf_fd = -1;
 
 	if (camera->fd == -1) {
 		CAMERA_V4L2_LOG_ERROR("Invalid fd, do nothing");
 		return 0;
 	}
 
-	struct v4l2_buffer buf;
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (!camera_v4l2_io_control(camera, VIDIOC_DQBUF, &buf)) {
-		CAMERA_V4L2_LOG_ERROR("Dequeue buffer failed");
+	if (!camera_v4l2_reclaim(camera, -1)) {
+		CAMERA_V4L2_LOG_WARN("Too many frames acquired (%d), release some first",
+				     camera->outstanding);
+		errno = EBUSY;
 		return 0;
 	}
 
-	frame->start = camera->buf[buf.index].start;
+	uint64_t deadline = 0;
+	if (timeout_ms > 0) {
+		deadline = camera_v4l2_clock_ns(CLOCK_MONOTONIC) +
+			(uint64_t) timeout_ms * 1000000ull;
+	}
+
+	struct v4l2_buffer buf;
+	int woke_on_error = 0;
+	int corrupt = 0;
+	// Keeps sequence tracking going over dropped corrupt frames, so the
+	// driver's own drops still add up.
+	camera_v4l2_frame_meta_t discarded;
+	unsigned int lost = 0;
+	for (;;) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = camera->memory;
+		if (camera_v4l2_io_control(camera, VIDIOC_DQBUF, &buf)) {
+			corrupt = camera_v4l2_frame_corrupt(camera, &buf);
+			if (!corrupt || camera->validate != CAMERA_V4L2_VALIDATE_DROP) {
+				break;
+			}
+			camera_v4l2_fill_meta(camera, &buf, &discarded);
+			lost += discarded.dropped;
+			if (!camera_v4l2_queue_buffer(camera, buf.index)) {
+				CAMERA_V4L2_LOG_ERROR("Queue buffer failed");
+				return 0;
+			}
+			woke_on_error = 0;
+			continue;
+		}
+		if (errno != EAGAIN) {
+			CAMERA_V4L2_LOG_ERROR("Dequeue buffer failed");
+			return 0;
+		}
+		if (woke_on_error) {
+			// POLLERR without a buffer, e.g. nothing queued.
+			CAMERA_V4L2_LOG_ERROR("Device reported an error");
+			errno = EIO;
+			return 0;
+		}
+
+		int wait_ms = timeout_ms;
+		if (timeout_ms > 0) {
+			wait_ms = camera_v4l2_remaining_ms(deadline);
+		}
+		if (timeout_ms == 0 || (timeout_ms > 0 && wait_ms == 0)) {
+			errno = EAGAIN;
+			return 0;
+		}
+		short revents = 0;
+		if (!camera_v4l2_wait_ready(camera, wait_ms, &revents)) {
+			return 0;
+		}
+		woke_on_error = !(revents & POLLIN);
+	}
+
+	camera_v4l2_fill_meta(camera, &buf, &frame->meta);
+	frame->meta.dropped += lost;
+
+	if (camera->latest_only) {
+		struct v4l2_buffer newer;
+		unsigned int dropped = frame->meta.dropped;
+		while (camera_v4l2_dequeue_ready(camera, &newer)) {
+			int newer_corrupt = camera_v4l2_frame_corrupt(camera, &newer);
+			int keep = !newer_corrupt ||
+				camera->validate != CAMERA_V4L2_VALIDATE_DROP;
+			if (!camera_v4l2_queue_buffer(camera, keep ? buf.index : newer.index)) {
+				CAMERA_V4L2_LOG_ERROR("Queue buffer failed");
+				return 0;
+			}
+			if (!keep) {
+				camera_v4l2_fill_meta(camera, &newer, &discarded);
+				dropped += discarded.dropped;
+				continue;
+			}
+			buf = newer;
+			corrupt = newer_corrupt;
+			frame->skipped++;
+			camera_v4l2_fill_meta(camera, &buf, &frame->meta);
+			dropped += frame->meta.dropped;
+		}
+		frame->meta.dropped = dropped;
+	}
+
+	frame->meta.corrupt = corrupt;
+	camera->slots[buf.index].held = 1;
+	camera->outstanding++;
+
+	uint64_t now = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	camera->slots[buf.index].acquired_ns = now;
+	camera_v4l2_count(&camera->stats.frames, 1);
+	camera_v4l2_count(&camera->stats.bytes, buf.bytesused);
+	camera_v4l2_count(&camera->stats.dropped, frame->meta.dropped);
+	if (frame->meta.timestamp_monotonic) {
+		camera_v4l2_histogram_record(
+			&camera->stats.latency,
+			now > frame->meta.timestamp_ns ? now - frame->meta.timestamp_ns : 0);
+	}
+
+	frame->index = buf.index;
+	frame->start = camera->slots[buf.index].start;
 	frame->length = buf.bytesused;
+	frame->dmabuf_fd = camera->slots[buf.index].dmabuf_fd;
+
+	return 1;
+}
+
+int camera_v4l2_acquire(camera_v4l2_camera_t *camera,
+			camera_v4l2_frame_t *frame) {
+	return camera_v4l2_acquire_timeout(camera, frame, -1);
+}
+
+static void camera_v4l2_reactor_resume(camera_v4l2_camera_t *camera);
+
+int camera_v4l2_release(camera_v4l2_camera_t *camera,
+			camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	// The buffers were unmapped by close, nothing left to give back.
+	if (camera->fd == -1 || camera->slots == NULL) {
+		frame->index = -1;
+		return 0;
+	}
+
+	if (frame->index < 0 || frame->index >= camera->buffer_count ||
+	    !camera->slots[frame->index].held) {
+		CAMERA_V4L2_LOG_ERROR("Frame %d is not acquired", frame->index);
+		return 0;
+	}
+
+	int index = frame->index;
+	frame->index = -1;
+	camera->slots[index].held = 0;
+	camera->outstanding--;
+	camera_v4l2_histogram_record(
+		&camera->stats.hold,
+		camera_v4l2_clock_ns(CLOCK_MONOTONIC) - camera->slots[index].acquired_ns);
 
-	if (!camera_v4l2_io_control(camera, VIDIOC_QBUF, &buf)) {
+	if (!camera_v4l2_queue_buffer(camera, index)) {
 		CAMERA_V4L2_LOG_ERROR("Queue buffer failed");
 		return 0;
 	}
+	if (camera->reactor_entry != NULL) {
+		camera_v4l2_reactor_resume(camera);
+	}
+
+	return 1;
+}
+
+int camera_v4l2_outstanding(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return camera->outstanding;
+}
+
+unsigned long camera_v4l2_corrupt_frames(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return (unsigned long) __atomic_load_n(&camera->stats.corrupt,
+					       __ATOMIC_RELAXED);
+}
+
+static void camera_v4l2_histogram_load(camera_v4l2_histogram_t *dst,
+				       const camera_v4l2_histogram_t *src) {
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum_ns = __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+	dst->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+	for (int i = 0; i < CAMERA_V4L2_HISTOGRAM_BUCKETS; i++) {
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+void camera_v4l2_camera_stats(camera_v4l2_camera_t *camera,
+			      camera_v4l2_stats_t *stats) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(stats != NULL, "Stats is null!!!");
+
+	const camera_v4l2_stats_t *live = &camera->stats;
+	stats->frames = __atomic_load_n(&live->frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&live->bytes, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&live->dropped, __ATOMIC_RELAXED);
+	stats->corrupt = __atomic_load_n(&live->corrupt, __ATOMIC_RELAXED);
+	stats->retries = __atomic_load_n(&live->retries, __ATOMIC_RELAXED);
+	stats->ioctl_errors = __atomic_load_n(&live->ioctl_errors, __ATOMIC_RELAXED);
+	camera_v4l2_histogram_load(&stats->latency, &live->latency);
+	camera_v4l2_histogram_load(&stats->hold, &live->hold);
+	camera_v4l2_histogram_load(&stats->ioctl, &live->ioctl);
+}
+
+uint64_t camera_v4l2_histogram_percentile(
+	const camera_v4l2_histogram_t *histogram, double fraction) {
+	CAMERA_V4L2_ASSERT(histogram != NULL, "Object is null!!!");
+
+	if (histogram->count == 0) return 0;
+	uint64_t rank = (uint64_t) (fraction * histogram->count);
+	if (rank >= histogram->count) rank = histogram->count - 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < CAMERA_V4L2_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += histogram->buckets[i];
+		if (seen <= rank) continue;
+		// Start of the next bucket, this one's upper bound.
+		int next = i + 1;
+		uint64_t bound = next < 8 ? (uint64_t) next :
+			(uint64_t) (8 + next % 8) << (next / 8 - 1);
+		return bound - 1 < histogram->max_ns ? bound - 1 : histogram->max_ns;
+	}
+	return histogram->max_ns;
+}
+
+int camera_v4l2_buffer_count(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return camera->buffer_count;
+}
+
+static int camera_v4l2_read_frame(camera_v4l2_camera_t *camera,
+				  camera_v4l2_buffer_t *frame,
+				  camera_v4l2_frame_meta_t *meta,
+				  int timeout_ms) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+
+	camera_v4l2_frame_t acquired;
+	if (!camera_v4l2_acquire_timeout(camera, &acquired, timeout_ms)) {
+		return 0;
+	}
+
+	frame->start = acquired.start;
+	frame->length = acquired.length;
+	if (meta != NULL) {
+		*meta = acquired.meta;
+	}
+
+	return camera_v4l2_release(camera, &acquired);
+}
+
+int camera_v4l2_dmabuf_fd(camera_v4l2_camera_t *camera, int index) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	if (camera->slots == NULL || index < 0 || index >= camera->buffer_count) {
+		return -1;
+	}
+	return camera->slots[index].dmabuf_fd;
+}
+
+int camera_v4l2_frame_interval(camera_v4l2_camera_t *camera,
+			       uint32_t *numerator, uint32_t *denominator) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+
+	if (camera->fd == -1 || camera->interval_denominator == 0) {
+		return 0;
+	}
+	*numerator = camera->interval_numerator;
+	*denominator = camera->interval_denominator;
 
 	return 1;
 }
 
+camera_v4l2_memory_t camera_v4l2_memory(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return camera->memory == V4L2_MEMORY_USERPTR ?
+		CAMERA_V4L2_MEMORY_USERPTR : CAMERA_V4L2_MEMORY_MMAP;
+}
+
+int camera_v4l2_read_meta(camera_v4l2_camera_t *camera,
+			  camera_v4l2_buffer_t *frame,
+			  camera_v4l2_frame_meta_t *meta) {
+	return camera_v4l2_read_frame(camera, frame, meta, -1);
+}
+
+int camera_v4l2_read(camera_v4l2_camera_t *camera,
+		     camera_v4l2_buffer_t *frame) {
+	return camera_v4l2_read_frame(camera, frame, NULL, -1);
+}
+
+int camera_v4l2_read_timeout(camera_v4l2_camera_t *camera,
+			     camera_v4l2_buffer_t *frame, int timeout_ms) {
+	return camera_v4l2_read_frame(camera, frame, NULL, timeout_ms);
+}
+
+int camera_v4l2_try_read(camera_v4l2_camera_t *camera,
+			 camera_v4l2_buffer_t *frame) {
+	return camera_v4l2_read_frame(camera, frame, NULL, 0);
+}
+
 int camera_v4l2_isopened(camera_v4l2_camera_t *camera) {
 	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
 	return camera->fd != -1 && camera->streaming;
 }
 
+const camera_v4l2_caps_t *camera_v4l2_query_caps(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+
+	if (camera->fd == -1) {
+		CAMERA_V4L2_LOG_ERROR("Invalid fd, do nothing");
+		return NULL;
+	}
+	if (!camera->caps_valid) {
+		if (!camera_v4l2_caps_lookup(camera, &camera->caps)) {
+			return NULL;
+		}
+		camera->caps_valid = 1;
+	}
+
+	return &camera->caps;
+}
+
+void camera_v4l2_set_caps_cache_dir(const char *dir) {
+	pthread_mutex_lock(&camera_v4l2_caps_lock);
+	free(camera_v4l2_caps_dir);
+	camera_v4l2_caps_dir = dir != NULL ? strdup(dir) : NULL;
+	pthread_mutex_unlock(&camera_v4l2_caps_lock);
+}
+
+void camera_v4l2_clear_caps_cache() {
+	pthread_mutex_lock(&camera_v4l2_caps_lock);
+	while (camera_v4l2_caps_cache != NULL) {
+		struct camera_v4l2_caps_entry *entry = camera_v4l2_caps_cache;
+		camera_v4l2_caps_cache = entry->next;
+		camera_v4l2_caps_free(&entry->caps);
+		free(entry);
+	}
+	pthread_mutex_unlock(&camera_v4l2_caps_lock);
+}
+
+int camera_v4l2_fd(camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Object is null!!!");
+	return camera->fd;
+}
+
+struct camera_v4l2_reactor_entry {
+	camera_v4l2_reactor_t *reactor;
+	camera_v4l2_camera_t *camera;  // NULL once removed
+	int fd;
+	camera_v4l2_frame_callback_t callback;
+	void *user;
+	// Not polled while the camera is at its acquire limit, until a
+	// release makes room.
+	int paused;
+};
+
+struct camera_v4l2_reactor {
+	int epoll_fd;
+	// Handed to the reclaim callbacks of paused cameras, polled with the
+	// reactor itself as data.
+	int wake_fd;
+	struct camera_v4l2_reactor_entry **entries;
+	int entry_count;
+	int entry_capacity;
+	int dispatching;
+};
+
+// Free entries removed while dispatching, they may still be referenced
+// by pending epoll events until the batch is done.
+static void camera_v4l2_reactor_sweep(camera_v4l2_reactor_t *reactor) {
+	int kept = 0;
+	for (int i = 0; i < reactor->entry_count; i++) {
+		if (reactor->entries[i]->camera == NULL) {
+			free(reactor->entries[i]);
+		} else {
+			reactor->entries[kept++] = reactor->entries[i];
+		}
+	}
+	reactor->entry_count = kept;
+}
+
+static void camera_v4l2_reactor_drop(camera_v4l2_reactor_t *reactor,
+				     struct camera_v4l2_reactor_entry *entry) {
+	// The fd is already gone from the epoll set if the camera closed it.
+	if (entry->camera->fd == entry->fd) {
+		epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+	}
+	if (entry->camera->reactor_entry == entry) {
+		entry->camera->reactor_entry = NULL;
+	}
+	entry->camera = NULL;
+	if (!reactor->dispatching) {
+		camera_v4l2_reactor_sweep(reactor);
+	}
+}
+
+camera_v4l2_reactor_t *camera_v4l2_reactor_create() {
+	camera_v4l2_reactor_t *reactor = NULL;
+	reactor = (camera_v4l2_reactor_t *) calloc(1, sizeof(*reactor));
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("epoll_create1 failed: %s", strerror(errno));
+		free(reactor);
+		return NULL;
+	}
+
+	reactor->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = reactor;
+	if (reactor->wake_fd < 0 ||
+	    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd,
+		      &event) < 0) {
+		CAMERA_V4L2_LOG_ERROR("Reactor wake fd failed: %s", strerror(errno));
+		if (reactor->wake_fd >= 0) close(reactor->wake_fd);
+		close(reactor->epoll_fd);
+		free(reactor);
+		return NULL;
+	}
+
+	return reactor;
+}
+
+void camera_v4l2_reactor_destroy(camera_v4l2_reactor_t *reactor) {
+	CAMERA_V4L2_ASSERT(reactor != NULL, "Object is NULL!!!");
+
+	for (int i = 0; i < reactor->entry_count; i++) {
+		struct camera_v4l2_reactor_entry *entry = reactor->entries[i];
+		if (entry->camera != NULL && entry->camera->reactor_entry == entry) {
+			entry->camera->reactor_entry = NULL;
+		}
+		free(entry);
+	}
+	free(reactor->entries);
+	close(reactor->wake_fd);
+	close(reactor->epoll_fd);
+
+	free(reactor);
+}
+
+int camera_v4l2_reactor_add(camera_v4l2_reactor_t *reactor,
+			    camera_v4l2_camera_t *camera,
+			    camera_v4l2_frame_callback_t callback,
+			    void *user) {
+	CAMERA_V4L2_ASSERT(reactor != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(camera != NULL, "Camera is null!!!");
+	CAMERA_V4L2_ASSERT(callback != NULL, "Callback is null!!!");
+
+	if (camera->fd == -1) {
+		CAMERA_V4L2_LOG_ERROR("Camera is not opened");
+		return 0;
+	}
+
+	for (int i = 0; i < reactor->entry_count; i++) {
+		// Added again, possibly after a reopen, replace the old entry.
+		if (reactor->entries[i]->camera == camera) {
+			camera_v4l2_reactor_drop(reactor, reactor->entries[i]);
+			break;
+		}
+	}
+
+	if (reactor->entry_count == reactor->entry_capacity) {
+		int capacity = reactor->entry_capacity ?
+			reactor->entry_capacity * 2 : 8;
+		struct camera_v4l2_reactor_entry **entries =
+			(struct camera_v4l2_reactor_entry **) realloc(
+				reactor->entries,
+				capacity * sizeof(*reactor->entries));
+		if (entries == NULL) {
+			CAMERA_V4L2_LOG_ERROR("Out of memory");
+			return 0;
+		}
+		reactor->entries = entries;
+		reactor->entry_capacity = capacity;
+	}
+
+	struct camera_v4l2_reactor_entry *entry =
+		(struct camera_v4l2_reactor_entry *) calloc(1, sizeof(*entry));
+	entry->reactor = reactor;
+	entry->camera = camera;
+	entry->fd = camera->fd;
+	entry->callback = callback;
+	entry->user = user;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = entry;
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, entry->fd, &event) < 0) {
+		CAMERA_V4L2_LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+		free(entry);
+		return 0;
+	}
+
+	reactor->entries[reactor->entry_count++] = entry;
+	camera->reactor_entry = entry;
+
+	return 1;
+}
+
+int camera_v4l2_reactor_remove(camera_v4l2_reactor_t *reactor,
+			       camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(reactor != NULL, "Object is null!!!");
+
+	for (int i = 0; i < reactor->entry_count; i++) {
+		if (reactor->entries[i]->camera == camera) {
+			camera_v4l2_reactor_drop(reactor, reactor->entries[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int camera_v4l2_reactor_poll(struct camera_v4l2_reactor_entry *entry,
+				    uint32_t events) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = entry;
+	if (epoll_ctl(entry->reactor->epoll_fd, EPOLL_CTL_MOD, entry->fd,
+		      &event) < 0) {
+		CAMERA_V4L2_LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+		return 0;
+	}
+	entry->paused = events == 0;
+	return 1;
+}
+
+static void camera_v4l2_reactor_resume(camera_v4l2_camera_t *camera) {
+	struct camera_v4l2_reactor_entry *entry = camera->reactor_entry;
+	if (entry->paused && camera->fd == entry->fd &&
+	    camera->outstanding < camera_v4l2_acquire_limit(camera)) {
+		camera_v4l2_reactor_poll(entry, EPOLLIN);
+	}
+}
+
+static int camera_v4l2_reactor_dispatch(
+	camera_v4l2_reactor_t *reactor,
+	struct camera_v4l2_reactor_entry *entry,
+	uint32_t events) {
+	camera_v4l2_camera_t *camera = entry->camera;
+	int dispatched = 0;
+
+	// Bounded so one busy camera cannot starve the others.
+	for (int i = 0; i < camera->buffer_count; i++) {
+		if (camera->fd == entry->fd && !camera_v4l2_reclaim(camera, -1)) {
+			// Every frame it may hand out is held. Level triggered
+			// EPOLLIN would wake us again and again for nothing, so
+			// stop polling until a release re-arms it, and have the
+			// reclaim callback wake us once frames come back. Errors
+			// are reported regardless, and with buffers still queued
+			// they mean the device is gone.
+			if (dispatched == 0 && (events & (EPOLLERR | EPOLLHUP))) {
+				CAMERA_V4L2_LOG_WARN("Camera failed, removed from reactor");
+				camera_v4l2_reactor_drop(reactor, entry);
+			} else if (!entry->paused) {
+				camera_v4l2_reactor_poll(entry, 0);
+				camera_v4l2_reclaim(camera, reactor->wake_fd);
+			}
+			break;
+		}
+
+		camera_v4l2_frame_t frame;
+		if (!camera_v4l2_acquire_timeout(camera, &frame, 0)) {
+			// A closed camera, or an error that would keep
+			// waking us without ever producing a frame.
+			if (camera->fd != entry->fd ||
+			    (dispatched == 0 && (events & (EPOLLERR | EPOLLHUP)))) {
+				CAMERA_V4L2_LOG_WARN("Camera failed, removed from reactor");
+				camera_v4l2_reactor_drop(reactor, entry);
+			}
+			break;
+		}
+
+		dispatched++;
+		if (!entry->callback(camera, &frame, entry->user)) {
+			camera_v4l2_release(camera, &frame);
+		}
+		// The callback may have removed the camera or closed it.
+		if (entry->camera == NULL || camera->fd != entry->fd) {
+			if (entry->camera != NULL) {
+				camera_v4l2_reactor_drop(reactor, entry);
+			}
+			break;
+		}
+	}
+
+	return dispatched;
+}
+
+// Runs the reclaim callbacks of the paused cameras, a release resumes
+// those it makes room on.
+static void camera_v4l2_reactor_reclaim(camera_v4l2_reactor_t *reactor) {
+	uint64_t signals;
+	if (read(reactor->wake_fd, &signals, sizeof(signals)) < 0) {
+		// Not signalled, the callbacks are cheap when idle.
+	}
+	for (int i = 0; i < reactor->entry_count; i++) {
+		struct camera_v4l2_reactor_entry *entry = reactor->entries[i];
+		if (entry->camera != NULL && entry->paused) {
+			camera_v4l2_reclaim(entry->camera, reactor->wake_fd);
+		}
+	}
+}
+
+int camera_v4l2_reactor_run_once(camera_v4l2_reactor_t *reactor,
+				 int timeout_ms) {
+	CAMERA_V4L2_ASSERT(reactor != NULL, "Object is null!!!");
+
+	struct epoll_event events[CAMERA_V4L2_REACTOR_MAX_EVENTS];
+	int count = epoll_wait(reactor->epoll_fd, events,
+			       CAMERA_V4L2_REACTOR_MAX_EVENTS, timeout_ms);
+	if (count < 0) {
+		if (errno == EINTR) return 0;
+		CAMERA_V4L2_LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+		return -1;
+	}
+
+	int dispatched = 0;
+	reactor->dispatching = 1;
+	for (int i = 0; i < count; i++) {
+		if (events[i].data.ptr == reactor) {
+			camera_v4l2_reactor_reclaim(reactor);
+			continue;
+		}
+		struct camera_v4l2_reactor_entry *entry =
+			(struct camera_v4l2_reactor_entry *) events[i].data.ptr;
+		// Not a camera, only there to wake us up.
+		if (entry == NULL) continue;
+		if (entry->camera == NULL) continue;
+		dispatched += camera_v4l2_reactor_dispatch(reactor, entry,
+							   events[i].events);
+	}
+	reactor->dispatching = 0;
+	camera_v4l2_reactor_sweep(reactor);
+
+	return dispatched;
+}
+
+// Vyukov's bounded queue: every cell carries a sequence number telling
+// which lap of head or tail may use it next. Head and tail live on
+// their own cache lines.
+struct camera_v4l2_ring {
+	size_t head;
+	char head_pad[CAMERA_V4L2_CACHE_LINE - sizeof(size_t)];
+	size_t tail;
+	char tail_pad[CAMERA_V4L2_CACHE_LINE - sizeof(size_t)];
+	size_t mask;
+	size_t element_size;
+	size_t cell_size;
+	camera_v4l2_ring_mode_t mode;
+	uint8_t *cells;
+};
+
+static size_t *camera_v4l2_ring_sequence(camera_v4l2_ring_t *ring,
+					 size_t position) {
+	return (size_t *) (ring->cells + (position & ring->mask) * ring->cell_size);
+}
+
+camera_v4l2_ring_t *camera_v4l2_ring_create(size_t capacity,
+					    size_t element_size,
+					    camera_v4l2_ring_mode_t mode) {
+	if (capacity == 0 || element_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t cells = 2;
+	while (cells < capacity) cells <<= 1;
+
+	void *memory = NULL;
+	if (posix_memalign(&memory, CAMERA_V4L2_CACHE_LINE,
+			   sizeof(camera_v4l2_ring_t)) != 0) {
+		return NULL;
+	}
+	camera_v4l2_ring_t *ring = (camera_v4l2_ring_t *) memory;
+	memset(ring, 0, sizeof(*ring));
+	ring->mask = cells - 1;
+	ring->element_size = element_size;
+	// Sequence number first, elements kept size_t aligned.
+	ring->cell_size = sizeof(size_t) +
+		(element_size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+	ring->mode = mode;
+	ring->cells = (uint8_t *) calloc(cells, ring->cell_size);
+	if (ring->cells == NULL) {
+		free(ring);
+		return NULL;
+	}
+	for (size_t i = 0; i < cells; i++) {
+		*camera_v4l2_ring_sequence(ring, i) = i;
+	}
+
+	return ring;
+}
+
+void camera_v4l2_ring_destroy(camera_v4l2_ring_t *ring) {
+	if (ring == NULL) return;
+	free(ring->cells);
+	free(ring);
+}
+
+int camera_v4l2_ring_pop(camera_v4l2_ring_t *ring, void *element) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+
+	// The pushing side evicts through here too, so even a single
+	// consumer has to claim its cell with a CAS.
+	size_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t *sequence = camera_v4l2_ring_sequence(ring, position);
+		size_t seen = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) (seen - (position + 1));
+		if (diff < 0) {
+			errno = EAGAIN;
+			return 0;
+		}
+		if (diff > 0) {
+			position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1,
+						1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			memcpy(element, sequence + 1, ring->element_size);
+			__atomic_store_n(sequence, position + ring->mask + 1,
+					 __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+}
+
+int camera_v4l2_ring_push(camera_v4l2_ring_t *ring, const void *element,
+			  void *evicted, int *evicted_count) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+
+	int evictions = 0;
+	int claimed = 0;
+	size_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	size_t *sequence;
+	while (!claimed) {
+		sequence = camera_v4l2_ring_sequence(ring, position);
+		size_t seen = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) (seen - position);
+		if (diff > 0) {
+			position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (diff == 0) {
+			if (ring->mode == CAMERA_V4L2_RING_SPSC) {
+				__atomic_store_n(&ring->head, position + 1, __ATOMIC_RELAXED);
+				claimed = 1;
+			} else {
+				claimed = __atomic_compare_exchange_n(
+					&ring->head, &position, position + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+
+		// Full, the head cell still holds the element pushed one lap
+		// ago. Claiming it as the tail evicts it and keeps every other
+		// producer off the cell, which is then reused in place.
+		size_t oldest = position - ring->mask - 1;
+		if (evicted == NULL) break;
+		if (seen != oldest + 1) {
+			// The producer of that element has not published it yet.
+			if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == position) break;
+			position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		size_t tail = oldest;
+		if (__atomic_compare_exchange_n(&ring->tail, &tail, oldest + 1, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			memcpy(evicted, sequence + 1, ring->element_size);
+			__atomic_store_n(&ring->head, position + 1, __ATOMIC_RELAXED);
+			evictions = 1;
+			claimed = 1;
+			continue;
+		}
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		if (head == position && (intptr_t) (tail - oldest) > 0) {
+			// A consumer is popping exactly that element right now.
+			break;
+		}
+		position = head;
+	}
+	if (evicted_count != NULL) *evicted_count = evictions;
+	if (!claimed) {
+		errno = EAGAIN;
+		return 0;
+	}
+
+	memcpy(sequence + 1, element, ring->element_size);
+	__atomic_store_n(sequence, position + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+size_t camera_v4l2_ring_count(camera_v4l2_ring_t *ring) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	return head - tail > ring->mask + 1 ? 0 : head - tail;
+}
+
+struct camera_v4l2_ring_frame {
+	camera_v4l2_camera_t *camera;
+	camera_v4l2_frame_t frame;
+};
+
+struct camera_v4l2_frame_ring {
+	camera_v4l2_ring_t *frames;
+	// Given back by consumers, released by the capturing thread. Holds
+	// more than any camera can have acquired at once.
+	camera_v4l2_ring_t *returned;
+	// Frames held before the oldest is overwritten, below the capacity
+	// when an attached camera has fewer buffers.
+	size_t limit;
+	// Written on the next give back while the capturing thread waits.
+	int wake_fd;
+	camera_v4l2_camera_t **cameras;  // Attached
+	int camera_count;
+};
+
+camera_v4l2_frame_ring_t *camera_v4l2_frame_ring_create(
+	size_t capacity, camera_v4l2_ring_mode_t mode) {
+	camera_v4l2_frame_ring_t *ring =
+		(camera_v4l2_frame_ring_t *) calloc(1, sizeof(camera_v4l2_frame_ring_t));
+	if (ring == NULL) return NULL;
+
+	ring->wake_fd = -1;
+	ring->frames = camera_v4l2_ring_create(
+		capacity, sizeof(struct camera_v4l2_ring_frame), mode);
+	ring->limit = ring->frames != NULL ? ring->frames->mask + 1 : 0;
+	// Consumers give back frames concurrently with the pushing thread's
+	// own eviction path, so this side is always multi producer.
+	ring->returned = camera_v4l2_ring_create(
+		capacity + 2 * VIDEO_MAX_FRAME,
+		sizeof(struct camera_v4l2_ring_frame), CAMERA_V4L2_RING_MPMC);
+	if (ring->frames == NULL || ring->returned == NULL) {
+		camera_v4l2_ring_destroy(ring->frames);
+		camera_v4l2_ring_destroy(ring->returned);
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+int camera_v4l2_frame_ring_reclaim(camera_v4l2_frame_ring_t *ring) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+
+	int count = 0;
+	struct camera_v4l2_ring_frame entry;
+	while (camera_v4l2_ring_pop(ring->returned, &entry)) {
+		camera_v4l2_release(entry.camera, &entry.frame);
+		count++;
+	}
+	return count;
+}
+
+void camera_v4l2_frame_ring_destroy(camera_v4l2_frame_ring_t *ring) {
+	if (ring == NULL) return;
+
+	struct camera_v4l2_ring_frame entry;
+	while (camera_v4l2_ring_pop(ring->frames, &entry)) {
+		camera_v4l2_release(entry.camera, &entry.frame);
+	}
+	camera_v4l2_frame_ring_reclaim(ring);
+	for (int i = 0; i < ring->camera_count; i++) {
+		if (ring->cameras[i]->reclaim_user == ring) {
+			camera_v4l2_set_reclaim(ring->cameras[i], NULL, NULL);
+		}
+	}
+	free(ring->cameras);
+	camera_v4l2_ring_destroy(ring->frames);
+	camera_v4l2_ring_destroy(ring->returned);
+	free(ring);
+}
+
+static int camera_v4l2_frame_ring_reclaim_callback(void *user, int wake_fd) {
+	camera_v4l2_frame_ring_t *ring = (camera_v4l2_frame_ring_t *) user;
+	if (wake_fd >= 0) {
+		// Pairs with the exchange in give back, both full barriers:
+		// either the reclaim below sees its frame, or it sees the fd.
+		__atomic_exchange_n(&ring->wake_fd, wake_fd, __ATOMIC_SEQ_CST);
+	}
+	return camera_v4l2_frame_ring_reclaim(ring);
+}
+
+int camera_v4l2_frame_ring_attach(camera_v4l2_frame_ring_t *ring,
+				  camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(camera != NULL, "Camera is null!!!");
+
+	if (camera->fd == -1) {
+		CAMERA_V4L2_LOG_ERROR("Camera is not opened");
+		errno = EINVAL;
+		return 0;
+	}
+	int limit = camera_v4l2_acquire_limit(camera) - 1;
+	if (limit < 1) limit = 1;
+	if ((size_t) limit < ring->limit) {
+		CAMERA_V4L2_LOG_INFO("Ring holds %d frame(s) for %d buffers",
+				     limit, camera->buffer_count);
+		ring->limit = (size_t) limit;
+	}
+
+	int attached = 0;
+	for (int i = 0; i < ring->camera_count; i++) {
+		if (ring->cameras[i] == camera) attached = 1;
+	}
+	if (!attached) {
+		camera_v4l2_camera_t **cameras = (camera_v4l2_camera_t **) realloc(
+			ring->cameras, (ring->camera_count + 1) * sizeof(*cameras));
+		if (cameras == NULL) {
+			CAMERA_V4L2_LOG_ERROR("Out of memory");
+			return 0;
+		}
+		ring->cameras = cameras;
+		ring->cameras[ring->camera_count++] = camera;
+	}
+	camera_v4l2_set_reclaim(camera, camera_v4l2_frame_ring_reclaim_callback,
+				ring);
+
+	return 1;
+}
+
+int camera_v4l2_frame_ring_push(camera_v4l2_frame_ring_t *ring,
+				camera_v4l2_camera_t *camera,
+				camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	camera_v4l2_frame_ring_reclaim(ring);
+
+	struct camera_v4l2_ring_frame entry;
+	struct camera_v4l2_ring_frame evicted;
+	int evicted_count = 0;
+	// Below the capacity the ring does not evict by itself.
+	while (camera_v4l2_ring_count(ring->frames) >= ring->limit &&
+	       camera_v4l2_ring_pop(ring->frames, &evicted)) {
+		camera_v4l2_release(evicted.camera, &evicted.frame);
+	}
+	entry.camera = camera;
+	entry.frame = *frame;
+	frame->index = -1;
+	int pushed = camera_v4l2_ring_push(ring->frames, &entry,
+					   &evicted, &evicted_count);
+	if (evicted_count > 0) {
+		camera_v4l2_release(evicted.camera, &evicted.frame);
+	}
+	if (!pushed) {
+		camera_v4l2_release(camera, &entry.frame);
+		errno = EAGAIN;
+		return 0;
+	}
+	return 1;
+}
+
+int camera_v4l2_frame_ring_take(camera_v4l2_frame_ring_t *ring,
+				camera_v4l2_camera_t **camera,
+				camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	struct camera_v4l2_ring_frame entry;
+	if (!camera_v4l2_ring_pop(ring->frames, &entry)) return 0;
+	if (camera != NULL) *camera = entry.camera;
+	*frame = entry.frame;
+	return 1;
+}
+
+int camera_v4l2_frame_ring_take_latest(camera_v4l2_frame_ring_t *ring,
+				       camera_v4l2_camera_t **camera,
+				       camera_v4l2_frame_t *frame,
+				       unsigned int *skipped) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	struct camera_v4l2_ring_frame latest;
+	struct camera_v4l2_ring_frame newer;
+	unsigned int count = 0;
+	if (skipped != NULL) *skipped = 0;
+	if (!camera_v4l2_ring_pop(ring->frames, &latest)) return 0;
+	while (camera_v4l2_ring_pop(ring->frames, &newer)) {
+		camera_v4l2_frame_ring_give_back(ring, latest.camera, &latest.frame);
+		latest = newer;
+		count++;
+	}
+
+	if (camera != NULL) *camera = latest.camera;
+	*frame = latest.frame;
+	if (skipped != NULL) *skipped = count;
+	return 1;
+}
+
+int camera_v4l2_frame_ring_give_back(camera_v4l2_frame_ring_t *ring,
+				     camera_v4l2_camera_t *camera,
+				     camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(ring != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	struct camera_v4l2_ring_frame entry;
+	entry.camera = camera;
+	entry.frame = *frame;
+	// Never overwrite here, that would lose a buffer.
+	if (!camera_v4l2_ring_push(ring->returned, &entry, NULL, NULL)) {
+		CAMERA_V4L2_LOG_ERROR("Too many frames given back");
+		errno = ENOSPC;
+		return 0;
+	}
+	frame->index = -1;
+	int wake_fd = __atomic_exchange_n(&ring->wake_fd, -1, __ATOMIC_SEQ_CST);
+	if (wake_fd >= 0) {
+		uint64_t signal = 1;
+		if (write(wake_fd, &signal, sizeof(signal)) < 0) {
+			// The counter is already pending, the waiter wakes anyway.
+		}
+	}
+	return 1;
+}
+
+struct camera_v4l2_shared_frame {
+	camera_v4l2_frame_t frame;
+	int refs;
+	camera_v4l2_fanout_t *fanout;
+};
+
+struct camera_v4l2_fanout {
+	camera_v4l2_camera_t *camera;
+	camera_v4l2_fanout_policy_t policy;
+	struct camera_v4l2_shared_frame *frames;  // By buffer index
+	int frame_count;
+	// Buffer indices whose last reference was dropped.
+	camera_v4l2_ring_t *dropped;
+	// Signalled on a drop while the capturing thread waits for one.
+	int event_fd;
+	// What unref signals, the event fd or a reactor's, -1 if no one
+	// waits.
+	int wake_fd;
+};
+
+static int camera_v4l2_fanout_reclaim_callback(void *user, int wake_fd) {
+	camera_v4l2_fanout_t *fanout = (camera_v4l2_fanout_t *) user;
+	if (wake_fd >= 0) {
+		// As in camera_v4l2_fanout_wait.
+		__atomic_exchange_n(&fanout->wake_fd, wake_fd, __ATOMIC_SEQ_CST);
+	}
+	return camera_v4l2_fanout_reclaim(fanout);
+}
+
+camera_v4l2_fanout_t *camera_v4l2_fanout_create(
+	camera_v4l2_camera_t *camera, camera_v4l2_fanout_policy_t policy) {
+	CAMERA_V4L2_ASSERT(camera != NULL, "Camera is null!!!");
+
+	if (camera->fd == -1) {
+		CAMERA_V4L2_LOG_ERROR("Camera is not opened");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	camera_v4l2_fanout_t *fanout =
+		(camera_v4l2_fanout_t *) calloc(1, sizeof(camera_v4l2_fanout_t));
+	if (fanout == NULL) return NULL;
+
+	fanout->camera = camera;
+	fanout->policy = policy;
+	fanout->event_fd = -1;
+	fanout->wake_fd = -1;
+	fanout->frame_count = camera->buffer_count;
+	fanout->frames = (struct camera_v4l2_shared_frame *) calloc(
+		fanout->frame_count, sizeof(struct camera_v4l2_shared_frame));
+	// Each index is in there at most once, so it never fills up.
+	fanout->dropped = camera_v4l2_ring_create(
+		fanout->frame_count, sizeof(int), CAMERA_V4L2_RING_MPMC);
+	fanout->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fanout->frames == NULL || fanout->dropped == NULL ||
+	    fanout->event_fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("Fanout setup failed: %s", strerror(errno));
+		camera_v4l2_fanout_destroy(fanout);
+		return NULL;
+	}
+	for (int i = 0; i < fanout->frame_count; i++) {
+		fanout->frames[i].frame.index = -1;
+		fanout->frames[i].fanout = fanout;
+	}
+	camera_v4l2_set_reclaim(camera, camera_v4l2_fanout_reclaim_callback, fanout);
+
+	return fanout;
+}
+
+void camera_v4l2_fanout_destroy(camera_v4l2_fanout_t *fanout) {
+	if (fanout == NULL) return;
+
+	if (fanout->camera->reclaim_user == fanout) {
+		camera_v4l2_set_reclaim(fanout->camera, NULL, NULL);
+	}
+	if (fanout->dropped != NULL) {
+		camera_v4l2_fanout_reclaim(fanout);
+		camera_v4l2_ring_destroy(fanout->dropped);
+	}
+	if (fanout->frames != NULL) {
+		for (int i = 0; i < fanout->frame_count; i++) {
+			struct camera_v4l2_shared_frame *shared = &fanout->frames[i];
+			if (shared->frame.index == -1) continue;
+			CAMERA_V4L2_LOG_WARN("Frame %d still has %d reference(s)",
+					     i, shared->refs);
+			camera_v4l2_release(fanout->camera, &shared->frame);
+		}
+		free(fanout->frames);
+	}
+	if (fanout->event_fd >= 0) close(fanout->event_fd);
+
+	free(fanout);
+}
+
+int camera_v4l2_fanout_reclaim(camera_v4l2_fanout_t *fanout) {
+	CAMERA_V4L2_ASSERT(fanout != NULL, "Object is null!!!");
+
+	int count = 0;
+	int index;
+	while (camera_v4l2_ring_pop(fanout->dropped, &index)) {
+		camera_v4l2_release(fanout->camera, &fanout->frames[index].frame);
+		count++;
+	}
+	return count;
+}
+
+// Every buffer is referenced, wait until one is dropped. In SKIP mode
+// the frames arriving meanwhile are queued straight back.
+static int camera_v4l2_fanout_wait(camera_v4l2_fanout_t *fanout,
+				   int timeout_ms) {
+	camera_v4l2_camera_t *camera = fanout->camera;
+
+	// Pairs with the exchange in unref, both full barriers: either we
+	// see its drop here, or it sees us waiting and signals.
+	__atomic_exchange_n(&fanout->wake_fd, fanout->event_fd, __ATOMIC_SEQ_CST);
+	if (camera_v4l2_ring_count(fanout->dropped) > 0) {
+		__atomic_store_n(&fanout->wake_fd, -1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	struct pollfd pfd[2];
+	nfds_t count = 1;
+	pfd[0].fd = fanout->event_fd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	if (fanout->policy == CAMERA_V4L2_FANOUT_SKIP) {
+		pfd[1].fd = camera->fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		count = 2;
+	}
+
+	uint64_t deadline = 0;
+	if (timeout_ms > 0) {
+		deadline = camera_v4l2_clock_ns(CLOCK_MONOTONIC) +
+			(uint64_t) timeout_ms * 1000000ull;
+	}
+	int ret;
+	while ((ret = poll(pfd, count, timeout_ms)) < 0 && errno == EINTR) {
+		if (timeout_ms > 0) {
+			timeout_ms = camera_v4l2_remaining_ms(deadline);
+		}
+	}
+	__atomic_store_n(&fanout->wake_fd, -1, __ATOMIC_RELAXED);
+	if (ret < 0) {
+		CAMERA_V4L2_LOG_ERROR("poll failed: %s", strerror(errno));
+		return 0;
+	}
+	if (ret == 0) {
+		errno = EAGAIN;
+		return 0;
+	}
+
+	if (pfd[0].revents & POLLIN) {
+		uint64_t signals;
+		if (read(fanout->event_fd, &signals, sizeof(signals)) < 0) {
+			// Already drained, nothing else can fail here.
+		}
+	}
+	if (count == 2 && pfd[1].revents != 0) {
+		struct v4l2_buffer buf;
+		int skipped = 0;
+		// Bounded, requeued buffers may be ready again right away.
+		while (skipped < camera->buffer_count &&
+		       camera_v4l2_dequeue_ready(camera, &buf)) {
+			if (!camera_v4l2_queue_buffer(camera, buf.index)) {
+				CAMERA_V4L2_LOG_ERROR("Queue buffer failed");
+				return 0;
+			}
+			skipped++;
+		}
+		if (skipped == 0 && !(pfd[1].revents & POLLIN)) {
+			CAMERA_V4L2_LOG_ERROR("Device reported an error");
+			errno = EIO;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int camera_v4l2_fanout_acquire(camera_v4l2_fanout_t *fanout,
+			       camera_v4l2_shared_frame_t **shared,
+			       int timeout_ms) {
+	CAMERA_V4L2_ASSERT(fanout != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(shared != NULL, "Frame is null!!!");
+
+	*shared = NULL;
+	camera_v4l2_camera_t *camera = fanout->camera;
+
+	uint64_t deadline = 0;
+	if (timeout_ms > 0) {
+		deadline = camera_v4l2_clock_ns(CLOCK_MONOTONIC) +
+			(uint64_t) timeout_ms * 1000000ull;
+	}
+
+	camera_v4l2_frame_t frame;
+	for (;;) {
+		camera_v4l2_fanout_reclaim(fanout);
+
+		int wait_ms = timeout_ms;
+		if (timeout_ms > 0) {
+			wait_ms = camera_v4l2_remaining_ms(deadline);
+		}
+		if (camera->fd == -1 ||
+		    camera->outstanding < camera_v4l2_acquire_limit(camera)) {
+			if (!camera_v4l2_acquire_timeout(camera, &frame, wait_ms)) {
+				return 0;
+			}
+			break;
+		}
+
+		if (fanout->policy == CAMERA_V4L2_FANOUT_FAIL) {
+			errno = EBUSY;
+			return 0;
+		}
+		if (timeout_ms == 0 || (timeout_ms > 0 && wait_ms == 0)) {
+			errno = EAGAIN;
+			return 0;
+		}
+		if (!camera_v4l2_fanout_wait(fanout, wait_ms)) {
+			return 0;
+		}
+	}
+
+	if (frame.index >= fanout->frame_count) {
+		CAMERA_V4L2_LOG_ERROR("Camera was reopened under the fanout");
+		camera_v4l2_release(camera, &frame);
+		errno = EINVAL;
+		return 0;
+	}
+
+	struct camera_v4l2_shared_frame *slot = &fanout->frames[frame.index];
+	slot->frame = frame;
+	__atomic_store_n(&slot->refs, 1, __ATOMIC_RELEASE);
+	*shared = slot;
+
+	return 1;
+}
+
+const camera_v4l2_frame_t *camera_v4l2_shared_frame_get(
+	const camera_v4l2_shared_frame_t *shared) {
+	CAMERA_V4L2_ASSERT(shared != NULL, "Object is null!!!");
+	return &shared->frame;
+}
+
+void camera_v4l2_shared_frame_ref(camera_v4l2_shared_frame_t *shared) {
+	CAMERA_V4L2_ASSERT(shared != NULL, "Object is null!!!");
+
+	int refs = __atomic_fetch_add(&shared->refs, 1, __ATOMIC_RELAXED);
+	CAMERA_V4L2_ASSERT(refs > 0, "Frame is not referenced!!!");
+}
+
+void camera_v4l2_shared_frame_unref(camera_v4l2_shared_frame_t *shared) {
+	CAMERA_V4L2_ASSERT(shared != NULL, "Object is null!!!");
+
+	int refs = __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL);
+	CAMERA_V4L2_ASSERT(refs >= 0, "Frame is not referenced!!!");
+	if (refs > 0) return;
+
+	camera_v4l2_fanout_t *fanout = shared->fanout;
+	int index = shared->frame.index;
+	if (!camera_v4l2_ring_push(fanout->dropped, &index, NULL, NULL)) {
+		CAMERA_V4L2_LOG_ERROR("Frame %d dropped twice", index);
+		return;
+	}
+	int wake_fd = __atomic_exchange_n(&fanout->wake_fd, -1, __ATOMIC_SEQ_CST);
+	if (wake_fd >= 0) {
+		uint64_t signal = 1;
+		if (write(wake_fd, &signal, sizeof(signal)) < 0) {
+			// The counter is already pending, the waiter wakes anyway.
+		}
+	}
+}
+
+int camera_v4l2_frame_ring_callback(camera_v4l2_camera_t *camera,
+				    camera_v4l2_frame_t *frame, void *user) {
+	CAMERA_V4L2_ASSERT(user != NULL, "Ring is null!!!");
+
+	// Released by the ring itself when it cannot take the frame.
+	camera_v4l2_frame_ring_push((camera_v4l2_frame_ring_t *) user,
+				    camera, frame);
+	return 1;
+}
+
+struct camera_v4l2_thread_entry {
+	camera_v4l2_capture_thread_t *thread;
+	camera_v4l2_camera_t *camera;
+	camera_v4l2_frame_callback_t callback;
+	void *user;
+	int timed;  // The two below are valid
+	uint64_t last_timestamp_ns;
+	uint64_t last_dequeue_ns;
+	size_t locked_bytes;
+};
+
+// Stats are written by the capture thread only, and read with atomic
+// loads from anywhere.
+struct camera_v4l2_capture_thread {
+	camera_v4l2_thread_param_t param;
+	camera_v4l2_reactor_t *reactor;
+	struct camera_v4l2_thread_entry **entries;
+	int entry_count;
+	int entry_capacity;
+	pthread_t thread;
+	int running;
+	int stopping;
+	int wake_fd;
+	uint64_t frames;
+	uint64_t latency_count;
+	uint64_t latency_sum_ns;
+	uint64_t latency_max_ns;
+	uint64_t jitter_count;
+	uint64_t jitter_sum_ns;
+	uint64_t jitter_max_ns;
+	uint64_t preemptions;
+	int pinned;
+	int realtime;
+	size_t locked_bytes;
+};
+
+static void camera_v4l2_stat_add(uint64_t *sum, uint64_t *max,
+				 uint64_t value) {
+	__atomic_store_n(sum, *sum + value, __ATOMIC_RELAXED);
+	if (value > *max) __atomic_store_n(max, value, __ATOMIC_RELAXED);
+}
+
+static int camera_v4l2_capture_thread_dispatch(camera_v4l2_camera_t *camera,
+					       camera_v4l2_frame_t *frame,
+					       void *user) {
+	struct camera_v4l2_thread_entry *entry =
+		(struct camera_v4l2_thread_entry *) user;
+	camera_v4l2_capture_thread_t *thread = entry->thread;
+
+	uint64_t now = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	uint64_t timestamp = frame->meta.timestamp_ns;
+	// Frames without a monotonic timestamp cannot be timed.
+	if (frame->meta.timestamp_monotonic) {
+		camera_v4l2_stat_add(&thread->latency_sum_ns, &thread->latency_max_ns,
+				     now > timestamp ? now - timestamp : 0);
+		__atomic_store_n(&thread->latency_count, thread->latency_count + 1,
+				 __ATOMIC_RELAXED);
+		if (entry->timed && timestamp > entry->last_timestamp_ns) {
+			int64_t jitter = (int64_t) (now - entry->last_dequeue_ns) -
+				(int64_t) (timestamp - entry->last_timestamp_ns);
+			camera_v4l2_stat_add(&thread->jitter_sum_ns, &thread->jitter_max_ns,
+					     jitter < 0 ? -jitter : jitter);
+			__atomic_store_n(&thread->jitter_count, thread->jitter_count + 1,
+					 __ATOMIC_RELAXED);
+		}
+		entry->last_timestamp_ns = timestamp;
+		entry->last_dequeue_ns = now;
+	}
+	entry->timed = frame->meta.timestamp_monotonic;
+	__atomic_store_n(&thread->frames, thread->frames + 1, __ATOMIC_RELAXED);
+
+	return entry->callback(camera, frame, entry->user);
+}
+
+static void camera_v4l2_capture_thread_setup(
+	camera_v4l2_capture_thread_t *thread) {
+	if (thread->param.cpu_mask != 0) {
+		// sched_setaffinity and cpu_set_t need _GNU_SOURCE, which
+		// including this header cannot promise.
+		unsigned long mask[64 / (8 * sizeof(unsigned long)) + 1];
+		memset(mask, 0, sizeof(mask));
+		for (int cpu = 0; cpu < 64; cpu++) {
+			if (!(thread->param.cpu_mask & (1ull << cpu))) continue;
+			mask[cpu / (8 * sizeof(unsigned long))] |=
+				1ul << (cpu % (8 * sizeof(unsigned long)));
+		}
+		if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0) {
+			__atomic_store_n(&thread->pinned, 1, __ATOMIC_RELAXED);
+		} else {
+			CAMERA_V4L2_LOG_WARN("Cannot pin the capture thread: %s",
+					     strerror(errno));
+		}
+	}
+
+	if (thread->param.priority > 0) {
+		struct sched_param sched;
+		memset(&sched, 0, sizeof(sched));
+		sched.sched_priority = thread->param.priority;
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+		if (err == 0) {
+			__atomic_store_n(&thread->realtime, 1, __ATOMIC_RELAXED);
+		} else {
+			CAMERA_V4L2_LOG_WARN("No SCHED_FIFO for the capture thread: %s",
+					     strerror(err));
+		}
+	}
+}
+
+static uint64_t camera_v4l2_thread_preemptions() {
+	struct rusage usage;
+	if (getrusage(CAMERA_V4L2_RUSAGE_THREAD, &usage) < 0) return 0;
+	return (uint64_t) usage.ru_nivcsw;
+}
+
+static void *camera_v4l2_capture_thread_main(void *arg) {
+	camera_v4l2_capture_thread_t *thread = (camera_v4l2_capture_thread_t *) arg;
+
+	camera_v4l2_capture_thread_setup(thread);
+	uint64_t initial = camera_v4l2_thread_preemptions();
+	uint64_t base = thread->preemptions;
+	while (!__atomic_load_n(&thread->stopping, __ATOMIC_ACQUIRE)) {
+		// Hand given back frames to the driver as soon as possible,
+		// not only once their camera runs out of buffers.
+		for (int i = 0; i < thread->entry_count; i++) {
+			camera_v4l2_reclaim(thread->entries[i]->camera, -1);
+		}
+		if (camera_v4l2_reactor_run_once(thread->reactor, -1) < 0) break;
+		__atomic_store_n(&thread->preemptions,
+				 base + camera_v4l2_thread_preemptions() - initial,
+				 __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+camera_v4l2_capture_thread_t *camera_v4l2_capture_thread_create(
+	const camera_v4l2_thread_param_t *param) {
+	camera_v4l2_capture_thread_t *thread =
+		(camera_v4l2_capture_thread_t *) calloc(
+			1, sizeof(camera_v4l2_capture_thread_t));
+	if (thread == NULL) return NULL;
+
+	if (param != NULL) thread->param = *param;
+	thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	thread->reactor = camera_v4l2_reactor_create();
+	if (thread->wake_fd < 0 || thread->reactor == NULL) {
+		CAMERA_V4L2_LOG_ERROR("Capture thread setup failed");
+		camera_v4l2_capture_thread_destroy(thread);
+		return NULL;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(thread->reactor->epoll_fd, EPOLL_CTL_ADD,
+		      thread->wake_fd, &event) < 0) {
+		CAMERA_V4L2_LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+		camera_v4l2_capture_thread_destroy(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void camera_v4l2_capture_thread_destroy(camera_v4l2_capture_thread_t *thread) {
+	if (thread == NULL) return;
+
+	camera_v4l2_capture_thread_stop(thread);
+	for (int i = 0; i < thread->entry_count; i++) {
+		free(thread->entries[i]);
+	}
+	free(thread->entries);
+	if (thread->reactor != NULL) camera_v4l2_reactor_destroy(thread->reactor);
+	if (thread->wake_fd >= 0) close(thread->wake_fd);
+
+	free(thread);
+}
+
+int camera_v4l2_capture_thread_add(camera_v4l2_capture_thread_t *thread,
+				   camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_callback_t callback,
+				   void *user) {
+	CAMERA_V4L2_ASSERT(thread != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(callback != NULL, "Callback is null!!!");
+
+	if (thread->running) {
+		CAMERA_V4L2_LOG_ERROR("Capture thread is running");
+		errno = EBUSY;
+		return 0;
+	}
+	camera_v4l2_capture_thread_remove(thread, camera);
+
+	if (thread->entry_count == thread->entry_capacity) {
+		int capacity = thread->entry_capacity ?
+			thread->entry_capacity * 2 : 8;
+		struct camera_v4l2_thread_entry **entries =
+			(struct camera_v4l2_thread_entry **) realloc(
+				thread->entries, capacity * sizeof(*thread->entries));
+		if (entries == NULL) {
+			CAMERA_V4L2_LOG_ERROR("Out of memory");
+			return 0;
+		}
+		thread->entries = entries;
+		thread->entry_capacity = capacity;
+	}
+
+	struct camera_v4l2_thread_entry *entry =
+		(struct camera_v4l2_thread_entry *) calloc(1, sizeof(*entry));
+	if (entry == NULL) return 0;
+	entry->thread = thread;
+	entry->camera = camera;
+	entry->callback = callback;
+	entry->user = user;
+	if (!camera_v4l2_reactor_add(thread->reactor, camera,
+				     camera_v4l2_capture_thread_dispatch, entry)) {
+		free(entry);
+		return 0;
+	}
+	thread->entries[thread->entry_count++] = entry;
+
+	return 1;
+}
+
+int camera_v4l2_capture_thread_remove(camera_v4l2_capture_thread_t *thread,
+				      camera_v4l2_camera_t *camera) {
+	CAMERA_V4L2_ASSERT(thread != NULL, "Object is null!!!");
+
+	if (thread->running) {
+		CAMERA_V4L2_LOG_ERROR("Capture thread is running");
+		errno = EBUSY;
+		return 0;
+	}
+	for (int i = 0; i < thread->entry_count; i++) {
+		if (thread->entries[i]->camera != camera) continue;
+		camera_v4l2_reactor_remove(thread->reactor, camera);
+		free(thread->entries[i]);
+		thread->entries[i] = thread->entries[--thread->entry_count];
+		return 1;
+	}
+
+	return 0;
+}
+
+static void camera_v4l2_capture_thread_lock(camera_v4l2_capture_thread_t *thread,
+					    int lock) {
+	size_t total = 0;
+	for (int i = 0; i < thread->entry_count; i++) {
+		struct camera_v4l2_thread_entry *entry = thread->entries[i];
+		camera_v4l2_camera_t *camera = entry->camera;
+		if (!lock) {
+			if (entry->locked_bytes != 0 && camera->slots != NULL) {
+				for (int j = 0; j < camera->buffer_count; j++) {
+					munlock(camera->slots[j].start, camera->slots[j].length);
+				}
+			}
+			entry->locked_bytes = 0;
+			continue;
+		}
+		if (camera->slots == NULL) continue;
+		for (int j = 0; j < camera->buffer_count; j++) {
+			if (mlock(camera->slots[j].start, camera->slots[j].length) < 0) {
+				CAMERA_V4L2_LOG_WARN("Cannot lock capture buffers: %s",
+						     strerror(errno));
+				break;
+			}
+			entry->locked_bytes += camera->slots[j].length;
+		}
+		total += entry->locked_bytes;
+	}
+	__atomic_store_n(&thread->locked_bytes, total, __ATOMIC_RELAXED);
+}
+
+int camera_v4l2_capture_thread_start(camera_v4l2_capture_thread_t *thread) {
+	CAMERA_V4L2_ASSERT(thread != NULL, "Object is null!!!");
+
+	if (thread->running) return 1;
+
+	if (thread->param.lock_memory) {
+		camera_v4l2_capture_thread_lock(thread, 1);
+	}
+	thread->stopping = 0;
+	int err = pthread_create(&thread->thread, NULL,
+				 camera_v4l2_capture_thread_main, thread);
+	if (err != 0) {
+		CAMERA_V4L2_LOG_ERROR("pthread_create failed: %s", strerror(err));
+		camera_v4l2_capture_thread_lock(thread, 0);
+		errno = err;
+		return 0;
+	}
+	thread->running = 1;
+
+	return 1;
+}
+
+void camera_v4l2_capture_thread_stop(camera_v4l2_capture_thread_t *thread) {
+	CAMERA_V4L2_ASSERT(thread != NULL, "Object is null!!!");
+
+	if (!thread->running) return;
+
+	__atomic_store_n(&thread->stopping, 1, __ATOMIC_RELEASE);
+	uint64_t signal = 1;
+	if (write(thread->wake_fd, &signal, sizeof(signal)) < 0) {
+		// Already signalled.
+	}
+	pthread_join(thread->thread, NULL);
+	if (read(thread->wake_fd, &signal, sizeof(signal)) < 0) {
+		// Nothing pending.
+	}
+	thread->running = 0;
+	camera_v4l2_capture_thread_lock(thread, 0);
+}
+
+void camera_v4l2_capture_thread_stats(camera_v4l2_capture_thread_t *thread,
+				      camera_v4l2_thread_stats_t *stats) {
+	CAMERA_V4L2_ASSERT(thread != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(stats != NULL, "Stats is null!!!");
+
+	memset(stats, 0, sizeof(*stats));
+	stats->frames = __atomic_load_n(&thread->frames, __ATOMIC_RELAXED);
+	uint64_t latency_count =
+		__atomic_load_n(&thread->latency_count, __ATOMIC_RELAXED);
+	if (latency_count != 0) {
+		stats->latency_mean_ns = __atomic_load_n(
+			&thread->latency_sum_ns, __ATOMIC_RELAXED) / latency_count;
+	}
+	stats->latency_max_ns =
+		__atomic_load_n(&thread->latency_max_ns, __ATOMIC_RELAXED);
+	uint64_t jitter_count =
+		__atomic_load_n(&thread->jitter_count, __ATOMIC_RELAXED);
+	if (jitter_count != 0) {
+		stats->jitter_mean_ns = __atomic_load_n(
+			&thread->jitter_sum_ns, __ATOMIC_RELAXED) / jitter_count;
+	}
+	stats->jitter_max_ns =
+		__atomic_load_n(&thread->jitter_max_ns, __ATOMIC_RELAXED);
+	stats->preemptions = __atomic_load_n(&thread->preemptions, __ATOMIC_RELAXED);
+	stats->pinned = __atomic_load_n(&thread->pinned, __ATOMIC_RELAXED);
+	stats->realtime = __atomic_load_n(&thread->realtime, __ATOMIC_RELAXED);
+	stats->locked_bytes =
+		__atomic_load_n(&thread->locked_bytes, __ATOMIC_RELAXED);
+}
+
 #undef CAMERA_V4L2_BUFFER_COUNT
+#undef CAMERA_V4L2_MIN_QUEUED
+#undef CAMERA_V4L2_REACTOR_MAX_EVENTS
+#undef CAMERA_V4L2_HUGE_PAGE_SIZE
+#undef CAMERA_V4L2_CACHE_LINE
+#undef CAMERA_V4L2_RUSAGE_THREAD
 #undef CAMERA_V4L2_ASSERT
 #undef CAMERA_V4L2_LOG_ERROR
 #undef CAMERA_V4L2_LOG_INFO
@@ -471,4 +3464,5 @@ int camera_v4l2_isopened(camera_v4l2_camera_t *camera) {
 }
 #endif
 
+#endif  // CAMERA_V4L2_IMPLEMENTATION_
 #endif  // CAMERA_V4L2_IMPLEMENTATION
@@ -0,0 +1,737 @@
+#ifndef CAMERA_V4L2_AVI_H_
+#define CAMERA_V4L2_AVI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_v4l2.h"
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+// Wraps MJPEG frames as they come from the camera into an AVI file any
+// player opens, without decoding them. Files grow past 1 GB as OpenDML
+// (AVI 2.0) RIFF segments, with a legacy idx1 index for the first one.
+// The OpenDML index is written as frames come in and the headers are
+// kept in step with it, so a file cut short by a crash plays up to the
+// last index chunk.
+struct camera_v4l2_avi_param {
+	uint32_t width;
+	uint32_t height;
+	// Seconds per frame (1/30 for 30 fps), as camera_v4l2_frame_interval
+	// reports it. 0/0 selects 1/30.
+	uint32_t interval_numerator;
+	uint32_t interval_denominator;
+	// Frames per index chunk, 0 selects 32. Long files space their chunks
+	// out progressively to fit the fixed size top level index, which
+	// with 32 runs out after about 4 million frames (38 hours at 30 fps);
+	// frames past that are counted but not indexed.
+	int index_frames;
+	// Sync the file to disk before every header update, so it survives
+	// power loss as well and not only the process dying.
+	int sync;
+};
+typedef struct camera_v4l2_avi_param camera_v4l2_avi_param_t;
+
+struct camera_v4l2_avi;
+typedef struct camera_v4l2_avi camera_v4l2_avi_t;
+
+// Creates or truncates path.
+camera_v4l2_avi_t *camera_v4l2_avi_open(const char *path,
+					const camera_v4l2_avi_param_t *param);
+// Finishes the indexes and headers. Returns 0 if anything failed on the
+// way, with errno set from the first failure.
+int camera_v4l2_avi_close(camera_v4l2_avi_t *avi);
+// Appends one MJPEG frame, adding the standard Huffman tables when it
+// has none (as UVC cameras send them). dropped frames before it (see
+// camera_v4l2_frame_meta_t) are written as empty chunks, which players
+// show as a repeat of the previous frame, so the timeline stays true;
+// a gap longer than a few seconds is cut short. After a failed write
+// every frame is refused with its errno.
+int camera_v4l2_avi_write(camera_v4l2_avi_t *avi, const void *data,
+			  size_t length, unsigned int dropped);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_AVI_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_AVI_IMPLEMENTATION_
+#define CAMERA_V4L2_AVI_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/uio.h>
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_LOG_WARN(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[32mWARN: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_ASSERT(cond, msg) \
+do { \
+	if (!(cond)) { \
+		fprintf(stderr, "\x1B[31m Assert failed: [%s][%d] %s \e[0m\n", __FUNCTION__, __LINE__, msg); \
+		exit(1); \
+	} \
+} while(0)
+
+#define CAMERA_V4L2_AVI_INDEX_FRAMES (32)
+// Longest gap written as empty chunks. Sequence numbers jumping further
+// are taken as a glitch rather than frames lost.
+#define CAMERA_V4L2_AVI_MAX_GAP_SECONDS (5)
+// Largest RIFF segment, as OpenDML readers expect. Tests define a small
+// one to cross segments.
+#ifndef CAMERA_V4L2_AVI_RIFF_SIZE
+#define CAMERA_V4L2_AVI_RIFF_SIZE (1u << 30)
+#endif
+// Entries of the top level index in the header. The index chunks are
+// spaced out twice as far every eighth of it, see
+// camera_v4l2_avi_interval.
+#define CAMERA_V4L2_AVI_SUPER_ENTRIES (4096)
+#define CAMERA_V4L2_AVI_FOURCC(a, b, c, d) \
+	((uint32_t) (a) | ((uint32_t) (b) << 8) | \
+	 ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+#define CAMERA_V4L2_AVIF_HASINDEX (0x10)
+#define CAMERA_V4L2_AVIIF_KEYFRAME (0x10)
+// In an index chunk entry's size.
+#define CAMERA_V4L2_AVI_NOT_KEYFRAME (0x80000000u)
+// Entry of an OpenDML index chunk: offset from the segment start of a
+// chunk's data and its size.
+#define CAMERA_V4L2_AVI_ENTRY_SIZE (8)
+// Entry of the legacy idx1 index: chunk id, flags, offset of the chunk
+// header from the movi fourcc and size.
+#define CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE (16)
+
+// The standard tables of ITU T.81 Annex K.3, which MJPEG cameras leave
+// out of their frames.
+static const uint8_t camera_v4l2_avi_dht[] = {
+	0xFF, 0xC4, 0x01, 0xA2,
+	// Luminance DC
+	0x00,
+	0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0A, 0x0B,
+	// Chrominance DC
+	0x01,
+	0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0A, 0x0B,
+	// Luminance AC
+	0x10,
+	0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03,
+	0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+	0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16,
+	0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+	0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+	0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+	0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+	0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+	0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+	0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+	// Chrominance AC
+	0x11,
+	0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04,
+	0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+	0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34,
+	0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+	0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+	0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+	0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+	0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2,
+	0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+	0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9,
+	0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+};
+
+struct camera_v4l2_avi {
+	camera_v4l2_avi_param_t param;
+	int fd;
+	uint64_t offset;  // End of the file
+	int error;  // errno of the first failed write
+	// Where the header fields kept up to date live.
+	uint64_t avih_offset;
+	uint64_t strh_offset;
+	uint64_t super_offset;
+	uint64_t dmlh_offset;
+	// The current RIFF segment and its movi list.
+	int segment;
+	uint64_t riff_offset;
+	uint64_t movi_offset;
+	uint32_t frames;  // Total, empty chunks included
+	uint32_t first_frames;  // In the first segment
+	uint32_t max_size;
+	// Frames not in an index chunk yet, their entries as written.
+	uint8_t *pending;
+	uint32_t pending_count;
+	uint32_t pending_capacity;
+	uint32_t super_count;
+	// The first segment's frames, for its idx1 written at its end.
+	uint8_t *legacy;
+	uint32_t legacy_count;
+	uint32_t legacy_capacity;
+};
+
+static void camera_v4l2_avi_put16(uint8_t *p, uint16_t value) {
+	p[0] = (uint8_t) value;
+	p[1] = (uint8_t) (value >> 8);
+}
+
+static void camera_v4l2_avi_put32(uint8_t *p, uint32_t value) {
+	camera_v4l2_avi_put16(p, (uint16_t) value);
+	camera_v4l2_avi_put16(p + 2, (uint16_t) (value >> 16));
+}
+
+static void camera_v4l2_avi_put64(uint8_t *p, uint64_t value) {
+	camera_v4l2_avi_put32(p, (uint32_t) value);
+	camera_v4l2_avi_put32(p + 4, (uint32_t) (value >> 32));
+}
+
+static void camera_v4l2_avi_fail(camera_v4l2_avi_t *avi, int error) {
+	if (avi->error == 0) {
+		avi->error = error;
+		CAMERA_V4L2_LOG_ERROR("Cannot write AVI: %s", strerror(error));
+	}
+	errno = avi->error;
+}
+
+// Appends at the end of the file.
+static int camera_v4l2_avi_append(camera_v4l2_avi_t *avi,
+				  struct iovec *iov, int count) {
+	size_t total = 0;
+	for (int i = 0; i < count; i++) total += iov[i].iov_len;
+
+	while (total > 0) {
+		ssize_t written = pwritev(avi->fd, iov, count, (off_t) avi->offset);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			camera_v4l2_avi_fail(avi, errno);
+			return 0;
+		}
+		avi->offset += written;
+		total -= written;
+		while (count > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 1;
+}
+
+static int camera_v4l2_avi_patch(camera_v4l2_avi_t *avi, uint64_t offset,
+				 const void *data, size_t length) {
+	ssize_t written;
+	do {
+		written = pwrite(avi->fd, data, length, (off_t) offset);
+	} while (written < 0 && errno == EINTR);
+	if (written != (ssize_t) length) {
+		camera_v4l2_avi_fail(avi, written < 0 ? errno : EIO);
+		return 0;
+	}
+	return 1;
+}
+
+static int camera_v4l2_avi_patch32(camera_v4l2_avi_t *avi, uint64_t offset,
+				   uint32_t value) {
+	uint8_t bytes[4];
+	camera_v4l2_avi_put32(bytes, value);
+	return camera_v4l2_avi_patch(avi, offset, bytes, sizeof(bytes));
+}
+
+// Brings the sizes and counts in the headers up to the end of the file.
+static int camera_v4l2_avi_update(camera_v4l2_avi_t *avi) {
+	if (avi->param.sync && fdatasync(avi->fd) < 0) {
+		camera_v4l2_avi_fail(avi, errno);
+		return 0;
+	}
+
+	uint32_t first_frames = avi->segment == 0 ?
+		avi->frames : avi->first_frames;
+	return camera_v4l2_avi_patch32(avi, avi->riff_offset + 4,
+				       (uint32_t) (avi->offset - avi->riff_offset - 8)) &&
+		camera_v4l2_avi_patch32(avi, avi->movi_offset + 4,
+					(uint32_t) (avi->offset - avi->movi_offset - 8)) &&
+		camera_v4l2_avi_patch32(avi, avi->avih_offset + 8 + 16, first_frames) &&
+		camera_v4l2_avi_patch32(avi, avi->avih_offset + 8 + 28, avi->max_size) &&
+		camera_v4l2_avi_patch32(avi, avi->strh_offset + 8 + 32, avi->frames) &&
+		camera_v4l2_avi_patch32(avi, avi->strh_offset + 8 + 36, avi->max_size) &&
+		camera_v4l2_avi_patch32(avi, avi->dmlh_offset + 8, avi->frames);
+}
+
+// Frames per index chunk, doubling every eighth of the top level index
+// so that it lasts for days of video.
+static uint32_t camera_v4l2_avi_interval(camera_v4l2_avi_t *avi) {
+	uint32_t eighth = avi->super_count / (CAMERA_V4L2_AVI_SUPER_ENTRIES / 8);
+	return (uint32_t) avi->param.index_frames << eighth;
+}
+
+// Writes the pending frames' index chunk, lists it in the top level
+// index and updates the headers.
+static int camera_v4l2_avi_flush(camera_v4l2_avi_t *avi) {
+	if (avi->pending_count == 0) return 1;
+	if (avi->super_count == CAMERA_V4L2_AVI_SUPER_ENTRIES) {
+		// Out of room, the rest stays unindexed.
+		avi->pending_count = 0;
+		return camera_v4l2_avi_update(avi);
+	}
+
+	uint8_t header[32];
+	uint32_t size = 24 + avi->pending_count * 8;
+	camera_v4l2_avi_put32(header, CAMERA_V4L2_AVI_FOURCC('i', 'x', '0', '0'));
+	camera_v4l2_avi_put32(header + 4, size);
+	camera_v4l2_avi_put16(header + 8, 2);  // wLongsPerEntry
+	header[10] = 0;  // bIndexSubType
+	header[11] = 1;  // bIndexType, AVI_INDEX_OF_CHUNKS
+	camera_v4l2_avi_put32(header + 12, avi->pending_count);
+	camera_v4l2_avi_put32(header + 16, CAMERA_V4L2_AVI_FOURCC('0', '0', 'd', 'c'));
+	camera_v4l2_avi_put64(header + 20, avi->riff_offset);  // qwBaseOffset
+	camera_v4l2_avi_put32(header + 28, 0);
+
+	uint64_t chunk_offset = avi->offset;
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = avi->pending;
+	iov[1].iov_len = avi->pending_count * CAMERA_V4L2_AVI_ENTRY_SIZE;
+	if (!camera_v4l2_avi_append(avi, iov, 2)) return 0;
+
+	uint8_t entry[16];
+	camera_v4l2_avi_put64(entry, chunk_offset);
+	camera_v4l2_avi_put32(entry + 8, size + 8);
+	camera_v4l2_avi_put32(entry + 12, avi->pending_count);  // dwDuration
+	uint32_t count = avi->super_count + 1;
+	avi->pending_count = 0;
+
+	// The frames and their index chunk have to be in place before the
+	// headers point at them.
+	if (!camera_v4l2_avi_update(avi) ||
+	    !camera_v4l2_avi_patch(avi, avi->super_offset + 32 +
+				   (uint64_t) avi->super_count * 16,
+				   entry, sizeof(entry)) ||
+	    !camera_v4l2_avi_patch32(avi, avi->super_offset + 12, count)) {
+		return 0;
+	}
+	avi->super_count = count;
+	return 1;
+}
+
+// Ends the first segment with its idx1, which players without OpenDML
+// support rely on.
+static int camera_v4l2_avi_write_legacy(camera_v4l2_avi_t *avi) {
+	uint8_t header[8];
+	camera_v4l2_avi_put32(header, CAMERA_V4L2_AVI_FOURCC('i', 'd', 'x', '1'));
+	camera_v4l2_avi_put32(header + 4, avi->legacy_count *
+			      CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE);
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = avi->legacy;
+	iov[1].iov_len = avi->legacy_count * CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE;
+	uint64_t movi_end = avi->offset;
+	if (!camera_v4l2_avi_append(avi, iov, 2)) return 0;
+
+	free(avi->legacy);
+	avi->legacy = NULL;
+	avi->legacy_count = 0;
+	avi->legacy_capacity = 0;
+
+	uint8_t flags[4];
+	camera_v4l2_avi_put32(flags, CAMERA_V4L2_AVIF_HASINDEX);
+	return camera_v4l2_avi_patch32(avi, avi->movi_offset + 4,
+				       (uint32_t) (movi_end - avi->movi_offset - 8)) &&
+		camera_v4l2_avi_patch32(avi, avi->riff_offset + 4,
+					(uint32_t) (avi->offset - avi->riff_offset - 8)) &&
+		camera_v4l2_avi_patch(avi, avi->avih_offset + 8 + 12, flags,
+				      sizeof(flags));
+}
+
+// Starts a RIFF segment, the first one with the headers.
+static int camera_v4l2_avi_begin_segment(camera_v4l2_avi_t *avi) {
+	uint8_t header[24];
+	avi->riff_offset = avi->offset;
+	avi->movi_offset = avi->offset + 12;
+	camera_v4l2_avi_put32(header, CAMERA_V4L2_AVI_FOURCC('R', 'I', 'F', 'F'));
+	camera_v4l2_avi_put32(header + 4, 4 + 12);
+	camera_v4l2_avi_put32(header + 8, CAMERA_V4L2_AVI_FOURCC('A', 'V', 'I', 'X'));
+	camera_v4l2_avi_put32(header + 12, CAMERA_V4L2_AVI_FOURCC('L', 'I', 'S', 'T'));
+	camera_v4l2_avi_put32(header + 16, 4);
+	camera_v4l2_avi_put32(header + 20, CAMERA_V4L2_AVI_FOURCC('m', 'o', 'v', 'i'));
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	return camera_v4l2_avi_append(avi, &iov, 1);
+}
+
+static int camera_v4l2_avi_write_headers(camera_v4l2_avi_t *avi) {
+	const size_t super_size = 24 + CAMERA_V4L2_AVI_SUPER_ENTRIES * 16;
+	const size_t strl_size = 4 + (8 + 56) + (8 + 40) + (8 + super_size);
+	const size_t odml_size = 4 + (8 + 248);
+	const size_t hdrl_size = 4 + (8 + 56) + (8 + strl_size) + (8 + odml_size);
+	const size_t size = 12 + 8 + hdrl_size + 12;
+	uint8_t *header = (uint8_t *) calloc(1, size);
+	if (header == NULL) {
+		camera_v4l2_avi_fail(avi, ENOMEM);
+		return 0;
+	}
+
+	const camera_v4l2_avi_param_t *param = &avi->param;
+	uint32_t usec = (uint32_t) ((uint64_t) 1000000 *
+		param->interval_numerator / param->interval_denominator);
+	uint8_t *p = header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('R', 'I', 'F', 'F'));
+	camera_v4l2_avi_put32(p + 4, (uint32_t) (size - 8));
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('A', 'V', 'I', ' '));
+	p += 12;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('L', 'I', 'S', 'T'));
+	camera_v4l2_avi_put32(p + 4, (uint32_t) hdrl_size);
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('h', 'd', 'r', 'l'));
+	p += 12;
+
+	// MainAVIHeader
+	avi->avih_offset = p - header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('a', 'v', 'i', 'h'));
+	camera_v4l2_avi_put32(p + 4, 56);
+	camera_v4l2_avi_put32(p + 8, usec);  // dwMicroSecPerFrame
+	camera_v4l2_avi_put32(p + 8 + 24, 1);  // dwStreams
+	camera_v4l2_avi_put32(p + 8 + 32, param->width);
+	camera_v4l2_avi_put32(p + 8 + 36, param->height);
+	p += 8 + 56;
+
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('L', 'I', 'S', 'T'));
+	camera_v4l2_avi_put32(p + 4, (uint32_t) strl_size);
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('s', 't', 'r', 'l'));
+	p += 12;
+
+	// AVIStreamHeader, rate / scale is the frame rate.
+	avi->strh_offset = p - header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('s', 't', 'r', 'h'));
+	camera_v4l2_avi_put32(p + 4, 56);
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('v', 'i', 'd', 's'));
+	camera_v4l2_avi_put32(p + 8 + 4, CAMERA_V4L2_AVI_FOURCC('M', 'J', 'P', 'G'));
+	camera_v4l2_avi_put32(p + 8 + 20, param->interval_numerator);  // dwScale
+	camera_v4l2_avi_put32(p + 8 + 24, param->interval_denominator);  // dwRate
+	camera_v4l2_avi_put32(p + 8 + 40, 0xFFFFFFFFu);  // dwQuality
+	camera_v4l2_avi_put16(p + 8 + 52, (uint16_t) param->width);  // rcFrame
+	camera_v4l2_avi_put16(p + 8 + 54, (uint16_t) param->height);
+	p += 8 + 56;
+
+	// BITMAPINFOHEADER
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('s', 't', 'r', 'f'));
+	camera_v4l2_avi_put32(p + 4, 40);
+	camera_v4l2_avi_put32(p + 8, 40);
+	camera_v4l2_avi_put32(p + 8 + 4, param->width);
+	camera_v4l2_avi_put32(p + 8 + 8, param->height);
+	camera_v4l2_avi_put16(p + 8 + 12, 1);  // biPlanes
+	camera_v4l2_avi_put16(p + 8 + 14, 24);  // biBitCount
+	camera_v4l2_avi_put32(p + 8 + 16, CAMERA_V4L2_AVI_FOURCC('M', 'J', 'P', 'G'));
+	camera_v4l2_avi_put32(p + 8 + 20, param->width * param->height * 3);
+	p += 8 + 40;
+
+	// OpenDML top level index, filled in as index chunks are written.
+	avi->super_offset = p - header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('i', 'n', 'd', 'x'));
+	camera_v4l2_avi_put32(p + 4, (uint32_t) super_size);
+	camera_v4l2_avi_put16(p + 8, 4);  // wLongsPerEntry
+	p[11] = 0;  // bIndexType, AVI_INDEX_OF_INDEXES
+	camera_v4l2_avi_put32(p + 16, CAMERA_V4L2_AVI_FOURCC('0', '0', 'd', 'c'));
+	p += 8 + super_size;
+
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('L', 'I', 'S', 'T'));
+	camera_v4l2_avi_put32(p + 4, (uint32_t) odml_size);
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('o', 'd', 'm', 'l'));
+	p += 12;
+	avi->dmlh_offset = p - header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('d', 'm', 'l', 'h'));
+	camera_v4l2_avi_put32(p + 4, 248);
+	p += 8 + 248;
+
+	avi->riff_offset = 0;
+	avi->movi_offset = p - header;
+	camera_v4l2_avi_put32(p, CAMERA_V4L2_AVI_FOURCC('L', 'I', 'S', 'T'));
+	camera_v4l2_avi_put32(p + 4, 4);
+	camera_v4l2_avi_put32(p + 8, CAMERA_V4L2_AVI_FOURCC('m', 'o', 'v', 'i'));
+
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = size;
+	int ok = camera_v4l2_avi_append(avi, &iov, 1);
+	free(header);
+	return ok;
+}
+
+// Where the standard tables go: in front of the first SOS when no DHT
+// comes before it. Returns 0 when the frame has its own or is not one
+// that can be patched.
+static size_t camera_v4l2_avi_dht_position(const uint8_t *p, size_t length) {
+	if (length < 4 || p[0] != 0xFF || p[1] != 0xD8) return 0;
+
+	size_t pos = 2;
+	while (pos + 4 <= length && p[pos] == 0xFF) {
+		uint8_t marker = p[pos + 1];
+		if (marker == 0xFF) {
+			pos++;  // Fill byte
+			continue;
+		}
+		if (marker == 0xC4) return 0;
+		if (marker == 0xDA) return pos;
+		pos += 2 + (((size_t) p[pos + 2] << 8) | p[pos + 3]);
+	}
+	return 0;
+}
+
+static int camera_v4l2_avi_add_frame(camera_v4l2_avi_t *avi,
+				     uint64_t chunk_offset, uint32_t size) {
+	if (avi->pending_count == avi->pending_capacity) {
+		uint32_t capacity = avi->pending_capacity > 0 ?
+			avi->pending_capacity * 2 : 64;
+		uint8_t *pending = (uint8_t *) realloc(
+			avi->pending, capacity * CAMERA_V4L2_AVI_ENTRY_SIZE);
+		if (pending == NULL) {
+			camera_v4l2_avi_fail(avi, ENOMEM);
+			return 0;
+		}
+		avi->pending = pending;
+		avi->pending_capacity = capacity;
+	}
+	uint8_t *entry = avi->pending +
+		(size_t) avi->pending_count++ * CAMERA_V4L2_AVI_ENTRY_SIZE;
+	camera_v4l2_avi_put32(entry, (uint32_t) (chunk_offset + 8 - avi->riff_offset));
+	camera_v4l2_avi_put32(entry + 4, size > 0 ? size : CAMERA_V4L2_AVI_NOT_KEYFRAME);
+
+	if (avi->segment == 0) {
+		if (avi->legacy_count == avi->legacy_capacity) {
+			uint32_t capacity = avi->legacy_capacity > 0 ?
+				avi->legacy_capacity * 2 : 1024;
+			uint8_t *legacy = (uint8_t *) realloc(
+				avi->legacy, capacity * CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE);
+			if (legacy == NULL) {
+				camera_v4l2_avi_fail(avi, ENOMEM);
+				return 0;
+			}
+			avi->legacy = legacy;
+			avi->legacy_capacity = capacity;
+		}
+		uint8_t *legacy = avi->legacy +
+			(size_t) avi->legacy_count++ * CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE;
+		camera_v4l2_avi_put32(legacy, CAMERA_V4L2_AVI_FOURCC('0', '0', 'd', 'c'));
+		camera_v4l2_avi_put32(legacy + 4,
+				      size > 0 ? CAMERA_V4L2_AVIIF_KEYFRAME : 0);
+		camera_v4l2_avi_put32(legacy + 8,
+				      (uint32_t) (chunk_offset - avi->movi_offset - 8));
+		camera_v4l2_avi_put32(legacy + 12, size);
+	}
+
+	avi->frames++;
+	if (size > avi->max_size) avi->max_size = size;
+	return 1;
+}
+
+// Appends one 00dc chunk, data split around the inserted tables.
+static int camera_v4l2_avi_chunk(camera_v4l2_avi_t *avi, const uint8_t *data,
+				 size_t length, size_t dht_position) {
+	size_t size = length + (dht_position > 0 ? sizeof(camera_v4l2_avi_dht) : 0);
+	if (avi->offset + 8 + size + 1 - avi->riff_offset >
+	    CAMERA_V4L2_AVI_RIFF_SIZE && avi->frames > 0) {
+		// Start the next segment, the first one gets its idx1.
+		if (!camera_v4l2_avi_flush(avi)) return 0;
+		if (avi->segment == 0) {
+			if (!camera_v4l2_avi_write_legacy(avi)) return 0;
+			avi->first_frames = avi->frames;
+		}
+		avi->segment++;
+		if (!camera_v4l2_avi_begin_segment(avi) ||
+		    !camera_v4l2_avi_update(avi)) {
+			return 0;
+		}
+	}
+
+	static const uint8_t padding = 0;
+	uint8_t header[8];
+	camera_v4l2_avi_put32(header, CAMERA_V4L2_AVI_FOURCC('0', '0', 'd', 'c'));
+	camera_v4l2_avi_put32(header + 4, (uint32_t) size);
+	struct iovec iov[5];
+	int count = 0;
+	iov[count].iov_base = header;
+	iov[count++].iov_len = sizeof(header);
+	if (dht_position > 0) {
+		iov[count].iov_base = (void *) data;
+		iov[count++].iov_len = dht_position;
+		iov[count].iov_base = (void *) camera_v4l2_avi_dht;
+		iov[count++].iov_len = sizeof(camera_v4l2_avi_dht);
+	}
+	if (length > dht_position) {
+		iov[count].iov_base = (void *) (data + dht_position);
+		iov[count++].iov_len = length - dht_position;
+	}
+	// Chunks are word aligned.
+	if (size % 2 != 0) {
+		iov[count].iov_base = (void *) &padding;
+		iov[count++].iov_len = 1;
+	}
+
+	uint64_t chunk_offset = avi->offset;
+	if (!camera_v4l2_avi_append(avi, iov, count) ||
+	    !camera_v4l2_avi_add_frame(avi, chunk_offset, (uint32_t) size)) {
+		return 0;
+	}
+	if (avi->pending_count >= camera_v4l2_avi_interval(avi)) {
+		return camera_v4l2_avi_flush(avi);
+	}
+	return 1;
+}
+
+camera_v4l2_avi_t *camera_v4l2_avi_open(const char *path,
+					const camera_v4l2_avi_param_t *param) {
+	CAMERA_V4L2_ASSERT(path != NULL, "Path is null!!!");
+	CAMERA_V4L2_ASSERT(param != NULL, "Param is null!!!");
+	CAMERA_V4L2_ASSERT(param->width > 0 && param->height > 0,
+			   "Frame size is zero!!!");
+
+	camera_v4l2_avi_t *avi =
+		(camera_v4l2_avi_t *) calloc(1, sizeof(camera_v4l2_avi_t));
+	if (avi == NULL) return NULL;
+
+	avi->param = *param;
+	if (avi->param.interval_numerator == 0 ||
+	    avi->param.interval_denominator == 0) {
+		avi->param.interval_numerator = 1;
+		avi->param.interval_denominator = 30;
+	}
+	if (avi->param.index_frames <= 0) {
+		avi->param.index_frames = CAMERA_V4L2_AVI_INDEX_FRAMES;
+	}
+
+	avi->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (avi->fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("Cannot open %s: %s", path, strerror(errno));
+		free(avi);
+		return NULL;
+	}
+	if (!camera_v4l2_avi_write_headers(avi)) {
+		int error = errno;
+		close(avi->fd);
+		free(avi);
+		errno = error;
+		return NULL;
+	}
+
+	return avi;
+}
+
+int camera_v4l2_avi_close(camera_v4l2_avi_t *avi) {
+	CAMERA_V4L2_ASSERT(avi != NULL, "Object is null!!!");
+
+	// Flushing leaves the headers up to date, the first segment only
+	// lacks its idx1.
+	if (avi->error == 0 && camera_v4l2_avi_flush(avi) &&
+	    avi->segment == 0) {
+		camera_v4l2_avi_write_legacy(avi);
+	}
+
+	int error = avi->error;
+	if (close(avi->fd) < 0 && error == 0) error = errno;
+	free(avi->pending);
+	free(avi->legacy);
+	free(avi);
+	if (error != 0) {
+		errno = error;
+		return 0;
+	}
+	return 1;
+}
+
+int camera_v4l2_avi_write(camera_v4l2_avi_t *avi, const void *data,
+			  size_t length, unsigned int dropped) {
+	CAMERA_V4L2_ASSERT(avi != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(data != NULL || length == 0, "Frame is null!!!");
+
+	if (avi->error != 0) {
+		errno = avi->error;
+		return 0;
+	}
+
+	uint64_t max_dropped = (uint64_t) CAMERA_V4L2_AVI_MAX_GAP_SECONDS *
+		avi->param.interval_denominator / avi->param.interval_numerator;
+	if (max_dropped == 0) max_dropped = 1;
+	if (dropped > max_dropped) {
+		CAMERA_V4L2_LOG_WARN("%u frames dropped, writing %llu empty chunks",
+				     dropped, (unsigned long long) max_dropped);
+		dropped = (unsigned int) max_dropped;
+	}
+	for (unsigned int i = 0; i < dropped; i++) {
+		if (!camera_v4l2_avi_chunk(avi, NULL, 0, 0)) return 0;
+	}
+	const uint8_t *bytes = (const uint8_t *) data;
+	return camera_v4l2_avi_chunk(avi, bytes, length,
+				     camera_v4l2_avi_dht_position(bytes, length));
+}
+
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_LOG_WARN
+#undef CAMERA_V4L2_ASSERT
+#undef CAMERA_V4L2_AVI_INDEX_FRAMES
+#undef CAMERA_V4L2_AVI_MAX_GAP_SECONDS
+#undef CAMERA_V4L2_AVI_RIFF_SIZE
+#undef CAMERA_V4L2_AVI_SUPER_ENTRIES
+#undef CAMERA_V4L2_AVI_FOURCC
+#undef CAMERA_V4L2_AVIF_HASINDEX
+#undef CAMERA_V4L2_AVIIF_KEYFRAME
+#undef CAMERA_V4L2_AVI_NOT_KEYFRAME
+#undef CAMERA_V4L2_AVI_ENTRY_SIZE
+#undef CAMERA_V4L2_AVI_LEGACY_ENTRY_SIZE
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_AVI_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
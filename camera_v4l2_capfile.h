@@ -0,0 +1,482 @@
+#ifndef CAMERA_V4L2_CAPFILE_H_
+#define CAMERA_V4L2_CAPFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+// Capture files: a recording (see camera_v4l2_replay.h) plus an index
+// next to it, path + CAMERA_V4L2_CAPFILE_SUFFIX, of one fixed size
+// entry per frame. Both only ever grow, so a crash loses at most the
+// frames written since the index was last flushed, and those are found
+// again by scanning the end of the recording. Recorders write the index
+// with param.index_frames set (see camera_v4l2_record.h),
+// camera_v4l2_capfile_reindex builds one for any recording.
+#define CAMERA_V4L2_CAPFILE_SUFFIX ".idx"
+#define CAMERA_V4L2_CAPFILE_MAGIC (0x494c3456u)  // "V4LI"
+#define CAMERA_V4L2_CAPFILE_VERSION (1)
+
+// Starts the index, followed by the entries in recording order. All in
+// host byte order.
+struct camera_v4l2_capfile_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;  // sizeof(camera_v4l2_capfile_entry_t)
+	uint32_t reserved;
+};
+typedef struct camera_v4l2_capfile_header camera_v4l2_capfile_header_t;
+
+struct camera_v4l2_capfile_entry {
+	uint64_t offset;  // Of the frame's record header in the recording
+	uint64_t timestamp_ns;
+	uint32_t length;  // Payload
+	uint32_t sequence;
+};
+typedef struct camera_v4l2_capfile_entry camera_v4l2_capfile_entry_t;
+
+struct camera_v4l2_capfile_frame {
+	const void *data;  // Into the mapped recording, valid until close
+	size_t length;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+};
+typedef struct camera_v4l2_capfile_frame camera_v4l2_capfile_frame_t;
+
+struct camera_v4l2_capfile;
+typedef struct camera_v4l2_capfile camera_v4l2_capfile_t;
+
+// Maps the recording and its index. Without an index, or past its last
+// entry, the frames are found by scanning the recording once.
+camera_v4l2_capfile_t *camera_v4l2_capfile_open(const char *path);
+void camera_v4l2_capfile_close(camera_v4l2_capfile_t *capfile);
+size_t camera_v4l2_capfile_count(camera_v4l2_capfile_t *capfile);
+int camera_v4l2_capfile_frame(camera_v4l2_capfile_t *capfile, size_t index,
+			      camera_v4l2_capfile_frame_t *frame);
+// Index of the first frame taken at or after timestamp_ns, count when
+// there is none, by binary search. Timestamps have to ascend, as a
+// camera's kernel timestamps do.
+size_t camera_v4l2_capfile_seek(camera_v4l2_capfile_t *capfile,
+				uint64_t timestamp_ns);
+// Source for camera_v4l2_replay_create streaming the frames from first
+// on, rewinding to first. Valid until close; one at a time per capfile.
+void camera_v4l2_capfile_source(camera_v4l2_capfile_t *capfile, size_t first,
+				camera_v4l2_replay_source_t *source);
+// (Re)writes the index of the recording at path.
+int camera_v4l2_capfile_reindex(const char *path);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_CAPFILE_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_CAPFILE_IMPLEMENTATION_
+#define CAMERA_V4L2_CAPFILE_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_LOG_WARN(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[32mWARN: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_ASSERT(cond, msg) \
+do { \
+	if (!(cond)) { \
+		fprintf(stderr, "\x1B[31m Assert failed: [%s][%d] %s \e[0m\n", __FUNCTION__, __LINE__, msg); \
+		exit(1); \
+	} \
+} while(0)
+
+struct camera_v4l2_capfile {
+	const uint8_t *map;
+	size_t map_length;
+	const uint8_t *index_map;
+	size_t index_map_length;
+	// Straight from the index map when it covers the whole recording,
+	// otherwise a copy completed by scanning.
+	const camera_v4l2_capfile_entry_t *entries;
+	camera_v4l2_capfile_entry_t *owned;
+	size_t count;
+	// Source position.
+	size_t first;
+	size_t cursor;
+};
+
+// Maps path read only, NULL with length 0 for an empty file.
+static int camera_v4l2_capfile_map(const char *path, const uint8_t **map,
+				   size_t *length) {
+	*map = NULL;
+	*length = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size > 0) {
+		void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+		*map = (const uint8_t *) ptr;
+		*length = st.st_size;
+	}
+	close(fd);
+	return 1;
+}
+
+static char *camera_v4l2_capfile_index_path(const char *path) {
+	size_t length = strlen(path);
+	char *index_path = (char *) malloc(
+		length + sizeof(CAMERA_V4L2_CAPFILE_SUFFIX));
+	if (index_path == NULL) return NULL;
+	memcpy(index_path, path, length);
+	memcpy(index_path + length, CAMERA_V4L2_CAPFILE_SUFFIX,
+	       sizeof(CAMERA_V4L2_CAPFILE_SUFFIX));
+	return index_path;
+}
+
+// Whether entry points at a whole frame record in the recording.
+static int camera_v4l2_capfile_entry_valid(
+	const camera_v4l2_capfile_t *capfile,
+	const camera_v4l2_capfile_entry_t *entry) {
+	camera_v4l2_replay_header_t header;
+	if (entry->offset > capfile->map_length ||
+	    capfile->map_length - entry->offset < sizeof(header)) {
+		return 0;
+	}
+	memcpy(&header, capfile->map + entry->offset, sizeof(header));
+	size_t payload = ((size_t) header.length + 7) & ~(size_t) 7;
+	return header.magic == CAMERA_V4L2_REPLAY_MAGIC &&
+		!(header.flags & CAMERA_V4L2_REPLAY_FILLER) &&
+		header.length == entry->length &&
+		header.sequence == entry->sequence &&
+		header.timestamp_ns == entry->timestamp_ns &&
+		capfile->map_length - entry->offset - sizeof(header) >= payload;
+}
+
+// How many leading entries of the index can be trusted. The index is
+// written after the frames it points at, so only its end can be torn or
+// ahead of the recording: each entry's record has to end within the
+// recording and before the next entry, and the last one trusted has to
+// match its record.
+static size_t camera_v4l2_capfile_trusted(const camera_v4l2_capfile_t *capfile,
+					  const camera_v4l2_capfile_entry_t *entries,
+					  size_t count) {
+	size_t trusted = 0;
+	while (trusted < count) {
+		const camera_v4l2_capfile_entry_t *entry = &entries[trusted];
+		size_t record = sizeof(camera_v4l2_replay_header_t) +
+			(((size_t) entry->length + 7) & ~(size_t) 7);
+		if (entry->offset > capfile->map_length ||
+		    capfile->map_length - entry->offset < record ||
+		    (trusted + 1 < count &&
+		     entries[trusted + 1].offset < entry->offset + record)) {
+			break;
+		}
+		trusted++;
+	}
+	while (trusted > 0 &&
+	       !camera_v4l2_capfile_entry_valid(capfile, &entries[trusted - 1])) {
+		trusted--;
+	}
+	return trusted;
+}
+
+// Collects the frame records from offset on into the owned entries, up
+// to the end of the recording or the first torn record.
+static int camera_v4l2_capfile_scan(camera_v4l2_capfile_t *capfile,
+				    size_t offset, size_t *capacity) {
+	camera_v4l2_replay_header_t header;
+	while (capfile->map_length - offset >= sizeof(header)) {
+		memcpy(&header, capfile->map + offset, sizeof(header));
+		size_t payload = ((size_t) header.length + 7) & ~(size_t) 7;
+		if (header.magic != CAMERA_V4L2_REPLAY_MAGIC ||
+		    capfile->map_length - offset - sizeof(header) < payload) {
+			break;
+		}
+
+		if (!(header.flags & CAMERA_V4L2_REPLAY_FILLER)) {
+			if (capfile->count == *capacity) {
+				size_t grown = *capacity > 0 ? *capacity * 2 : 1024;
+				camera_v4l2_capfile_entry_t *owned =
+					(camera_v4l2_capfile_entry_t *) realloc(
+						capfile->owned, grown * sizeof(*owned));
+				if (owned == NULL) {
+					errno = ENOMEM;
+					return 0;
+				}
+				capfile->owned = owned;
+				*capacity = grown;
+			}
+			camera_v4l2_capfile_entry_t *entry =
+				&capfile->owned[capfile->count++];
+			entry->offset = offset;
+			entry->timestamp_ns = header.timestamp_ns;
+			entry->length = header.length;
+			entry->sequence = header.sequence;
+		}
+		offset += sizeof(header) + payload;
+	}
+	return 1;
+}
+
+static int camera_v4l2_capfile_load(camera_v4l2_capfile_t *capfile,
+				    const char *path) {
+	const camera_v4l2_capfile_entry_t *entries = NULL;
+	size_t count = 0;
+
+	char *index_path = camera_v4l2_capfile_index_path(path);
+	if (index_path == NULL) return 0;
+	if (camera_v4l2_capfile_map(index_path, &capfile->index_map,
+				    &capfile->index_map_length)) {
+		camera_v4l2_capfile_header_t header;
+		if (capfile->index_map_length >= sizeof(header)) {
+			memcpy(&header, capfile->index_map, sizeof(header));
+		}
+		if (capfile->index_map_length >= sizeof(header) &&
+		    header.magic == CAMERA_V4L2_CAPFILE_MAGIC &&
+		    header.version == CAMERA_V4L2_CAPFILE_VERSION &&
+		    header.entry_size == sizeof(camera_v4l2_capfile_entry_t)) {
+			entries = (const camera_v4l2_capfile_entry_t *)
+				(capfile->index_map + sizeof(header));
+			count = (capfile->index_map_length - sizeof(header)) /
+				sizeof(camera_v4l2_capfile_entry_t);
+			count = camera_v4l2_capfile_trusted(capfile, entries, count);
+		} else {
+			CAMERA_V4L2_LOG_WARN("Ignoring bad index %s", index_path);
+		}
+	}
+	free(index_path);
+
+	// Frames written after the index was last flushed.
+	size_t offset = 0;
+	if (count > 0) {
+		const camera_v4l2_capfile_entry_t *last = &entries[count - 1];
+		offset = last->offset + sizeof(camera_v4l2_replay_header_t) +
+			(((size_t) last->length + 7) & ~(size_t) 7);
+	}
+	size_t capacity = 0;
+	if (!camera_v4l2_capfile_scan(capfile, offset, &capacity)) return 0;
+	if (capfile->count == 0) {
+		// The index covers it all, use it in place.
+		capfile->entries = entries;
+		capfile->count = count;
+		return 1;
+	}
+
+	size_t scanned = capfile->count;
+	if (count > 0) {
+		camera_v4l2_capfile_entry_t *owned = (camera_v4l2_capfile_entry_t *)
+			malloc((count + scanned) * sizeof(*owned));
+		if (owned == NULL) {
+			errno = ENOMEM;
+			return 0;
+		}
+		memcpy(owned, entries, count * sizeof(*owned));
+		memcpy(owned + count, capfile->owned, scanned * sizeof(*owned));
+		free(capfile->owned);
+		capfile->owned = owned;
+	}
+	capfile->entries = capfile->owned;
+	capfile->count = count + scanned;
+	return 1;
+}
+
+camera_v4l2_capfile_t *camera_v4l2_capfile_open(const char *path) {
+	CAMERA_V4L2_ASSERT(path != NULL, "Path is null!!!");
+
+	camera_v4l2_capfile_t *capfile =
+		(camera_v4l2_capfile_t *) calloc(1, sizeof(camera_v4l2_capfile_t));
+	if (capfile == NULL) return NULL;
+
+	if (!camera_v4l2_capfile_map(path, &capfile->map, &capfile->map_length)) {
+		CAMERA_V4L2_LOG_ERROR("Cannot map %s: %s", path, strerror(errno));
+		free(capfile);
+		return NULL;
+	}
+	if (!camera_v4l2_capfile_load(capfile, path)) {
+		CAMERA_V4L2_LOG_ERROR("Cannot index %s: %s", path, strerror(errno));
+		camera_v4l2_capfile_close(capfile);
+		return NULL;
+	}
+
+	return capfile;
+}
+
+void camera_v4l2_capfile_close(camera_v4l2_capfile_t *capfile) {
+	if (capfile == NULL) return;
+
+	if (capfile->map != NULL) {
+		munmap((void *) capfile->map, capfile->map_length);
+	}
+	if (capfile->index_map != NULL) {
+		munmap((void *) capfile->index_map, capfile->index_map_length);
+	}
+	free(capfile->owned);
+	free(capfile);
+}
+
+size_t camera_v4l2_capfile_count(camera_v4l2_capfile_t *capfile) {
+	CAMERA_V4L2_ASSERT(capfile != NULL, "Object is null!!!");
+	return capfile->count;
+}
+
+int camera_v4l2_capfile_frame(camera_v4l2_capfile_t *capfile, size_t index,
+			      camera_v4l2_capfile_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(capfile != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	if (index >= capfile->count) {
+		errno = ERANGE;
+		return 0;
+	}
+
+	const camera_v4l2_capfile_entry_t *entry = &capfile->entries[index];
+	frame->data = capfile->map + entry->offset +
+		sizeof(camera_v4l2_replay_header_t);
+	frame->length = entry->length;
+	frame->sequence = entry->sequence;
+	frame->timestamp_ns = entry->timestamp_ns;
+	return 1;
+}
+
+size_t camera_v4l2_capfile_seek(camera_v4l2_capfile_t *capfile,
+				uint64_t timestamp_ns) {
+	CAMERA_V4L2_ASSERT(capfile != NULL, "Object is null!!!");
+
+	size_t low = 0;
+	size_t high = capfile->count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (capfile->entries[middle].timestamp_ns < timestamp_ns) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+static int camera_v4l2_capfile_next(void *user, const void **data,
+				    size_t *length, uint64_t *timestamp_ns,
+				    uint32_t *sequence) {
+	camera_v4l2_capfile_t *capfile = (camera_v4l2_capfile_t *) user;
+
+	camera_v4l2_capfile_frame_t frame;
+	if (!camera_v4l2_capfile_frame(capfile, capfile->cursor, &frame)) {
+		return 0;
+	}
+	capfile->cursor++;
+
+	*data = frame.data;
+	*length = frame.length;
+	*timestamp_ns = frame.timestamp_ns;
+	*sequence = frame.sequence;
+	return 1;
+}
+
+static int camera_v4l2_capfile_rewind(void *user) {
+	camera_v4l2_capfile_t *capfile = (camera_v4l2_capfile_t *) user;
+	capfile->cursor = capfile->first;
+	return 1;
+}
+
+void camera_v4l2_capfile_source(camera_v4l2_capfile_t *capfile, size_t first,
+				camera_v4l2_replay_source_t *source) {
+	CAMERA_V4L2_ASSERT(capfile != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(source != NULL, "Source is null!!!");
+
+	capfile->first = first;
+	capfile->cursor = first;
+	source->next = camera_v4l2_capfile_next;
+	source->rewind = camera_v4l2_capfile_rewind;
+	source->user = capfile;
+}
+
+int camera_v4l2_capfile_reindex(const char *path) {
+	CAMERA_V4L2_ASSERT(path != NULL, "Path is null!!!");
+
+	camera_v4l2_capfile_t *capfile = camera_v4l2_capfile_open(path);
+	if (capfile == NULL) return 0;
+
+	// Written aside and renamed over, readers never see half an index.
+	char *index_path = camera_v4l2_capfile_index_path(path);
+	size_t length = index_path != NULL ? strlen(index_path) : 0;
+	char *temp_path = (char *) malloc(length + sizeof(".tmp"));
+	if (index_path == NULL || temp_path == NULL) {
+		free(index_path);
+		free(temp_path);
+		camera_v4l2_capfile_close(capfile);
+		errno = ENOMEM;
+		return 0;
+	}
+	memcpy(temp_path, index_path, length);
+	memcpy(temp_path + length, ".tmp", sizeof(".tmp"));
+
+	camera_v4l2_capfile_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CAMERA_V4L2_CAPFILE_MAGIC;
+	header.version = CAMERA_V4L2_CAPFILE_VERSION;
+	header.entry_size = sizeof(camera_v4l2_capfile_entry_t);
+
+	int ok = 0;
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		size_t size = capfile->count * sizeof(camera_v4l2_capfile_entry_t);
+		ok = write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+			(size == 0 ||
+			 write(fd, capfile->entries, size) == (ssize_t) size) &&
+			fdatasync(fd) == 0;
+		if (close(fd) < 0) ok = 0;
+		if (ok && rename(temp_path, index_path) < 0) ok = 0;
+		if (!ok) unlink(temp_path);
+	}
+	if (!ok) {
+		CAMERA_V4L2_LOG_ERROR("Cannot write %s: %s", index_path,
+				      strerror(errno));
+	}
+
+	free(index_path);
+	free(temp_path);
+	camera_v4l2_capfile_close(capfile);
+	return ok;
+}
+
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_LOG_WARN
+#undef CAMERA_V4L2_ASSERT
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_CAPFILE_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
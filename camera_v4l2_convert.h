@@ -0,0 +1,604 @@
+#ifndef CAMERA_V4L2_CONVERT_H_
+#define CAMERA_V4L2_CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+enum camera_v4l2_pixel_layout {
+	CAMERA_V4L2_LAYOUT_BGR = 0,
+	CAMERA_V4L2_LAYOUT_RGB,
+	CAMERA_V4L2_LAYOUT_BGRA,
+	CAMERA_V4L2_LAYOUT_RGBA,
+};
+typedef enum camera_v4l2_pixel_layout camera_v4l2_pixel_layout_t;
+
+enum camera_v4l2_color_matrix {
+	CAMERA_V4L2_BT601 = 0,
+	CAMERA_V4L2_BT709,
+};
+typedef enum camera_v4l2_color_matrix camera_v4l2_color_matrix_t;
+
+enum camera_v4l2_color_range {
+	CAMERA_V4L2_RANGE_LIMITED = 0,  // Y 16..235, what UVC cameras send
+	CAMERA_V4L2_RANGE_FULL,
+};
+typedef enum camera_v4l2_color_range camera_v4l2_color_range_t;
+
+enum camera_v4l2_isa {
+	CAMERA_V4L2_ISA_SCALAR = 0,
+	CAMERA_V4L2_ISA_SSE2,
+	CAMERA_V4L2_ISA_SSSE3,
+	CAMERA_V4L2_ISA_AVX2,
+	CAMERA_V4L2_ISA_AVX512,
+};
+typedef enum camera_v4l2_isa camera_v4l2_isa_t;
+
+// Converts a YUYV (4:2:2) image into the caller's packed BGR/RGB(A)
+// buffer. Strides are in bytes, width must be even. Every kernel gives
+// bit-identical output to the scalar one. Alpha is written as 255.
+int camera_v4l2_yuyv_convert(const void *src, size_t src_stride,
+			     void *dst, size_t dst_stride,
+			     int width, int height,
+			     camera_v4l2_pixel_layout_t layout,
+			     camera_v4l2_color_matrix_t matrix,
+			     camera_v4l2_color_range_t range);
+// The kernel picked from cpuid on first use.
+camera_v4l2_isa_t camera_v4l2_convert_isa();
+// Forces a kernel, mostly for benchmarks. Fails if the CPU lacks it.
+int camera_v4l2_convert_set_isa(camera_v4l2_isa_t isa);
+int camera_v4l2_convert_isa_supported(camera_v4l2_isa_t isa);
+const char *camera_v4l2_isa_name(camera_v4l2_isa_t isa);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_CONVERT_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_CONVERT_IMPLEMENTATION_
+#define CAMERA_V4L2_CONVERT_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CAMERA_V4L2_CONVERT_X86 (1)
+#include <immintrin.h>
+#endif
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+// Fixed point Q13 coefficients. Chosen so the products fit the 16 bit
+// pairs of pmaddwd, which keeps the SIMD kernels exact.
+#define CAMERA_V4L2_CONVERT_SHIFT (13)
+#define CAMERA_V4L2_CONVERT_ROUND (1 << (CAMERA_V4L2_CONVERT_SHIFT - 1))
+
+struct camera_v4l2_yuv_coeffs {
+	int16_t y;
+	int16_t rv;
+	int16_t gu;
+	int16_t gv;
+	int16_t bu;
+	int16_t y_offset;
+};
+
+static const struct camera_v4l2_yuv_coeffs camera_v4l2_yuv_coeffs_table[2][2] = {
+	// BT.601 limited, full
+	{ { 9539, 13075, -3209, -6660, 16525, 16 },
+	  { 8192, 11485, -2819, -5850, 14516, 0 } },
+	// BT.709 limited, full
+	{ { 9539, 14686, -1747, -4366, 17305, 16 },
+	  { 8192, 12901, -1535, -3835, 15201, 0 } },
+};
+
+typedef void (*camera_v4l2_yuyv_row_fn)(const uint8_t *src, uint8_t *dst,
+					int width,
+					const struct camera_v4l2_yuv_coeffs *c,
+					int layout);
+
+static inline uint8_t camera_v4l2_clamp_u8(int value) {
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int camera_v4l2_layout_channels(int layout) {
+	return layout == CAMERA_V4L2_LAYOUT_BGR ||
+		layout == CAMERA_V4L2_LAYOUT_RGB ? 3 : 4;
+}
+
+static inline int camera_v4l2_layout_is_rgb(int layout) {
+	return layout == CAMERA_V4L2_LAYOUT_RGB ||
+		layout == CAMERA_V4L2_LAYOUT_RGBA;
+}
+
+// The reference every other kernel must match. Handles pairs of pixels
+// starting at src/dst, so SIMD kernels use it for their tails.
+static void camera_v4l2_yuyv_row_scalar(const uint8_t *src, uint8_t *dst,
+					int width,
+					const struct camera_v4l2_yuv_coeffs *c,
+					int layout) {
+	int channels = camera_v4l2_layout_channels(layout);
+	int r_at = camera_v4l2_layout_is_rgb(layout) ? 0 : 2;
+	int b_at = 2 - r_at;
+
+	for (int x = 0; x < width; x += 2) {
+		int u = src[1] - 128;
+		int v = src[3] - 128;
+		for (int i = 0; i < 2; i++) {
+			int y = c->y * (src[i * 2] - c->y_offset) +
+				CAMERA_V4L2_CONVERT_ROUND;
+			dst[r_at] = camera_v4l2_clamp_u8(
+				(y + c->rv * v) >> CAMERA_V4L2_CONVERT_SHIFT);
+			dst[1] = camera_v4l2_clamp_u8(
+				(y + c->gu * u + c->gv * v) >>
+				CAMERA_V4L2_CONVERT_SHIFT);
+			dst[b_at] = camera_v4l2_clamp_u8(
+				(y + c->bu * u) >> CAMERA_V4L2_CONVERT_SHIFT);
+			if (channels == 4) dst[3] = 255;
+			dst += channels;
+		}
+		src += 4;
+	}
+}
+
+#ifdef CAMERA_V4L2_CONVERT_X86
+
+// Splits 4 pixels of unpacked, offset YUYV words into the (Y, U), (Y, V)
+// and (V, 1) pairs that one pmaddwd per channel turns into R, G and B.
+#define CAMERA_V4L2_YUYV_CHANNELS_SSE2(h, r, g, b) \
+do { \
+	__m128i yu = _mm_shufflehi_epi16( \
+		_mm_shufflelo_epi16(h, _MM_SHUFFLE(1, 2, 1, 0)), \
+		_MM_SHUFFLE(1, 2, 1, 0)); \
+	__m128i yv = _mm_shufflehi_epi16( \
+		_mm_shufflelo_epi16(h, _MM_SHUFFLE(3, 2, 3, 0)), \
+		_MM_SHUFFLE(3, 2, 3, 0)); \
+	__m128i v1 = _mm_or_si128(_mm_srli_epi32(yv, 16), one_hi); \
+	r = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv, k_rv), round), \
+			   CAMERA_V4L2_CONVERT_SHIFT); \
+	g = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu, k_gu), \
+					 _mm_madd_epi16(v1, k_gv)), \
+			   CAMERA_V4L2_CONVERT_SHIFT); \
+	b = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu, k_bu), round), \
+			   CAMERA_V4L2_CONVERT_SHIFT); \
+} while (0)
+
+static inline int32_t camera_v4l2_pair16(int16_t lo, int16_t hi) {
+	return (int32_t) ((uint32_t) (uint16_t) lo |
+			  ((uint32_t) (uint16_t) hi << 16));
+}
+
+// 4 pixels of BGRA to 12 bytes of BGR.
+__attribute__((target("ssse3")))
+static inline void camera_v4l2_store_bgr4_ssse3(uint8_t *dst, __m128i bgra) {
+	const __m128i drop_alpha = _mm_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m128i bgr = _mm_shuffle_epi8(bgra, drop_alpha);
+	_mm_storel_epi64((__m128i *) dst, bgr);
+	int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(bgr, 8));
+	memcpy(dst + 8, &tail, 4);
+}
+
+// Interleaves 8 pixels of 16 bit R, G, B into 2 x 4 pixels of BGRA.
+#define CAMERA_V4L2_PACK_BGRA_SSE2(r16, g16, b16, lo, hi) \
+do { \
+	__m128i r8 = _mm_packus_epi16(r16, r16); \
+	__m128i g8 = _mm_packus_epi16(g16, g16); \
+	__m128i b8 = _mm_packus_epi16(b16, b16); \
+	if (rgb) { \
+		__m128i t = r8; r8 = b8; b8 = t; \
+	} \
+	__m128i bg = _mm_unpacklo_epi8(b8, g8); \
+	__m128i ra = _mm_unpacklo_epi8(r8, alpha); \
+	lo = _mm_unpacklo_epi16(bg, ra); \
+	hi = _mm_unpackhi_epi16(bg, ra); \
+} while (0)
+
+#define CAMERA_V4L2_CONVERT_CONSTANTS_SSE2 \
+	const __m128i zero = _mm_setzero_si128(); \
+	const __m128i alpha = _mm_set1_epi8((char) 0xFF); \
+	const __m128i offset = _mm_set1_epi32( \
+		camera_v4l2_pair16(c->y_offset, 128)); \
+	const __m128i one_hi = _mm_set1_epi32(1 << 16); \
+	const __m128i round = _mm_set1_epi32(CAMERA_V4L2_CONVERT_ROUND); \
+	const __m128i k_rv = _mm_set1_epi32(camera_v4l2_pair16(c->y, c->rv)); \
+	const __m128i k_gu = _mm_set1_epi32(camera_v4l2_pair16(c->y, c->gu)); \
+	const __m128i k_gv = _mm_set1_epi32( \
+		camera_v4l2_pair16(c->gv, CAMERA_V4L2_CONVERT_ROUND)); \
+	const __m128i k_bu = _mm_set1_epi32(camera_v4l2_pair16(c->y, c->bu)); \
+	int channels = camera_v4l2_layout_channels(layout); \
+	int rgb = camera_v4l2_layout_is_rgb(layout);
+
+// 8 pixels of YUYV into 16 bit R, G, B.
+#define CAMERA_V4L2_CONVERT8_SSE2(src, r16, g16, b16) \
+do { \
+	__m128i in = _mm_loadu_si128((const __m128i *) (src)); \
+	__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(in, zero), offset); \
+	__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(in, zero), offset); \
+	__m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi; \
+	CAMERA_V4L2_YUYV_CHANNELS_SSE2(lo, r_lo, g_lo, b_lo); \
+	CAMERA_V4L2_YUYV_CHANNELS_SSE2(hi, r_hi, g_hi, b_hi); \
+	r16 = _mm_packs_epi32(r_lo, r_hi); \
+	g16 = _mm_packs_epi32(g_lo, g_hi); \
+	b16 = _mm_packs_epi32(b_lo, b_hi); \
+} while (0)
+
+__attribute__((target("sse2")))
+static void camera_v4l2_yuyv_row_sse2(const uint8_t *src, uint8_t *dst,
+				      int width,
+				      const struct camera_v4l2_yuv_coeffs *c,
+				      int layout) {
+	CAMERA_V4L2_CONVERT_CONSTANTS_SSE2
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i r16, g16, b16, lo, hi;
+		CAMERA_V4L2_CONVERT8_SSE2(src, r16, g16, b16);
+		CAMERA_V4L2_PACK_BGRA_SSE2(r16, g16, b16, lo, hi);
+		if (channels == 4) {
+			_mm_storeu_si128((__m128i *) dst, lo);
+			_mm_storeu_si128((__m128i *) (dst + 16), hi);
+		} else {
+			uint8_t bgra[32];
+			_mm_storeu_si128((__m128i *) bgra, lo);
+			_mm_storeu_si128((__m128i *) (bgra + 16), hi);
+			for (int i = 0; i < 8; i++) {
+				memcpy(dst + i * 3, bgra + i * 4, 3);
+			}
+		}
+		src += 16;
+		dst += 8 * channels;
+	}
+
+	camera_v4l2_yuyv_row_scalar(src, dst, width - x, c, layout);
+}
+
+__attribute__((target("ssse3")))
+static void camera_v4l2_yuyv_row_ssse3(const uint8_t *src, uint8_t *dst,
+				       int width,
+				       const struct camera_v4l2_yuv_coeffs *c,
+				       int layout) {
+	CAMERA_V4L2_CONVERT_CONSTANTS_SSE2
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i r16, g16, b16, lo, hi;
+		CAMERA_V4L2_CONVERT8_SSE2(src, r16, g16, b16);
+		CAMERA_V4L2_PACK_BGRA_SSE2(r16, g16, b16, lo, hi);
+		if (channels == 4) {
+			_mm_storeu_si128((__m128i *) dst, lo);
+			_mm_storeu_si128((__m128i *) (dst + 16), hi);
+		} else {
+			camera_v4l2_store_bgr4_ssse3(dst, lo);
+			camera_v4l2_store_bgr4_ssse3(dst + 12, hi);
+		}
+		src += 16;
+		dst += 8 * channels;
+	}
+
+	camera_v4l2_yuyv_row_scalar(src, dst, width - x, c, layout);
+}
+
+__attribute__((target("avx2")))
+static void camera_v4l2_yuyv_row_avx2(const uint8_t *src, uint8_t *dst,
+				      int width,
+				      const struct camera_v4l2_yuv_coeffs *c,
+				      int layout) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha = _mm256_set1_epi8((char) 0xFF);
+	const __m256i offset = _mm256_set1_epi32(
+		camera_v4l2_pair16(c->y_offset, 128));
+	const __m256i one_hi = _mm256_set1_epi32(1 << 16);
+	const __m256i round = _mm256_set1_epi32(CAMERA_V4L2_CONVERT_ROUND);
+	const __m256i k_rv = _mm256_set1_epi32(camera_v4l2_pair16(c->y, c->rv));
+	const __m256i k_gu = _mm256_set1_epi32(camera_v4l2_pair16(c->y, c->gu));
+	const __m256i k_gv = _mm256_set1_epi32(
+		camera_v4l2_pair16(c->gv, CAMERA_V4L2_CONVERT_ROUND));
+	const __m256i k_bu = _mm256_set1_epi32(camera_v4l2_pair16(c->y, c->bu));
+	int channels = camera_v4l2_layout_channels(layout);
+	int rgb = camera_v4l2_layout_is_rgb(layout);
+	int x = 0;
+
+	// 16 pixels per step. Lane 0 holds pixels 0-7 and lane 1 pixels
+	// 8-15 all the way through, since every op works within lanes.
+	for (; x + 16 <= width; x += 16) {
+		__m256i in = _mm256_loadu_si256((const __m256i *) src);
+		__m256i halves[2] = {
+			_mm256_sub_epi16(_mm256_unpacklo_epi8(in, zero), offset),
+			_mm256_sub_epi16(_mm256_unpackhi_epi8(in, zero), offset),
+		};
+		__m256i r[2], g[2], b[2];
+		for (int i = 0; i < 2; i++) {
+			__m256i h = halves[i];
+			__m256i yu = _mm256_shufflehi_epi16(
+				_mm256_shufflelo_epi16(h, _MM_SHUFFLE(1, 2, 1, 0)),
+				_MM_SHUFFLE(1, 2, 1, 0));
+			__m256i yv = _mm256_shufflehi_epi16(
+				_mm256_shufflelo_epi16(h, _MM_SHUFFLE(3, 2, 3, 0)),
+				_MM_SHUFFLE(3, 2, 3, 0));
+			__m256i v1 = _mm256_or_si256(_mm256_srli_epi32(yv, 16),
+						     one_hi);
+			r[i] = _mm256_srai_epi32(
+				_mm256_add_epi32(_mm256_madd_epi16(yv, k_rv), round),
+				CAMERA_V4L2_CONVERT_SHIFT);
+			g[i] = _mm256_srai_epi32(
+				_mm256_add_epi32(_mm256_madd_epi16(yu, k_gu),
+						 _mm256_madd_epi16(v1, k_gv)),
+				CAMERA_V4L2_CONVERT_SHIFT);
+			b[i] = _mm256_srai_epi32(
+				_mm256_add_epi32(_mm256_madd_epi16(yu, k_bu), round),
+				CAMERA_V4L2_CONVERT_SHIFT);
+		}
+		__m256i r16 = _mm256_packs_epi32(r[0], r[1]);
+		__m256i g16 = _mm256_packs_epi32(g[0], g[1]);
+		__m256i b16 = _mm256_packs_epi32(b[0], b[1]);
+		__m256i r8 = _mm256_packus_epi16(r16, r16);
+		__m256i g8 = _mm256_packus_epi16(g16, g16);
+		__m256i b8 = _mm256_packus_epi16(b16, b16);
+		if (rgb) {
+			__m256i t = r8; r8 = b8; b8 = t;
+		}
+		__m256i bg = _mm256_unpacklo_epi8(b8, g8);
+		__m256i ra = _mm256_unpacklo_epi8(r8, alpha);
+		__m256i lo = _mm256_unpacklo_epi16(bg, ra);  // 0-3 | 8-11
+		__m256i hi = _mm256_unpackhi_epi16(bg, ra);  // 4-7 | 12-15
+		if (channels == 4) {
+			_mm256_storeu_si256((__m256i *) dst,
+					    _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i *) (dst + 32),
+					    _mm256_permute2x128_si256(lo, hi, 0x31));
+		} else {
+			camera_v4l2_store_bgr4_ssse3(dst, _mm256_castsi256_si128(lo));
+			camera_v4l2_store_bgr4_ssse3(dst + 12, _mm256_castsi256_si128(hi));
+			camera_v4l2_store_bgr4_ssse3(dst + 24, _mm256_extracti128_si256(lo, 1));
+			camera_v4l2_store_bgr4_ssse3(dst + 36, _mm256_extracti128_si256(hi, 1));
+		}
+		src += 32;
+		dst += 16 * channels;
+	}
+
+	camera_v4l2_yuyv_row_scalar(src, dst, width - x, c, layout);
+}
+
+// GCC flags the _mm512_undefined_* placeholders inside its own
+// intrinsics as maybe-uninitialized at -O3.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+__attribute__((target("avx512f,avx512bw")))
+static void camera_v4l2_yuyv_row_avx512(const uint8_t *src, uint8_t *dst,
+					int width,
+					const struct camera_v4l2_yuv_coeffs *c,
+					int layout) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i alpha = _mm512_set1_epi8((char) 0xFF);
+	const __m512i offset = _mm512_set1_epi32(
+		camera_v4l2_pair16(c->y_offset, 128));
+	const __m512i one_hi = _mm512_set1_epi32(1 << 16);
+	const __m512i round = _mm512_set1_epi32(CAMERA_V4L2_CONVERT_ROUND);
+	const __m512i k_rv = _mm512_set1_epi32(camera_v4l2_pair16(c->y, c->rv));
+	const __m512i k_gu = _mm512_set1_epi32(camera_v4l2_pair16(c->y, c->gu));
+	const __m512i k_gv = _mm512_set1_epi32(
+		camera_v4l2_pair16(c->gv, CAMERA_V4L2_CONVERT_ROUND));
+	const __m512i k_bu = _mm512_set1_epi32(camera_v4l2_pair16(c->y, c->bu));
+	int channels = camera_v4l2_layout_channels(layout);
+	int rgb = camera_v4l2_layout_is_rgb(layout);
+	int x = 0;
+
+	// 32 pixels per step, lane k holds pixels 8k to 8k+7.
+	for (; x + 32 <= width; x += 32) {
+		__m512i in = _mm512_loadu_si512((const void *) src);
+		__m512i halves[2] = {
+			_mm512_sub_epi16(_mm512_unpacklo_epi8(in, zero), offset),
+			_mm512_sub_epi16(_mm512_unpackhi_epi8(in, zero), offset),
+		};
+		__m512i r[2], g[2], b[2];
+		for (int i = 0; i < 2; i++) {
+			__m512i h = halves[i];
+			__m512i yu = _mm512_shufflehi_epi16(
+				_mm512_shufflelo_epi16(h, _MM_SHUFFLE(1, 2, 1, 0)),
+				_MM_SHUFFLE(1, 2, 1, 0));
+			__m512i yv = _mm512_shufflehi_epi16(
+				_mm512_shufflelo_epi16(h, _MM_SHUFFLE(3, 2, 3, 0)),
+				_MM_SHUFFLE(3, 2, 3, 0));
+			__m512i v1 = _mm512_or_si512(_mm512_srli_epi32(yv, 16),
+						     one_hi);
+			r[i] = _mm512_srai_epi32(
+				_mm512_add_epi32(_mm512_madd_epi16(yv, k_rv), round),
+				CAMERA_V4L2_CONVERT_SHIFT);
+			g[i] = _mm512_srai_epi32(
+				_mm512_add_epi32(_mm512_madd_epi16(yu, k_gu),
+						 _mm512_madd_epi16(v1, k_gv)),
+				CAMERA_V4L2_CONVERT_SHIFT);
+			b[i] = _mm512_srai_epi32(
+				_mm512_add_epi32(_mm512_madd_epi16(yu, k_bu), round),
+				CAMERA_V4L2_CONVERT_SHIFT);
+		}
+		__m512i r16 = _mm512_packs_epi32(r[0], r[1]);
+		__m512i g16 = _mm512_packs_epi32(g[0], g[1]);
+		__m512i b16 = _mm512_packs_epi32(b[0], b[1]);
+		__m512i r8 = _mm512_packus_epi16(r16, r16);
+		__m512i g8 = _mm512_packus_epi16(g16, g16);
+		__m512i b8 = _mm512_packus_epi16(b16, b16);
+		if (rgb) {
+			__m512i t = r8; r8 = b8; b8 = t;
+		}
+		__m512i bg = _mm512_unpacklo_epi8(b8, g8);
+		__m512i ra = _mm512_unpacklo_epi8(r8, alpha);
+		__m512i lo = _mm512_unpacklo_epi16(bg, ra);
+		__m512i hi = _mm512_unpackhi_epi16(bg, ra);
+		__m128i quads[8] = {
+			_mm512_extracti32x4_epi32(lo, 0), _mm512_extracti32x4_epi32(hi, 0),
+			_mm512_extracti32x4_epi32(lo, 1), _mm512_extracti32x4_epi32(hi, 1),
+			_mm512_extracti32x4_epi32(lo, 2), _mm512_extracti32x4_epi32(hi, 2),
+			_mm512_extracti32x4_epi32(lo, 3), _mm512_extracti32x4_epi32(hi, 3),
+		};
+		for (int i = 0; i < 8; i++) {
+			if (channels == 4) {
+				_mm_storeu_si128((__m128i *) (dst + i * 16), quads[i]);
+			} else {
+				camera_v4l2_store_bgr4_ssse3(dst + i * 12, quads[i]);
+			}
+		}
+		src += 64;
+		dst += 32 * channels;
+	}
+
+	camera_v4l2_yuyv_row_avx2(src, dst, width - x, c, layout);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif  // CAMERA_V4L2_CONVERT_X86
+
+static camera_v4l2_isa_t camera_v4l2_selected_isa = CAMERA_V4L2_ISA_SCALAR;
+static int camera_v4l2_isa_selected = 0;
+
+int camera_v4l2_convert_isa_supported(camera_v4l2_isa_t isa) {
+	switch (isa) {
+		case CAMERA_V4L2_ISA_SCALAR: {
+			return 1;
+		}
+#ifdef CAMERA_V4L2_CONVERT_X86
+		case CAMERA_V4L2_ISA_SSE2: {
+			return __builtin_cpu_supports("sse2");
+		}
+		case CAMERA_V4L2_ISA_SSSE3: {
+			return __builtin_cpu_supports("ssse3");
+		}
+		case CAMERA_V4L2_ISA_AVX2: {
+			return __builtin_cpu_supports("avx2");
+		}
+		case CAMERA_V4L2_ISA_AVX512: {
+			return __builtin_cpu_supports("avx512f") &&
+				__builtin_cpu_supports("avx512bw");
+		}
+#endif
+		default: {
+			return 0;
+		}
+	}
+}
+
+camera_v4l2_isa_t camera_v4l2_convert_isa() {
+	if (__atomic_load_n(&camera_v4l2_isa_selected, __ATOMIC_ACQUIRE)) {
+		return camera_v4l2_selected_isa;
+	}
+
+	camera_v4l2_isa_t isa = CAMERA_V4L2_ISA_AVX512;
+	while (!camera_v4l2_convert_isa_supported(isa)) {
+		isa = (camera_v4l2_isa_t) (isa - 1);
+	}
+	// Racing threads all pick the same answer.
+	camera_v4l2_selected_isa = isa;
+	__atomic_store_n(&camera_v4l2_isa_selected, 1, __ATOMIC_RELEASE);
+
+	return isa;
+}
+
+int camera_v4l2_convert_set_isa(camera_v4l2_isa_t isa) {
+	if (!camera_v4l2_convert_isa_supported(isa)) {
+		CAMERA_V4L2_LOG_ERROR("%s is not supported on this CPU",
+				      camera_v4l2_isa_name(isa));
+		return 0;
+	}
+
+	camera_v4l2_selected_isa = isa;
+	__atomic_store_n(&camera_v4l2_isa_selected, 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+const char *camera_v4l2_isa_name(camera_v4l2_isa_t isa) {
+	switch (isa) {
+		case CAMERA_V4L2_ISA_SCALAR: return "scalar";
+		case CAMERA_V4L2_ISA_SSE2: return "sse2";
+		case CAMERA_V4L2_ISA_SSSE3: return "ssse3";
+		case CAMERA_V4L2_ISA_AVX2: return "avx2";
+		case CAMERA_V4L2_ISA_AVX512: return "avx512";
+	}
+	return "unknown";
+}
+
+int camera_v4l2_yuyv_convert(const void *src, size_t src_stride,
+			     void *dst, size_t dst_stride,
+			     int width, int height,
+			     camera_v4l2_pixel_layout_t layout,
+			     camera_v4l2_color_matrix_t matrix,
+			     camera_v4l2_color_range_t range) {
+	if (src == NULL || dst == NULL || width <= 0 || height <= 0 ||
+	    (width & 1) != 0 || (unsigned) matrix > CAMERA_V4L2_BT709 ||
+	    (unsigned) range > CAMERA_V4L2_RANGE_FULL ||
+	    (unsigned) layout > CAMERA_V4L2_LAYOUT_RGBA) {
+		CAMERA_V4L2_LOG_ERROR("Invalid conversion arguments");
+		return 0;
+	}
+
+	const struct camera_v4l2_yuv_coeffs *c =
+		&camera_v4l2_yuv_coeffs_table[matrix][range];
+	camera_v4l2_yuyv_row_fn row = camera_v4l2_yuyv_row_scalar;
+#ifdef CAMERA_V4L2_CONVERT_X86
+	switch (camera_v4l2_convert_isa()) {
+		case CAMERA_V4L2_ISA_SSE2: {
+			row = camera_v4l2_yuyv_row_sse2;
+			break;
+		}
+		case CAMERA_V4L2_ISA_SSSE3: {
+			row = camera_v4l2_yuyv_row_ssse3;
+			break;
+		}
+		case CAMERA_V4L2_ISA_AVX2: {
+			row = camera_v4l2_yuyv_row_avx2;
+			break;
+		}
+		case CAMERA_V4L2_ISA_AVX512: {
+			row = camera_v4l2_yuyv_row_avx512;
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+#endif
+
+	const uint8_t *in = (const uint8_t *) src;
+	uint8_t *out = (uint8_t *) dst;
+	for (int y = 0; y < height; y++) {
+		row(in, out, width, c, layout);
+		in += src_stride;
+		out += dst_stride;
+	}
+
+	return 1;
+}
+
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_CONVERT_SHIFT
+#undef CAMERA_V4L2_CONVERT_ROUND
+#ifdef CAMERA_V4L2_CONVERT_X86
+#undef CAMERA_V4L2_CONVERT_X86
+#undef CAMERA_V4L2_YUYV_CHANNELS_SSE2
+#undef CAMERA_V4L2_PACK_BGRA_SSE2
+#undef CAMERA_V4L2_CONVERT_CONSTANTS_SSE2
+#undef CAMERA_V4L2_CONVERT8_SSE2
+#endif
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_CONVERT_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
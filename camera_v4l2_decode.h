@@ -0,0 +1,1200 @@
+#ifndef CAMERA_V4L2_DECODE_H_
+#define CAMERA_V4L2_DECODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_v4l2.h"
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+enum camera_v4l2_decode_format {
+	CAMERA_V4L2_DECODE_BGR = 0,
+	CAMERA_V4L2_DECODE_RGB,
+	CAMERA_V4L2_DECODE_BGRA,
+	CAMERA_V4L2_DECODE_RGBA,
+	CAMERA_V4L2_DECODE_GRAY,
+	// Planar 4:2:0 straight from the JPEG's YCbCr planes, no RGB pass.
+	// Needs a YCbCr frame with 4:2:2, 4:2:0 or 4:4:4 sampling.
+	CAMERA_V4L2_DECODE_I420,
+	CAMERA_V4L2_DECODE_NV12,
+};
+typedef enum camera_v4l2_decode_format camera_v4l2_decode_format_t;
+
+struct camera_v4l2_image {
+	// Set by the caller. With buffer NULL the image lands in memory owned
+	// by the decoder, reused across calls and valid until the next decode
+	// at the same scale, so one frame can feed a full size and a scaled
+	// consumer.
+	camera_v4l2_decode_format_t format;
+	// 1 (or 0), 2, 4 or 8. Scales in the DCT domain, skipping most of the
+	// IDCT and color conversion instead of resizing afterwards. Odd sizes
+	// round up.
+	int scale;
+	void *buffer;
+	size_t capacity;
+	// 0 for tightly packed rows. For I420 and NV12 this is the Y stride;
+	// chroma rows use half of it (rounded up) in I420 and all of it in
+	// NV12, and the chroma planes follow the Y plane.
+	size_t stride;
+
+	// Filled in by camera_v4l2_decode.
+	void *data;
+	// Y, U, V for planar formats (NV12 V is U + 1), only [0] otherwise.
+	void *planes[3];
+	size_t plane_strides[3];
+	int width;
+	int height;
+	size_t size;  // Bytes written, or needed when failing with ENOSPC
+	uint64_t decode_ns;
+	unsigned int warnings;  // Recoverable corruption libjpeg skipped over
+};
+typedef struct camera_v4l2_image camera_v4l2_image_t;
+
+// One per camera: keeps the libjpeg state between frames so decoding
+// does not set up a decompressor or allocate for every frame. libjpeg's
+// per image memory comes from an arena the decoder keeps, so once a
+// frame of a given size and format was decoded, the next ones allocate
+// nothing. Progressive frames still allocate their coefficient buffers.
+typedef struct camera_v4l2_decoder camera_v4l2_decoder_t;
+
+camera_v4l2_decoder_t *camera_v4l2_decoder_create();
+void camera_v4l2_decoder_destroy(camera_v4l2_decoder_t *decoder);
+// Decodes one MJPEG frame, e.g. camera_v4l2_frame_t start/length. Fails
+// with errno EINVAL on undecodable data and ENOSPC when the caller's
+// buffer is smaller than image->size.
+int camera_v4l2_decode(camera_v4l2_decoder_t *decoder,
+		       const void *jpeg, size_t length,
+		       camera_v4l2_image_t *image);
+
+// What camera_v4l2_decode_pool_submit does when every slot is taken.
+enum camera_v4l2_decode_drop {
+	CAMERA_V4L2_DECODE_BLOCK = 0,  // Wait for the consumer, never drop
+	CAMERA_V4L2_DECODE_DROP_NEWEST,  // Drop the submitted frame
+	// Drop the oldest frame that is not being decoded right now, whether
+	// it is still queued or decoded but not received yet.
+	CAMERA_V4L2_DECODE_DROP_OLDEST,
+};
+typedef enum camera_v4l2_decode_drop camera_v4l2_decode_drop_t;
+
+struct camera_v4l2_decode_pool_param {
+	int workers;  // 0 for one per online CPU
+	// Frames in flight or waiting to be received, 0 for 2 x workers. The
+	// frames of one camera still being decoded are further capped one
+	// below its acquire limit, so its thread can always acquire the next
+	// frame to submit.
+	int depth;
+	camera_v4l2_decode_drop_t drop;
+	// Output of every frame, as in camera_v4l2_image_t
+	camera_v4l2_decode_format_t format;
+	int scale;
+	size_t stride;
+};
+typedef struct camera_v4l2_decode_pool_param camera_v4l2_decode_pool_param_t;
+
+struct camera_v4l2_decode_result {
+	camera_v4l2_camera_t *camera;
+	camera_v4l2_frame_meta_t meta;
+	// Pixels owned by the pool, valid until the next receive.
+	camera_v4l2_image_t image;
+	unsigned int dropped;  // By the drop policy since the previous result
+	unsigned int failed;  // Undecodable frames since the previous result
+};
+typedef struct camera_v4l2_decode_result camera_v4l2_decode_result_t;
+
+// Decodes acquired frames on worker threads and hands the results back
+// in the order they were submitted, so in capture order per camera.
+typedef struct camera_v4l2_decode_pool camera_v4l2_decode_pool_t;
+
+camera_v4l2_decode_pool_t *camera_v4l2_decode_pool_create(
+	const camera_v4l2_decode_pool_param_t *param);
+// Releases the frames still held, so destroy the pool before closing
+// its cameras, on the thread that submits.
+void camera_v4l2_decode_pool_destroy(camera_v4l2_decode_pool_t *pool);
+// Takes over a frame from camera_v4l2_acquire. Capture buffers are given
+// back to their camera by submit and reclaim once decoded or dropped,
+// since cameras are not thread safe: call both from the thread that
+// acquires. Returns 0 with errno EAGAIN when the drop policy discarded
+// this frame.
+int camera_v4l2_decode_pool_submit(camera_v4l2_decode_pool_t *pool,
+				   camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_t *frame);
+// Gives the capture buffers of decoded or dropped frames back to their
+// cameras without submitting, returns how many. Call it before acquiring
+// when frames may not arrive for a while, e.g. on EBUSY, or whenever the
+// fd polls readable.
+int camera_v4l2_decode_pool_reclaim(camera_v4l2_decode_pool_t *pool);
+// Readable (POLLIN) while reclaim has capture buffers to give back, for
+// the acquiring thread's event loop.
+int camera_v4l2_decode_pool_fd(camera_v4l2_decode_pool_t *pool);
+// The next decoded frame in submission order. Waits up to timeout_ms
+// (< 0 forever, 0 never) and returns 0 with errno EAGAIN when it is not
+// ready. May run on another thread than submit.
+int camera_v4l2_decode_pool_receive(camera_v4l2_decode_pool_t *pool,
+				    camera_v4l2_decode_result_t *result,
+				    int timeout_ms);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_DECODE_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_DECODE_IMPLEMENTATION_
+#define CAMERA_V4L2_DECODE_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#ifndef JCS_EXTENSIONS
+#error "camera_v4l2_decode.h needs the libjpeg-turbo flavour of jpeglib.h"
+#endif
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_ASSERT(cond, msg) \
+do { \
+	if (!(cond)) { \
+		fprintf(stderr, "\x1B[31m Assert failed: [%s][%d] %s \e[0m\n", __FUNCTION__, __LINE__, msg); \
+		exit(1); \
+	} \
+} while(0)
+
+// libjpeg hands out at most this many rows per read_scanlines call.
+#define CAMERA_V4L2_DECODE_ROWS (16)
+// 1, 1/2, 1/4 and 1/8
+#define CAMERA_V4L2_DECODE_SCALES (4)
+// Alignment of arena allocations and their sample rows, what
+// libjpeg-turbo's SIMD code expects of its own allocator.
+#define CAMERA_V4L2_DECODE_ALIGN (64)
+#define CAMERA_V4L2_DECODE_CHUNK (64 * 1024)
+
+#if JPEG_LIB_VERSION >= 70
+#define CAMERA_V4L2_DCT_H(comp) ((comp)->DCT_h_scaled_size)
+#define CAMERA_V4L2_DCT_V(comp) ((comp)->DCT_v_scaled_size)
+#else
+#define CAMERA_V4L2_DCT_H(comp) ((comp)->DCT_scaled_size)
+#define CAMERA_V4L2_DCT_V(comp) ((comp)->DCT_scaled_size)
+#endif
+
+struct camera_v4l2_decode_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+// Memory libjpeg's per image pool is carved from, kept across frames.
+struct camera_v4l2_decode_chunk {
+	struct camera_v4l2_decode_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+struct camera_v4l2_decoder {
+	// First, so the memory manager hooks can get back to the decoder.
+	struct jpeg_decompress_struct cinfo;
+	struct camera_v4l2_decode_error error;
+	// libjpeg's own memory manager methods. Ours serve JPOOL_IMAGE from
+	// the chunks, which are only rewound when libjpeg frees the pool.
+	struct jpeg_memory_mgr mem;
+	struct camera_v4l2_decode_chunk *chunks;
+	// Output buffers by scale
+	uint8_t *buffers[CAMERA_V4L2_DECODE_SCALES];
+	size_t buffer_sizes[CAMERA_V4L2_DECODE_SCALES];
+	// Padded raw rows for planar output
+	uint8_t *scratch;
+	size_t scratch_size;
+};
+
+// libjpeg's default error_exit calls exit().
+static void camera_v4l2_decode_error_exit(j_common_ptr cinfo) {
+	struct camera_v4l2_decode_error *error =
+		(struct camera_v4l2_decode_error *) cinfo->err;
+	longjmp(error->jump, 1);
+}
+
+// Warnings are counted in num_warnings instead of going to stderr for
+// every damaged frame.
+static void camera_v4l2_decode_output_message(j_common_ptr cinfo) {
+	(void) cinfo;
+}
+
+static size_t camera_v4l2_decode_align(size_t size) {
+	return (size + CAMERA_V4L2_DECODE_ALIGN - 1) &
+		~(size_t) (CAMERA_V4L2_DECODE_ALIGN - 1);
+}
+
+static struct camera_v4l2_decode_chunk *camera_v4l2_decode_chunk_create(
+	size_t size) {
+	void *memory = NULL;
+	size_t header = camera_v4l2_decode_align(sizeof(struct camera_v4l2_decode_chunk));
+	if (posix_memalign(&memory, CAMERA_V4L2_DECODE_ALIGN, header + size) != 0) {
+		return NULL;
+	}
+	struct camera_v4l2_decode_chunk *chunk =
+		(struct camera_v4l2_decode_chunk *) memory;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void camera_v4l2_decode_chunks_free(camera_v4l2_decoder_t *decoder) {
+	while (decoder->chunks != NULL) {
+		struct camera_v4l2_decode_chunk *next = decoder->chunks->next;
+		free(decoder->chunks);
+		decoder->chunks = next;
+	}
+}
+
+static void *camera_v4l2_decode_arena_alloc(camera_v4l2_decoder_t *decoder,
+					    size_t size) {
+	size = camera_v4l2_decode_align(size);
+	struct camera_v4l2_decode_chunk *chunk = decoder->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = camera_v4l2_decode_chunk_create(
+			size > CAMERA_V4L2_DECODE_CHUNK ? size : CAMERA_V4L2_DECODE_CHUNK);
+		if (chunk == NULL) {
+			ERREXIT1(&decoder->cinfo, JERR_OUT_OF_MEMORY, 0);
+		}
+		chunk->next = decoder->chunks;
+		decoder->chunks = chunk;
+	}
+	uint8_t *memory = (uint8_t *) chunk +
+		camera_v4l2_decode_align(sizeof(struct camera_v4l2_decode_chunk)) +
+		chunk->used;
+	chunk->used += size;
+	return memory;
+}
+
+static void *camera_v4l2_decode_alloc_small(j_common_ptr cinfo, int pool_id,
+					    size_t size) {
+	camera_v4l2_decoder_t *decoder = (camera_v4l2_decoder_t *) cinfo;
+	if (pool_id != JPOOL_IMAGE) {
+		return decoder->mem.alloc_small(cinfo, pool_id, size);
+	}
+	return camera_v4l2_decode_arena_alloc(decoder, size);
+}
+
+static void *camera_v4l2_decode_alloc_large(j_common_ptr cinfo, int pool_id,
+					    size_t size) {
+	camera_v4l2_decoder_t *decoder = (camera_v4l2_decoder_t *) cinfo;
+	if (pool_id != JPOOL_IMAGE) {
+		return decoder->mem.alloc_large(cinfo, pool_id, size);
+	}
+	return camera_v4l2_decode_arena_alloc(decoder, size);
+}
+
+static JSAMPARRAY camera_v4l2_decode_alloc_sarray(j_common_ptr cinfo,
+						  int pool_id,
+						  JDIMENSION samples,
+						  JDIMENSION rows) {
+	camera_v4l2_decoder_t *decoder = (camera_v4l2_decoder_t *) cinfo;
+	if (pool_id != JPOOL_IMAGE) {
+		return decoder->mem.alloc_sarray(cinfo, pool_id, samples, rows);
+	}
+	// Rows padded as libjpeg's allocator does, SIMD code runs past them.
+	size_t row = camera_v4l2_decode_align((size_t) samples * sizeof(JSAMPLE));
+	JSAMPARRAY array = (JSAMPARRAY) camera_v4l2_decode_arena_alloc(
+		decoder, rows * sizeof(JSAMPROW));
+	uint8_t *data = (uint8_t *) camera_v4l2_decode_arena_alloc(decoder, row * rows);
+	for (JDIMENSION i = 0; i < rows; i++) {
+		array[i] = (JSAMPROW) (data + i * row);
+	}
+	return array;
+}
+
+static JBLOCKARRAY camera_v4l2_decode_alloc_barray(j_common_ptr cinfo,
+						   int pool_id,
+						   JDIMENSION blocks,
+						   JDIMENSION rows) {
+	camera_v4l2_decoder_t *decoder = (camera_v4l2_decoder_t *) cinfo;
+	if (pool_id != JPOOL_IMAGE) {
+		return decoder->mem.alloc_barray(cinfo, pool_id, blocks, rows);
+	}
+	size_t row = camera_v4l2_decode_align((size_t) blocks * sizeof(JBLOCK));
+	JBLOCKARRAY array = (JBLOCKARRAY) camera_v4l2_decode_arena_alloc(
+		decoder, rows * sizeof(JBLOCKROW));
+	uint8_t *data = (uint8_t *) camera_v4l2_decode_arena_alloc(decoder, row * rows);
+	for (JDIMENSION i = 0; i < rows; i++) {
+		array[i] = (JBLOCKROW) (data + i * row);
+	}
+	return array;
+}
+
+// End of an image. The arena is rewound, and when the image needed
+// more than one chunk they are merged into one that fits it, so from
+// the next frame of that size on nothing is allocated.
+static void camera_v4l2_decode_free_pool(j_common_ptr cinfo, int pool_id) {
+	camera_v4l2_decoder_t *decoder = (camera_v4l2_decoder_t *) cinfo;
+	// Virtual arrays (progressive frames) still come from libjpeg.
+	decoder->mem.free_pool(cinfo, pool_id);
+	if (pool_id != JPOOL_IMAGE || decoder->chunks == NULL) return;
+
+	if (decoder->chunks->next == NULL) {
+		decoder->chunks->used = 0;
+		return;
+	}
+	size_t total = 0;
+	for (struct camera_v4l2_decode_chunk *chunk = decoder->chunks;
+	     chunk != NULL; chunk = chunk->next) {
+		total += chunk->used;
+	}
+	camera_v4l2_decode_chunks_free(decoder);
+	// On failure the next image starts from scratch.
+	decoder->chunks = camera_v4l2_decode_chunk_create(total);
+}
+
+static uint64_t camera_v4l2_decode_clock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static J_COLOR_SPACE camera_v4l2_decode_color_space(
+	camera_v4l2_decode_format_t format) {
+	switch (format) {
+		case CAMERA_V4L2_DECODE_RGB: return JCS_EXT_RGB;
+		case CAMERA_V4L2_DECODE_BGRA: return JCS_EXT_BGRA;
+		case CAMERA_V4L2_DECODE_RGBA: return JCS_EXT_RGBA;
+		case CAMERA_V4L2_DECODE_GRAY: return JCS_GRAYSCALE;
+		default: return JCS_EXT_BGR;
+	}
+}
+
+// Index of a supported scale, -1 for anything else.
+static int camera_v4l2_decode_scale_index(int scale) {
+	switch (scale) {
+		case 0:
+		case 1: return 0;
+		case 2: return 1;
+		case 4: return 2;
+		case 8: return 3;
+		default: return -1;
+	}
+}
+
+static int camera_v4l2_decode_is_planar(camera_v4l2_decode_format_t format) {
+	return format == CAMERA_V4L2_DECODE_I420 ||
+		format == CAMERA_V4L2_DECODE_NV12;
+}
+
+// Grows a decoder owned buffer, never shrinks it.
+static int camera_v4l2_decode_reserve(uint8_t **buffer_ptr,
+				      size_t *buffer_size, size_t size) {
+	if (*buffer_size >= size) return 1;
+
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, 64, size) != 0) {
+		CAMERA_V4L2_LOG_ERROR("Failed to allocate %zu bytes", size);
+		errno = ENOMEM;
+		return 0;
+	}
+	free(*buffer_ptr);
+	*buffer_ptr = (uint8_t *) buffer;
+	*buffer_size = size;
+	return 1;
+}
+
+// 1 when chroma has the luma resolution along an axis, 2 when it has
+// half of it, 0 for anything else.
+static int camera_v4l2_decode_chroma_step(int luma, int chroma) {
+	if (luma == chroma) return 1;
+	if (luma == chroma * 2) return 2;
+	return 0;
+}
+
+static int camera_v4l2_decode_raw_supported(
+	struct jpeg_decompress_struct *cinfo) {
+	jpeg_component_info *luma = &cinfo->comp_info[0];
+	jpeg_component_info *chroma = &cinfo->comp_info[1];
+	jpeg_component_info *chroma2 = &cinfo->comp_info[2];
+
+	if (cinfo->jpeg_color_space != JCS_YCbCr ||
+	    cinfo->num_components != 3) return 0;
+	if (luma->h_samp_factor != cinfo->max_h_samp_factor ||
+	    luma->v_samp_factor != cinfo->max_v_samp_factor) return 0;
+	if (chroma->h_samp_factor != chroma2->h_samp_factor ||
+	    chroma->v_samp_factor != chroma2->v_samp_factor ||
+	    CAMERA_V4L2_DCT_H(chroma) != CAMERA_V4L2_DCT_H(chroma2) ||
+	    CAMERA_V4L2_DCT_V(chroma) != CAMERA_V4L2_DCT_V(chroma2)) return 0;
+	if (luma->v_samp_factor * CAMERA_V4L2_DCT_V(luma) > CAMERA_V4L2_DECODE_ROWS ||
+	    chroma->v_samp_factor * CAMERA_V4L2_DCT_V(chroma) > CAMERA_V4L2_DECODE_ROWS) return 0;
+
+	return camera_v4l2_decode_chroma_step(
+			luma->h_samp_factor * CAMERA_V4L2_DCT_H(luma),
+			chroma->h_samp_factor * CAMERA_V4L2_DCT_H(chroma)) &&
+		camera_v4l2_decode_chroma_step(
+			luma->v_samp_factor * CAMERA_V4L2_DCT_V(luma),
+			chroma->v_samp_factor * CAMERA_V4L2_DCT_V(chroma));
+}
+
+// Sets the image size and strides and where each plane starts. Fails
+// when the requested stride cannot hold a row.
+static int camera_v4l2_decode_layout(struct jpeg_decompress_struct *cinfo,
+				     camera_v4l2_image_t *image,
+				     size_t offsets[3]) {
+	size_t width = cinfo->output_width;
+	size_t height = cinfo->output_height;
+	size_t stride = image->stride;
+
+	memset(image->plane_strides, 0, sizeof(image->plane_strides));
+	offsets[0] = offsets[1] = offsets[2] = 0;
+
+	if (!camera_v4l2_decode_is_planar(image->format)) {
+		size_t packed = width * cinfo->output_components;
+		if (stride == 0) stride = packed;
+		image->plane_strides[0] = stride;
+		image->size = stride * (height - 1) + packed;
+		return stride >= packed;
+	}
+
+	if (stride == 0) stride = width;
+	size_t chroma_height = (height + 1) / 2;
+	size_t chroma_stride = (stride + 1) / 2;
+	offsets[1] = stride * height;
+	if (image->format == CAMERA_V4L2_DECODE_NV12) {
+		chroma_stride *= 2;
+		offsets[2] = offsets[1] + 1;
+		image->size = offsets[1] + chroma_stride * chroma_height;
+	} else {
+		offsets[2] = offsets[1] + chroma_stride * chroma_height;
+		image->size = offsets[2] + chroma_stride * chroma_height;
+	}
+	image->plane_strides[0] = stride;
+	image->plane_strides[1] = chroma_stride;
+	image->plane_strides[2] = chroma_stride;
+	return stride >= width;
+}
+
+static void camera_v4l2_decode_halve_row(uint8_t *dst, const uint8_t *src,
+					 size_t src_width, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		size_t right = 2 * x + 1 < src_width ? 2 * x + 1 : 2 * x;
+		dst[x] = (src[2 * x] + src[right] + 1) >> 1;
+	}
+}
+
+static void camera_v4l2_decode_put_chroma(camera_v4l2_image_t *image,
+					  size_t row, const uint8_t *cb,
+					  const uint8_t *cr, size_t width) {
+	uint8_t *u = (uint8_t *) image->planes[1] + row * image->plane_strides[1];
+	if (image->format == CAMERA_V4L2_DECODE_NV12) {
+		for (size_t x = 0; x < width; x++) {
+			u[2 * x] = cb[x];
+			u[2 * x + 1] = cr[x];
+		}
+		return;
+	}
+	uint8_t *v = (uint8_t *) image->planes[2] + row * image->plane_strides[2];
+	memcpy(u, cb, width);
+	memcpy(v, cr, width);
+}
+
+// Reads the raw Y, Cb and Cr planes and writes them out as I420 or NV12.
+// Luma goes straight into the image when its padded rows fit the stride.
+// Full resolution chroma (vertically in 4:2:2, both ways in 4:4:4) is
+// averaged down to 4:2:0 on the way.
+static int camera_v4l2_decode_raw(camera_v4l2_decoder_t *decoder,
+				  camera_v4l2_image_t *image) {
+	struct jpeg_decompress_struct *cinfo = &decoder->cinfo;
+	jpeg_component_info *luma = &cinfo->comp_info[0];
+	jpeg_component_info *chroma = &cinfo->comp_info[1];
+	size_t height = cinfo->output_height;
+	size_t width = cinfo->output_width;
+	size_t chroma_width = (width + 1) / 2;
+	size_t chroma_height = chroma->downsampled_height;
+	int luma_rows = luma->v_samp_factor * CAMERA_V4L2_DCT_V(luma);
+	int chroma_rows = chroma->v_samp_factor * CAMERA_V4L2_DCT_V(chroma);
+	size_t luma_pad = (size_t) luma->width_in_blocks * CAMERA_V4L2_DCT_H(luma);
+	size_t chroma_pad =
+		(size_t) chroma->width_in_blocks * CAMERA_V4L2_DCT_H(chroma);
+	int hstep = camera_v4l2_decode_chroma_step(
+		luma->h_samp_factor * CAMERA_V4L2_DCT_H(luma),
+		chroma->h_samp_factor * CAMERA_V4L2_DCT_H(chroma));
+	int vstep = camera_v4l2_decode_chroma_step(
+		luma->v_samp_factor * CAMERA_V4L2_DCT_V(luma),
+		chroma->v_samp_factor * CAMERA_V4L2_DCT_V(chroma));
+
+	size_t need = luma_pad * luma_rows + 2 * chroma_pad * chroma_rows +
+		4 * chroma_width;
+	if (!camera_v4l2_decode_reserve(&decoder->scratch,
+					&decoder->scratch_size, need)) {
+		return 0;
+	}
+	uint8_t *luma_scratch = decoder->scratch;
+	uint8_t *cb_scratch = luma_scratch + luma_pad * luma_rows;
+	uint8_t *cr_scratch = cb_scratch + chroma_pad * chroma_rows;
+	uint8_t *half[2] = { cr_scratch + chroma_pad * chroma_rows,
+			     cr_scratch + chroma_pad * chroma_rows + chroma_width };
+	uint8_t *pending[2] = { half[1] + chroma_width,
+				half[1] + 2 * chroma_width };
+
+	uint8_t *y_plane = (uint8_t *) image->planes[0];
+	size_t y_stride = image->plane_strides[0];
+	int direct = y_stride >= luma_pad;
+
+	JSAMPROW y_rows[CAMERA_V4L2_DECODE_ROWS];
+	JSAMPROW cb_rows[CAMERA_V4L2_DECODE_ROWS];
+	JSAMPROW cr_rows[CAMERA_V4L2_DECODE_ROWS];
+	JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+	for (int i = 0; i < chroma_rows; i++) {
+		cb_rows[i] = cb_scratch + i * chroma_pad;
+		cr_rows[i] = cr_scratch + i * chroma_pad;
+	}
+
+	size_t chroma_row = 0;
+	while (cinfo->output_scanline < height) {
+		size_t first = cinfo->output_scanline;
+		for (int i = 0; i < luma_rows; i++) {
+			size_t row = first + i;
+			y_rows[i] = direct && row < height ?
+				y_plane + row * y_stride : luma_scratch + i * luma_pad;
+		}
+		jpeg_read_raw_data(cinfo, planes, luma_rows);
+		if (!direct) {
+			for (int i = 0; i < luma_rows && first + i < height; i++) {
+				memcpy(y_plane + (first + i) * y_stride, y_rows[i], width);
+			}
+		}
+
+		for (int i = 0; i < chroma_rows && chroma_row < chroma_height;
+		     i++, chroma_row++) {
+			const uint8_t *src[2] = { cb_rows[i], cr_rows[i] };
+			if (hstep == 1) {
+				for (int c = 0; c < 2; c++) {
+					camera_v4l2_decode_halve_row(half[c], src[c],
+								     chroma->downsampled_width,
+								     chroma_width);
+					src[c] = half[c];
+				}
+			}
+
+			size_t row = chroma_row;
+			if (vstep == 1) {
+				if ((chroma_row & 1) == 0 && chroma_row + 1 < chroma_height) {
+					memcpy(pending[0], src[0], chroma_width);
+					memcpy(pending[1], src[1], chroma_width);
+					continue;
+				}
+				if (chroma_row & 1) {
+					for (int c = 0; c < 2; c++) {
+						for (size_t x = 0; x < chroma_width; x++) {
+							pending[c][x] = (pending[c][x] + src[c][x] + 1) >> 1;
+						}
+						src[c] = pending[c];
+					}
+				}
+				row = chroma_row / 2;
+			}
+			camera_v4l2_decode_put_chroma(image, row, src[0], src[1],
+						      chroma_width);
+		}
+	}
+	return 1;
+}
+
+static int camera_v4l2_decode_init(camera_v4l2_decoder_t *decoder) {
+	decoder->cinfo.err = jpeg_std_error(&decoder->error.mgr);
+	decoder->error.mgr.error_exit = camera_v4l2_decode_error_exit;
+	decoder->error.mgr.output_message = camera_v4l2_decode_output_message;
+	if (setjmp(decoder->error.jump)) {
+		CAMERA_V4L2_LOG_ERROR("Failed to create jpeg decompressor");
+		return 0;
+	}
+	jpeg_create_decompress(&decoder->cinfo);
+
+	struct jpeg_memory_mgr *mem = decoder->cinfo.mem;
+	decoder->mem = *mem;
+	mem->alloc_small = camera_v4l2_decode_alloc_small;
+	mem->alloc_large = camera_v4l2_decode_alloc_large;
+	mem->alloc_sarray = camera_v4l2_decode_alloc_sarray;
+	mem->alloc_barray = camera_v4l2_decode_alloc_barray;
+	mem->free_pool = camera_v4l2_decode_free_pool;
+	return 1;
+}
+
+camera_v4l2_decoder_t *camera_v4l2_decoder_create() {
+	camera_v4l2_decoder_t *decoder =
+		(camera_v4l2_decoder_t *) calloc(1, sizeof(camera_v4l2_decoder_t));
+	if (decoder == NULL) return NULL;
+
+	if (!camera_v4l2_decode_init(decoder)) {
+		free(decoder);
+		return NULL;
+	}
+	return decoder;
+}
+
+void camera_v4l2_decoder_destroy(camera_v4l2_decoder_t *decoder) {
+	if (decoder == NULL) return;
+
+	jpeg_destroy_decompress(&decoder->cinfo);
+	camera_v4l2_decode_chunks_free(decoder);
+	for (int i = 0; i < CAMERA_V4L2_DECODE_SCALES; i++) {
+		free(decoder->buffers[i]);
+	}
+	free(decoder->scratch);
+	free(decoder);
+}
+
+// Runs between the setjmp in camera_v4l2_decode and libjpeg's errors.
+static int camera_v4l2_decode_frame(camera_v4l2_decoder_t *decoder,
+				    const void *jpeg, size_t length,
+				    camera_v4l2_image_t *image, int slot) {
+	struct jpeg_decompress_struct *cinfo = &decoder->cinfo;
+
+	cinfo->err->num_warnings = 0;
+	jpeg_mem_src(cinfo, (unsigned char *) jpeg, (unsigned long) length);
+	jpeg_read_header(cinfo, TRUE);
+	int planar = camera_v4l2_decode_is_planar(image->format);
+	if (planar) {
+		cinfo->out_color_space = JCS_YCbCr;
+		cinfo->raw_data_out = TRUE;
+	} else {
+		cinfo->out_color_space = camera_v4l2_decode_color_space(image->format);
+	}
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = 1u << slot;
+	jpeg_calc_output_dimensions(cinfo);
+
+	if (planar && !camera_v4l2_decode_raw_supported(cinfo)) {
+		CAMERA_V4L2_LOG_ERROR("No planar output for this frame's sampling");
+		jpeg_abort_decompress(cinfo);
+		errno = EINVAL;
+		return 0;
+	}
+
+	size_t offsets[3];
+	int fits = camera_v4l2_decode_layout(cinfo, image, offsets);
+	image->width = cinfo->output_width;
+	image->height = cinfo->output_height;
+
+	uint8_t *out = (uint8_t *) image->buffer;
+	if (!fits || (out != NULL && image->capacity < image->size)) {
+		jpeg_abort_decompress(cinfo);
+		errno = ENOSPC;
+		return 0;
+	}
+	if (out == NULL) {
+		if (!camera_v4l2_decode_reserve(&decoder->buffers[slot],
+						&decoder->buffer_sizes[slot],
+						image->size)) {
+			jpeg_abort_decompress(cinfo);
+			return 0;
+		}
+		out = decoder->buffers[slot];
+	}
+	for (int i = 0; i < 3; i++) {
+		image->planes[i] = image->plane_strides[i] ? out + offsets[i] : NULL;
+	}
+
+	jpeg_start_decompress(cinfo);
+	if (planar) {
+		if (!camera_v4l2_decode_raw(decoder, image)) {
+			jpeg_abort_decompress(cinfo);
+			return 0;
+		}
+	} else {
+		size_t stride = image->plane_strides[0];
+		while (cinfo->output_scanline < cinfo->output_height) {
+			JSAMPROW rows[CAMERA_V4L2_DECODE_ROWS];
+			JDIMENSION count = cinfo->output_height - cinfo->output_scanline;
+			if (count > CAMERA_V4L2_DECODE_ROWS) count = CAMERA_V4L2_DECODE_ROWS;
+			for (JDIMENSION i = 0; i < count; i++) {
+				rows[i] = out + (cinfo->output_scanline + i) * stride;
+			}
+			jpeg_read_scanlines(cinfo, rows, count);
+		}
+	}
+	jpeg_finish_decompress(cinfo);
+	image->warnings = cinfo->err->num_warnings;
+
+	image->data = out;
+	return 1;
+}
+
+int camera_v4l2_decode(camera_v4l2_decoder_t *decoder,
+		       const void *jpeg, size_t length,
+		       camera_v4l2_image_t *image) {
+	if (decoder == NULL || jpeg == NULL || length == 0 || image == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	int slot = camera_v4l2_decode_scale_index(image->scale);
+	if (slot < 0) {
+		CAMERA_V4L2_LOG_ERROR("Unsupported scale 1/%d", image->scale);
+		errno = EINVAL;
+		return 0;
+	}
+
+	struct jpeg_decompress_struct *cinfo = &decoder->cinfo;
+	uint64_t start = camera_v4l2_decode_clock_ns();
+
+	if (setjmp(decoder->error.jump)) {
+		char message[JMSG_LENGTH_MAX];
+		cinfo->err->format_message((j_common_ptr) cinfo, message);
+		CAMERA_V4L2_LOG_ERROR("Failed to decode frame: %s", message);
+		// Leaves the decompressor ready for the next frame.
+		jpeg_abort_decompress(cinfo);
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (!camera_v4l2_decode_frame(decoder, jpeg, length, image, slot)) {
+		return 0;
+	}
+	image->decode_ns = camera_v4l2_decode_clock_ns() - start;
+	return 1;
+}
+
+enum camera_v4l2_decode_job_state {
+	CAMERA_V4L2_JOB_FREE = 0,
+	CAMERA_V4L2_JOB_QUEUED,
+	CAMERA_V4L2_JOB_DECODING,
+	CAMERA_V4L2_JOB_DONE,
+	CAMERA_V4L2_JOB_DELIVERED,  // Handed out by the last receive
+};
+
+struct camera_v4l2_decode_job {
+	int state;
+	uint64_t ticket;  // Submission order
+	camera_v4l2_camera_t *camera;
+	camera_v4l2_frame_t frame;
+	int frame_held;  // Capture buffer not given back to the camera yet
+	int ok;
+	camera_v4l2_image_t image;
+	uint8_t *buffer;
+	size_t buffer_size;
+};
+
+struct camera_v4l2_decode_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;  // A job was queued, or stop
+	pthread_cond_t done;  // A job finished decoding or a slot came free
+	int stop;
+	camera_v4l2_decode_pool_param_t param;
+
+	struct camera_v4l2_decode_job *jobs;
+	int depth;
+	uint64_t next_ticket;
+	int delivered;  // Job returned by the last receive, -1 for none
+	unsigned int dropped;
+	unsigned int failed;
+	// Frames to release, only touched by the submitting thread.
+	struct camera_v4l2_decode_job *reaped;
+	// Signalled when a job holding a capture buffer finishes.
+	int event_fd;
+
+	pthread_t *threads;
+	camera_v4l2_decoder_t **decoders;
+	int workers;
+	int started;  // Threads running
+};
+
+struct camera_v4l2_decode_worker {
+	camera_v4l2_decode_pool_t *pool;
+	int index;
+};
+
+// Oldest job in the given state (or any pending one with state -1),
+// of camera unless it is NULL. -1 if there is none.
+static int camera_v4l2_decode_pool_oldest(camera_v4l2_decode_pool_t *pool,
+					  int state,
+					  camera_v4l2_camera_t *camera) {
+	int oldest = -1;
+	for (int i = 0; i < pool->depth; i++) {
+		struct camera_v4l2_decode_job *job = &pool->jobs[i];
+		if (camera != NULL && job->camera != camera) continue;
+		if (state >= 0 && job->state != state) continue;
+		if (state < 0 && (job->state == CAMERA_V4L2_JOB_FREE ||
+				  job->state == CAMERA_V4L2_JOB_DELIVERED)) continue;
+		if (oldest < 0 || job->ticket < pool->jobs[oldest].ticket) {
+			oldest = i;
+		}
+	}
+	return oldest;
+}
+
+static void camera_v4l2_decode_job_run(camera_v4l2_decoder_t *decoder,
+				       camera_v4l2_decode_pool_t *pool,
+				       struct camera_v4l2_decode_job *job) {
+	for (int attempt = 0; attempt < 2; attempt++) {
+		memset(&job->image, 0, sizeof(job->image));
+		job->image.format = pool->param.format;
+		job->image.scale = pool->param.scale;
+		job->image.stride = pool->param.stride;
+		job->image.buffer = job->buffer;
+		job->image.capacity = job->buffer_size;
+		job->ok = camera_v4l2_decode(decoder, job->frame.start,
+					     job->frame.length, &job->image);
+		if (job->ok || errno != ENOSPC) return;
+
+		// First frame in this slot, or the size changed.
+		if (!camera_v4l2_decode_reserve(&job->buffer, &job->buffer_size,
+						job->image.size)) return;
+	}
+}
+
+static void *camera_v4l2_decode_pool_worker(void *arg) {
+	struct camera_v4l2_decode_worker *worker =
+		(struct camera_v4l2_decode_worker *) arg;
+	camera_v4l2_decode_pool_t *pool = worker->pool;
+	camera_v4l2_decoder_t *decoder = pool->decoders[worker->index];
+	free(worker);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		int index = camera_v4l2_decode_pool_oldest(pool,
+							    CAMERA_V4L2_JOB_QUEUED, NULL);
+		if (index < 0) {
+			if (pool->stop) break;
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+
+		struct camera_v4l2_decode_job *job = &pool->jobs[index];
+		job->state = CAMERA_V4L2_JOB_DECODING;
+		pthread_mutex_unlock(&pool->lock);
+
+		camera_v4l2_decode_job_run(decoder, pool, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->state = CAMERA_V4L2_JOB_DONE;
+		pthread_cond_broadcast(&pool->done);
+		if (job->frame_held) {
+			uint64_t signal = 1;
+			if (write(pool->event_fd, &signal, sizeof(signal)) < 0) {
+				// The counter is already pending.
+			}
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+camera_v4l2_decode_pool_t *camera_v4l2_decode_pool_create(
+	const camera_v4l2_decode_pool_param_t *param) {
+	CAMERA_V4L2_ASSERT(param != NULL, "Param is null!!!");
+
+	if (camera_v4l2_decode_scale_index(param->scale) < 0) {
+		CAMERA_V4L2_LOG_ERROR("Unsupported scale 1/%d", param->scale);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	camera_v4l2_decode_pool_t *pool =
+		(camera_v4l2_decode_pool_t *) calloc(1, sizeof(camera_v4l2_decode_pool_t));
+	if (pool == NULL) return NULL;
+
+	pool->param = *param;
+	pool->workers = param->workers;
+	if (pool->workers <= 0) {
+		pool->workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (pool->workers <= 0) pool->workers = 1;
+	}
+	pool->depth = param->depth > 0 ? param->depth : 2 * pool->workers;
+	pool->delivered = -1;
+	pool->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->done, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pool->jobs = (struct camera_v4l2_decode_job *)
+		calloc(pool->depth, sizeof(struct camera_v4l2_decode_job));
+	pool->reaped = (struct camera_v4l2_decode_job *)
+		calloc(pool->depth, sizeof(struct camera_v4l2_decode_job));
+	pool->threads = (pthread_t *) calloc(pool->workers, sizeof(pthread_t));
+	pool->decoders = (camera_v4l2_decoder_t **)
+		calloc(pool->workers, sizeof(camera_v4l2_decoder_t *));
+	if (pool->jobs == NULL || pool->reaped == NULL ||
+	    pool->threads == NULL || pool->decoders == NULL || pool->event_fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("Failed to allocate the decode pool");
+		camera_v4l2_decode_pool_destroy(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < pool->workers; i++) {
+		struct camera_v4l2_decode_worker *worker =
+			(struct camera_v4l2_decode_worker *)
+			malloc(sizeof(struct camera_v4l2_decode_worker));
+		pool->decoders[i] = camera_v4l2_decoder_create();
+		if (worker == NULL || pool->decoders[i] == NULL) {
+			free(worker);
+			camera_v4l2_decode_pool_destroy(pool);
+			return NULL;
+		}
+		worker->pool = pool;
+		worker->index = i;
+		int err = pthread_create(&pool->threads[i], NULL,
+					 camera_v4l2_decode_pool_worker, worker);
+		if (err != 0) {
+			CAMERA_V4L2_LOG_ERROR("Failed to start decode worker: %s",
+					      strerror(err));
+			free(worker);
+			camera_v4l2_decode_pool_destroy(pool);
+			errno = err;
+			return NULL;
+		}
+		pool->started++;
+	}
+
+	return pool;
+}
+
+// Moves the capture buffers of finished or dropped jobs out of the pool.
+// The caller releases them outside the lock.
+static int camera_v4l2_decode_pool_reap(camera_v4l2_decode_pool_t *pool) {
+	int count = 0;
+	for (int i = 0; i < pool->depth; i++) {
+		struct camera_v4l2_decode_job *job = &pool->jobs[i];
+		if (!job->frame_held || job->state == CAMERA_V4L2_JOB_QUEUED ||
+		    job->state == CAMERA_V4L2_JOB_DECODING) continue;
+		pool->reaped[count].camera = job->camera;
+		pool->reaped[count].frame = job->frame;
+		count++;
+		job->frame_held = 0;
+	}
+	return count;
+}
+
+static void camera_v4l2_decode_pool_release(camera_v4l2_decode_pool_t *pool,
+					    int count) {
+	for (int i = 0; i < count; i++) {
+		camera_v4l2_release(pool->reaped[i].camera, &pool->reaped[i].frame);
+	}
+}
+
+void camera_v4l2_decode_pool_destroy(camera_v4l2_decode_pool_t *pool) {
+	if (pool == NULL) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->started; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (int i = 0; pool->decoders != NULL && i < pool->workers; i++) {
+		camera_v4l2_decoder_destroy(pool->decoders[i]);
+	}
+
+	// Workers drained the queue before stopping, every job is done.
+	if (pool->jobs != NULL) {
+		camera_v4l2_decode_pool_release(pool, camera_v4l2_decode_pool_reap(pool));
+		for (int i = 0; i < pool->depth; i++) {
+			free(pool->jobs[i].buffer);
+		}
+	}
+
+	if (pool->event_fd >= 0) close(pool->event_fd);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->decoders);
+	free(pool->threads);
+	free(pool->reaped);
+	free(pool->jobs);
+	free(pool);
+}
+
+int camera_v4l2_decode_pool_reclaim(camera_v4l2_decode_pool_t *pool) {
+	CAMERA_V4L2_ASSERT(pool != NULL, "Object is null!!!");
+
+	uint64_t signals;
+	if (read(pool->event_fd, &signals, sizeof(signals)) < 0) {
+		// Nothing signalled, there may still be dropped frames.
+	}
+	pthread_mutex_lock(&pool->lock);
+	int reaped = camera_v4l2_decode_pool_reap(pool);
+	pthread_mutex_unlock(&pool->lock);
+	camera_v4l2_decode_pool_release(pool, reaped);
+	return reaped;
+}
+
+int camera_v4l2_decode_pool_fd(camera_v4l2_decode_pool_t *pool) {
+	CAMERA_V4L2_ASSERT(pool != NULL, "Object is null!!!");
+	return pool->event_fd;
+}
+
+int camera_v4l2_decode_pool_submit(camera_v4l2_decode_pool_t *pool,
+				   camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(pool != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	// Frames of this camera the pool may hold besides the one submitted,
+	// leaving one the thread can still acquire.
+	int limit = camera_v4l2_acquire_limit(camera) - 2;
+	pthread_mutex_lock(&pool->lock);
+	int slot = -1;
+	for (;;) {
+		int reaped = camera_v4l2_decode_pool_reap(pool);
+		if (reaped > 0) {
+			pthread_mutex_unlock(&pool->lock);
+			camera_v4l2_decode_pool_release(pool, reaped);
+			pthread_mutex_lock(&pool->lock);
+		}
+
+		// After reaping only queued and decoding jobs hold buffers.
+		int held = 0;
+		for (int i = 0; i < pool->depth; i++) {
+			if (pool->jobs[i].frame_held && pool->jobs[i].camera == camera) {
+				held++;
+			}
+		}
+		int full = held > limit && held > 0;
+		for (int i = 0; i < pool->depth && slot < 0 && !full; i++) {
+			if (pool->jobs[i].state == CAMERA_V4L2_JOB_FREE &&
+			    !pool->jobs[i].frame_held) slot = i;
+		}
+		if (slot >= 0) break;
+
+		if (pool->param.drop == CAMERA_V4L2_DECODE_BLOCK) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+		if (pool->param.drop == CAMERA_V4L2_DECODE_DROP_OLDEST) {
+			// With the camera's share used up only dropping one of
+			// its queued frames makes room.
+			int queued = camera_v4l2_decode_pool_oldest(
+				pool, CAMERA_V4L2_JOB_QUEUED, full ? camera : NULL);
+			int done = full ? -1 : camera_v4l2_decode_pool_oldest(
+				pool, CAMERA_V4L2_JOB_DONE, NULL);
+			int oldest = queued;
+			if (oldest < 0 || (done >= 0 &&
+					   pool->jobs[done].ticket < pool->jobs[oldest].ticket)) {
+				oldest = done;
+			}
+			if (oldest >= 0) {
+				pool->jobs[oldest].state = CAMERA_V4L2_JOB_FREE;
+				pool->dropped++;
+				// Its buffer goes back on the next pass.
+				continue;
+			}
+		}
+
+		// DROP_NEWEST, or nothing old enough to drop.
+		pool->dropped++;
+		pthread_mutex_unlock(&pool->lock);
+		camera_v4l2_release(camera, frame);
+		errno = EAGAIN;
+		return 0;
+	}
+
+	struct camera_v4l2_decode_job *job = &pool->jobs[slot];
+	job->ticket = pool->next_ticket++;
+	job->camera = camera;
+	job->frame = *frame;
+	job->frame_held = 1;
+	job->state = CAMERA_V4L2_JOB_QUEUED;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	frame->index = -1;
+	return 1;
+}
+
+int camera_v4l2_decode_pool_receive(camera_v4l2_decode_pool_t *pool,
+				    camera_v4l2_decode_result_t *result,
+				    int timeout_ms) {
+	CAMERA_V4L2_ASSERT(pool != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(result != NULL, "Result is null!!!");
+
+	struct timespec deadline;
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000l;
+		if (deadline.tv_nsec >= 1000000000l) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000l;
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->delivered >= 0) {
+		pool->jobs[pool->delivered].state = CAMERA_V4L2_JOB_FREE;
+		pool->delivered = -1;
+		pthread_cond_broadcast(&pool->done);
+	}
+
+	for (;;) {
+		int oldest = camera_v4l2_decode_pool_oldest(pool, -1, NULL);
+		if (oldest >= 0 && pool->jobs[oldest].state == CAMERA_V4L2_JOB_DONE) {
+			struct camera_v4l2_decode_job *job = &pool->jobs[oldest];
+			if (!job->ok) {
+				job->state = CAMERA_V4L2_JOB_FREE;
+				pool->failed++;
+				pthread_cond_broadcast(&pool->done);
+				continue;
+			}
+			job->state = CAMERA_V4L2_JOB_DELIVERED;
+			pool->delivered = oldest;
+			result->camera = job->camera;
+			result->meta = job->frame.meta;
+			result->image = job->image;
+			result->dropped = pool->dropped;
+			result->failed = pool->failed;
+			pool->dropped = 0;
+			pool->failed = 0;
+			pthread_mutex_unlock(&pool->lock);
+			return 1;
+		}
+
+		int err = 0;
+		if (timeout_ms == 0) {
+			err = ETIMEDOUT;
+		} else if (timeout_ms < 0) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		} else {
+			err = pthread_cond_timedwait(&pool->done, &pool->lock, &deadline);
+		}
+		if (err == ETIMEDOUT) {
+			pthread_mutex_unlock(&pool->lock);
+			errno = EAGAIN;
+			return 0;
+		}
+	}
+}
+
+#undef CAMERA_V4L2_ASSERT
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_DECODE_ROWS
+#undef CAMERA_V4L2_DECODE_SCALES
+#undef CAMERA_V4L2_DECODE_ALIGN
+#undef CAMERA_V4L2_DECODE_CHUNK
+#undef CAMERA_V4L2_DCT_H
+#undef CAMERA_V4L2_DCT_V
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_DECODE_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
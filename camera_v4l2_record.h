@@ -0,0 +1,1150 @@
+#ifndef CAMERA_V4L2_RECORD_H_
+#define CAMERA_V4L2_RECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+#include "camera_v4l2_capfile.h"
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+// Archives frames straight from the acquired capture buffers with
+// io_uring: each frame is written from where the driver put it and
+// released back to the driver once its write completed, so recording
+// costs a submission per frame and no copy on our side. The files are
+// recordings as camera_v4l2_replay_open plays them back.
+//
+// A recorder belongs to the thread capturing its cameras (the reactor or
+// capture thread feeding it), as frames are released from there. Without
+// io_uring (old kernels, or disabled by policy) the same files are
+// written with synchronous writes instead.
+struct camera_v4l2_recorder_param {
+	// Writes in flight across every recording, 0 selects 64. Submitting
+	// waits for a completion beyond that. Clamped to what io_uring
+	// accepts, and to 64 without it.
+	unsigned int queue_depth;
+	// Frames of one recording in flight before submitting waits for the
+	// disk, 0 selects all but one of the buffers its camera hands out so
+	// capture can go on meanwhile.
+	int frames_in_flight;
+	// Open the files O_DIRECT, so archiving does not push everything else
+	// out of the page cache. Payloads are still written from the capture
+	// buffers; headers and the unaligned tail of each frame go through
+	// small staging blocks and filler records keep the file block
+	// aligned. Filesystems refusing O_DIRECT get buffered writes.
+	int direct;
+	// Keep a capture file index next to each recording (see
+	// camera_v4l2_capfile.h), appended every index_frames written frames
+	// once the recording is synced to disk, then synced itself. 0 writes
+	// none.
+	int index_frames;
+};
+typedef struct camera_v4l2_recorder_param camera_v4l2_recorder_param_t;
+
+struct camera_v4l2_recording_stats {
+	uint64_t frames;  // Written
+	uint64_t bytes;  // To the file, headers and padding included
+	// Copied through staging blocks: headers and tails with direct I/O,
+	// whole frames when the capture buffers cannot be used for it.
+	uint64_t staged_bytes;
+	uint64_t errors;  // Failed writes, their frames are lost
+	int in_flight;  // Writes and syncs
+	int direct;  // The file is written with O_DIRECT
+	int uring;  // Written through io_uring, not synchronously
+};
+typedef struct camera_v4l2_recording_stats camera_v4l2_recording_stats_t;
+
+struct camera_v4l2_recorder;
+typedef struct camera_v4l2_recorder camera_v4l2_recorder_t;
+struct camera_v4l2_recording;
+typedef struct camera_v4l2_recording camera_v4l2_recording_t;
+
+// param may be NULL for the defaults.
+camera_v4l2_recorder_t *camera_v4l2_recorder_create(
+	const camera_v4l2_recorder_param_t *param);
+// Closes the recordings still open.
+void camera_v4l2_recorder_destroy(camera_v4l2_recorder_t *recorder);
+// Readable when writes completed, for the caller's own event loop.
+int camera_v4l2_recorder_fd(camera_v4l2_recorder_t *recorder);
+// Releases the frames whose writes completed, waiting up to timeout_ms
+// (< 0 forever) for one if none has. Submitting does the same, call it
+// while idle so buffers need not wait for the next frame. Returns how
+// many frames were released, -1 on error.
+int camera_v4l2_recorder_poll(camera_v4l2_recorder_t *recorder,
+			      int timeout_ms);
+
+// Creates or truncates path. Close the recording before the camera:
+// frames still in flight when the camera closes, as it does on its own
+// when the device is unplugged, lose their buffers and are recorded
+// damaged or not at all.
+camera_v4l2_recording_t *camera_v4l2_recording_open(
+	camera_v4l2_recorder_t *recorder, camera_v4l2_camera_t *camera,
+	const char *path);
+// Waits for the writes in flight. Returns 0 if any write failed, with
+// errno set from the first failure, or if they could not be waited for,
+// the recording then being leaked as the kernel may still use it.
+int camera_v4l2_recording_close(camera_v4l2_recording_t *recording);
+// Takes over a frame acquired from the recording's camera, released
+// once written or right away on failure. After a failed write the
+// recording refuses every frame with that write's errno.
+int camera_v4l2_recording_submit(camera_v4l2_recording_t *recording,
+				 camera_v4l2_frame_t *frame);
+// Frame callback submitting every frame to the camera_v4l2_recording_t
+// passed as user, for use with a reactor or a capture thread.
+int camera_v4l2_recording_callback(camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_t *frame, void *user);
+void camera_v4l2_recording_stats(camera_v4l2_recording_t *recording,
+				 camera_v4l2_recording_stats_t *stats);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_RECORD_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_RECORD_IMPLEMENTATION_
+#define CAMERA_V4L2_RECORD_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// The raw system calls, liburing is not needed for the few operations
+// used here.
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define CAMERA_V4L2_RECORD_URING
+#endif
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_LOG_WARN(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[32mWARN: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_ASSERT(cond, msg) \
+do { \
+	if (!(cond)) { \
+		fprintf(stderr, "\x1B[31m Assert failed: [%s][%d] %s \e[0m\n", __FUNCTION__, __LINE__, msg); \
+		exit(1); \
+	} \
+} while(0)
+
+#define CAMERA_V4L2_RECORD_QUEUE_DEPTH (64)
+// Alignment of direct I/O offsets, lengths and memory, covering every
+// logical block size in use.
+#define CAMERA_V4L2_RECORD_BLOCK ((size_t) 4096)
+// Only declared with _GNU_SOURCE.
+#ifdef O_DIRECT
+#define CAMERA_V4L2_O_DIRECT O_DIRECT
+#else
+#define CAMERA_V4L2_O_DIRECT __O_DIRECT
+#endif
+
+struct camera_v4l2_record_slot {
+	camera_v4l2_recording_t *recording;  // NULL while free
+	// Syncs this fd to disk instead of writing, otherwise -1.
+	int sync_fd;
+	camera_v4l2_frame_t frame;
+	int held;  // frame is still to be released
+	camera_v4l2_replay_header_t header;
+	struct iovec iov[3];
+	int iov_count;
+	uint64_t offset;
+	size_t total;
+	// The payload is written from the capture buffer with direct I/O,
+	// which the buffer may turn out not to support.
+	int zero_copy;
+	// Direct I/O head block and up to two tail blocks.
+	uint8_t *blocks;
+	// The whole record, when the capture buffer cannot be used.
+	uint8_t *stage;
+	size_t stage_capacity;
+	uint64_t entry_id;  // Index entry of the frame
+	int next_free;
+};
+
+struct camera_v4l2_recording {
+	camera_v4l2_recorder_t *recorder;
+	camera_v4l2_camera_t *camera;
+	int fd;
+	int frames_in_flight;
+	// Capture buffers refused direct I/O, frames are staged whole.
+	int stage_all;
+	uint64_t offset;  // Of the next record
+	int error;  // errno of the first failed write
+	camera_v4l2_recording_stats_t stats;
+	// Index entries of the frames not appended to the index yet, in
+	// recording order, and whether their writes are done (1) or failed
+	// (2). Entries are appended once every frame before them is written,
+	// so the index never points ahead of the recording.
+	int index_fd;  // -1 without index
+	camera_v4l2_capfile_entry_t *entries;
+	uint8_t *entry_states;
+	size_t entry_count;
+	size_t entry_capacity;
+	uint64_t entry_base;  // Id of entries[0]
+	uint64_t index_offset;
+	// A write failed or the index could not be appended to, the frames
+	// after it are left to be found by scanning.
+	int index_stopped;
+	// The leading entries appended once the recording synced, while
+	// that sync is in flight.
+	size_t index_pending;
+	int index_syncing;
+	// Syncs of the recording and the index waiting for a free slot.
+	int data_sync_wanted;
+	int index_sync_wanted;
+};
+
+struct camera_v4l2_recorder {
+	camera_v4l2_recorder_param_t param;
+	// -1 without io_uring, writes are synchronous then.
+	int ring_fd;
+	int event_fd;
+#ifdef CAMERA_V4L2_RECORD_URING
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+	void *sq_map;
+	size_t sq_map_length;
+	void *cq_map;
+	size_t cq_map_length;
+	void *sqe_map;
+	size_t sqe_map_length;
+	struct camera_v4l2_record_slot *slots;
+	int slot_count;
+	int free_slot;
+	int in_flight;
+	camera_v4l2_recording_t **recordings;
+	int recording_count;
+};
+
+static size_t camera_v4l2_record_align(size_t length, size_t alignment) {
+	return (length + alignment - 1) & ~(alignment - 1);
+}
+
+static void camera_v4l2_record_filler(uint8_t *at, size_t length) {
+	camera_v4l2_replay_header_t filler;
+	memset(&filler, 0, sizeof(filler));
+	filler.magic = CAMERA_V4L2_REPLAY_MAGIC;
+	filler.length = (uint32_t) (length - sizeof(filler));
+	filler.flags = CAMERA_V4L2_REPLAY_FILLER;
+	memcpy(at, &filler, sizeof(filler));
+	memset(at + sizeof(filler), 0, length - sizeof(filler));
+}
+
+// Ends a payload of used bytes, starting on a block boundary, on the
+// next one: padding to 8 bytes, then a filler record, one block longer
+// when the gap is too short for its header. Returns the padded length;
+// data must have room for one block past used.
+static size_t camera_v4l2_record_pad_block(uint8_t *data, size_t used) {
+	if (used % CAMERA_V4L2_RECORD_BLOCK == 0) return used;
+
+	size_t padded = camera_v4l2_record_align(used, 8);
+	memset(data + used, 0, padded - used);
+	size_t gap = camera_v4l2_record_align(padded, CAMERA_V4L2_RECORD_BLOCK) -
+		padded;
+	if (gap < sizeof(camera_v4l2_replay_header_t)) {
+		gap += CAMERA_V4L2_RECORD_BLOCK;
+	}
+	camera_v4l2_record_filler(data + padded, gap);
+	return padded + gap;
+}
+
+// Lays out the record of the slot's frame at the recording's next
+// offset. With direct I/O the frame header ends a block of its own so
+// the payload starts on a block boundary, as it does in memory.
+static int camera_v4l2_record_prepare(camera_v4l2_recording_t *recording,
+				      struct camera_v4l2_record_slot *slot) {
+	camera_v4l2_frame_t *frame = &slot->frame;
+	camera_v4l2_replay_header_t *header = &slot->header;
+	memset(header, 0, sizeof(*header));
+	header->magic = CAMERA_V4L2_REPLAY_MAGIC;
+	header->length = (uint32_t) frame->length;
+	header->sequence = frame->meta.sequence;
+	header->timestamp_ns = frame->meta.timestamp_ns;
+	slot->zero_copy = 0;
+
+	if (!recording->stats.direct) {
+		static const uint8_t padding[8] = { 0 };
+		slot->iov[0].iov_base = header;
+		slot->iov[0].iov_len = sizeof(*header);
+		slot->iov[1].iov_base = frame->start;
+		slot->iov[1].iov_len = frame->length;
+		slot->iov[2].iov_base = (void *) padding;
+		slot->iov[2].iov_len = (8 - frame->length % 8) % 8;
+		slot->iov_count = 3;
+		slot->total = sizeof(*header) + frame->length + slot->iov[2].iov_len;
+		return 1;
+	}
+
+	const size_t block = CAMERA_V4L2_RECORD_BLOCK;
+	uint8_t *head = slot->blocks;
+	camera_v4l2_record_filler(head, block - sizeof(*header));
+	memcpy(head + block - sizeof(*header), header, sizeof(*header));
+
+	if (!recording->stage_all && (uintptr_t) frame->start % block == 0) {
+		size_t tail = frame->length % block;
+		size_t body = frame->length - tail;
+		uint8_t *end = slot->blocks + block;
+		memcpy(end, (const uint8_t *) frame->start + body, tail);
+		size_t end_length = camera_v4l2_record_pad_block(end, tail);
+
+		slot->iov_count = 0;
+		slot->iov[slot->iov_count].iov_base = head;
+		slot->iov[slot->iov_count++].iov_len = block;
+		if (body > 0) {
+			slot->iov[slot->iov_count].iov_base = frame->start;
+			slot->iov[slot->iov_count++].iov_len = body;
+		}
+		if (end_length > 0) {
+			slot->iov[slot->iov_count].iov_base = end;
+			slot->iov[slot->iov_count++].iov_len = end_length;
+		}
+		slot->total = block + body + end_length;
+		slot->zero_copy = 1;
+		recording->stats.staged_bytes += block + end_length;
+		return 1;
+	}
+
+	size_t capacity = block +
+		camera_v4l2_record_align(frame->length, block) + block;
+	if (slot->stage_capacity < capacity) {
+		void *stage = NULL;
+		if (posix_memalign(&stage, block, capacity) != 0) {
+			errno = ENOMEM;
+			return 0;
+		}
+		free(slot->stage);
+		slot->stage = (uint8_t *) stage;
+		slot->stage_capacity = capacity;
+	}
+	memcpy(slot->stage, head, block);
+	memcpy(slot->stage + block, frame->start, frame->length);
+	slot->total = block +
+		camera_v4l2_record_pad_block(slot->stage + block, frame->length);
+	slot->iov[0].iov_base = slot->stage;
+	slot->iov[0].iov_len = slot->total;
+	slot->iov_count = 1;
+	recording->stats.staged_bytes += slot->total;
+	// Nothing points into the capture buffer any more.
+	camera_v4l2_release(recording->camera, frame);
+	slot->held = 0;
+	return 1;
+}
+
+static void camera_v4l2_record_free_slot(camera_v4l2_recorder_t *recorder,
+					 struct camera_v4l2_record_slot *slot) {
+	slot->recording->stats.in_flight--;
+	recorder->in_flight--;
+	slot->recording = NULL;
+	slot->next_free = recorder->free_slot;
+	recorder->free_slot = (int) (slot - recorder->slots);
+}
+
+static int camera_v4l2_record_complete(camera_v4l2_recorder_t *recorder,
+				       struct camera_v4l2_record_slot *slot,
+				       int result);
+
+static void camera_v4l2_record_run_sync(camera_v4l2_recorder_t *recorder,
+					struct camera_v4l2_record_slot *slot) {
+	ssize_t result;
+	do {
+		if (slot->sync_fd != -1) {
+			result = fdatasync(slot->sync_fd);
+		} else {
+			result = pwritev(slot->recording->fd, slot->iov,
+					 slot->iov_count, (off_t) slot->offset);
+		}
+	} while (result < 0 && errno == EINTR);
+	camera_v4l2_record_complete(recorder, slot,
+				    result < 0 ? -errno : (int) result);
+}
+
+#ifdef CAMERA_V4L2_RECORD_URING
+static int camera_v4l2_record_enter(int ring_fd, unsigned to_submit,
+				    unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			     min_complete, flags, NULL, 0);
+}
+#endif
+
+static int camera_v4l2_record_reap(camera_v4l2_recorder_t *recorder);
+
+// Waits for at least one completion and handles it.
+static int camera_v4l2_record_wait(camera_v4l2_recorder_t *recorder) {
+#ifdef CAMERA_V4L2_RECORD_URING
+	if (recorder->ring_fd != -1) {
+		if (camera_v4l2_record_enter(recorder->ring_fd, 0, 1,
+					     IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR) {
+			int error = errno;
+			CAMERA_V4L2_LOG_ERROR("io_uring_enter failed: %s",
+					      strerror(error));
+			errno = error;
+			return 0;
+		}
+		camera_v4l2_record_reap(recorder);
+		return 1;
+	}
+#endif
+	// Synchronous writes never leave anything in flight.
+	(void) recorder;
+	return 1;
+}
+
+static void camera_v4l2_record_issue(camera_v4l2_recorder_t *recorder,
+				     struct camera_v4l2_record_slot *slot) {
+#ifdef CAMERA_V4L2_RECORD_URING
+	if (recorder->ring_fd != -1) {
+		// Every entry is submitted right away, so the ring always has
+		// room for the next one.
+		unsigned tail = *recorder->sq_tail;
+		unsigned index = tail & *recorder->sq_mask;
+		struct io_uring_sqe *sqe = &recorder->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		if (slot->sync_fd != -1) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = slot->sync_fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		} else {
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = slot->recording->fd;
+			sqe->off = slot->offset;
+			sqe->addr = (uint64_t) (uintptr_t) slot->iov;
+			sqe->len = slot->iov_count;
+		}
+		sqe->user_data = (uint64_t) (slot - recorder->slots);
+		recorder->sq_array[index] = index;
+		__atomic_store_n(recorder->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		int ret;
+		while ((ret = camera_v4l2_record_enter(recorder->ring_fd, 1, 0,
+						       0)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				// Short of kernel resources or completion room.
+				if (camera_v4l2_record_wait(recorder)) continue;
+			}
+			break;
+		}
+		if (ret >= 1) return;
+
+		// Take the entry back and run this one synchronously.
+		CAMERA_V4L2_LOG_ERROR("io_uring_enter failed: %s", strerror(errno));
+		__atomic_store_n(recorder->sq_tail, tail, __ATOMIC_RELEASE);
+	}
+#endif
+	camera_v4l2_record_run_sync(recorder, slot);
+}
+
+// Syncs the recording or its index to disk in the background, or right
+// away without io_uring. With every slot busy the sync waits for the next
+// one freed, ahead of any frame.
+static void camera_v4l2_record_sync(camera_v4l2_recorder_t *recorder,
+				    camera_v4l2_recording_t *recording,
+				    int fd) {
+	if (recorder->free_slot == -1) {
+		if (fd == recording->fd) {
+			recording->data_sync_wanted = 1;
+		} else {
+			recording->index_sync_wanted = 1;
+		}
+		return;
+	}
+
+	struct camera_v4l2_record_slot *slot =
+		&recorder->slots[recorder->free_slot];
+	recorder->free_slot = slot->next_free;
+	slot->recording = recording;
+	slot->sync_fd = fd;
+	slot->held = 0;
+	recording->stats.in_flight++;
+	recorder->in_flight++;
+	camera_v4l2_record_issue(recorder, slot);
+}
+
+// Issues the syncs that found every slot busy.
+static void camera_v4l2_record_sync_wanted(camera_v4l2_recorder_t *recorder) {
+	for (int i = 0; i < recorder->recording_count &&
+	     recorder->free_slot != -1; i++) {
+		camera_v4l2_recording_t *recording = recorder->recordings[i];
+		if (recording->data_sync_wanted) {
+			recording->data_sync_wanted = 0;
+			camera_v4l2_record_sync(recorder, recording, recording->fd);
+		}
+		if (recording->index_sync_wanted && recorder->free_slot != -1) {
+			recording->index_sync_wanted = 0;
+			camera_v4l2_record_sync(recorder, recording,
+						recording->index_fd);
+		}
+	}
+}
+
+static void camera_v4l2_record_drop_entries(camera_v4l2_recording_t *recording,
+					    size_t count) {
+	recording->entry_count -= count;
+	recording->entry_base += count;
+	memmove(recording->entries, recording->entries + count,
+		recording->entry_count * sizeof(camera_v4l2_capfile_entry_t));
+	memmove(recording->entry_states, recording->entry_states + count,
+		recording->entry_count);
+}
+
+// Appends the entries of the frames written so far to the index once
+// there are index_frames of them, or whatever there is when forced. The
+// recording is synced first and the entries appended once that sync
+// completed, so not even a power loss leaves the index pointing ahead of
+// the recording.
+static void camera_v4l2_record_flush_index(camera_v4l2_recorder_t *recorder,
+					   camera_v4l2_recording_t *recording,
+					   int force) {
+	// Flushed again once the sync in flight completed.
+	if (recording->index_syncing) return;
+
+	size_t ready = 0;
+	while (ready < recording->entry_count &&
+	       recording->entry_states[ready] != 0) {
+		ready++;
+	}
+	if (ready == 0 ||
+	    (!force && ready < (size_t) recorder->param.index_frames)) {
+		return;
+	}
+
+	size_t written = 0;
+	while (written < ready && recording->entry_states[written] == 1) {
+		written++;
+	}
+	if (written > 0 && !recording->index_stopped) {
+		// The frames after a failed write are left out for good.
+		if (written < ready) recording->index_stopped = 1;
+		recording->index_pending = written;
+		recording->index_syncing = 1;
+		camera_v4l2_record_sync(recorder, recording, recording->fd);
+		return;
+	}
+	recording->index_stopped = 1;
+	camera_v4l2_record_drop_entries(recording, ready);
+}
+
+// Appends the pending entries once the recording synced, result being
+// that sync's.
+static void camera_v4l2_record_append_index(camera_v4l2_recorder_t *recorder,
+					    camera_v4l2_recording_t *recording,
+					    int result) {
+	size_t pending = recording->index_pending;
+	recording->index_pending = 0;
+	recording->index_syncing = 0;
+
+	if (result < 0) {
+		recording->index_stopped = 1;
+	} else {
+		size_t size = pending * sizeof(camera_v4l2_capfile_entry_t);
+		ssize_t written;
+		do {
+			written = pwrite(recording->index_fd, recording->entries, size,
+					 (off_t) recording->index_offset);
+		} while (written < 0 && errno == EINTR);
+		if (written == (ssize_t) size) {
+			recording->index_offset += size;
+			camera_v4l2_record_sync(recorder, recording,
+						recording->index_fd);
+		} else {
+			CAMERA_V4L2_LOG_ERROR("Cannot append to index: %s",
+					      written < 0 ? strerror(errno) : "short write");
+			recording->index_stopped = 1;
+		}
+	}
+	camera_v4l2_record_drop_entries(recording, pending);
+	camera_v4l2_record_flush_index(recorder, recording, 0);
+}
+
+// Reserves the index entry of the slot's frame, in recording order.
+static int camera_v4l2_record_add_entry(camera_v4l2_recording_t *recording,
+					struct camera_v4l2_record_slot *slot) {
+	if (recording->entry_count == recording->entry_capacity) {
+		size_t capacity = recording->entry_capacity > 0 ?
+			recording->entry_capacity * 2 : 64;
+		camera_v4l2_capfile_entry_t *entries =
+			(camera_v4l2_capfile_entry_t *) realloc(
+				recording->entries, capacity * sizeof(*entries));
+		if (entries == NULL) return 0;
+		recording->entries = entries;
+		uint8_t *states = (uint8_t *) realloc(recording->entry_states,
+						      capacity);
+		if (states == NULL) return 0;
+		recording->entry_states = states;
+		recording->entry_capacity = capacity;
+	}
+
+	camera_v4l2_capfile_entry_t *entry =
+		&recording->entries[recording->entry_count];
+	entry->offset = slot->offset;
+	if (recording->stats.direct) {
+		// The frame header ends the head block.
+		entry->offset += CAMERA_V4L2_RECORD_BLOCK -
+			sizeof(camera_v4l2_replay_header_t);
+	}
+	entry->timestamp_ns = slot->header.timestamp_ns;
+	entry->length = slot->header.length;
+	entry->sequence = slot->header.sequence;
+	recording->entry_states[recording->entry_count] = 0;
+	slot->entry_id = recording->entry_base + recording->entry_count++;
+	return 1;
+}
+
+// Returns 1 when a frame is done with, 0 for syncs and writes
+// submitted again.
+static int camera_v4l2_record_complete(camera_v4l2_recorder_t *recorder,
+				       struct camera_v4l2_record_slot *slot,
+				       int result) {
+	camera_v4l2_recording_t *recording = slot->recording;
+
+	if (result == -EINTR || result == -EAGAIN) {
+		camera_v4l2_record_issue(recorder, slot);
+		return 0;
+	}
+	if (slot->sync_fd != -1) {
+		if (result < 0 && recording->error == 0) {
+			recording->error = -result;
+			CAMERA_V4L2_LOG_ERROR("Cannot sync recording: %s",
+					      strerror(recording->error));
+		}
+		int data = slot->sync_fd == recording->fd;
+		slot->sync_fd = -1;
+		camera_v4l2_record_free_slot(recorder, slot);
+		if (data && recording->index_syncing) {
+			camera_v4l2_record_append_index(recorder, recording, result);
+		}
+		camera_v4l2_record_sync_wanted(recorder);
+		return 0;
+	}
+	if ((result == -EFAULT || result == -EINVAL) && slot->zero_copy &&
+	    camera_v4l2_isopened(recording->camera)) {
+		// Device memory that cannot be pinned for direct I/O, staging
+		// the frames is the only way left. Unless the camera was closed
+		// under the write and took its buffers along.
+		if (!recording->stage_all) {
+			CAMERA_V4L2_LOG_WARN("Capture buffers refuse direct I/O, "
+					     "staging frames: %s", strerror(-result));
+			recording->stage_all = 1;
+		}
+		if (camera_v4l2_record_prepare(recording, slot)) {
+			camera_v4l2_record_issue(recorder, slot);
+			return 0;
+		}
+		result = -errno;
+	}
+
+	int written = result >= 0 && (size_t) result == slot->total;
+	if (!written) {
+		if (recording->error == 0) {
+			recording->error = result < 0 ? -result : EIO;
+			CAMERA_V4L2_LOG_ERROR("Cannot record frame: %s",
+					      strerror(recording->error));
+		}
+		recording->stats.errors++;
+	} else {
+		recording->stats.frames++;
+		recording->stats.bytes += slot->total;
+	}
+
+	if (slot->held) {
+		camera_v4l2_release(recording->camera, &slot->frame);
+		slot->held = 0;
+	}
+	uint64_t entry_id = slot->entry_id;
+	camera_v4l2_record_free_slot(recorder, slot);
+	camera_v4l2_record_sync_wanted(recorder);
+	if (entry_id != UINT64_MAX) {
+		recording->entry_states[entry_id - recording->entry_base] =
+			written ? 1 : 2;
+		camera_v4l2_record_flush_index(recorder, recording, 0);
+	}
+	return 1;
+}
+
+// Handles every completion posted so far, without a system call.
+static int camera_v4l2_record_reap(camera_v4l2_recorder_t *recorder) {
+	int completed = 0;
+#ifdef CAMERA_V4L2_RECORD_URING
+	if (recorder->ring_fd == -1) return 0;
+
+	unsigned head = *recorder->cq_head;
+	for (;;) {
+		unsigned tail = __atomic_load_n(recorder->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) break;
+		struct io_uring_cqe *cqe = &recorder->cqes[head & *recorder->cq_mask];
+		uint64_t index = cqe->user_data;
+		int result = cqe->res;
+		// Free the entry first, completing may submit again.
+		__atomic_store_n(recorder->cq_head, ++head, __ATOMIC_RELEASE);
+		completed += camera_v4l2_record_complete(
+			recorder, &recorder->slots[index], result);
+		head = *recorder->cq_head;
+	}
+#else
+	(void) recorder;
+#endif
+	return completed;
+}
+
+static int camera_v4l2_record_setup(camera_v4l2_recorder_t *recorder,
+				    unsigned int entries) {
+#ifdef CAMERA_V4L2_RECORD_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) return 0;
+
+	recorder->ring_fd = fd;
+	if (params.sq_entries < entries) {
+		recorder->param.queue_depth = params.sq_entries;
+	}
+	recorder->sq_map_length = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	recorder->cq_map_length = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (recorder->cq_map_length > recorder->sq_map_length) {
+			recorder->sq_map_length = recorder->cq_map_length;
+		}
+		recorder->cq_map_length = 0;
+	}
+
+	recorder->sq_map = mmap(NULL, recorder->sq_map_length,
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				IORING_OFF_SQ_RING);
+	if (recorder->sq_map == MAP_FAILED) {
+		recorder->sq_map = NULL;
+		return 0;
+	}
+	if (recorder->cq_map_length > 0) {
+		recorder->cq_map = mmap(NULL, recorder->cq_map_length,
+					PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+					IORING_OFF_CQ_RING);
+		if (recorder->cq_map == MAP_FAILED) {
+			recorder->cq_map = NULL;
+			return 0;
+		}
+	}
+	recorder->sqe_map_length = params.sq_entries * sizeof(struct io_uring_sqe);
+	recorder->sqe_map = mmap(NULL, recorder->sqe_map_length,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				 IORING_OFF_SQES);
+	if (recorder->sqe_map == MAP_FAILED) {
+		recorder->sqe_map = NULL;
+		return 0;
+	}
+
+	uint8_t *sq = (uint8_t *) recorder->sq_map;
+	uint8_t *cq = recorder->cq_map != NULL ?
+		(uint8_t *) recorder->cq_map : sq;
+	recorder->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	recorder->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	recorder->sq_array = (unsigned *) (sq + params.sq_off.array);
+	recorder->sqes = (struct io_uring_sqe *) recorder->sqe_map;
+	recorder->cq_head = (unsigned *) (cq + params.cq_off.head);
+	recorder->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	recorder->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	recorder->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+		    &recorder->event_fd, 1) < 0) {
+		return 0;
+	}
+	return 1;
+#else
+	(void) recorder;
+	(void) entries;
+	errno = ENOSYS;
+	return 0;
+#endif
+}
+
+static void camera_v4l2_record_teardown(camera_v4l2_recorder_t *recorder) {
+	if (recorder->sqe_map != NULL) {
+		munmap(recorder->sqe_map, recorder->sqe_map_length);
+	}
+	if (recorder->cq_map != NULL) {
+		munmap(recorder->cq_map, recorder->cq_map_length);
+	}
+	if (recorder->sq_map != NULL) {
+		munmap(recorder->sq_map, recorder->sq_map_length);
+	}
+	if (recorder->ring_fd != -1) close(recorder->ring_fd);
+	recorder->sqe_map = NULL;
+	recorder->cq_map = NULL;
+	recorder->sq_map = NULL;
+	recorder->ring_fd = -1;
+}
+
+camera_v4l2_recorder_t *camera_v4l2_recorder_create(
+	const camera_v4l2_recorder_param_t *param) {
+	camera_v4l2_recorder_t *recorder =
+		(camera_v4l2_recorder_t *) calloc(1, sizeof(camera_v4l2_recorder_t));
+	if (recorder == NULL) return NULL;
+
+	if (param != NULL) recorder->param = *param;
+	if (recorder->param.queue_depth == 0) {
+		recorder->param.queue_depth = CAMERA_V4L2_RECORD_QUEUE_DEPTH;
+	}
+	recorder->ring_fd = -1;
+	recorder->free_slot = -1;
+	recorder->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (recorder->event_fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("eventfd failed: %s", strerror(errno));
+		free(recorder);
+		return NULL;
+	}
+
+	if (!camera_v4l2_record_setup(recorder, recorder->param.queue_depth)) {
+		CAMERA_V4L2_LOG_WARN("io_uring unavailable, writing synchronously: %s",
+				     strerror(errno));
+		camera_v4l2_record_teardown(recorder);
+		// Synchronous writes complete before the next is submitted.
+		if (recorder->param.queue_depth > CAMERA_V4L2_RECORD_QUEUE_DEPTH) {
+			recorder->param.queue_depth = CAMERA_V4L2_RECORD_QUEUE_DEPTH;
+		}
+	}
+
+	int count = (int) recorder->param.queue_depth;
+	recorder->slots = (struct camera_v4l2_record_slot *) calloc(
+		count, sizeof(struct camera_v4l2_record_slot));
+	if (recorder->slots == NULL) {
+		camera_v4l2_recorder_destroy(recorder);
+		return NULL;
+	}
+	recorder->slot_count = count;
+	for (int i = count - 1; i >= 0; i--) {
+		void *blocks = NULL;
+		if (posix_memalign(&blocks, CAMERA_V4L2_RECORD_BLOCK,
+				   3 * CAMERA_V4L2_RECORD_BLOCK) != 0) {
+			camera_v4l2_recorder_destroy(recorder);
+			return NULL;
+		}
+		recorder->slots[i].blocks = (uint8_t *) blocks;
+		recorder->slots[i].sync_fd = -1;
+		recorder->slots[i].next_free = recorder->free_slot;
+		recorder->free_slot = i;
+	}
+
+	return recorder;
+}
+
+void camera_v4l2_recorder_destroy(camera_v4l2_recorder_t *recorder) {
+	if (recorder == NULL) return;
+
+	while (recorder->recording_count > 0) {
+		camera_v4l2_recording_close(
+			recorder->recordings[recorder->recording_count - 1]);
+	}
+	camera_v4l2_record_teardown(recorder);
+	// Left in flight by a failed ring, see camera_v4l2_recording_close.
+	if (recorder->in_flight == 0) {
+		for (int i = 0; i < recorder->slot_count; i++) {
+			free(recorder->slots[i].blocks);
+			free(recorder->slots[i].stage);
+		}
+		free(recorder->slots);
+	}
+	free(recorder->recordings);
+	close(recorder->event_fd);
+	free(recorder);
+}
+
+int camera_v4l2_recorder_fd(camera_v4l2_recorder_t *recorder) {
+	CAMERA_V4L2_ASSERT(recorder != NULL, "Object is null!!!");
+	return recorder->event_fd;
+}
+
+int camera_v4l2_recorder_poll(camera_v4l2_recorder_t *recorder,
+			      int timeout_ms) {
+	CAMERA_V4L2_ASSERT(recorder != NULL, "Object is null!!!");
+
+	// Drained before reaping, so a completion posted meanwhile still
+	// leaves the fd readable.
+	uint64_t counter;
+	if (read(recorder->event_fd, &counter, sizeof(counter)) < 0) {
+		// Nothing pending.
+	}
+	int completed = camera_v4l2_record_reap(recorder);
+	if (completed > 0 || recorder->in_flight == 0 || timeout_ms == 0) {
+		return completed;
+	}
+
+	struct pollfd pfd;
+	pfd.fd = recorder->event_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+		CAMERA_V4L2_LOG_ERROR("poll failed: %s", strerror(errno));
+		return -1;
+	}
+	if (read(recorder->event_fd, &counter, sizeof(counter)) < 0) {
+		// Timed out.
+	}
+	return camera_v4l2_record_reap(recorder);
+}
+
+static int camera_v4l2_record_open_index(camera_v4l2_recording_t *recording,
+					 const char *path) {
+	size_t length = strlen(path);
+	char *index_path = (char *) malloc(
+		length + sizeof(CAMERA_V4L2_CAPFILE_SUFFIX));
+	if (index_path == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	memcpy(index_path, path, length);
+	memcpy(index_path + length, CAMERA_V4L2_CAPFILE_SUFFIX,
+	       sizeof(CAMERA_V4L2_CAPFILE_SUFFIX));
+	recording->index_fd = open(index_path,
+				   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	free(index_path);
+	if (recording->index_fd < 0) {
+		recording->index_fd = -1;
+		return 0;
+	}
+
+	camera_v4l2_capfile_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CAMERA_V4L2_CAPFILE_MAGIC;
+	header.version = CAMERA_V4L2_CAPFILE_VERSION;
+	header.entry_size = sizeof(camera_v4l2_capfile_entry_t);
+	if (write(recording->index_fd, &header, sizeof(header)) !=
+	    (ssize_t) sizeof(header)) {
+		if (errno == 0) errno = EIO;
+		close(recording->index_fd);
+		recording->index_fd = -1;
+		return 0;
+	}
+	recording->index_offset = sizeof(header);
+	return 1;
+}
+
+camera_v4l2_recording_t *camera_v4l2_recording_open(
+	camera_v4l2_recorder_t *recorder, camera_v4l2_camera_t *camera,
+	const char *path) {
+	CAMERA_V4L2_ASSERT(recorder != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(camera != NULL, "Camera is null!!!");
+	CAMERA_V4L2_ASSERT(path != NULL, "Path is null!!!");
+
+	camera_v4l2_recording_t **recordings = (camera_v4l2_recording_t **)
+		realloc(recorder->recordings, (recorder->recording_count + 1) *
+			sizeof(camera_v4l2_recording_t *));
+	if (recordings == NULL) return NULL;
+	recorder->recordings = recordings;
+
+	camera_v4l2_recording_t *recording =
+		(camera_v4l2_recording_t *) calloc(1, sizeof(camera_v4l2_recording_t));
+	if (recording == NULL) return NULL;
+	recording->recorder = recorder;
+	recording->camera = camera;
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	recording->fd = -1;
+	if (recorder->param.direct) {
+		recording->fd = open(path, flags | CAMERA_V4L2_O_DIRECT, 0644);
+		if (recording->fd >= 0) {
+			recording->stats.direct = 1;
+		} else if (errno == EINVAL) {
+			CAMERA_V4L2_LOG_WARN("%s does not support O_DIRECT, "
+					     "writing buffered", path);
+		}
+	}
+	if (recording->fd < 0) recording->fd = open(path, flags, 0644);
+	if (recording->fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("Cannot open %s: %s", path, strerror(errno));
+		free(recording);
+		return NULL;
+	}
+	recording->stats.uring = recorder->ring_fd != -1;
+
+	recording->index_fd = -1;
+	if (recorder->param.index_frames > 0 &&
+	    !camera_v4l2_record_open_index(recording, path)) {
+		CAMERA_V4L2_LOG_ERROR("Cannot create index of %s: %s", path,
+				      strerror(errno));
+		close(recording->fd);
+		free(recording);
+		return NULL;
+	}
+
+	recording->frames_in_flight = recorder->param.frames_in_flight;
+	if (recording->frames_in_flight <= 0) {
+		// The camera keeps two buffers queued, see camera_v4l2_acquire.
+		recording->frames_in_flight = camera_v4l2_buffer_count(camera) - 3;
+		if (recording->frames_in_flight < 1) recording->frames_in_flight = 1;
+	}
+
+	recorder->recordings[recorder->recording_count++] = recording;
+	return recording;
+}
+
+int camera_v4l2_recording_close(camera_v4l2_recording_t *recording) {
+	CAMERA_V4L2_ASSERT(recording != NULL, "Object is null!!!");
+	camera_v4l2_recorder_t *recorder = recording->recorder;
+
+	int wait_error = 0;
+	while (recording->stats.in_flight > 0) {
+		if (!camera_v4l2_record_wait(recorder)) {
+			wait_error = errno;
+			break;
+		}
+	}
+	if (recording->index_fd != -1 && recording->stats.in_flight == 0) {
+		camera_v4l2_record_flush_index(recorder, recording, 1);
+		while (recording->stats.in_flight > 0) {
+			if (!camera_v4l2_record_wait(recorder)) {
+				wait_error = errno;
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < recorder->recording_count; i++) {
+		if (recorder->recordings[i] == recording) {
+			recorder->recordings[i] =
+				recorder->recordings[--recorder->recording_count];
+			break;
+		}
+	}
+
+	if (recording->stats.in_flight > 0) {
+		// The ring failed and the kernel may still write from the slots
+		// and the frames they hold, leave them and the recording be.
+		CAMERA_V4L2_LOG_ERROR("%d write(s) left in flight, leaking the recording",
+				      recording->stats.in_flight);
+		errno = wait_error != 0 ? wait_error : EIO;
+		return 0;
+	}
+
+	int error = recording->error;
+	if (close(recording->fd) < 0 && error == 0) error = errno;
+	if (recording->index_fd != -1) close(recording->index_fd);
+	free(recording->entries);
+	free(recording->entry_states);
+	free(recording);
+	if (error != 0) {
+		errno = error;
+		return 0;
+	}
+	return 1;
+}
+
+int camera_v4l2_recording_submit(camera_v4l2_recording_t *recording,
+				 camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(recording != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+	camera_v4l2_recorder_t *recorder = recording->recorder;
+
+	camera_v4l2_record_reap(recorder);
+	while (recording->error == 0 &&
+	       (recorder->free_slot == -1 ||
+		recording->stats.in_flight >= recording->frames_in_flight)) {
+		if (!camera_v4l2_record_wait(recorder)) {
+			camera_v4l2_release(recording->camera, frame);
+			return 0;
+		}
+	}
+	if (recording->error != 0) {
+		camera_v4l2_release(recording->camera, frame);
+		errno = recording->error;
+		return 0;
+	}
+
+	struct camera_v4l2_record_slot *slot =
+		&recorder->slots[recorder->free_slot];
+	recorder->free_slot = slot->next_free;
+	slot->recording = recording;
+	slot->sync_fd = -1;
+	slot->frame = *frame;
+	slot->held = 1;
+	recording->stats.in_flight++;
+	recorder->in_flight++;
+
+	if (!camera_v4l2_record_prepare(recording, slot)) {
+		int error = errno;
+		CAMERA_V4L2_LOG_ERROR("Cannot stage frame: %s", strerror(error));
+		if (slot->held) camera_v4l2_release(recording->camera, &slot->frame);
+		slot->held = 0;
+		camera_v4l2_record_free_slot(recorder, slot);
+		errno = error;
+		return 0;
+	}
+	slot->offset = recording->offset;
+	recording->offset += slot->total;
+	slot->entry_id = UINT64_MAX;
+	if (recording->index_fd != -1 && !recording->index_stopped &&
+	    !camera_v4l2_record_add_entry(recording, slot)) {
+		CAMERA_V4L2_LOG_ERROR("Cannot index frame: out of memory");
+		recording->index_stopped = 1;
+	}
+	camera_v4l2_record_issue(recorder, slot);
+
+	return 1;
+}
+
+int camera_v4l2_recording_callback(camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_t *frame, void *user) {
+	(void) camera;
+	CAMERA_V4L2_ASSERT(user != NULL, "Recording is null!!!");
+
+	// Released by the recording itself when it cannot take the frame.
+	camera_v4l2_recording_submit((camera_v4l2_recording_t *) user, frame);
+	return 1;
+}
+
+void camera_v4l2_recording_stats(camera_v4l2_recording_t *recording,
+				 camera_v4l2_recording_stats_t *stats) {
+	CAMERA_V4L2_ASSERT(recording != NULL, "Object is null!!!");
+	CAMERA_V4L2_ASSERT(stats != NULL, "Stats is null!!!");
+	*stats = recording->stats;
+}
+
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_LOG_WARN
+#undef CAMERA_V4L2_ASSERT
+#undef CAMERA_V4L2_RECORD_URING
+#undef CAMERA_V4L2_RECORD_QUEUE_DEPTH
+#undef CAMERA_V4L2_RECORD_BLOCK
+#undef CAMERA_V4L2_O_DIRECT
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_RECORD_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
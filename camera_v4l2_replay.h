@@ -0,0 +1,746 @@
+#ifndef CAMERA_V4L2_REPLAY_H_
+#define CAMERA_V4L2_REPLAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_v4l2.h"
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+// Stands in for a V4L2 device and serves recorded frames through the
+// same REQBUFS/QBUF/DQBUF/STREAMON sequence the kernel would, so the
+// capture path can be run and measured on any Linux box. Pass
+// camera_v4l2_replay_backend() as param.backend; the device index is
+// ignored. One replay serves one open camera at a time.
+enum camera_v4l2_replay_pacing {
+	// Frames become ready at their recorded intervals.
+	CAMERA_V4L2_REPLAY_REALTIME = 0,
+	// As soon as a buffer is queued, to measure the read path alone.
+	CAMERA_V4L2_REPLAY_FAST,
+};
+typedef enum camera_v4l2_replay_pacing camera_v4l2_replay_pacing_t;
+
+// Where the frames come from. next returns 0 at the end, data has to
+// stay valid until the following call. rewind starts over for looping,
+// NULL when the source cannot.
+struct camera_v4l2_replay_source {
+	int (*next)(void *user, const void **data, size_t *length,
+		    uint64_t *timestamp_ns, uint32_t *sequence);
+	int (*rewind)(void *user);
+	void *user;
+};
+typedef struct camera_v4l2_replay_source camera_v4l2_replay_source_t;
+
+struct camera_v4l2_replay_param {
+	// The one format the device offers, any other request is answered
+	// with it as drivers do. 0 selects MJPEG, 640x480.
+	uint32_t pixelformat;  // V4L2_PIX_FMT_*
+	uint32_t width;
+	uint32_t height;
+	// Per capture buffer, 0 selects width * height * 2. Longer frames
+	// are cut and flagged V4L2_BUF_FLAG_ERROR.
+	size_t buffer_size;
+	camera_v4l2_replay_pacing_t pacing;
+	// Start over at the end, with sequence and timestamps carrying on.
+	// Otherwise the device reports a disconnect (EPIPE), which closes
+	// the camera.
+	int loop;
+	// Hand out the recorded timestamps as they are. By default they are
+	// moved onto the replay's clock, keeping their intervals, so the
+	// latency stats stay meaningful.
+	int keep_timestamps;
+};
+typedef struct camera_v4l2_replay_param camera_v4l2_replay_param_t;
+
+// Recordings are a sequence of records, each this header in host byte
+// order followed by its payload padded to 8 bytes. Filler records carry
+// no frame, they only keep direct I/O writes block aligned (see
+// camera_v4l2_record.h) and are skipped on replay.
+#define CAMERA_V4L2_REPLAY_MAGIC (0x524c3456u)  // "V4LR"
+#define CAMERA_V4L2_REPLAY_FILLER (1u << 0)
+
+struct camera_v4l2_replay_header {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t sequence;
+	uint32_t flags;  // CAMERA_V4L2_REPLAY_FILLER
+	uint64_t timestamp_ns;
+};
+typedef struct camera_v4l2_replay_header camera_v4l2_replay_header_t;
+
+struct camera_v4l2_replay;
+typedef struct camera_v4l2_replay camera_v4l2_replay_t;
+
+// param may be NULL for the defaults.
+camera_v4l2_replay_t *camera_v4l2_replay_create(
+	const camera_v4l2_replay_param_t *param,
+	const camera_v4l2_replay_source_t *source);
+// Replays a file written with camera_v4l2_replay_record. It is mapped,
+// not read, and a torn record at the end (a crash) ends the replay.
+camera_v4l2_replay_t *camera_v4l2_replay_open(
+	const char *path, const camera_v4l2_replay_param_t *param);
+// Close the camera first.
+void camera_v4l2_replay_destroy(camera_v4l2_replay_t *replay);
+// Valid until destroy.
+const camera_v4l2_backend_t *camera_v4l2_replay_backend(
+	camera_v4l2_replay_t *replay);
+// Appends an acquired frame to fd with its sequence and timestamp.
+int camera_v4l2_replay_record(int fd, const camera_v4l2_frame_t *frame);
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_REPLAY_H_
+
+#ifdef CAMERA_V4L2_IMPLEMENTATION
+#ifndef CAMERA_V4L2_REPLAY_IMPLEMENTATION_
+#define CAMERA_V4L2_REPLAY_IMPLEMENTATION_
+
+#ifdef __cpluscplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <linux/videodev2.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#define CAMERA_V4L2_LOG_ERROR(msg, ...)	\
+do { \
+	fprintf(stderr, "\x1B[31mERROR: [%s][%d] " msg "\e[0m\n", __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define CAMERA_V4L2_ASSERT(cond, msg) \
+do { \
+	if (!(cond)) { \
+		fprintf(stderr, "\x1B[31m Assert failed: [%s][%d] %s \e[0m\n", __FUNCTION__, __LINE__, msg); \
+		exit(1); \
+	} \
+} while(0)
+
+#define CAMERA_V4L2_REPLAY_PAGE (4096)
+
+struct camera_v4l2_replay {
+	camera_v4l2_replay_param_t param;
+	camera_v4l2_replay_source_t source;
+	camera_v4l2_backend_t backend;
+	// Recording mapped by camera_v4l2_replay_open.
+	const uint8_t *map;
+	size_t map_length;
+	size_t map_offset;
+	// The device, a timerfd armed for when the next frame is due.
+	int fd;
+	int streaming;
+	uint8_t **buffers;
+	int buffer_count;
+	size_t buffer_stride;  // Fake mmap offset between buffers
+	int *queued;  // By index
+	int *queue;  // Indices in QBUF order
+	int queue_head;
+	int queue_count;
+	// Next frame from the source, not handed out yet.
+	int pending;
+	const void *data;
+	size_t length;
+	uint64_t timestamp_ns;
+	uint32_t sequence;
+	// Maps recorded time and sequence onto the replay's.
+	int based;
+	uint64_t start_ns;
+	uint64_t first_timestamp_ns;
+	uint64_t last_timestamp_ns;
+	uint64_t interval_ns;
+	uint64_t loop_offset_ns;
+	uint32_t sequence_offset;
+	uint32_t last_sequence;
+	int ended;
+};
+
+static uint64_t camera_v4l2_replay_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int camera_v4l2_replay_file_next(void *user, const void **data,
+					size_t *length, uint64_t *timestamp_ns,
+					uint32_t *sequence) {
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+
+	camera_v4l2_replay_header_t header;
+	size_t payload;
+	do {
+		if (replay->map_length - replay->map_offset < sizeof(header)) {
+			return 0;
+		}
+		memcpy(&header, replay->map + replay->map_offset, sizeof(header));
+		payload = ((size_t) header.length + 7) & ~(size_t) 7;
+		if (header.magic != CAMERA_V4L2_REPLAY_MAGIC ||
+		    replay->map_length - replay->map_offset - sizeof(header) <
+		    payload) {
+			return 0;
+		}
+		if (header.flags & CAMERA_V4L2_REPLAY_FILLER) {
+			replay->map_offset += sizeof(header) + payload;
+		}
+	} while (header.flags & CAMERA_V4L2_REPLAY_FILLER);
+
+	*data = replay->map + replay->map_offset + sizeof(header);
+	*length = header.length;
+	*timestamp_ns = header.timestamp_ns;
+	*sequence = header.sequence;
+	replay->map_offset += sizeof(header) + payload;
+	return 1;
+}
+
+static int camera_v4l2_replay_file_rewind(void *user) {
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+	replay->map_offset = 0;
+	return 1;
+}
+
+// Pulls the next frame into pending, looping over the source if asked
+// to. Returns 0 once the recording is over.
+static int camera_v4l2_replay_fetch(camera_v4l2_replay_t *replay) {
+	if (replay->pending) return 1;
+	if (replay->ended) return 0;
+
+	camera_v4l2_replay_source_t *source = &replay->source;
+	int ok = source->next(source->user, &replay->data, &replay->length,
+			      &replay->timestamp_ns, &replay->sequence);
+	if (!ok && replay->based && replay->param.loop &&
+	    source->rewind != NULL && source->rewind(source->user)) {
+		ok = source->next(source->user, &replay->data, &replay->length,
+				  &replay->timestamp_ns, &replay->sequence);
+		if (ok) {
+			// Carry on one frame interval after the last one.
+			replay->loop_offset_ns += replay->last_timestamp_ns -
+				replay->first_timestamp_ns + replay->interval_ns;
+			replay->sequence_offset =
+				replay->last_sequence + 1 - replay->sequence;
+		}
+	}
+	if (!ok) {
+		replay->ended = 1;
+		return 0;
+	}
+
+	if (!replay->based) {
+		replay->based = 1;
+		replay->first_timestamp_ns = replay->timestamp_ns;
+		replay->last_timestamp_ns = replay->timestamp_ns;
+	}
+	replay->pending = 1;
+	return 1;
+}
+
+// When the pending frame is ready on the replay's clock.
+static uint64_t camera_v4l2_replay_due(camera_v4l2_replay_t *replay) {
+	return replay->start_ns + replay->loop_offset_ns +
+		(replay->timestamp_ns - replay->first_timestamp_ns);
+}
+
+// The fd polls readable once a queued buffer can be dequeued: right
+// away in FAST mode or at the end of the recording, otherwise when the
+// next frame is due.
+static void camera_v4l2_replay_arm(camera_v4l2_replay_t *replay) {
+	struct itimerspec timer;
+	memset(&timer, 0, sizeof(timer));
+	if (replay->streaming && replay->queue_count > 0) {
+		uint64_t due = 1;
+		if (camera_v4l2_replay_fetch(replay) &&
+		    replay->param.pacing == CAMERA_V4L2_REPLAY_REALTIME) {
+			due = camera_v4l2_replay_due(replay);
+		}
+		timer.it_value.tv_sec = due / 1000000000ull;
+		timer.it_value.tv_nsec = due % 1000000000ull;
+	}
+	timerfd_settime(replay->fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+static void camera_v4l2_replay_free_buffers(camera_v4l2_replay_t *replay) {
+	for (int i = 0; i < replay->buffer_count; i++) {
+		free(replay->buffers[i]);
+	}
+	free(replay->buffers);
+	free(replay->queued);
+	free(replay->queue);
+	replay->buffers = NULL;
+	replay->queued = NULL;
+	replay->queue = NULL;
+	replay->buffer_count = 0;
+	replay->queue_head = 0;
+	replay->queue_count = 0;
+}
+
+static int camera_v4l2_replay_reqbufs(camera_v4l2_replay_t *replay,
+				      struct v4l2_requestbuffers *reqbufs) {
+	if (reqbufs->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+	    reqbufs->memory != V4L2_MEMORY_MMAP) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (replay->streaming) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	camera_v4l2_replay_free_buffers(replay);
+	int count = (int) reqbufs->count;
+	if (count > VIDEO_MAX_FRAME) count = VIDEO_MAX_FRAME;
+	reqbufs->count = 0;
+	if (count == 0) return 0;
+
+	replay->buffers = (uint8_t **) calloc(count, sizeof(uint8_t *));
+	replay->queued = (int *) calloc(count, sizeof(int));
+	replay->queue = (int *) calloc(count, sizeof(int));
+	if (replay->buffers == NULL || replay->queued == NULL ||
+	    replay->queue == NULL) {
+		camera_v4l2_replay_free_buffers(replay);
+		errno = ENOMEM;
+		return -1;
+	}
+	replay->buffer_count = count;
+	for (int i = 0; i < count; i++) {
+		void *buffer = NULL;
+		if (posix_memalign(&buffer, CAMERA_V4L2_REPLAY_PAGE,
+				   replay->param.buffer_size) != 0) {
+			camera_v4l2_replay_free_buffers(replay);
+			errno = ENOMEM;
+			return -1;
+		}
+		replay->buffers[i] = (uint8_t *) buffer;
+	}
+
+	reqbufs->count = count;
+	return 0;
+}
+
+static int camera_v4l2_replay_qbuf(camera_v4l2_replay_t *replay,
+				   struct v4l2_buffer *buf) {
+	int index = (int) buf->index;
+	if (index < 0 || index >= replay->buffer_count ||
+	    replay->queued[index]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	replay->queued[index] = 1;
+	int tail = (replay->queue_head + replay->queue_count) % replay->buffer_count;
+	replay->queue[tail] = index;
+	if (replay->queue_count++ == 0) camera_v4l2_replay_arm(replay);
+	return 0;
+}
+
+static int camera_v4l2_replay_dqbuf(camera_v4l2_replay_t *replay,
+				    struct v4l2_buffer *buf) {
+	if (!replay->streaming) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (replay->queue_count == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (!camera_v4l2_replay_fetch(replay)) {
+		// The recording is over, as if the camera was unplugged.
+		errno = EPIPE;
+		return -1;
+	}
+	uint64_t due = camera_v4l2_replay_due(replay);
+	if (replay->param.pacing == CAMERA_V4L2_REPLAY_REALTIME &&
+	    camera_v4l2_replay_now() < due) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	int index = replay->queue[replay->queue_head];
+	replay->queue_head = (replay->queue_head + 1) % replay->buffer_count;
+	replay->queue_count--;
+	replay->queued[index] = 0;
+
+	size_t length = replay->length;
+	uint32_t flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_DONE |
+		V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+	if (length > replay->param.buffer_size) {
+		length = replay->param.buffer_size;
+		flags |= V4L2_BUF_FLAG_ERROR;
+	}
+	memcpy(replay->buffers[index], replay->data, length);
+
+	uint64_t timestamp = replay->timestamp_ns;
+	if (!replay->param.keep_timestamps) {
+		timestamp = replay->param.pacing == CAMERA_V4L2_REPLAY_REALTIME ?
+			due : camera_v4l2_replay_now();
+	}
+	uint32_t sequence = replay->sequence + replay->sequence_offset;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = V4L2_MEMORY_MMAP;
+	buf->index = index;
+	buf->bytesused = length;
+	buf->length = replay->param.buffer_size;
+	buf->flags = flags;
+	buf->field = V4L2_FIELD_NONE;
+	buf->sequence = sequence;
+	buf->timestamp.tv_sec = timestamp / 1000000000ull;
+	buf->timestamp.tv_usec = (timestamp % 1000000000ull) / 1000;
+	buf->m.offset = index * replay->buffer_stride;
+
+	if (replay->timestamp_ns > replay->last_timestamp_ns) {
+		replay->interval_ns = replay->timestamp_ns - replay->last_timestamp_ns;
+	}
+	replay->last_timestamp_ns = replay->timestamp_ns;
+	replay->last_sequence = sequence;
+	replay->pending = 0;
+	camera_v4l2_replay_arm(replay);
+	return 0;
+}
+
+static void camera_v4l2_replay_fill_format(camera_v4l2_replay_t *replay,
+					   struct v4l2_pix_format *pix) {
+	memset(pix, 0, sizeof(*pix));
+	pix->width = replay->param.width;
+	pix->height = replay->param.height;
+	pix->pixelformat = replay->param.pixelformat;
+	pix->field = V4L2_FIELD_NONE;
+	if (pix->pixelformat == V4L2_PIX_FMT_YUYV) {
+		pix->bytesperline = pix->width * 2;
+	}
+	pix->sizeimage = replay->param.buffer_size;
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+}
+
+static int camera_v4l2_replay_ioctl(int fd, unsigned long request,
+				    void *arg, void *user) {
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+	if (fd != replay->fd || fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	// Requests passed through an int arrive sign extended, the kernel
+	// only looks at the low 32 bits too.
+	unsigned int command = (unsigned int) request;
+	switch (command) {
+		case VIDIOC_QUERYCAP: {
+			struct v4l2_capability *cap = (struct v4l2_capability *) arg;
+			memset(cap, 0, sizeof(*cap));
+			snprintf((char *) cap->driver, sizeof(cap->driver), "replay");
+			snprintf((char *) cap->card, sizeof(cap->card),
+				 "camera_v4l2 replay %ux%u",
+				 replay->param.width, replay->param.height);
+			snprintf((char *) cap->bus_info, sizeof(cap->bus_info),
+				 "replay:%.4s", (const char *) &replay->param.pixelformat);
+			cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+			cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+			return 0;
+		}
+		case VIDIOC_ENUM_FMT: {
+			struct v4l2_fmtdesc *desc = (struct v4l2_fmtdesc *) arg;
+			if (desc->index != 0 ||
+			    desc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) break;
+			desc->pixelformat = replay->param.pixelformat;
+			desc->flags = replay->param.pixelformat == V4L2_PIX_FMT_MJPEG ?
+				V4L2_FMT_FLAG_COMPRESSED : 0;
+			snprintf((char *) desc->description, sizeof(desc->description),
+				 "%.4s", (const char *) &replay->param.pixelformat);
+			return 0;
+		}
+		case VIDIOC_ENUM_FRAMESIZES: {
+			struct v4l2_frmsizeenum *size = (struct v4l2_frmsizeenum *) arg;
+			if (size->index != 0 ||
+			    size->pixel_format != replay->param.pixelformat) break;
+			size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+			size->discrete.width = replay->param.width;
+			size->discrete.height = replay->param.height;
+			return 0;
+		}
+		case VIDIOC_G_FMT:
+		case VIDIOC_S_FMT:
+		case VIDIOC_TRY_FMT: {
+			struct v4l2_format *fmt = (struct v4l2_format *) arg;
+			if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) break;
+			if (command == VIDIOC_S_FMT && replay->buffer_count > 0) {
+				errno = EBUSY;
+				return -1;
+			}
+			camera_v4l2_replay_fill_format(replay, &fmt->fmt.pix);
+			return 0;
+		}
+		case VIDIOC_REQBUFS:
+			return camera_v4l2_replay_reqbufs(
+				replay, (struct v4l2_requestbuffers *) arg);
+		case VIDIOC_QUERYBUF: {
+			struct v4l2_buffer *buf = (struct v4l2_buffer *) arg;
+			if ((int) buf->index >= replay->buffer_count) break;
+			buf->length = replay->param.buffer_size;
+			buf->m.offset = buf->index * replay->buffer_stride;
+			buf->flags = V4L2_BUF_FLAG_MAPPED |
+				(replay->queued[buf->index] ? V4L2_BUF_FLAG_QUEUED : 0);
+			return 0;
+		}
+		case VIDIOC_QBUF:
+			return camera_v4l2_replay_qbuf(replay, (struct v4l2_buffer *) arg);
+		case VIDIOC_DQBUF:
+			return camera_v4l2_replay_dqbuf(replay, (struct v4l2_buffer *) arg);
+		case VIDIOC_STREAMON: {
+			if (replay->buffer_count == 0) break;
+			if (!replay->streaming) {
+				replay->streaming = 1;
+				// The next frame is due right away, the ones after
+				// it at their recorded intervals.
+				replay->start_ns = camera_v4l2_replay_now();
+				replay->loop_offset_ns = 0;
+				replay->based = replay->pending;
+				replay->first_timestamp_ns = replay->timestamp_ns;
+				replay->last_timestamp_ns = replay->timestamp_ns;
+				camera_v4l2_replay_arm(replay);
+			}
+			return 0;
+		}
+		case VIDIOC_STREAMOFF: {
+			replay->streaming = 0;
+			replay->queue_head = 0;
+			replay->queue_count = 0;
+			for (int i = 0; i < replay->buffer_count; i++) {
+				replay->queued[i] = 0;
+			}
+			camera_v4l2_replay_arm(replay);
+			return 0;
+		}
+		case VIDIOC_G_PARM:
+		case VIDIOC_S_PARM:
+		case VIDIOC_ENUM_FRAMEINTERVALS:
+		case VIDIOC_EXPBUF:
+			// Not offered, as some drivers do.
+			break;
+		default:
+			errno = ENOTTY;
+			return -1;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int camera_v4l2_replay_open_device(const char *path, int flags,
+					  void *user) {
+	(void) path;
+	(void) flags;
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+	if (replay->fd != -1) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	replay->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (replay->fd < 0) {
+		replay->fd = -1;
+		return -1;
+	}
+	replay->pending = 0;
+	replay->ended = 0;
+	replay->based = 0;
+	replay->sequence_offset = 0;
+	if (replay->source.rewind != NULL) {
+		replay->source.rewind(replay->source.user);
+	}
+	return replay->fd;
+}
+
+static int camera_v4l2_replay_close_device(int fd, void *user) {
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+	if (fd != replay->fd || fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	replay->streaming = 0;
+	camera_v4l2_replay_free_buffers(replay);
+	close(replay->fd);
+	replay->fd = -1;
+	return 0;
+}
+
+static void *camera_v4l2_replay_mmap(size_t length, int fd,
+				     uint32_t offset, void *user) {
+	camera_v4l2_replay_t *replay = (camera_v4l2_replay_t *) user;
+	size_t index = offset / replay->buffer_stride;
+	if (fd != replay->fd || offset % replay->buffer_stride != 0 ||
+	    index >= (size_t) replay->buffer_count ||
+	    length > replay->param.buffer_size) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return replay->buffers[index];
+}
+
+static int camera_v4l2_replay_munmap(void *start, size_t length, void *user) {
+	// The buffers belong to the replay, freed with REQBUFS or close.
+	(void) start;
+	(void) length;
+	(void) user;
+	return 0;
+}
+
+camera_v4l2_replay_t *camera_v4l2_replay_create(
+	const camera_v4l2_replay_param_t *param,
+	const camera_v4l2_replay_source_t *source) {
+	CAMERA_V4L2_ASSERT(source != NULL && source->next != NULL,
+			   "Source is null!!!");
+
+	camera_v4l2_replay_t *replay =
+		(camera_v4l2_replay_t *) calloc(1, sizeof(camera_v4l2_replay_t));
+	if (replay == NULL) return NULL;
+
+	if (param != NULL) replay->param = *param;
+	if (replay->param.pixelformat == 0) {
+		replay->param.pixelformat = V4L2_PIX_FMT_MJPEG;
+	}
+	if (replay->param.width == 0 || replay->param.height == 0) {
+		replay->param.width = 640;
+		replay->param.height = 480;
+	}
+	if (replay->param.buffer_size == 0) {
+		replay->param.buffer_size =
+			(size_t) replay->param.width * replay->param.height * 2;
+	}
+	replay->buffer_stride = (replay->param.buffer_size +
+		CAMERA_V4L2_REPLAY_PAGE - 1) & ~(size_t) (CAMERA_V4L2_REPLAY_PAGE - 1);
+	replay->source = *source;
+	replay->fd = -1;
+
+	replay->backend.open = camera_v4l2_replay_open_device;
+	replay->backend.close = camera_v4l2_replay_close_device;
+	replay->backend.ioctl = camera_v4l2_replay_ioctl;
+	replay->backend.mmap = camera_v4l2_replay_mmap;
+	replay->backend.munmap = camera_v4l2_replay_munmap;
+	replay->backend.user = replay;
+
+	return replay;
+}
+
+camera_v4l2_replay_t *camera_v4l2_replay_open(
+	const char *path, const camera_v4l2_replay_param_t *param) {
+	CAMERA_V4L2_ASSERT(path != NULL, "Path is null!!!");
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		CAMERA_V4L2_LOG_ERROR("Cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	const uint8_t *map = NULL;
+	if (st.st_size > 0) {
+		void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED) {
+			CAMERA_V4L2_LOG_ERROR("Cannot map %s: %s", path, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		map = (const uint8_t *) ptr;
+		madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	camera_v4l2_replay_source_t source;
+	source.next = camera_v4l2_replay_file_next;
+	source.rewind = camera_v4l2_replay_file_rewind;
+	source.user = NULL;
+	camera_v4l2_replay_t *replay = camera_v4l2_replay_create(param, &source);
+	if (replay == NULL) {
+		if (map != NULL) munmap((void *) map, st.st_size);
+		return NULL;
+	}
+	replay->source.user = replay;
+	replay->map = map;
+	replay->map_length = map != NULL ? (size_t) st.st_size : 0;
+
+	return replay;
+}
+
+void camera_v4l2_replay_destroy(camera_v4l2_replay_t *replay) {
+	if (replay == NULL) return;
+
+	if (replay->fd != -1) {
+		camera_v4l2_replay_close_device(replay->fd, replay);
+	}
+	if (replay->map != NULL) {
+		munmap((void *) replay->map, replay->map_length);
+	}
+	free(replay);
+}
+
+const camera_v4l2_backend_t *camera_v4l2_replay_backend(
+	camera_v4l2_replay_t *replay) {
+	CAMERA_V4L2_ASSERT(replay != NULL, "Object is null!!!");
+	return &replay->backend;
+}
+
+int camera_v4l2_replay_record(int fd, const camera_v4l2_frame_t *frame) {
+	CAMERA_V4L2_ASSERT(frame != NULL, "Frame is null!!!");
+
+	camera_v4l2_replay_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CAMERA_V4L2_REPLAY_MAGIC;
+	header.length = (uint32_t) frame->length;
+	header.sequence = frame->meta.sequence;
+	header.timestamp_ns = frame->meta.timestamp_ns;
+
+	static const uint8_t padding[8] = { 0 };
+	struct iovec iov[3];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = frame->start;
+	iov[1].iov_len = frame->length;
+	iov[2].iov_base = (void *) padding;
+	iov[2].iov_len = (8 - frame->length % 8) % 8;
+	size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+	ssize_t written;
+	do {
+		written = writev(fd, iov, 3);
+	} while (written < 0 && errno == EINTR);
+	if (written < 0) {
+		CAMERA_V4L2_LOG_ERROR("Cannot record frame: %s", strerror(errno));
+		return 0;
+	}
+	if ((size_t) written != total) {
+		CAMERA_V4L2_LOG_ERROR("Short write recording frame");
+		errno = EIO;
+		return 0;
+	}
+
+	return 1;
+}
+
+#undef CAMERA_V4L2_LOG_ERROR
+#undef CAMERA_V4L2_ASSERT
+#undef CAMERA_V4L2_REPLAY_PAGE
+
+#ifdef __cpluscplus
+}
+#endif
+
+#endif  // CAMERA_V4L2_REPLAY_IMPLEMENTATION_
+#endif  // CAMERA_V4L2_IMPLEMENTATION
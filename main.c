@@ -4,17 +4,25 @@
 
 #define CAMERA_V4L2_IMPLEMENTATION
 #include "camera_v4l2.h"
+#include "camera_v4l2_decode.h"
 
 int main() {
 	camera_v4l2_camera_t *camera = camera_v4l2_create();
 
 	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
 	param.frame_width = 640;
 	param.frame_height = 480;
 	param.fmt = MJPEG;
+	param.validate = CAMERA_V4L2_VALIDATE_DROP;
 
 	camera_v4l2_open(camera, 0, &param);
 
+	camera_v4l2_decoder_t *decoder = camera_v4l2_decoder_create();
+	camera_v4l2_image_t image;
+	memset(&image, 0, sizeof(image));
+	image.format = CAMERA_V4L2_DECODE_BGR;
+
 	if (camera_v4l2_isopened(camera) == 0) {
 		printf(":(\n");
 		std::terminate();
@@ -32,8 +40,8 @@ int main() {
 
 		[[maybe_unused]]
 		int ret = camera_v4l2_read(camera, &frame);
-		if (ret) {
-			cv::Mat f = cv::imdecode(cv::Mat(1, frame.length, CV_8UC1, frame.start), cv::IMREAD_COLOR);
+		if (ret && camera_v4l2_decode(decoder, frame.start, frame.length, &image)) {
+			cv::Mat f(image.height, image.width, CV_8UC3, image.data);
 			cv::imshow("frame", f);
 		}
 
@@ -44,6 +52,7 @@ int main() {
 
 	// TODO: should destroy window. Never mind :).
 
+	camera_v4l2_decoder_destroy(decoder);
 	camera_v4l2_destroy(camera);
 	return 0;
 }
@@ -7,13 +7,16 @@
 
 #define CAMERA_V4L2_IMPLEMENTATION
 #include "../camera_v4l2.h"
+#include "../camera_v4l2_decode.h"
 
 CameraThread::CameraThread(QObject *parent) : QThread(parent) {
   camera_ = nullptr;
   camera_ = camera_v4l2_create();
+  decoder_ = camera_v4l2_decoder_create();
 
   if (camera_ != nullptr) {
     camera_v4l2_param_t param;
+    memset(&param, 0, sizeof(param));
     param.frame_width = 640;
     param.frame_height = 480;
     param.fmt = MJPEG;
@@ -22,18 +25,28 @@ CameraThread::CameraThread(QObject *parent) : QThread(parent) {
 }
 
 CameraThread::~CameraThread() {
+  camera_v4l2_decoder_destroy(decoder_);
   camera_v4l2_destroy(camera_);
 }
 
 void CameraThread::run() {
+  camera_v4l2_image_t image;
+  memset(&image, 0, sizeof(image));
+  image.format = CAMERA_V4L2_DECODE_RGB;
+
   while (true) {
     camera_v4l2_buffer_t buf;
     int ret = camera_v4l2_read(camera_, &buf);
     if (ret) {
-      QImage image = QImage::fromData((const unsigned char*)buf.start, buf.length);
-      emit ReadFrameSignal(image.copy());
+      if (camera_v4l2_decode(decoder_, buf.start, buf.length, &image)) {
+        QImage frame((const uchar *)image.data, image.width, image.height,
+                     image.width * 3, QImage::Format_RGB888);
+        emit ReadFrameSignal(frame.copy());
+      }
+    } else {
+      // Not opened or disconnected, read returns straight away.
+      QThread::msleep(10);
     }
-    QThread::msleep(10);
   } 
 }
 
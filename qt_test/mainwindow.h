@@ -7,6 +7,7 @@
 #include <QImage>
 
 #include "../camera_v4l2.h"
+#include "../camera_v4l2_decode.h"
 
 namespace Ui {
   class MainWindow;
@@ -24,6 +25,7 @@ class CameraThread : public QThread {
   virtual void run() override;
  private:
   camera_v4l2_camera_t *camera_;
+  camera_v4l2_decoder_t *decoder_;
 };
 
 class MainWindow : public QWidget {
@@ -0,0 +1,441 @@
+// Writes AVIs and walks their RIFF structure back: every frame must be
+// in the movi lists as written (Huffman tables added where missing, an
+// empty chunk per dropped frame), and the OpenDML index chunks, the top
+// level index, the legacy idx1 and the header counts must all point at
+// exactly those chunks. Segments are kept small so that a longer file
+// spans several AVIX segments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+// Twice the headers, which take up the first 64 KiB.
+#define AVI_TEST_RIFF_SIZE (128 * 1024)
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#define CAMERA_V4L2_AVI_RIFF_SIZE AVI_TEST_RIFF_SIZE
+#include "camera_v4l2.h"
+#include "camera_v4l2_avi.h"
+
+// Not a divisor of the frame counts, so the last index chunk is partial.
+#define AVI_TEST_INDEX_FRAMES (7)
+#define AVI_TEST_MAX_CHUNKS (1024)
+#define AVI_TEST_MAX_SEGMENTS (16)
+// Empty chunks written for a gap, at the default 30 fps.
+#define AVI_TEST_MAX_GAP (5 * 30)
+#define AVI_TEST_FOURCC(a, b, c, d) \
+	((uint32_t) (a) | ((uint32_t) (b) << 8) | \
+	 ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+#define AVI_TEST_HASINDEX (0x10)  // avih flag
+#define AVI_TEST_KEYFRAME (0x10)  // idx1 flag
+#define AVI_TEST_NOT_KEYFRAME (0x80000000u)  // In an index chunk entry's size
+
+struct avi_test_chunk {
+	size_t offset;  // Of the data
+	uint32_t size;
+	int segment;
+};
+
+struct avi_test_file {
+	const uint8_t *data;
+	size_t length;
+	// Found while walking it.
+	size_t avih;
+	size_t strh;
+	size_t indx;
+	size_t dmlh;
+	// The first segment's movi list, its fourcc, and the idx1 after it.
+	size_t movi;
+	size_t movi_end;
+	size_t idx1;
+	uint32_t idx1_size;
+	size_t segments[AVI_TEST_MAX_SEGMENTS];  // Of the RIFF chunks
+	int segment_count;
+	struct avi_test_chunk frames[AVI_TEST_MAX_CHUNKS];
+	int frame_count;
+	int first_frames;  // In the first segment
+	struct avi_test_chunk indexes[AVI_TEST_MAX_CHUNKS];
+	int index_count;
+};
+
+static uint32_t avi_test_get32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+		((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t avi_test_get64(const uint8_t *p) {
+	return avi_test_get32(p) | ((uint64_t) avi_test_get32(p + 4) << 32);
+}
+
+// A baseline JPEG's marker layout around scan data that is just bytes:
+// SOI, DQT, optionally DHT, SOS, data and EOI.
+static uint8_t *avi_test_frame(int index, int with_dht, size_t *length) {
+	size_t scan = 200 + (size_t) index * 37 % 500;
+	size_t dht = with_dht ? 4 + 20 : 0;
+	*length = 2 + (4 + 65) + dht + (4 + 8) + scan + 2;
+	uint8_t *frame = (uint8_t *) malloc(*length);
+	uint8_t *p = frame;
+
+	*p++ = 0xFF;
+	*p++ = 0xD8;
+	*p++ = 0xFF;
+	*p++ = 0xDB;
+	*p++ = 0;
+	*p++ = 2 + 65;
+	memset(p, index, 65);
+	p += 65;
+	if (with_dht) {
+		*p++ = 0xFF;
+		*p++ = 0xC4;
+		*p++ = 0;
+		*p++ = 2 + 20;
+		memset(p, 0x11, 20);
+		p += 20;
+	}
+	*p++ = 0xFF;
+	*p++ = 0xDA;
+	*p++ = 0;
+	*p++ = 2 + 8;
+	memset(p, 0x22, 8);
+	p += 8;
+	for (size_t i = 0; i < scan; i++) *p++ = (uint8_t) (i * 7 + index);
+	*p++ = 0xFF;
+	*p++ = 0xD9;
+
+	return frame;
+}
+
+// What the writer makes of a frame without tables: the standard ones
+// in front of its SOS.
+static uint8_t *avi_test_with_dht(const uint8_t *frame, size_t length,
+				  size_t *patched_length) {
+	size_t sos = camera_v4l2_avi_dht_position(frame, length);
+	*patched_length = length + sizeof(camera_v4l2_avi_dht);
+	uint8_t *patched = (uint8_t *) malloc(*patched_length);
+	memcpy(patched, frame, sos);
+	memcpy(patched + sos, camera_v4l2_avi_dht, sizeof(camera_v4l2_avi_dht));
+	memcpy(patched + sos + sizeof(camera_v4l2_avi_dht), frame + sos,
+	       length - sos);
+	return patched;
+}
+
+// Walks the chunks from offset to end. Returns 0 when one overruns its
+// list or the file.
+static int avi_test_walk(struct avi_test_file *file, size_t offset,
+			 size_t end) {
+	while (offset + 8 <= end) {
+		const uint8_t *p = file->data + offset;
+		uint32_t fourcc = avi_test_get32(p);
+		uint32_t size = avi_test_get32(p + 4);
+		if (offset + 8 + size > end) {
+			printf("chunk at %zu overruns its list\n", offset);
+			return 0;
+		}
+
+		if (fourcc == AVI_TEST_FOURCC('L', 'I', 'S', 'T')) {
+			if (avi_test_get32(p + 8) == AVI_TEST_FOURCC('m', 'o', 'v', 'i') &&
+			    file->movi == 0) {
+				file->movi = offset + 8;
+				file->movi_end = offset + 8 + size;
+			}
+			if (!avi_test_walk(file, offset + 12, offset + 8 + size)) return 0;
+		} else if (fourcc == AVI_TEST_FOURCC('0', '0', 'd', 'c') ||
+			   fourcc == AVI_TEST_FOURCC('i', 'x', '0', '0')) {
+			struct avi_test_chunk *chunk =
+				fourcc == AVI_TEST_FOURCC('0', '0', 'd', 'c') ?
+				&file->frames[file->frame_count++] :
+				&file->indexes[file->index_count++];
+			chunk->offset = offset + 8;
+			chunk->size = size;
+			chunk->segment = file->segment_count - 1;
+			if (file->frame_count == AVI_TEST_MAX_CHUNKS ||
+			    file->index_count == AVI_TEST_MAX_CHUNKS) {
+				printf("too many chunks\n");
+				return 0;
+			}
+		} else if (fourcc == AVI_TEST_FOURCC('a', 'v', 'i', 'h')) {
+			file->avih = offset + 8;
+		} else if (fourcc == AVI_TEST_FOURCC('s', 't', 'r', 'h')) {
+			file->strh = offset + 8;
+		} else if (fourcc == AVI_TEST_FOURCC('i', 'n', 'd', 'x')) {
+			file->indx = offset + 8;
+		} else if (fourcc == AVI_TEST_FOURCC('d', 'm', 'l', 'h')) {
+			file->dmlh = offset + 8;
+		} else if (fourcc == AVI_TEST_FOURCC('i', 'd', 'x', '1') &&
+			   file->idx1 == 0) {
+			file->idx1 = offset;
+			file->idx1_size = size;
+		}
+		offset += 8 + size + (size & 1);
+	}
+	return 1;
+}
+
+// Walks the RIFF segments, an AVI one then AVIX ones, which have to end
+// exactly with the file. Returns 0 when they do not.
+static int avi_test_walk_file(struct avi_test_file *file) {
+	size_t offset = 0;
+	while (offset < file->length) {
+		const uint8_t *p = file->data + offset;
+		uint32_t type = file->segment_count == 0 ?
+			AVI_TEST_FOURCC('A', 'V', 'I', ' ') :
+			AVI_TEST_FOURCC('A', 'V', 'I', 'X');
+		if (file->length - offset < 12 ||
+		    avi_test_get32(p) != AVI_TEST_FOURCC('R', 'I', 'F', 'F') ||
+		    avi_test_get32(p + 8) != type ||
+		    file->length - offset - 8 < avi_test_get32(p + 4) ||
+		    file->segment_count == AVI_TEST_MAX_SEGMENTS) {
+			printf("bad RIFF segment at %zu\n", offset);
+			return 0;
+		}
+		uint32_t size = avi_test_get32(p + 4);
+		file->segments[file->segment_count++] = offset;
+		if (!avi_test_walk(file, offset + 12, offset + 8 + size)) return 0;
+		if (file->segment_count == 1) file->first_frames = file->frame_count;
+		offset += 8 + size + (size & 1);
+	}
+	return file->segment_count > 0 && offset == file->length;
+}
+
+// Checks the indexes and headers against the chunks found. Returns the
+// number of failures.
+static int avi_test_check_indexes(const struct avi_test_file *file) {
+	const uint8_t *data = file->data;
+	int failures = 0;
+
+	// OpenDML index chunks, one after another cover every frame.
+	int frame = 0;
+	for (int i = 0; i < file->index_count; i++) {
+		const uint8_t *p = data + file->indexes[i].offset;
+		uint32_t count = avi_test_get32(p + 4);
+		uint64_t base = avi_test_get64(p + 12);
+		int segment = file->indexes[i].segment;
+		if (base != file->segments[segment]) {
+			printf("index chunk %d based at %llu, its segment at %zu\n", i,
+			       (unsigned long long) base, file->segments[segment]);
+			failures++;
+		}
+		for (uint32_t k = 0; k < count; k++, frame++) {
+			if (frame >= file->frame_count) break;
+			uint32_t offset = avi_test_get32(p + 24 + 8 * k);
+			uint32_t size = avi_test_get32(p + 24 + 8 * k + 4);
+			const struct avi_test_chunk *chunk = &file->frames[frame];
+			int keyframe = !(size & AVI_TEST_NOT_KEYFRAME);
+			if (chunk->segment != segment ||
+			    base + offset != chunk->offset ||
+			    (size & ~AVI_TEST_NOT_KEYFRAME) != chunk->size ||
+			    keyframe != (chunk->size > 0)) {
+				printf("index chunk %d entry %u is wrong\n", i, k);
+				failures++;
+			}
+		}
+	}
+	if (frame != file->frame_count) {
+		printf("index chunks cover %d of %d frames\n", frame, file->frame_count);
+		failures++;
+	}
+
+	// The top level index lists exactly those chunks.
+	uint32_t in_use = avi_test_get32(data + file->indx + 4);
+	if (in_use != (uint32_t) file->index_count) {
+		printf("top level index lists %u of %d index chunks\n", in_use,
+		       file->index_count);
+		failures++;
+	}
+	for (uint32_t i = 0; i < in_use && i < (uint32_t) file->index_count; i++) {
+		const uint8_t *p = data + file->indx + 24 + 16 * i;
+		const struct avi_test_chunk *chunk = &file->indexes[i];
+		if (avi_test_get64(p) != chunk->offset - 8 ||
+		    avi_test_get32(p + 8) != chunk->size + 8 ||
+		    avi_test_get32(p + 12) != avi_test_get32(data + chunk->offset + 4)) {
+			printf("top level index entry %u is wrong\n", i);
+			failures++;
+		}
+	}
+
+	// idx1 follows the first movi list, offsets from its fourcc.
+	if (file->idx1 != file->movi_end) {
+		printf("idx1 at %zu, movi ends at %zu\n", file->idx1, file->movi_end);
+		return failures + 1;
+	}
+	uint32_t legacy_count = file->idx1_size / 16;
+	if (legacy_count != (uint32_t) file->first_frames) {
+		printf("idx1 lists %u of %d frames\n", legacy_count, file->first_frames);
+		failures++;
+	}
+	for (uint32_t i = 0; i < legacy_count && i < (uint32_t) file->first_frames; i++) {
+		const uint8_t *p = data + file->idx1 + 8 + 16 * i;
+		const struct avi_test_chunk *chunk = &file->frames[i];
+		uint32_t flags = chunk->size > 0 ? AVI_TEST_KEYFRAME : 0;
+		if (avi_test_get32(p) != AVI_TEST_FOURCC('0', '0', 'd', 'c') ||
+		    avi_test_get32(p + 4) != flags ||
+		    file->movi + avi_test_get32(p + 8) + 8 != chunk->offset ||
+		    avi_test_get32(p + 12) != chunk->size) {
+			printf("idx1 entry %u is wrong\n", i);
+			failures++;
+		}
+	}
+
+	// avih counts the first segment, the rest the whole file.
+	uint32_t total = (uint32_t) file->frame_count;
+	if (!(avi_test_get32(data + file->avih + 12) & AVI_TEST_HASINDEX) ||
+	    avi_test_get32(data + file->avih + 16) != (uint32_t) file->first_frames ||
+	    avi_test_get32(data + file->strh + 32) != total ||
+	    avi_test_get32(data + file->dmlh) != total) {
+		printf("header counts are not %d of %u frames with an index\n",
+		       file->first_frames, total);
+		failures++;
+	}
+
+	// Segments roll over before outgrowing their size, the first one
+	// then gets its idx1 on top.
+	for (int i = 0; i < file->segment_count; i++) {
+		uint32_t size = avi_test_get32(data + file->segments[i] + 4);
+		if (i == 0) size -= 8 + file->idx1_size;
+		if (size > AVI_TEST_RIFF_SIZE) {
+			printf("segment %d is %u bytes\n", i, size);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+// Writes frame_count frames, some dropped and one with a gap too long
+// to fill at gap_frame (-1 for none), and checks the file. Returns the
+// number of failures.
+static int avi_test_run(const char *path, int frame_count, int gap_frame,
+			int min_segments, int max_segments) {
+	camera_v4l2_avi_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.width = 320;
+	param.height = 240;
+	param.index_frames = AVI_TEST_INDEX_FRAMES;
+	camera_v4l2_avi_t *avi = camera_v4l2_avi_open(path, &param);
+	if (avi == NULL) {
+		printf("cannot open %s\n", path);
+		return 1;
+	}
+
+	// Expected movi content, an empty chunk per dropped frame.
+	static uint8_t *expected[AVI_TEST_MAX_CHUNKS];
+	static size_t expected_length[AVI_TEST_MAX_CHUNKS];
+	int expected_count = 0;
+	int failures = 0;
+	for (int i = 0; i < frame_count; i++) {
+		size_t length;
+		uint8_t *frame = avi_test_frame(i, i % 2, &length);
+		unsigned int dropped = i % 10 == 4 ? 2 : 0;
+		unsigned int written = dropped;
+		if (i == gap_frame) {
+			dropped = 1u << 31;
+			written = AVI_TEST_MAX_GAP;
+		}
+		if (expected_count + written + 1 > AVI_TEST_MAX_CHUNKS) {
+			printf("too many chunks\n");
+			free(frame);
+			failures++;
+			break;
+		}
+		if (!camera_v4l2_avi_write(avi, frame, length, dropped)) {
+			printf("frame %d: write failed\n", i);
+			failures++;
+		}
+		for (unsigned int k = 0; k < written; k++) {
+			expected[expected_count] = NULL;
+			expected_length[expected_count++] = 0;
+		}
+		if (i % 2) {
+			expected[expected_count] = frame;
+			expected_length[expected_count++] = length;
+		} else {
+			expected[expected_count] =
+				avi_test_with_dht(frame, length, &expected_length[expected_count]);
+			expected_count++;
+			free(frame);
+		}
+	}
+	if (!camera_v4l2_avi_close(avi)) {
+		printf("close failed\n");
+		failures++;
+	}
+
+	static struct avi_test_file file;
+	memset(&file, 0, sizeof(file));
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	uint8_t *data = NULL;
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		data = (uint8_t *) malloc(st.st_size);
+		if (read(fd, data, st.st_size) != st.st_size) {
+			free(data);
+			data = NULL;
+		}
+	}
+	if (fd >= 0) close(fd);
+	unlink(path);
+	if (data == NULL) {
+		printf("cannot read back %s\n", path);
+		for (int i = 0; i < expected_count; i++) free(expected[i]);
+		return failures + 1;
+	}
+	file.data = data;
+	file.length = (size_t) st.st_size;
+
+	if (!avi_test_walk_file(&file) ||
+	    file.avih == 0 || file.strh == 0 || file.indx == 0 ||
+	    file.dmlh == 0 || file.movi == 0 || file.idx1 == 0) {
+		printf("not an AVI with OpenDML and legacy indexes\n");
+		failures++;
+	} else {
+		if (file.segment_count < min_segments ||
+		    file.segment_count > max_segments) {
+			printf("%d segment(s), expected %d to %d\n", file.segment_count,
+			       min_segments, max_segments);
+			failures++;
+		}
+		if (file.frame_count != expected_count) {
+			printf("%d frame chunks, expected %d\n", file.frame_count,
+			       expected_count);
+			failures++;
+		}
+		for (int i = 0; i < file.frame_count && i < expected_count; i++) {
+			if (file.frames[i].size != expected_length[i] ||
+			    (expected_length[i] > 0 &&
+			     memcmp(data + file.frames[i].offset, expected[i],
+				    expected_length[i]) != 0)) {
+				printf("frame chunk %d differs\n", i);
+				failures++;
+			}
+		}
+		failures += avi_test_check_indexes(&file);
+	}
+
+	for (int i = 0; i < expected_count; i++) free(expected[i]);
+	free(data);
+
+	printf("%d frames: %d frame chunk(s), %d index chunk(s), %d segment(s)\n",
+	       frame_count, file.frame_count, file.index_count, file.segment_count);
+	return failures;
+}
+
+int main(void) {
+	char dir[] = "/tmp/camera_v4l2_test.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "%s/avi_test.avi", dir);
+
+	// Within the first segment, then across several.
+	int failures = avi_test_run(path, 50, -1, 1, 1);
+	failures += avi_test_run(path, 500, 250, 3, AVI_TEST_MAX_SEGMENTS);
+	rmdir(dir);
+
+	printf("avi: %d failure(s)\n", failures);
+	return failures == 0 ? 0 : 1;
+}
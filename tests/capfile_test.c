@@ -0,0 +1,231 @@
+// Capture file crash safety: indexed recordings open in place, and a
+// torn index, a torn recording, a missing index or a corrupted one still
+// yield every complete frame, found by scanning. Each case checks the
+// frames, seeking and streaming through a replay.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+#include "camera_v4l2_capfile.h"
+#include "camera_v4l2_record.h"
+
+#include "test_recording.h"
+
+// Where the recording is cut short.
+#define CAPFILE_TEST_TORN_FRAME (250)
+
+// Checks the capture file at path holds the first count frames, read
+// through the index when in_place. Returns the number of failures.
+static int capfile_test_check(const struct test_recording *test,
+			      const char *path, const char *name,
+			      size_t count, int in_place) {
+	camera_v4l2_capfile_t *capfile = camera_v4l2_capfile_open(path);
+	if (capfile == NULL) {
+		printf("%s: cannot open\n", name);
+		return 1;
+	}
+
+	int failures = 0;
+	size_t found = camera_v4l2_capfile_count(capfile);
+	if (found != count) {
+		printf("%s: %zu frames, expected %zu\n", name, found, count);
+		failures++;
+	}
+	if ((capfile->owned == NULL) != in_place) {
+		printf("%s: index %s, expected the opposite\n", name,
+		       in_place ? "rebuilt" : "used in place");
+		failures++;
+	}
+
+	for (size_t i = 0; i < found; i++) {
+		camera_v4l2_capfile_frame_t frame;
+		if (!camera_v4l2_capfile_frame(capfile, i, &frame) ||
+		    !test_recording_match(test, i, frame.data, frame.length,
+					  frame.sequence, frame.timestamp_ns)) {
+			printf("%s: frame %zu differs\n", name, i);
+			failures++;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < found; i++) {
+		uint64_t timestamp = TEST_RECORDING_TIMESTAMP(i);
+		if (camera_v4l2_capfile_seek(capfile, timestamp) != i ||
+		    camera_v4l2_capfile_seek(capfile, timestamp - 1) != i) {
+			printf("%s: seeking to frame %zu failed\n", name, i);
+			failures++;
+			break;
+		}
+	}
+	if (camera_v4l2_capfile_seek(capfile, 0) != 0 ||
+	    camera_v4l2_capfile_seek(capfile, TEST_RECORDING_TIMESTAMP(found)) != found) {
+		printf("%s: seeking out of range failed\n", name);
+		failures++;
+	}
+
+	// Stream the second half.
+	size_t first = camera_v4l2_capfile_seek(
+		capfile, TEST_RECORDING_TIMESTAMP(found / 2) - 5);
+	camera_v4l2_replay_source_t source;
+	camera_v4l2_capfile_source(capfile, first, &source);
+	camera_v4l2_replay_t *replay;
+	camera_v4l2_camera_t *camera = test_recording_camera(&source, 0, &replay);
+	if (camera == NULL) {
+		printf("%s: cannot stream\n", name);
+		camera_v4l2_capfile_close(capfile);
+		return failures + 1;
+	}
+	size_t streamed = 0;
+	int bad = 0;
+	camera_v4l2_frame_t frame;
+	while (camera_v4l2_acquire_timeout(camera, &frame, 1000)) {
+		if (!test_recording_match(test, first + streamed, frame.start,
+					  frame.length, frame.meta.sequence,
+					  frame.meta.timestamp_ns)) {
+			bad++;
+		}
+		streamed++;
+		camera_v4l2_release(camera, &frame);
+	}
+	if (streamed != found - first || bad != 0) {
+		printf("%s: streamed %zu of %zu frames, %d bad\n", name, streamed,
+		       found - first, bad);
+		failures++;
+	}
+	test_recording_close_camera(camera, replay);
+	camera_v4l2_capfile_close(capfile);
+
+	return failures;
+}
+
+static int capfile_test_truncate(const char *path, off_t length) {
+	if (truncate(path, length) < 0) {
+		perror("truncate");
+		return 0;
+	}
+	return 1;
+}
+
+// Recovery from what a crash or a bad disk leaves behind, in sequence.
+static int capfile_test_recovery(struct test_recording *test,
+				 const char *path, const char *index_path) {
+	camera_v4l2_recorder_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.direct = 1;
+	param.index_frames = 16;
+	if (!test_recording_record(test, path, &param)) return 1;
+
+	int failures = 0;
+	// The last entries never made it, the one before only partly.
+	struct stat st;
+	if (stat(index_path, &st) < 0 ||
+	    !capfile_test_truncate(index_path,
+				   st.st_size - 10 * sizeof(camera_v4l2_capfile_entry_t) - 5)) {
+		return failures + 1;
+	}
+	failures += capfile_test_check(test, path, "torn index",
+				       TEST_RECORDING_FRAMES, 0);
+
+	// Cut inside a frame: it and everything after it are lost, the index
+	// entries past the end are ignored.
+	camera_v4l2_capfile_t *capfile = camera_v4l2_capfile_open(path);
+	if (capfile == NULL) return failures + 1;
+	uint64_t torn = capfile->entries[CAPFILE_TEST_TORN_FRAME].offset;
+	camera_v4l2_capfile_close(capfile);
+	if (!capfile_test_truncate(path, (off_t) torn + 100)) return failures + 1;
+	failures += capfile_test_check(test, path, "torn recording",
+				       CAPFILE_TEST_TORN_FRAME, 1);
+
+	unlink(index_path);
+	failures += capfile_test_check(test, path, "missing index",
+				       CAPFILE_TEST_TORN_FRAME, 0);
+
+	if (!camera_v4l2_capfile_reindex(path)) {
+		printf("reindex failed\n");
+		return failures + 1;
+	}
+	failures += capfile_test_check(test, path, "reindexed",
+				       CAPFILE_TEST_TORN_FRAME, 1);
+
+	// A length running into the next frame, the offsets still ascending:
+	// the entries from it on are scanned.
+	int fd = open(index_path, O_WRONLY);
+	uint32_t length = 100000;
+	if (fd < 0 ||
+	    pwrite(fd, &length, sizeof(length),
+		   sizeof(camera_v4l2_capfile_header_t) +
+		   100 * sizeof(camera_v4l2_capfile_entry_t) +
+		   offsetof(camera_v4l2_capfile_entry_t, length)) < 0) {
+		perror("corrupting the index");
+		if (fd >= 0) close(fd);
+		return failures + 1;
+	}
+	close(fd);
+	failures += capfile_test_check(test, path, "corrupted length",
+				       CAPFILE_TEST_TORN_FRAME, 0);
+
+	// Garbage over an entry in the middle, the rest is scanned.
+	fd = open(index_path, O_WRONLY);
+	static const char garbage[] = "garbagegarbagegarbagegarbage";
+	if (fd < 0 ||
+	    pwrite(fd, garbage, sizeof(garbage) - 1,
+		   sizeof(camera_v4l2_capfile_header_t) +
+		   100 * sizeof(camera_v4l2_capfile_entry_t)) < 0) {
+		perror("corrupting the index");
+		if (fd >= 0) close(fd);
+		return failures + 1;
+	}
+	close(fd);
+	failures += capfile_test_check(test, path, "corrupted index",
+				       CAPFILE_TEST_TORN_FRAME, 0);
+
+	return failures;
+}
+
+int main(void) {
+	static struct test_recording test;
+	test_recording_init(&test);
+	char path[128];
+	char index_path[128];
+	snprintf(path, sizeof(path), "%s/capfile.v4lr", test.dir);
+	snprintf(index_path, sizeof(index_path), "%s/capfile.v4lr%s", test.dir,
+		 CAMERA_V4L2_CAPFILE_SUFFIX);
+
+	int failures = 0;
+	// Intact recordings, the index flushed at various intervals: more
+	// often than the queue, never before close.
+	static const int index_frames[] = {16, 7, 1000};
+	for (int i = 0; i < 3; i++) {
+		for (int direct = 0; direct < 2; direct++) {
+			camera_v4l2_recorder_param_t param;
+			memset(&param, 0, sizeof(param));
+			param.direct = direct;
+			param.index_frames = index_frames[i];
+			char name[64];
+			snprintf(name, sizeof(name), "index every %d, direct %d",
+				 index_frames[i], direct);
+			if (!test_recording_record(&test, path, &param)) {
+				failures++;
+				continue;
+			}
+			failures += capfile_test_check(&test, path, name,
+						       TEST_RECORDING_FRAMES, 1);
+		}
+	}
+	failures += capfile_test_recovery(&test, path, index_path);
+
+	unlink(index_path);
+	unlink(path);
+	test_recording_free(&test);
+
+	printf("capfile: %d failure(s)\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// Checks every YUYV conversion kernel the CPU supports against the
+// scalar one, byte for byte: all layouts, matrices and ranges, every
+// even width up to past the widest vector tail, and padded strides
+// whose padding must be left alone.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2_convert.h"
+
+// 4 x the 64 pixels of an AVX-512 iteration, plus tails on both sides.
+#define CONVERT_TEST_MAX_WIDTH (290)
+#define CONVERT_TEST_HEIGHT (3)
+// Not a multiple of any vector width, so rows start misaligned.
+#define CONVERT_TEST_PADDING (13)
+#define CONVERT_TEST_GUARD (0xA5)
+
+static const camera_v4l2_pixel_layout_t convert_test_layouts[] = {
+	CAMERA_V4L2_LAYOUT_BGR,
+	CAMERA_V4L2_LAYOUT_RGB,
+	CAMERA_V4L2_LAYOUT_BGRA,
+	CAMERA_V4L2_LAYOUT_RGBA,
+};
+
+static int convert_test_channels(camera_v4l2_pixel_layout_t layout) {
+	return layout == CAMERA_V4L2_LAYOUT_BGR ||
+		layout == CAMERA_V4L2_LAYOUT_RGB ? 3 : 4;
+}
+
+// Converts with isa into a guard filled buffer. Returns 0 if it fails
+// or writes outside the rows.
+static int convert_test_run(camera_v4l2_isa_t isa, const uint8_t *src,
+			    size_t src_stride, uint8_t *dst, size_t dst_size,
+			    size_t dst_stride, int width,
+			    camera_v4l2_pixel_layout_t layout,
+			    camera_v4l2_color_matrix_t matrix,
+			    camera_v4l2_color_range_t range) {
+	memset(dst, CONVERT_TEST_GUARD, dst_size);
+	if (!camera_v4l2_convert_set_isa(isa) ||
+	    !camera_v4l2_yuyv_convert(src, src_stride, dst, dst_stride, width,
+				      CONVERT_TEST_HEIGHT, layout, matrix, range)) {
+		printf("%s: conversion failed\n", camera_v4l2_isa_name(isa));
+		return 0;
+	}
+
+	size_t row_bytes = (size_t) width * convert_test_channels(layout);
+	for (size_t i = 0; i < dst_size; i++) {
+		if (i % dst_stride < row_bytes &&
+		    i / dst_stride < CONVERT_TEST_HEIGHT) {
+			continue;
+		}
+		if (dst[i] != CONVERT_TEST_GUARD) {
+			printf("%s: width %d layout %d wrote byte %zu outside the rows\n",
+			       camera_v4l2_isa_name(isa), width, layout, i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct convert_test_buffers {
+	const uint8_t *src;
+	size_t src_stride;
+	uint8_t *expected;
+	uint8_t *actual;
+	size_t dst_size;
+};
+
+// One case: isa against scalar, tightly packed and with padded rows.
+// Returns the number of failures.
+static int convert_test_case(const struct convert_test_buffers *buffers,
+			     camera_v4l2_isa_t isa, int width,
+			     camera_v4l2_pixel_layout_t layout,
+			     camera_v4l2_color_matrix_t matrix,
+			     camera_v4l2_color_range_t range) {
+	size_t packed = (size_t) width * convert_test_channels(layout);
+	size_t strides[2] = { packed, packed + CONVERT_TEST_PADDING };
+	int failures = 0;
+	for (int i = 0; i < 2; i++) {
+		if (!convert_test_run(CAMERA_V4L2_ISA_SCALAR, buffers->src,
+				      buffers->src_stride, buffers->expected,
+				      buffers->dst_size, strides[i], width,
+				      layout, matrix, range) ||
+		    !convert_test_run(isa, buffers->src, buffers->src_stride,
+				      buffers->actual, buffers->dst_size,
+				      strides[i], width, layout, matrix, range)) {
+			failures++;
+		} else if (memcmp(buffers->expected, buffers->actual,
+				  buffers->dst_size) != 0) {
+			printf("%s: differs from scalar, width %d stride %zu "
+			       "layout %d matrix %d range %d\n",
+			       camera_v4l2_isa_name(isa), width, strides[i],
+			       layout, matrix, range);
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main() {
+	struct convert_test_buffers buffers;
+	buffers.src_stride = CONVERT_TEST_MAX_WIDTH * 2 + CONVERT_TEST_PADDING;
+	buffers.dst_size = (size_t) (CONVERT_TEST_MAX_WIDTH * 4 +
+				     CONVERT_TEST_PADDING) * (CONVERT_TEST_HEIGHT + 1);
+	uint8_t *src = (uint8_t *) malloc(buffers.src_stride * CONVERT_TEST_HEIGHT);
+	buffers.src = src;
+	buffers.expected = (uint8_t *) malloc(buffers.dst_size);
+	buffers.actual = (uint8_t *) malloc(buffers.dst_size);
+	if (src == NULL || buffers.expected == NULL || buffers.actual == NULL) {
+		return 1;
+	}
+
+	// Every byte value in every position, including the Y and chroma
+	// extremes that clamp.
+	srand(1);
+	for (size_t i = 0; i < buffers.src_stride * CONVERT_TEST_HEIGHT; i++) {
+		src[i] = i < 256 ? (uint8_t) i : (uint8_t) rand();
+	}
+
+	camera_v4l2_isa_t best = camera_v4l2_convert_isa();
+	int failures = 0;
+	int kernels = 0;
+	for (int i = CAMERA_V4L2_ISA_SSE2; i <= CAMERA_V4L2_ISA_AVX512; i++) {
+		camera_v4l2_isa_t isa = (camera_v4l2_isa_t) i;
+		if (!camera_v4l2_convert_isa_supported(isa)) {
+			printf("%s: not supported, skipped\n", camera_v4l2_isa_name(isa));
+			continue;
+		}
+		kernels++;
+		for (size_t l = 0; l < sizeof(convert_test_layouts) /
+			     sizeof(convert_test_layouts[0]); l++) {
+			for (int m = CAMERA_V4L2_BT601; m <= CAMERA_V4L2_BT709; m++) {
+				for (int r = CAMERA_V4L2_RANGE_LIMITED;
+				     r <= CAMERA_V4L2_RANGE_FULL; r++) {
+					for (int width = 2; width <= CONVERT_TEST_MAX_WIDTH;
+					     width += 2) {
+						failures += convert_test_case(
+							&buffers, isa, width, convert_test_layouts[l],
+							(camera_v4l2_color_matrix_t) m,
+							(camera_v4l2_color_range_t) r);
+					}
+				}
+			}
+		}
+	}
+	camera_v4l2_convert_set_isa(best);
+
+	free(src);
+	free(buffers.expected);
+	free(buffers.actual);
+
+	printf("convert: %d SIMD kernel(s) against scalar, %d failure(s)\n",
+	       kernels, failures);
+	return failures == 0 ? 0 : 1;
+}
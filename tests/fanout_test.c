@@ -0,0 +1,350 @@
+// Fanout of a replay camera: consumer threads holding and dropping
+// references to shared frames must only ever see their frame's own
+// content, buffers being queued back only once the last reference is
+// dropped. Then, with every buffer referenced, each policy must behave
+// as documented: FAIL refuses at once, WAIT hands out the next frame
+// in line, SKIP a fresh one with the frames in between counted dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+
+#define FANOUT_TEST_FRAME_SIZE (1024)
+#define FANOUT_TEST_SOURCE_FRAMES (8)
+#define FANOUT_TEST_BUFFERS (6)
+#define FANOUT_TEST_CONSUMERS (3)
+#define FANOUT_TEST_FRAMES (1000)
+// How long a held reference is kept before a helper drops it.
+#define FANOUT_TEST_DROP_US (50000)
+
+struct fanout_test {
+	uint8_t frames[FANOUT_TEST_SOURCE_FRAMES][FANOUT_TEST_FRAME_SIZE];
+	int position;
+	// References consumers still hold per buffer index.
+	int holders[VIDEO_MAX_FRAME];
+	int reused;  // Buffers handed out again while still referenced
+	int corrupted;  // Frames whose content changed while referenced
+	int shared;  // Frames the consumers are to get
+};
+
+struct fanout_test_consumer {
+	struct fanout_test *test;
+	camera_v4l2_ring_t *queue;
+	int hold_us;
+	int done;
+	pthread_t thread;
+};
+
+static int fanout_test_next(void *user, const void **data, size_t *length,
+			    uint64_t *timestamp_ns, uint32_t *sequence) {
+	struct fanout_test *test = (struct fanout_test *) user;
+	if (test->position == FANOUT_TEST_SOURCE_FRAMES) return 0;
+	*data = test->frames[test->position];
+	*length = FANOUT_TEST_FRAME_SIZE;
+	*timestamp_ns = 1000000000ull + test->position * 33000000ull;
+	*sequence = (uint32_t) test->position++;
+	return 1;
+}
+
+static int fanout_test_rewind(void *user) {
+	((struct fanout_test *) user)->position = 0;
+	return 1;
+}
+
+// Every byte of a frame is its sequence, modulo the source's length.
+static int fanout_test_intact(const camera_v4l2_frame_t *frame) {
+	const uint8_t *data = (const uint8_t *) frame->start;
+	uint8_t expected = (uint8_t) (frame->meta.sequence % FANOUT_TEST_SOURCE_FRAMES);
+	if (frame->length != FANOUT_TEST_FRAME_SIZE) return 0;
+	for (size_t i = 0; i < frame->length; i++) {
+		if (data[i] != expected) return 0;
+	}
+	return 1;
+}
+
+static void *fanout_test_consumer(void *arg) {
+	struct fanout_test_consumer *consumer = (struct fanout_test_consumer *) arg;
+	struct fanout_test *test = consumer->test;
+
+	// Until every frame the capture shares, fewer if it failed.
+	while (consumer->done < __atomic_load_n(&test->shared, __ATOMIC_ACQUIRE)) {
+		camera_v4l2_shared_frame_t *shared;
+		if (!camera_v4l2_ring_pop(consumer->queue, &shared)) {
+			usleep(50);
+			continue;
+		}
+		const camera_v4l2_frame_t *frame = camera_v4l2_shared_frame_get(shared);
+		usleep(consumer->hold_us);
+		if (!fanout_test_intact(frame)) {
+			__atomic_add_fetch(&test->corrupted, 1, __ATOMIC_RELAXED);
+		}
+		// Before the drop, after which the buffer may be reused.
+		__atomic_sub_fetch(&test->holders[frame->index], 1, __ATOMIC_RELEASE);
+		camera_v4l2_shared_frame_unref(shared);
+		consumer->done++;
+	}
+	return NULL;
+}
+
+static camera_v4l2_camera_t *fanout_test_camera(struct fanout_test *test,
+						camera_v4l2_replay_t **replay) {
+	camera_v4l2_replay_source_t source = {
+		fanout_test_next, fanout_test_rewind, test
+	};
+	camera_v4l2_replay_param_t replay_param;
+	memset(&replay_param, 0, sizeof(replay_param));
+	replay_param.pacing = CAMERA_V4L2_REPLAY_FAST;
+	replay_param.loop = 1;
+	replay_param.buffer_size = FANOUT_TEST_FRAME_SIZE;
+	*replay = camera_v4l2_replay_create(&replay_param, &source);
+	if (*replay == NULL) return NULL;
+
+	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.frame_width = 640;
+	param.frame_height = 480;
+	param.fmt = MJPEG;
+	param.buffer_count = FANOUT_TEST_BUFFERS;
+	param.backend = camera_v4l2_replay_backend(*replay);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	if (!camera_v4l2_open(camera, 0, &param)) {
+		camera_v4l2_destroy(camera);
+		camera_v4l2_replay_destroy(*replay);
+		return NULL;
+	}
+	return camera;
+}
+
+// A reference dropped and reclaimed, the buffer goes back only with the
+// last one. Returns the number of failures.
+static int fanout_test_last_reference(camera_v4l2_camera_t *camera) {
+	camera_v4l2_fanout_t *fanout =
+		camera_v4l2_fanout_create(camera, CAMERA_V4L2_FANOUT_FAIL);
+	camera_v4l2_shared_frame_t *shared;
+	if (fanout == NULL || !camera_v4l2_fanout_acquire(fanout, &shared, 1000)) {
+		printf("last reference: cannot acquire\n");
+		camera_v4l2_fanout_destroy(fanout);
+		return 1;
+	}
+
+	int failures = 0;
+	camera_v4l2_shared_frame_ref(shared);
+	camera_v4l2_shared_frame_ref(shared);
+	for (int i = 0; i < 2; i++) {
+		camera_v4l2_shared_frame_unref(shared);
+		if (camera_v4l2_fanout_reclaim(fanout) != 0 || camera->outstanding != 1) {
+			printf("last reference: requeued with %d reference(s) left\n", 2 - i);
+			failures++;
+		}
+	}
+	camera_v4l2_shared_frame_unref(shared);
+	if (camera_v4l2_fanout_reclaim(fanout) != 1 || camera->outstanding != 0) {
+		printf("last reference: not requeued once dropped\n");
+		failures++;
+	}
+	camera_v4l2_fanout_destroy(fanout);
+	return failures;
+}
+
+// Consumer threads sharing every frame, each holding it a while of its
+// own. Returns the number of failures.
+static int fanout_test_consumers(struct fanout_test *test,
+				 camera_v4l2_camera_t *camera) {
+	camera_v4l2_fanout_t *fanout =
+		camera_v4l2_fanout_create(camera, CAMERA_V4L2_FANOUT_WAIT);
+	if (fanout == NULL) {
+		printf("consumers: cannot create the fanout\n");
+		return 1;
+	}
+	test->shared = FANOUT_TEST_FRAMES;
+
+	struct fanout_test_consumer consumers[FANOUT_TEST_CONSUMERS];
+	for (int i = 0; i < FANOUT_TEST_CONSUMERS; i++) {
+		consumers[i].test = test;
+		// Holds more than any camera can have acquired.
+		consumers[i].queue = camera_v4l2_ring_create(
+			VIDEO_MAX_FRAME, sizeof(camera_v4l2_shared_frame_t *),
+			CAMERA_V4L2_RING_SPSC);
+		consumers[i].hold_us = 100 + 300 * i;
+		consumers[i].done = 0;
+		pthread_create(&consumers[i].thread, NULL, fanout_test_consumer,
+			       &consumers[i]);
+	}
+
+	int failures = 0;
+	for (int n = 0; n < FANOUT_TEST_FRAMES; n++) {
+		camera_v4l2_shared_frame_t *shared;
+		if (!camera_v4l2_fanout_acquire(fanout, &shared, 1000)) {
+			printf("consumers: acquire failed after %d frames: %s\n", n,
+			       strerror(errno));
+			failures++;
+			__atomic_store_n(&test->shared, n, __ATOMIC_RELEASE);
+			break;
+		}
+		int index = camera_v4l2_shared_frame_get(shared)->index;
+		if (__atomic_load_n(&test->holders[index], __ATOMIC_ACQUIRE) != 0) {
+			test->reused++;
+		}
+		__atomic_store_n(&test->holders[index], FANOUT_TEST_CONSUMERS,
+				 __ATOMIC_RELEASE);
+		// The acquired reference goes to the first consumer.
+		for (int i = 1; i < FANOUT_TEST_CONSUMERS; i++) {
+			camera_v4l2_shared_frame_ref(shared);
+		}
+		for (int i = 0; i < FANOUT_TEST_CONSUMERS; i++) {
+			camera_v4l2_ring_push(consumers[i].queue, &shared, NULL, NULL);
+		}
+	}
+
+	for (int i = 0; i < FANOUT_TEST_CONSUMERS; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		camera_v4l2_shared_frame_t *shared;
+		while (camera_v4l2_ring_pop(consumers[i].queue, &shared)) {
+			camera_v4l2_shared_frame_unref(shared);
+		}
+		camera_v4l2_ring_destroy(consumers[i].queue);
+	}
+	camera_v4l2_fanout_reclaim(fanout);
+	if (test->reused != 0 || test->corrupted != 0 || camera->outstanding != 0) {
+		printf("consumers: %d buffer(s) reused while referenced, %d frame(s) "
+		       "changed, %d never requeued\n", test->reused, test->corrupted,
+		       camera->outstanding);
+		failures++;
+	}
+	camera_v4l2_fanout_destroy(fanout);
+	return failures;
+}
+
+struct fanout_test_drop {
+	camera_v4l2_shared_frame_t *shared;
+	pthread_t thread;
+};
+
+static void *fanout_test_drop_later(void *arg) {
+	struct fanout_test_drop *drop = (struct fanout_test_drop *) arg;
+	usleep(FANOUT_TEST_DROP_US);
+	camera_v4l2_shared_frame_unref(drop->shared);
+	return NULL;
+}
+
+// Every buffer referenced, then one dropped from another thread while
+// acquiring. Returns the number of failures.
+static int fanout_test_policy(camera_v4l2_camera_t *camera,
+			      camera_v4l2_fanout_policy_t policy,
+			      const char *name) {
+	camera_v4l2_fanout_t *fanout = camera_v4l2_fanout_create(camera, policy);
+	if (fanout == NULL) {
+		printf("%s: cannot create the fanout\n", name);
+		return 1;
+	}
+
+	int failures = 0;
+	int limit = camera_v4l2_acquire_limit(camera);
+	camera_v4l2_shared_frame_t *held[VIDEO_MAX_FRAME];
+	int held_count = 0;
+	while (held_count < limit &&
+	       camera_v4l2_fanout_acquire(fanout, &held[held_count], 1000)) {
+		held_count++;
+	}
+	if (held_count < limit) {
+		printf("%s: %d of %d buffers acquired\n", name, held_count, limit);
+		failures++;
+	}
+	uint32_t last = camera_v4l2_shared_frame_get(held[held_count - 1])->meta.sequence;
+
+	camera_v4l2_shared_frame_t *shared;
+	uint64_t start = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	int acquired = camera_v4l2_fanout_acquire(fanout, &shared, 100);
+	uint64_t elapsed_ms = (camera_v4l2_clock_ns(CLOCK_MONOTONIC) - start) / 1000000;
+	if (policy == CAMERA_V4L2_FANOUT_FAIL) {
+		if (acquired || errno != EBUSY || elapsed_ms >= 50) {
+			printf("%s: did not fail right away with EBUSY\n", name);
+			failures++;
+		}
+	} else if (acquired || errno != EAGAIN || elapsed_ms < 90) {
+		printf("%s: did not time out waiting\n", name);
+		failures++;
+	}
+	if (acquired) camera_v4l2_shared_frame_unref(shared);
+
+	// The oldest is dropped meanwhile, the frame after the held ones
+	// comes in its buffer.
+	struct fanout_test_drop drop;
+	drop.shared = held[0];
+	pthread_create(&drop.thread, NULL, fanout_test_drop_later, &drop);
+	acquired = camera_v4l2_fanout_acquire(fanout, &shared, 1000);
+	int errno_acquire = errno;
+	pthread_join(drop.thread, NULL);
+	if (policy == CAMERA_V4L2_FANOUT_FAIL) {
+		if (acquired || errno_acquire != EBUSY) {
+			printf("%s: waited for a reference\n", name);
+			failures++;
+		}
+	} else if (!acquired) {
+		printf("%s: no frame once a reference dropped: %s\n", name,
+		       strerror(errno_acquire));
+		failures++;
+	} else {
+		const camera_v4l2_frame_t *frame = camera_v4l2_shared_frame_get(shared);
+		uint32_t sequence = frame->meta.sequence;
+		if (policy == CAMERA_V4L2_FANOUT_WAIT &&
+		    (sequence != last + 1 || frame->meta.dropped != 0)) {
+			printf("%s: got frame %u dropping %u, expected %u in line\n",
+			       name, sequence, frame->meta.dropped, last + 1);
+			failures++;
+		}
+		if (policy == CAMERA_V4L2_FANOUT_SKIP &&
+		    (sequence <= last + 1 || frame->meta.dropped != sequence - last - 1)) {
+			printf("%s: got frame %u dropping %u after %u, expected a fresh one\n",
+			       name, sequence, frame->meta.dropped, last);
+			failures++;
+		}
+		if (!fanout_test_intact(frame)) {
+			printf("%s: frame content is wrong\n", name);
+			failures++;
+		}
+		camera_v4l2_shared_frame_unref(shared);
+	}
+
+	for (int i = 1; i < held_count; i++) camera_v4l2_shared_frame_unref(held[i]);
+	camera_v4l2_fanout_reclaim(fanout);
+	if (camera->outstanding != 0) {
+		printf("%s: %d buffer(s) never requeued\n", name, camera->outstanding);
+		failures++;
+	}
+	camera_v4l2_fanout_destroy(fanout);
+	return failures;
+}
+
+int main(void) {
+	static struct fanout_test test;
+	memset(&test, 0, sizeof(test));
+	for (int i = 0; i < FANOUT_TEST_SOURCE_FRAMES; i++) {
+		memset(test.frames[i], i, FANOUT_TEST_FRAME_SIZE);
+	}
+	camera_v4l2_replay_t *replay;
+	camera_v4l2_camera_t *camera = fanout_test_camera(&test, &replay);
+	if (camera == NULL) {
+		printf("cannot open the replay camera\n");
+		return 1;
+	}
+
+	int failures = 0;
+	failures += fanout_test_last_reference(camera);
+	failures += fanout_test_consumers(&test, camera);
+	failures += fanout_test_policy(camera, CAMERA_V4L2_FANOUT_FAIL, "fail");
+	failures += fanout_test_policy(camera, CAMERA_V4L2_FANOUT_WAIT, "wait");
+	failures += fanout_test_policy(camera, CAMERA_V4L2_FANOUT_SKIP, "skip");
+
+	camera_v4l2_close(camera);
+	camera_v4l2_destroy(camera);
+	camera_v4l2_replay_destroy(replay);
+
+	printf("fanout: %d failure(s)\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+// Records frames with every write path the recorder has (buffered and
+// O_DIRECT, a shallow and a deep submission queue) and replays the file,
+// which must give back every frame byte for byte with its sequence and
+// timestamp.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+#include "camera_v4l2_record.h"
+
+#include "test_recording.h"
+
+struct record_test_config {
+	int direct;
+	unsigned int queue_depth;
+};
+
+static const struct record_test_config record_test_configs[] = {
+	{0, 0},
+	{1, 0},
+	{0, 256},
+	{1, 256},
+	// Submitting waits for completions every other frame.
+	{1, 2},
+};
+
+// Replays path, returns the number of frames that differ or are missing.
+static int record_test_replay(const struct test_recording *test,
+			      const char *path) {
+	camera_v4l2_replay_param_t replay_param;
+	memset(&replay_param, 0, sizeof(replay_param));
+	replay_param.pacing = CAMERA_V4L2_REPLAY_FAST;
+	replay_param.keep_timestamps = 1;
+	replay_param.buffer_size = TEST_RECORDING_BUFFER_SIZE;
+	camera_v4l2_replay_t *replay = camera_v4l2_replay_open(path, &replay_param);
+	if (replay == NULL) {
+		printf("%s: cannot replay\n", path);
+		return TEST_RECORDING_FRAMES;
+	}
+
+	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.frame_width = 640;
+	param.frame_height = 480;
+	param.fmt = MJPEG;
+	param.backend = camera_v4l2_replay_backend(replay);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	if (!camera_v4l2_open(camera, 0, &param)) {
+		printf("%s: cannot replay\n", path);
+		camera_v4l2_destroy(camera);
+		camera_v4l2_replay_destroy(replay);
+		return TEST_RECORDING_FRAMES;
+	}
+
+	int count = 0;
+	int bad = 0;
+	camera_v4l2_frame_t frame;
+	// Ends with the recording, the replay disconnects.
+	while (camera_v4l2_acquire_timeout(camera, &frame, 1000)) {
+		if (!test_recording_match(test, count, frame.start, frame.length,
+					  frame.meta.sequence,
+					  frame.meta.timestamp_ns)) {
+			bad++;
+		}
+		count++;
+		camera_v4l2_release(camera, &frame);
+	}
+	if (count != TEST_RECORDING_FRAMES || bad != 0) {
+		printf("%s: replayed %d of %d frames, %d bad\n", path, count,
+		       TEST_RECORDING_FRAMES, bad);
+	}
+	test_recording_close_camera(camera, replay);
+
+	return bad + abs(TEST_RECORDING_FRAMES - count);
+}
+
+int main(void) {
+	static struct test_recording test;
+	test_recording_init(&test);
+	char path[128];
+	snprintf(path, sizeof(path), "%s/record.v4lr", test.dir);
+
+	int config_count =
+		(int) (sizeof(record_test_configs) / sizeof(record_test_configs[0]));
+	int failures = 0;
+	for (int i = 0; i < config_count; i++) {
+		camera_v4l2_recorder_param_t param;
+		memset(&param, 0, sizeof(param));
+		param.direct = record_test_configs[i].direct;
+		param.queue_depth = record_test_configs[i].queue_depth;
+		if (!test_recording_record(&test, path, &param) ||
+		    record_test_replay(&test, path) != 0) {
+			printf("direct %d, queue depth %u failed\n", param.direct,
+			       param.queue_depth);
+			failures++;
+		} else if (!test.stats.uring) {
+			// Every configuration is meant to go through the ring.
+			printf("direct %d, queue depth %u written without io_uring\n",
+			       param.direct, param.queue_depth);
+			failures++;
+		}
+	}
+	unlink(path);
+	test_recording_free(&test);
+
+	printf("record: %d configuration(s), %d failure(s)\n", config_count,
+	       failures);
+	return failures == 0 ? 0 : 1;
+}
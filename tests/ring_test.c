@@ -0,0 +1,363 @@
+// Rings under contention: producers and consumers hammering one ring,
+// overwriting its oldest elements when full, must neither lose nor
+// duplicate an element, and each producer's elements must come out in
+// order. Then a frame ring fed by a replay camera, smaller than the
+// camera can hand out and drained by consumers that stall for a while,
+// must keep capture going and account for every buffer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define CAMERA_V4L2_IMPLEMENTATION
+#include "camera_v4l2.h"
+#include "camera_v4l2_replay.h"
+
+#define RING_TEST_THREADS (4)
+#define RING_TEST_ELEMENTS (100000)  // Per producer
+#define RING_TEST_CAPACITY (64)
+
+#define RING_TEST_FRAME_SIZE (1024)
+#define RING_TEST_SOURCE_FRAMES (8)
+#define RING_TEST_BUFFERS (6)
+// Far more than the camera can hand out, as in the capture stall.
+#define RING_TEST_FRAME_CAPACITY (16)
+#define RING_TEST_TAKEN (2000)
+#define RING_TEST_MAX_SEQUENCE (1 << 20)
+#define RING_TEST_TIMEOUT_NS (10000000000ull)
+
+struct ring_test {
+	camera_v4l2_ring_t *ring;
+	int evict;
+	int producers;
+	int producers_done;
+	// Times each element came out, popped or evicted.
+	uint8_t seen[RING_TEST_THREADS * RING_TEST_ELEMENTS];
+	int out_of_order;
+};
+
+struct ring_test_thread {
+	struct ring_test *test;
+	int id;
+	pthread_t thread;
+};
+
+static void ring_test_count(struct ring_test *test, uint64_t value) {
+	__atomic_add_fetch(&test->seen[value], 1, __ATOMIC_RELAXED);
+}
+
+static void *ring_test_producer(void *arg) {
+	struct ring_test_thread *thread = (struct ring_test_thread *) arg;
+	struct ring_test *test = thread->test;
+
+	for (uint64_t i = 0; i < RING_TEST_ELEMENTS; i++) {
+		uint64_t value = (uint64_t) thread->id * RING_TEST_ELEMENTS + i;
+		uint64_t evicted;
+		int evicted_count = 0;
+		while (!camera_v4l2_ring_push(test->ring, &value,
+					      test->evict ? &evicted : NULL,
+					      &evicted_count)) {
+			sched_yield();
+		}
+		if (evicted_count > 0) ring_test_count(test, evicted);
+	}
+	__atomic_add_fetch(&test->producers_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *ring_test_consumer(void *arg) {
+	struct ring_test_thread *thread = (struct ring_test_thread *) arg;
+	struct ring_test *test = thread->test;
+	// Next value expected at least from each producer.
+	uint64_t next[RING_TEST_THREADS];
+	for (int i = 0; i < RING_TEST_THREADS; i++) {
+		next[i] = (uint64_t) i * RING_TEST_ELEMENTS;
+	}
+
+	for (;;) {
+		int done = __atomic_load_n(&test->producers_done, __ATOMIC_ACQUIRE) ==
+			test->producers;
+		uint64_t value;
+		if (!camera_v4l2_ring_pop(test->ring, &value)) {
+			if (done) break;
+			sched_yield();
+			continue;
+		}
+		ring_test_count(test, value);
+		int producer = (int) (value / RING_TEST_ELEMENTS);
+		if (value < next[producer]) {
+			__atomic_add_fetch(&test->out_of_order, 1, __ATOMIC_RELAXED);
+		}
+		next[producer] = value + 1;
+	}
+	return NULL;
+}
+
+// Returns the number of failures.
+static int ring_test_run(const char *name, camera_v4l2_ring_mode_t mode,
+			 int threads, int evict) {
+	static struct ring_test test;
+	memset(&test, 0, sizeof(test));
+	test.ring = camera_v4l2_ring_create(RING_TEST_CAPACITY, sizeof(uint64_t),
+					    mode);
+	test.evict = evict;
+	test.producers = threads;
+	if (test.ring == NULL) {
+		printf("%s: cannot create the ring\n", name);
+		return 1;
+	}
+
+	struct ring_test_thread producers[RING_TEST_THREADS];
+	struct ring_test_thread consumers[RING_TEST_THREADS];
+	for (int i = 0; i < threads; i++) {
+		producers[i].test = &test;
+		producers[i].id = i;
+		consumers[i].test = &test;
+		consumers[i].id = i;
+		pthread_create(&consumers[i].thread, NULL, ring_test_consumer,
+			       &consumers[i]);
+		pthread_create(&producers[i].thread, NULL, ring_test_producer,
+			       &producers[i]);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(producers[i].thread, NULL);
+		pthread_join(consumers[i].thread, NULL);
+	}
+	uint64_t value;
+	while (camera_v4l2_ring_pop(test.ring, &value)) ring_test_count(&test, value);
+	camera_v4l2_ring_destroy(test.ring);
+
+	int lost = 0;
+	int duplicated = 0;
+	for (int i = 0; i < threads * RING_TEST_ELEMENTS; i++) {
+		if (test.seen[i] == 0) lost++;
+		if (test.seen[i] > 1) duplicated++;
+	}
+	if (lost != 0 || duplicated != 0 || test.out_of_order != 0) {
+		printf("%s: %d lost, %d duplicated, %d out of order\n", name, lost,
+		       duplicated, test.out_of_order);
+		return 1;
+	}
+	return 0;
+}
+
+struct ring_test_capture {
+	camera_v4l2_frame_ring_t *ring;
+	int captured;
+	int taken;
+	int paused;  // Consumers hold off
+	int stop;
+	uint8_t taken_sequences[RING_TEST_MAX_SEQUENCE];
+	int duplicated;
+	int out_of_order;
+	uint8_t frame[RING_TEST_FRAME_SIZE];
+	int position;
+};
+
+static int ring_test_next(void *user, const void **data, size_t *length,
+			  uint64_t *timestamp_ns, uint32_t *sequence) {
+	struct ring_test_capture *capture = (struct ring_test_capture *) user;
+	if (capture->position == RING_TEST_SOURCE_FRAMES) return 0;
+	*data = capture->frame;
+	*length = sizeof(capture->frame);
+	*timestamp_ns = 1000000000ull + capture->position * 33000000ull;
+	*sequence = (uint32_t) capture->position++;
+	return 1;
+}
+
+static int ring_test_rewind(void *user) {
+	((struct ring_test_capture *) user)->position = 0;
+	return 1;
+}
+
+static int ring_test_callback(camera_v4l2_camera_t *camera,
+			      camera_v4l2_frame_t *frame, void *user) {
+	struct ring_test_capture *capture = (struct ring_test_capture *) user;
+	__atomic_add_fetch(&capture->captured, 1, __ATOMIC_RELEASE);
+	return camera_v4l2_frame_ring_callback(camera, frame, capture->ring);
+}
+
+static void *ring_test_frame_consumer(void *arg) {
+	struct ring_test_capture *capture = (struct ring_test_capture *) arg;
+	uint32_t last = 0;
+	int first = 1;
+
+	while (!__atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&capture->paused, __ATOMIC_ACQUIRE)) {
+			usleep(1000);
+			continue;
+		}
+		camera_v4l2_camera_t *camera;
+		camera_v4l2_frame_t frame;
+		if (!camera_v4l2_frame_ring_take(capture->ring, &camera, &frame)) {
+			usleep(100);
+			continue;
+		}
+		uint32_t sequence = frame.meta.sequence;
+		if (!first && sequence <= last) {
+			__atomic_add_fetch(&capture->out_of_order, 1, __ATOMIC_RELAXED);
+		}
+		first = 0;
+		last = sequence;
+		if (sequence < RING_TEST_MAX_SEQUENCE &&
+		    __atomic_add_fetch(&capture->taken_sequences[sequence], 1,
+				       __ATOMIC_RELAXED) > 1) {
+			__atomic_add_fetch(&capture->duplicated, 1, __ATOMIC_RELAXED);
+		}
+		// Hold it a while, as real work would.
+		usleep(200);
+		camera_v4l2_frame_ring_give_back(capture->ring, camera, &frame);
+		__atomic_add_fetch(&capture->taken, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+struct ring_test_reactor {
+	camera_v4l2_reactor_t *reactor;
+	int stop;
+};
+
+static void *ring_test_reactor_thread(void *arg) {
+	struct ring_test_reactor *driver = (struct ring_test_reactor *) arg;
+	while (!__atomic_load_n(&driver->stop, __ATOMIC_ACQUIRE)) {
+		camera_v4l2_reactor_run_once(driver->reactor, 10);
+	}
+	return NULL;
+}
+
+static int ring_test_taken(struct ring_test_capture *capture) {
+	return __atomic_load_n(&capture->taken, __ATOMIC_ACQUIRE);
+}
+
+// Waits until the consumers took count frames in all. Returns 0 on
+// timeout, capture having stalled.
+static int ring_test_wait_taken(struct ring_test_capture *capture, int count) {
+	uint64_t start = camera_v4l2_clock_ns(CLOCK_MONOTONIC);
+	while (ring_test_taken(capture) < count) {
+		if (camera_v4l2_clock_ns(CLOCK_MONOTONIC) - start > RING_TEST_TIMEOUT_NS) {
+			return 0;
+		}
+		usleep(1000);
+	}
+	return 1;
+}
+
+// A frame ring on a replay camera, captured by a capture thread or a
+// reactor. Returns the number of failures.
+static int ring_test_capture_run(const char *name, int use_thread) {
+	static struct ring_test_capture capture;
+	memset(&capture, 0, sizeof(capture));
+	camera_v4l2_replay_source_t source = {
+		ring_test_next, ring_test_rewind, &capture
+	};
+	camera_v4l2_replay_param_t replay_param;
+	memset(&replay_param, 0, sizeof(replay_param));
+	replay_param.pacing = CAMERA_V4L2_REPLAY_FAST;
+	replay_param.loop = 1;
+	replay_param.buffer_size = RING_TEST_FRAME_SIZE;
+	camera_v4l2_replay_t *replay = camera_v4l2_replay_create(&replay_param,
+								 &source);
+	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.frame_width = 640;
+	param.frame_height = 480;
+	param.fmt = MJPEG;
+	param.buffer_count = RING_TEST_BUFFERS;
+	param.backend = camera_v4l2_replay_backend(replay);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	if (replay == NULL || !camera_v4l2_open(camera, 0, &param)) {
+		printf("%s: cannot open the replay camera\n", name);
+		camera_v4l2_destroy(camera);
+		camera_v4l2_replay_destroy(replay);
+		return 1;
+	}
+
+	capture.ring = camera_v4l2_frame_ring_create(RING_TEST_FRAME_CAPACITY,
+						     CAMERA_V4L2_RING_MPMC);
+	camera_v4l2_frame_ring_attach(capture.ring, camera);
+
+	camera_v4l2_capture_thread_t *thread = NULL;
+	struct ring_test_reactor driver;
+	pthread_t driver_thread;
+	memset(&driver, 0, sizeof(driver));
+	if (use_thread) {
+		thread = camera_v4l2_capture_thread_create(NULL);
+		camera_v4l2_capture_thread_add(thread, camera, ring_test_callback,
+					       &capture);
+		camera_v4l2_capture_thread_start(thread);
+	} else {
+		driver.reactor = camera_v4l2_reactor_create();
+		camera_v4l2_reactor_add(driver.reactor, camera, ring_test_callback,
+					&capture);
+		pthread_create(&driver_thread, NULL, ring_test_reactor_thread, &driver);
+	}
+	pthread_t consumers[2];
+	for (int i = 0; i < 2; i++) {
+		pthread_create(&consumers[i], NULL, ring_test_frame_consumer, &capture);
+	}
+
+	int failures = 0;
+	if (!ring_test_wait_taken(&capture, RING_TEST_TAKEN / 2)) {
+		printf("%s: stalled at %d frames\n", name, ring_test_taken(&capture));
+		failures++;
+	}
+	// The ring fills up while no one takes from it and has to overwrite
+	// its oldest frames rather than keep the camera at its limit.
+	__atomic_store_n(&capture.paused, 1, __ATOMIC_RELEASE);
+	usleep(50000);
+	int captured = __atomic_load_n(&capture.captured, __ATOMIC_ACQUIRE);
+	usleep(100000);
+	captured = __atomic_load_n(&capture.captured, __ATOMIC_ACQUIRE) - captured;
+	if (captured < RING_TEST_BUFFERS) {
+		printf("%s: %d frame(s) captured while consumers paused\n", name,
+		       captured);
+		failures++;
+	}
+	__atomic_store_n(&capture.paused, 0, __ATOMIC_RELEASE);
+	if (failures == 0 && !ring_test_wait_taken(&capture, RING_TEST_TAKEN)) {
+		printf("%s: stalled at %d frames after a pause\n", name,
+		       ring_test_taken(&capture));
+		failures++;
+	}
+
+	__atomic_store_n(&capture.stop, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < 2; i++) pthread_join(consumers[i], NULL);
+	if (use_thread) {
+		camera_v4l2_capture_thread_destroy(thread);
+	} else {
+		__atomic_store_n(&driver.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(driver_thread, NULL);
+		camera_v4l2_reactor_destroy(driver.reactor);
+	}
+	camera_v4l2_frame_ring_destroy(capture.ring);
+
+	if (capture.duplicated != 0 || capture.out_of_order != 0) {
+		printf("%s: %d frame(s) taken twice, %d out of order\n", name,
+		       capture.duplicated, capture.out_of_order);
+		failures++;
+	}
+	if (camera->outstanding != 0) {
+		printf("%s: %d buffer(s) never released\n", name, camera->outstanding);
+		failures++;
+	}
+	camera_v4l2_close(camera);
+	camera_v4l2_destroy(camera);
+	camera_v4l2_replay_destroy(replay);
+	return failures;
+}
+
+int main(void) {
+	int failures = 0;
+	failures += ring_test_run("spsc, overwriting", CAMERA_V4L2_RING_SPSC, 1, 1);
+	failures += ring_test_run("mpmc, overwriting", CAMERA_V4L2_RING_MPMC,
+				  RING_TEST_THREADS, 1);
+	failures += ring_test_run("mpmc, refusing", CAMERA_V4L2_RING_MPMC,
+				  RING_TEST_THREADS, 0);
+	failures += ring_test_capture_run("frame ring, capture thread", 1);
+	failures += ring_test_capture_run("frame ring, reactor", 0);
+
+	printf("ring: %d failure(s)\n", failures);
+	return failures == 0 ? 0 : 1;
+}
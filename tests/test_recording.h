@@ -0,0 +1,185 @@
+// Shared by the recording tests: random frames of awkward lengths around
+// the 4 KiB direct I/O block, served by a replay camera and recorded
+// with camera_v4l2_recorder_t. Include after the headers under test.
+
+#ifndef TESTS_TEST_RECORDING_H_
+#define TESTS_TEST_RECORDING_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_RECORDING_FRAMES (300)
+#define TEST_RECORDING_SEQUENCE (7)
+#define TEST_RECORDING_TIMESTAMP(i) \
+	(1000000000ull + (uint64_t) (i) * 33000000ull)
+#define TEST_RECORDING_BUFFER_SIZE (64 * 1024)
+
+struct test_recording {
+	uint8_t *frames[TEST_RECORDING_FRAMES];
+	size_t lengths[TEST_RECORDING_FRAMES];
+	int position;  // Of the replay source
+	int recorded;  // Frames handed to the recording
+	camera_v4l2_recording_t *recording;
+	camera_v4l2_recording_stats_t stats;  // Of the last recording
+	char dir[64];
+};
+
+static void test_recording_init(struct test_recording *test) {
+	static const size_t edges[] = {1, 7, 8, 4072, 4073, 4095, 4096, 8192};
+	int edge_count = (int) (sizeof(edges) / sizeof(edges[0]));
+
+	srand(1);
+	for (int i = 0; i < TEST_RECORDING_FRAMES; i++) {
+		size_t length = i < edge_count ? edges[i] :
+			(size_t) (1000 + rand() % 60000);
+		test->frames[i] = (uint8_t *) malloc(length);
+		for (size_t k = 0; k < length; k++) test->frames[i][k] = (uint8_t) rand();
+		test->lengths[i] = length;
+	}
+	test->position = 0;
+	test->recorded = 0;
+
+	snprintf(test->dir, sizeof(test->dir), "/tmp/camera_v4l2_test.XXXXXX");
+	if (mkdtemp(test->dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+}
+
+static void test_recording_free(struct test_recording *test) {
+	for (int i = 0; i < TEST_RECORDING_FRAMES; i++) free(test->frames[i]);
+	rmdir(test->dir);
+}
+
+static int test_recording_next(void *user, const void **data, size_t *length,
+			       uint64_t *timestamp_ns, uint32_t *sequence) {
+	struct test_recording *test = (struct test_recording *) user;
+	if (test->position >= TEST_RECORDING_FRAMES) return 0;
+	*data = test->frames[test->position];
+	*length = test->lengths[test->position];
+	*timestamp_ns = TEST_RECORDING_TIMESTAMP(test->position);
+	*sequence = TEST_RECORDING_SEQUENCE + test->position;
+	test->position++;
+	return 1;
+}
+
+static int test_recording_rewind(void *user) {
+	((struct test_recording *) user)->position = 0;
+	return 1;
+}
+
+// Records every frame once, past that the replay loops and the frames
+// are released unrecorded.
+static int test_recording_callback(camera_v4l2_camera_t *camera,
+				   camera_v4l2_frame_t *frame, void *user) {
+	struct test_recording *test = (struct test_recording *) user;
+	if (test->recorded >= TEST_RECORDING_FRAMES) return 0;
+	test->recorded++;
+	return camera_v4l2_recording_callback(camera, frame, test->recording);
+}
+
+// Opens a camera replaying source, as recorded: timestamps kept.
+static camera_v4l2_camera_t *test_recording_camera(
+	const camera_v4l2_replay_source_t *source, int loop,
+	camera_v4l2_replay_t **replay) {
+	camera_v4l2_replay_param_t replay_param;
+	memset(&replay_param, 0, sizeof(replay_param));
+	replay_param.pacing = CAMERA_V4L2_REPLAY_FAST;
+	replay_param.keep_timestamps = 1;
+	replay_param.buffer_size = TEST_RECORDING_BUFFER_SIZE;
+	replay_param.loop = loop;
+	*replay = camera_v4l2_replay_create(&replay_param, source);
+	if (*replay == NULL) return NULL;
+
+	camera_v4l2_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.frame_width = 640;
+	param.frame_height = 480;
+	param.fmt = MJPEG;
+	param.backend = camera_v4l2_replay_backend(*replay);
+	camera_v4l2_camera_t *camera = camera_v4l2_create();
+	if (!camera_v4l2_open(camera, 0, &param)) {
+		camera_v4l2_destroy(camera);
+		camera_v4l2_replay_destroy(*replay);
+		return NULL;
+	}
+	return camera;
+}
+
+static void test_recording_close_camera(camera_v4l2_camera_t *camera,
+					camera_v4l2_replay_t *replay) {
+	camera_v4l2_close(camera);
+	camera_v4l2_destroy(camera);
+	camera_v4l2_replay_destroy(replay);
+}
+
+// Records every frame to path. Returns 0 and says why on failure.
+static int test_recording_record(struct test_recording *test, const char *path,
+				 const camera_v4l2_recorder_param_t *param) {
+	test->position = 0;
+	test->recorded = 0;
+	camera_v4l2_replay_source_t source = {
+		test_recording_next, test_recording_rewind, test
+	};
+	camera_v4l2_replay_t *replay;
+	camera_v4l2_camera_t *camera = test_recording_camera(&source, 1, &replay);
+	if (camera == NULL) {
+		printf("%s: cannot open the replay camera\n", path);
+		return 0;
+	}
+
+	camera_v4l2_recorder_t *recorder = camera_v4l2_recorder_create(param);
+	camera_v4l2_recording_t *recording =
+		camera_v4l2_recording_open(recorder, camera, path);
+	camera_v4l2_reactor_t *reactor = camera_v4l2_reactor_create();
+	if (recording == NULL || reactor == NULL) {
+		printf("%s: cannot start recording\n", path);
+		if (reactor != NULL) camera_v4l2_reactor_destroy(reactor);
+		camera_v4l2_recorder_destroy(recorder);
+		test_recording_close_camera(camera, replay);
+		return 0;
+	}
+	test->recording = recording;
+	camera_v4l2_reactor_add(reactor, camera, test_recording_callback, test);
+	// The recorder holds the buffers until their writes complete, so
+	// the camera may wait on it rather than on the replay.
+	while (test->recorded < TEST_RECORDING_FRAMES &&
+	       camera_v4l2_isopened(camera)) {
+		if (camera_v4l2_reactor_run_once(reactor, 100) <= 0) {
+			camera_v4l2_recorder_poll(recorder, 100);
+		}
+	}
+	camera_v4l2_recording_stats_t *stats = &test->stats;
+	camera_v4l2_recording_stats(recording, stats);
+	while (stats->in_flight > 0 &&
+	       camera_v4l2_recorder_poll(recorder, 100) >= 0) {
+		camera_v4l2_recording_stats(recording, stats);
+	}
+	int ok = camera_v4l2_recording_close(recording);
+	camera_v4l2_reactor_destroy(reactor);
+	camera_v4l2_recorder_destroy(recorder);
+	test_recording_close_camera(camera, replay);
+
+	if (!ok || stats->errors != 0 || stats->frames != TEST_RECORDING_FRAMES) {
+		printf("%s: recorded %llu of %d frames, %llu error(s)\n", path,
+		       (unsigned long long) stats->frames, TEST_RECORDING_FRAMES,
+		       (unsigned long long) stats->errors);
+		return 0;
+	}
+	return 1;
+}
+
+// Whether frame is frame index of the recording, as replayed.
+static int test_recording_match(const struct test_recording *test, size_t index,
+				const void *data, size_t length,
+				uint32_t sequence, uint64_t timestamp_ns) {
+	return index < TEST_RECORDING_FRAMES &&
+		length == test->lengths[index] &&
+		memcmp(data, test->frames[index], length) == 0 &&
+		sequence == TEST_RECORDING_SEQUENCE + index &&
+		timestamp_ns == TEST_RECORDING_TIMESTAMP(index);
+}
+
+#endif  // TESTS_TEST_RECORDING_H_